@@ -0,0 +1,427 @@
+// Peter: Monte Carlo batch simulator of needle insertions. See batchSimulator.h.
+
+#include "batchSimulator.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <math.h>
+#include <random>
+#include <stdint.h>
+
+#include "threadPool.h"
+
+using namespace Eigen;
+
+template<typename Scalar> struct sCoreScratch {
+	sCoreState<Scalar> state;
+	sCoreInput<Scalar> input;
+};
+
+// Buffers of one thread, reused between runs so that a run does not allocate.
+struct sBatchScratch {
+	sBatchScenario scenario;
+	sNeedleState state;
+	sNeedleStepInput input;
+	sCoreScratch<float> coreFloat;
+	sCoreScratch<double> coreDouble;
+};
+
+static sBatchLayer batchLayer(int handle, const std::string& name, float thickness, float stiffness)
+{
+	sBatchLayer layer;
+	layer.handle = handle;
+	layer.name = name;
+	layer.thickness = thickness;
+	layer.stiffness = stiffness;
+	layer.tissue = tissueParameters(name);
+	return layer;
+}
+
+sBatchSettings defaultBatchSettings()
+{
+	sBatchSettings settings;
+	settings.config.use_only_z_force_on_engine = false;
+	// The runs only record f_ext_magnitude. The stages that shape the force rendered on the device are left out,
+	// as CStepBudget sheds them in the plugin.
+	settings.config.use_virtual_fixture = false;
+	settings.config.use_passivity_control = false;
+	settings.config.force_snapshot = false;
+	settings.layers.push_back(batchLayer(1, "Fat", 0.015f, 200.0f));
+	settings.layers.push_back(batchLayer(2, "muscle", 0.02f, 400.0f));
+	settings.layers.push_back(batchLayer(3, "lung", 0.03f, 150.0f));
+	settings.layers.push_back(batchLayer(4, "bone", 0.01f, 5000.0f));
+	settings.profile.insertion_speed = 0.01f;
+	settings.profile.target_depth = 0.06f;
+	settings.profile.dwell_time = 1.0f;
+	settings.profile.withdrawal_speed = 0.02f;
+	return settings;
+}
+
+// std::seed_seq of { seed, run }, generated the same way ([rand.util.seedseq]) without the vector std::seed_seq
+// allocates for its values.
+struct sRunSeed {
+	typedef uint32_t result_type;
+	result_type values[2];
+
+	template<typename Iterator> void generate(Iterator begin, Iterator end) const
+	{
+		const size_t n = end - begin, s = 2;
+		if (n == 0)
+			return;
+		std::fill(begin, end, 0x8b8b8b8bu);
+		const size_t t = (n >= 623) ? 11 : (n >= 68) ? 7 : (n >= 39) ? 5 : (n >= 7) ? 3 : (n - 1) / 2;
+		const size_t p = (n - t) / 2, q = p + t, m = std::max(s + 1, n);
+		for (size_t k = 0; k < m; k++)
+		{
+			uint32_t r1 = 1664525u * mix(begin[k % n] ^ begin[(k + p) % n] ^ begin[(k + n - 1) % n]);
+			uint32_t r2 = r1 + (uint32_t)((k == 0) ? s : (k <= s) ? k % n + values[k - 1] : k % n);
+			begin[(k + p) % n] = (uint32_t)(begin[(k + p) % n] + r1);
+			begin[(k + q) % n] = (uint32_t)(begin[(k + q) % n] + r2);
+			begin[k % n] = r2;
+		}
+		for (size_t k = m; k < m + n; k++)
+		{
+			uint32_t r3 = 1566083941u * mix((uint32_t)(begin[k % n] + begin[(k + p) % n] + begin[(k + n - 1) % n]));
+			uint32_t r4 = r3 - (uint32_t)(k % n);
+			begin[(k + p) % n] = (uint32_t)(begin[(k + p) % n] ^ r3);
+			begin[(k + q) % n] = (uint32_t)(begin[(k + q) % n] ^ r4);
+			begin[k % n] = r4;
+		}
+	}
+
+private:
+	static uint32_t mix(uint32_t x)
+	{
+		return x ^ (x >> 27);
+	}
+};
+
+/**
+* @brief Sample the phantom and profile of one run into scenario, reusing its layers. Only depends on the seed
+*        and the run index.
+*/
+void sampleScenario(const sBatchSettings& settings, int run, sBatchScenario& scenario)
+{
+	sRunSeed seed = { { settings.seed, (uint32_t)run } };
+	std::mt19937 rng(seed);
+	std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+
+	scenario.layers = settings.layers;
+	for (sBatchLayer& layer : scenario.layers)
+	{
+		layer.thickness *= 1.0f + settings.thickness_spread * unit(rng);
+		layer.stiffness *= 1.0f + settings.coefficient_spread * unit(rng);
+		layer.tissue.damping *= 1.0f + settings.coefficient_spread * unit(rng);
+		layer.tissue.puncture_force *= 1.0f + settings.coefficient_spread * unit(rng);
+		layer.tissue.prony.equilibrium_stiffness *= 1.0f + settings.coefficient_spread * unit(rng);
+		for (int k = 0; k < PRONY_TERMS; k++)
+			layer.tissue.prony.stiffness[k] *= 1.0f + settings.coefficient_spread * unit(rng);
+	}
+	scenario.profile = settings.profile;
+	scenario.profile.insertion_speed *= 1.0f + 0.5f * unit(rng);
+	scenario.profile.target_depth *= 1.0f + 0.3f * unit(rng);
+	scenario.profile.dwell_time *= 1.0f + unit(rng);
+	scenario.profile.withdrawal_speed *= 1.0f + 0.5f * unit(rng);
+}
+
+sBatchScenario sampleScenario(const sBatchSettings& settings, int run)
+{
+	sBatchScenario scenario;
+	sampleScenario(settings, run, scenario);
+	return scenario;
+}
+
+// Steps of a run, the same in every precision.
+static int insertionSteps(const sInsertionProfile& profile, float dt)
+{
+	const float insertion_time = profile.target_depth / profile.insertion_speed;
+	const float dwell_end = insertion_time + profile.dwell_time;
+	const float total_time = dwell_end + profile.target_depth / profile.withdrawal_speed;
+	return (int)ceilf(total_time / dt);
+}
+
+static sInsertionResult simulateModelInsertion(const sBatchScenario& scenario, const sBatchSettings& settings, sBatchScratch& scratch)
+{
+	const sInsertionProfile& profile = scenario.profile;
+	const float insertion_time = profile.target_depth / profile.insertion_speed;
+	const float dwell_end = insertion_time + profile.dwell_time;
+
+	sNeedleState& state = scratch.state;
+	sNeedleStepInput& input = scratch.input;
+	state.reset();
+	input.contacts.clear();
+	input.needleAxis = Vector3f::UnitZ();
+	input.dummyDirection = Vector3f::UnitZ();
+	input.dt = settings.dt;
+
+	sInsertionResult result;
+	result.steps = insertionSteps(profile, settings.dt);
+	result.punctures = 0;
+	result.peak_force = 0.0f;
+	result.max_penetration = 0.0f;
+	result.first_puncture_time = -1.0f;
+	double force_sum = 0.0;
+
+	for (int step = 0; step < result.steps; step++)
+	{
+		float t = step * settings.dt;
+		float depth, velocity;
+		if (t < insertion_time)
+		{
+			depth = t * profile.insertion_speed;
+			velocity = profile.insertion_speed;
+		}
+		else if (t < dwell_end)
+		{
+			depth = profile.target_depth;
+			velocity = 0.0f;
+		}
+		else
+		{
+			depth = std::max(0.0f, profile.target_depth - (t - dwell_end) * profile.withdrawal_speed);
+			velocity = -profile.withdrawal_speed;
+		}
+		input.toolTipPoint = Vector3f(0.0f, 0.0f, -depth);
+		input.needleVelocity = fabsf(velocity);			// The plugin feeds the velocity magnitude.
+		input.needleAxialVelocity = velocity;
+		input.needleLinearVelocity = Vector3f(0.0f, 0.0f, -velocity);
+		input.commandedTip = input.toolTipPoint;
+
+		// The needle only touches the shallowest layer it has not punctured yet.
+		input.contacts.clear();
+		float surface = 0.0f;
+		for (const sBatchLayer& layer : scenario.layers)
+		{
+			bool punctured = false;
+			for (const sPuncture& puncture : state.punctures)
+				punctured = punctured || (puncture.handle == layer.handle);
+			if (!punctured)
+			{
+				if (depth > surface)
+				{
+					sContact contact;
+					contact.handle = layer.handle;
+					contact.name = layer.name;
+					contact.tissue = layer.tissue;
+					contact.force = Vector3f(0.0f, 0.0f, layer.stiffness * (depth - surface));
+					contact.respondable = true;
+					input.contacts.push_back(contact);
+				}
+				break;
+			}
+			surface += layer.thickness;
+		}
+
+		stepNeedle(state, input, settings.config);
+
+		if (!state.new_punctures.empty())
+		{
+			if (result.first_puncture_time < 0.0f)
+				result.first_puncture_time = t;
+			result.punctures += (int)state.new_punctures.size();
+		}
+		float force = fabsf(state.f_ext_magnitude);
+		result.peak_force = std::max(result.peak_force, force);
+		result.max_penetration = std::max(result.max_penetration, state.full_penetration_length);
+		force_sum += force;
+	}
+	result.mean_force = (result.steps > 0) ? (float)(force_sum / result.steps) : 0.0f;
+	return result;
+}
+
+template<typename Scalar> static sCoreSettings<Scalar> coreSettings(const sNeedleConfig& config)
+{
+	sCoreSettings<Scalar> settings;
+	settings.force_model = (config.force_model == "karnopp") ? CORE_KARNOPP : CORE_KELVIN_VOIGT;
+	settings.use_only_z_force_on_engine = config.use_only_z_force_on_engine;
+	settings.constant_puncture_threshold = config.constant_puncture_threshold;
+	settings.puncture_threshold = Scalar(config.puncture_threshold);
+	settings.hysteresis.entry_margin = Scalar(config.hysteresis.entry_margin);
+	settings.hysteresis.exit_depth = Scalar(config.hysteresis.exit_depth);
+	settings.hysteresis.entry_steps = config.hysteresis.entry_steps;
+	settings.hysteresis.exit_steps = config.hysteresis.exit_steps;
+	settings.model_force_scalar = Scalar(config.model_force_scalar);
+	settings.engine_force_scalar = Scalar(config.engine_force_scalar);
+	return settings;
+}
+
+// Same run as simulateModelInsertion() on the core of the model, with the phantom and the profile in Scalar.
+template<typename Scalar> static sInsertionResult simulateCoreInsertion(const sBatchScenario& scenario, const sBatchSettings& settings,
+	sCoreScratch<Scalar>& scratch)
+{
+	typedef tVector3<Scalar> Vector;
+	const sInsertionProfile& profile = scenario.profile;
+	const Scalar dt = Scalar(settings.dt);
+	const Scalar target_depth = Scalar(profile.target_depth);
+	const Scalar insertion_speed = Scalar(profile.insertion_speed);
+	const Scalar withdrawal_speed = Scalar(profile.withdrawal_speed);
+	const Scalar insertion_time = target_depth / insertion_speed;
+	const Scalar dwell_end = insertion_time + Scalar(profile.dwell_time);
+	const sCoreSettings<Scalar> core = coreSettings<Scalar>(settings.config);
+
+	sCoreState<Scalar>& state = scratch.state;
+	sCoreInput<Scalar>& input = scratch.input;
+	state.reset();
+	input.contacts.clear();
+	input.needleAxis = Vector::UnitZ();
+	input.dummyDirection = Vector::UnitZ();
+
+	sInsertionResult result;
+	result.steps = insertionSteps(profile, settings.dt);
+	result.punctures = 0;
+	result.first_puncture_time = -1.0f;
+	Scalar peak_force = Scalar(0);
+	Scalar max_penetration = Scalar(0);
+	double force_sum = 0.0;
+
+	for (int step = 0; step < result.steps; step++)
+	{
+		Scalar t = Scalar(step) * dt;
+		Scalar depth, velocity;
+		if (t < insertion_time)
+		{
+			depth = t * insertion_speed;
+			velocity = insertion_speed;
+		}
+		else if (t < dwell_end)
+		{
+			depth = target_depth;
+			velocity = Scalar(0);
+		}
+		else
+		{
+			depth = std::max(Scalar(0), target_depth - (t - dwell_end) * withdrawal_speed);
+			velocity = -withdrawal_speed;
+		}
+		input.toolTipPoint = Vector(Scalar(0), Scalar(0), -depth);
+		input.needleVelocity = std::abs(velocity);
+
+		// The needle only touches the shallowest layer it has not punctured yet.
+		input.contacts.clear();
+		Scalar surface = Scalar(0);
+		for (const sBatchLayer& layer : scenario.layers)
+		{
+			bool punctured = false;
+			for (const sCorePuncture<Scalar>& puncture : state.punctures)
+				punctured = punctured || (puncture.handle == layer.handle);
+			if (!punctured)
+			{
+				if (depth > surface)
+				{
+					sCoreContact<Scalar> contact;
+					contact.handle = layer.handle;
+					contact.damping = Scalar(layer.tissue.damping);
+					contact.puncture_force = Scalar(layer.tissue.puncture_force);
+					contact.force = Vector(Scalar(0), Scalar(0), Scalar(layer.stiffness) * (depth - surface));
+					contact.respondable = true;
+					input.contacts.push_back(contact);
+				}
+				break;
+			}
+			surface += Scalar(layer.thickness);
+		}
+
+		stepPunctureCore(state, input, core);
+
+		if (state.new_punctures > 0)
+		{
+			if (result.first_puncture_time < 0.0f)
+				result.first_puncture_time = (float)t;
+			result.punctures += state.new_punctures;
+		}
+		Scalar force = std::abs(state.f_ext_magnitude);
+		peak_force = std::max(peak_force, force);
+		max_penetration = std::max(max_penetration, state.full_penetration_length);
+		force_sum += (double)force;
+	}
+	result.peak_force = (float)peak_force;
+	result.max_penetration = (float)max_penetration;
+	result.mean_force = (result.steps > 0) ? (float)(force_sum / result.steps) : 0.0f;
+	return result;
+}
+
+static sInsertionResult simulateInsertion(const sBatchScenario& scenario, const sBatchSettings& settings, sBatchScratch& scratch)
+{
+	if (settings.precision == "double")
+		return simulateCoreInsertion(scenario, settings, scratch.coreDouble);
+	if (settings.precision == "float")
+		return simulateCoreInsertion(scenario, settings, scratch.coreFloat);
+	return simulateModelInsertion(scenario, settings, scratch);
+}
+
+/**
+* @brief Simulate one insertion from start to end.
+*/
+sInsertionResult simulateInsertion(const sBatchScenario& scenario, const sBatchSettings& settings)
+{
+	sBatchScratch scratch;
+	return simulateInsertion(scenario, settings, scratch);
+}
+
+/**
+* @brief Mean, spread and percentiles of a sample.
+*/
+sSummaryStatistic summarize(std::vector<double> values)
+{
+	sSummaryStatistic statistic = { 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0 };
+	if (values.empty())
+		return statistic;
+	std::sort(values.begin(), values.end());
+	double sum = 0.0;
+	for (double value : values)
+		sum += value;
+	statistic.mean = sum / values.size();
+	double squares = 0.0;
+	for (double value : values)
+		squares += (value - statistic.mean) * (value - statistic.mean);
+	statistic.stddev = sqrt(squares / values.size());
+	statistic.min = values.front();
+	statistic.max = values.back();
+	statistic.p5 = values[(values.size() - 1) * 5 / 100];
+	statistic.p50 = values[(values.size() - 1) / 2];
+	statistic.p95 = values[(values.size() - 1) * 95 / 100];
+	return statistic;
+}
+
+/**
+* @brief Run all insertions of a batch on the pool.
+* @param results: if not NULL, receives the result of every run, in run order.
+*/
+sBatchSummary runBatch(const sBatchSettings& settings, CThreadPool& pool, std::vector<sInsertionResult>* results)
+{
+	std::vector<sInsertionResult> runResults(settings.runs);
+	std::vector<sBatchScratch> scratch(pool.getParticipantCount());
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	pool.parallelForWithParticipant(settings.runs, [&](size_t participant, size_t run) {
+		sBatchScratch& buffers = scratch[participant];
+		sampleScenario(settings, (int)run, buffers.scenario);
+		runResults[run] = simulateInsertion(buffers.scenario, settings, buffers);
+	});
+
+	sBatchSummary summary;
+	summary.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	summary.runs = settings.runs;
+	summary.threads = (int)pool.getParticipantCount();
+	summary.steps = 0;
+	std::vector<double> peak, mean, penetration, punctures, first;
+	for (const sInsertionResult& result : runResults)
+	{
+		summary.steps += result.steps;
+		peak.push_back(result.peak_force);
+		mean.push_back(result.mean_force);
+		penetration.push_back(result.max_penetration);
+		punctures.push_back(result.punctures);
+		if (result.first_puncture_time >= 0.0f)
+			first.push_back(result.first_puncture_time);
+	}
+	summary.peak_force = summarize(peak);
+	summary.mean_force = summarize(mean);
+	summary.max_penetration = summarize(penetration);
+	summary.punctures = summarize(punctures);
+	summary.first_puncture_time = summarize(first);
+	if (results != NULL)
+		results->swap(runResults);
+	return summary;
+}
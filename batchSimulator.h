@@ -0,0 +1,93 @@
+// Peter: Monte Carlo batch simulator of needle insertions.
+//
+// Runs the plugin's needle model (stepNeedle(), so the same checkPunctures()/addPuncture()
+// bookkeeping and force models) against an analytic phantom: a stack of flat tissue layers
+// along the insertion axis. With precision "float" or "double" it runs the straight-needle core of the
+// model (stepPunctureCore(), punctureCore.h) in that precision instead, e.g. to calibrate in double. Every run samples its own layer thicknesses, tissue coefficients
+// and insertion profile from the seed and run index, so results do not depend on which thread
+// ran what. Runs are distributed over a work-stealing CThreadPool.
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include "needleModel.h"
+
+class CThreadPool;
+
+struct sBatchLayer {
+	int handle;
+	std::string name;
+	float thickness;								// Unit: m
+	float stiffness;								// Stiffness of the tissue surface before it is punctured. Unit: N/m
+	sTissueParameters tissue;
+};
+
+// Insert at constant speed to a target depth, dwell, and pull back out.
+struct sInsertionProfile {
+	float insertion_speed;							// Unit: m/s
+	float target_depth;								// Unit: m
+	float dwell_time;								// Unit: s
+	float withdrawal_speed;							// Unit: m/s
+};
+
+struct sBatchScenario {
+	std::vector<sBatchLayer> layers;
+	sInsertionProfile profile;
+};
+
+struct sBatchSettings {
+	int runs = 1000;
+	unsigned int seed = 1;
+	float dt = 1.0e-3f;								// Step of the model, the haptic rate. Unit: s
+	float thickness_spread = 0.3f;					// Relative spread of the layer thicknesses (uniform).
+	float coefficient_spread = 0.3f;				// Relative spread of the tissue coefficients (uniform).
+	std::string precision = "model";				// "model": stepNeedle(), float. "float" or "double": stepPunctureCore(),
+													// only the Kelvin-Voigt and Karnopp models.
+	sNeedleConfig config;
+	std::vector<sBatchLayer> layers;				// Nominal phantom, layers are sampled around it.
+	sInsertionProfile profile;						// Nominal profile, speeds and depth are sampled around it.
+};
+
+struct sInsertionResult {
+	int steps;
+	int punctures;									// Number of puncture events.
+	float peak_force;								// Largest f_ext_magnitude. Unit: N
+	float mean_force;								// Mean f_ext_magnitude. Unit: N
+	float max_penetration;							// Largest full_penetration_length. Unit: m
+	float first_puncture_time;						// -1 if nothing was punctured. Unit: s
+};
+
+struct sSummaryStatistic {
+	double mean;
+	double stddev;
+	double min;
+	double p5;
+	double p50;
+	double p95;
+	double max;
+};
+
+struct sBatchSummary {
+	int runs;
+	long long steps;
+	double seconds;
+	int threads;
+	sSummaryStatistic peak_force;
+	sSummaryStatistic mean_force;
+	sSummaryStatistic max_penetration;
+	sSummaryStatistic punctures;
+	sSummaryStatistic first_puncture_time;			// Over the runs that punctured something.
+};
+
+// Nominal phantom and profile. The phantom has no LWR tip frame, so the engine force is taken as
+// the full contact force magnitude (use_only_z_force_on_engine = false). The virtual fixture, the passivity
+// controller and the force snapshot only shape the force rendered on the device and are off.
+sBatchSettings defaultBatchSettings();
+
+sBatchScenario sampleScenario(const sBatchSettings& settings, int run);
+void sampleScenario(const sBatchSettings& settings, int run, sBatchScenario& scenario);
+sInsertionResult simulateInsertion(const sBatchScenario& scenario, const sBatchSettings& settings);
+sBatchSummary runBatch(const sBatchSettings& settings, CThreadPool& pool, std::vector<sInsertionResult>* results);
+sSummaryStatistic summarize(std::vector<double> values);
@@ -0,0 +1,152 @@
+// Peter: Needle bending coupled to the tissue, as an Euler-Bernoulli beam FEM. See beamModel.h.
+
+#include "beamModel.h"
+
+#include <algorithm>
+
+using namespace Eigen;
+
+typedef SimplicialLDLT<SparseMatrix<double> > BeamLDLT;
+
+// Index of the deflection and rotation of node j (1..N) in the system; the base node 0 is clamped.
+static int deflectionDof(int node)
+{
+	return 2 * (node - 1);
+}
+
+void sBeamState::resize(int new_elements, float new_length, float new_bending_stiffness)
+{
+	if ((new_elements == elements) && (new_length == length) && (new_bending_stiffness == bending_stiffness))
+		return;
+	elements = new_elements;
+	length = new_length;
+	bending_stiffness = new_bending_stiffness;
+
+	const int dofs = 2 * elements;
+	const double h = (double)length / elements;
+	const double k = bending_stiffness / (h * h * h);
+	const double element[4][4] = {
+		{ 12.0 * k, 6.0 * h * k, -12.0 * k, 6.0 * h * k },
+		{ 6.0 * h * k, 4.0 * h * h * k, -6.0 * h * k, 2.0 * h * h * k },
+		{ -12.0 * k, -6.0 * h * k, 12.0 * k, -6.0 * h * k },
+		{ 6.0 * h * k, 2.0 * h * h * k, -6.0 * h * k, 4.0 * h * h * k },
+	};
+	std::vector<Triplet<double> > triplets;
+	triplets.reserve(16 * elements);
+	for (int e = 0; e < elements; e++)
+	{
+		// Degrees of freedom of the two nodes of the element, negative for the clamped base.
+		int dof[4] = { deflectionDof(e), deflectionDof(e) + 1, deflectionDof(e + 1), deflectionDof(e + 1) + 1 };
+		for (int a = 0; a < 4; a++)
+			for (int b = 0; b < 4; b++)
+				if ((dof[a] >= 0) && (dof[b] >= 0))
+					triplets.push_back(Triplet<double>(dof[a], dof[b], element[a][b]));
+	}
+	beam.resize(dofs, dofs);
+	beam.setFromTriplets(triplets.begin(), triplets.end());
+	beam.makeCompressed();
+	system = beam;
+	diagonal.assign(dofs, -1);
+	for (int col = 0; col < dofs; col++)
+		for (int i = system.outerIndexPtr()[col]; i < system.outerIndexPtr()[col + 1]; i++)
+			if (system.innerIndexPtr()[i] == col)
+				diagonal[col] = i;
+
+	solver.ldlt.reset();
+	factorized = false;
+	springs.setZero(elements);
+	factorized_springs.setZero(elements);
+	rhs.setZero(dofs, 2);
+	displacement.setZero(dofs, 2);
+	residual.setZero(dofs, 2);
+	correction.setZero(dofs, 2);
+}
+
+void sBeamState::reset()
+{
+	displacement.setZero();
+}
+
+/**
+* @brief Numeric factorization of the system. The symbolic analysis is only done for a new solver.
+* @return false if the system could not be factorized
+*/
+static bool factorizeBeam(sBeamState& state)
+{
+	if (!state.solver.ldlt)
+	{
+		state.solver.ldlt.reset(new BeamLDLT());
+		state.solver.ldlt->analyzePattern(state.system);
+	}
+	state.solver.ldlt->factorize(state.system);
+	state.factorized = (state.solver.ldlt->info() == Success);
+	state.factorized_springs = state.springs;
+	return state.factorized;
+}
+
+/**
+* @brief Deflection of the needle in the tissue, see beamModel.h
+* @param state: beam, see sBeamState::resize(). Keeps the factorization and the last solution.
+* @param layers: parts of the needle in each tissue
+* @param tip: tip of the straight needle
+* @param axis: unit vector from the tip towards the base
+* @param tipForce: lateral force on the tip
+*/
+sBeamResult beamModel(sBeamState& state, const std::vector<sShaftLayer>& layers, const Vector3f& tip, const Vector3f& axis, const Vector3f& tipForce)
+{
+	const int n = state.elements;
+	const float h = state.length / n;
+	Vector3f e1 = axis.unitOrthogonal();
+	Vector3f e2 = axis.cross(e1);
+
+	// Tissue springs pull the nodes towards the entry lines of their tissues.
+	state.rhs.setZero();
+	Vector2d spring_force = Vector2d::Zero();
+	for (int j = 1; j <= n; j++)
+	{
+		float d = (n - j) * h;
+		double spring = 0.0;
+		for (const sShaftLayer& layer : layers)
+		{
+			if ((d < layer.begin) || (d >= layer.end))
+				continue;
+			Vector3f offset = tip + d * axis - layer.entry;
+			offset -= offset.dot(layer.direction) * layer.direction;
+			spring = layer.lateral_stiffness * ((j == n) ? 0.5f * h : h);
+			state.rhs(deflectionDof(j), 0) = -spring * offset.dot(e1);
+			state.rhs(deflectionDof(j), 1) = -spring * offset.dot(e2);
+			spring_force += state.rhs.row(deflectionDof(j)).transpose();
+			break;
+		}
+		state.springs(j - 1) = spring;
+	}
+	Vector3f lateral = tipForce - tipForce.dot(axis) * axis;
+	state.rhs(deflectionDof(n), 0) += lateral.dot(e1);
+	state.rhs(deflectionDof(n), 1) += lateral.dot(e2);
+
+	std::copy(state.beam.valuePtr(), state.beam.valuePtr() + state.beam.nonZeros(), state.system.valuePtr());
+	for (int j = 1; j <= n; j++)
+		state.system.valuePtr()[state.diagonal[deflectionDof(j)]] += state.springs(j - 1);
+
+	sBeamResult result;
+	if (!state.factorized || !state.solver.ldlt || (state.springs != state.factorized_springs))
+		result.factorized = factorizeBeam(state);
+	if (state.factorized)
+	{
+		// Warm start: only solve for the change since the last step. This is also one step of
+		// iterative refinement, which the badly conditioned beam needs.
+		state.residual = state.rhs;
+		state.residual.noalias() -= state.system * state.displacement;
+		state.correction = state.solver.ldlt->solve(state.residual);
+		state.displacement += state.correction;
+	}
+	else
+		state.displacement.setZero();
+
+	// Force of the springs on the needle: k (rest - w) summed over the embedded nodes.
+	for (int j = 1; j <= n; j++)
+		spring_force -= state.springs(j - 1) * state.displacement.row(deflectionDof(j)).transpose();
+	result.tissue_force = (float)spring_force(0) * e1 + (float)spring_force(1) * e2;
+	result.tip_deflection = (float)state.displacement(deflectionDof(n), 0) * e1 + (float)state.displacement(deflectionDof(n), 1) * e2;
+	return result;
+}
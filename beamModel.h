@@ -0,0 +1,69 @@
+// Peter: Needle bending coupled to the tissue, as an Euler-Bernoulli beam FEM.
+//
+// The needle is a beam clamped at its base (held by the robot) and split into N elements with a
+// deflection w and a rotation theta per node. Nodes inside a tissue are tied to the line the needle
+// entered that tissue along by springs of lateral_stiffness * element length, see shaftModel.h.
+// The two bending planes share the stiffness matrix, so both are solved with one factorization:
+//   (K_beam + K_tissue) u = f_tissue + f_tip
+//
+// The matrix is factorized with Eigen's SimplicialLDLT. Its sparsity pattern never changes, so the
+// symbolic analysis is only done once; the numeric factorization is only redone when a tissue spring
+// changed. Each step starts from the previous solution and solves for the change only.
+//
+// The solver works in double precision: the condition number of the beam grows with N^4.
+
+#pragma once
+
+#include <memory>
+#include <vector>
+
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+#include <Eigen/SparseCore>
+#include <Eigen/SparseCholesky>
+
+#include "shaftModel.h"
+
+struct sBeamResult {
+	Eigen::Vector3f tip_deflection = Eigen::Vector3f::Zero();	// Tip of the bent needle relative to the straight needle. Unit: m
+	Eigen::Vector3f tissue_force = Eigen::Vector3f::Zero();		// Sum of the spring forces of the tissue on the needle. Unit: N
+	bool factorized = false;						// The matrix was factorized in this step.
+};
+
+// SimplicialLDLT can not be copied, but the needle state is. A copy starts without a solver and
+// analyzes the pattern again on first use.
+struct sBeamSolver {
+	std::unique_ptr<Eigen::SimplicialLDLT<Eigen::SparseMatrix<double> > > ldlt;
+
+	sBeamSolver() {}
+	sBeamSolver(const sBeamSolver&) {}
+	sBeamSolver& operator=(const sBeamSolver&) { ldlt.reset(); return *this; }
+};
+
+struct sBeamState {
+	int elements = 0;
+	float length = 0.0f;							// Unit: m
+	float bending_stiffness = 0.0f;					// EI. Unit: N m^2
+	Eigen::SparseMatrix<double> beam;				// Beam stiffness without the clamped base node.
+	Eigen::SparseMatrix<double> system;				// Beam and tissue springs, same pattern as beam.
+	std::vector<int> diagonal;						// Index of the diagonal entries in the values of system.
+	sBeamSolver solver;
+	bool factorized = false;
+	Eigen::VectorXd springs;						// Tissue spring on the deflection of each node (1..N). Unit: N/m
+	Eigen::VectorXd factorized_springs;				// Springs of the current factorization.
+	Eigen::MatrixXd rhs;							// One column per bending plane.
+	Eigen::MatrixXd displacement;					// Solution of the last step, used as warm start.
+	Eigen::MatrixXd residual;
+	Eigen::MatrixXd correction;
+
+	// Assembles the beam. Only does work when the beam changes.
+	void resize(int elements, float length, float bending_stiffness);
+	void reset();
+};
+
+// Deflection of a needle with a straight base.
+// tip, axis: tip of the straight (unbent) needle and unit vector from the tip towards the base.
+// layers: parts of the needle in each tissue, measured from the tip as in shaftModel.h.
+// tipForce: lateral force on the tip, e.g. from the bevel. Only the part perpendicular to axis is used.
+sBeamResult beamModel(sBeamState& state, const std::vector<sShaftLayer>& layers, const Eigen::Vector3f& tip,
+	const Eigen::Vector3f& axis, const Eigen::Vector3f& tipForce);
@@ -0,0 +1,93 @@
+// Peter: Kinematic bevel-tip needle model. See bevelModel.h.
+
+#include "bevelModel.h"
+
+#include <math.h>
+
+using namespace Eigen;
+
+// Below this, sin and cos of the bending angle are replaced by their Taylor series.
+const float SMALL_ANGLE = 1.0e-4f;
+
+/**
+* @brief Part of v that is perpendicular to the unit vector axis, normalized.
+*        Falls back to any perpendicular direction if v is (nearly) parallel to axis.
+*/
+static Vector3f perpendicularDirection(const Vector3f& v, const Vector3f& axis)
+{
+	Vector3f perpendicular = v - v.dot(axis) * axis;
+	float norm = perpendicular.norm();
+	if (norm < 1.0e-6f)
+		return axis.unitOrthogonal();
+	return perpendicular / norm;
+}
+
+void sBevelTip::reset(const Vector3f& tip, const Vector3f& direction, const Vector3f& bevel)
+{
+	Vector3f z = direction.normalized();
+	Vector3f y = perpendicularDirection(bevel, z);
+	frame.col(0) = y.cross(z);
+	frame.col(1) = y;
+	frame.col(2) = z;
+	position = tip;
+	arc_length = 0.0f;
+	rigid_tip = tip;
+	rigid_bevel = bevel;
+	sBevelPathPoint start = { tip, 0.0f };
+	path.clear();
+	path.push_back(start);
+}
+
+float sBevelTip::deflection() const
+{
+	return (position - rigid_tip).norm();
+}
+
+/**
+* @brief Advance the tip along its arc, see bevelModel.h
+* @param bevel: tip to advance
+* @param tip: position of the rigid needle tip
+* @param direction: unit insertion direction of the rigid needle
+* @param bevelSide: direction the bevel of the rigid needle faces
+* @param curvature: curvature of the path in the tissue the tip is in. Unit: 1/m
+*/
+void advanceBevelTip(sBevelTip& bevel, const Vector3f& tip, const Vector3f& direction, const Vector3f& bevelSide, float curvature)
+{
+	float ds = (tip - bevel.rigid_tip).dot(direction);
+
+	// Roll of the needle about its axis turns the bending plane.
+	Vector3f previous = perpendicularDirection(bevel.rigid_bevel, direction);
+	Vector3f current = perpendicularDirection(bevelSide, direction);
+	float roll = atan2f(previous.cross(current).dot(direction), previous.dot(current));
+	if (roll != 0.0f)
+		bevel.frame = bevel.frame * AngleAxisf(roll, Vector3f::UnitZ()).toRotationMatrix();
+
+	float angle = curvature * ds;
+	Vector3f step;
+	if (fabsf(angle) < SMALL_ANGLE)
+		step = Vector3f(0.0f, 0.5f * angle * ds, ds);
+	else
+		step = Vector3f(0.0f, (1.0f - cosf(angle)) / curvature, sinf(angle) / curvature);
+	bevel.position += bevel.frame * step;
+	bevel.frame = bevel.frame * AngleAxisf(-angle, Vector3f::UnitX()).toRotationMatrix();
+
+	// Keep the frame orthonormal, rounding errors add up over many steps.
+	Vector3f z = bevel.frame.col(2).normalized();
+	Vector3f y = perpendicularDirection(bevel.frame.col(1), z);
+	bevel.frame.col(0) = y.cross(z);
+	bevel.frame.col(1) = y;
+	bevel.frame.col(2) = z;
+
+	bevel.arc_length += ds;
+	bevel.rigid_tip = tip;
+	bevel.rigid_bevel = bevelSide;
+
+	// Points the tip has withdrawn past are dropped, the next one is recorded a spacing after the last.
+	while ((bevel.path.size() > 1) && (bevel.path.back().arc_length > bevel.arc_length))
+		bevel.path.pop_back();
+	if (bevel.path.empty() || (bevel.arc_length >= bevel.path.back().arc_length + BEVEL_PATH_SPACING))
+	{
+		sBevelPathPoint point = { bevel.position, bevel.arc_length };
+		bevel.path.push_back(point);
+	}
+}
@@ -0,0 +1,49 @@
+// Peter: Kinematic bevel-tip needle model (unicycle model of Webster et al.).
+//
+// An asymmetric bevel makes the needle tip follow an arc of constant curvature while it is inserted
+// into a tissue, bending towards the bevel side. Rolling the needle about its axis turns the plane it
+// bends in. The tip frame is advanced incrementally from the motion of the rigid needle in the scene:
+//   ds   = axial displacement of the rigid tip along the insertion direction
+//   dphi = roll of the rigid needle about the insertion direction
+// Over one step with curvature k, the tip moves  frame * (0, (1 - cos(k ds)) / k, sin(k ds) / k)
+// and the frame turns by -k ds about its x axis. Withdrawing (ds < 0) runs the same arc backwards.
+// A step costs a few hundred flops. The tip keeps a point of its path every BEVEL_PATH_SPACING, so that the
+// part of the curved shaft inside a tissue can be measured along chords of the arc (see needleModel.cpp).
+// The vector of the points is reused between resets.
+
+#pragma once
+
+#include <vector>
+
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+
+// Arc length between the recorded points of the path. The chords between them are off the arc by s^2 k / 8,
+// 16 um at a curvature of 5 1/m. Unit: m
+const float BEVEL_PATH_SPACING = 5.0e-3f;
+
+// Point of the curved path, see sBevelTip::path.
+struct sBevelPathPoint {
+	Eigen::Vector3f position;
+	float arc_length;								// Unit: m
+};
+
+struct sBevelTip {
+	Eigen::Vector3f position = Eigen::Vector3f::Zero();		// Tip on the curved path, world frame.
+	Eigen::Matrix3f frame = Eigen::Matrix3f::Identity();	// Columns: bending axis, bevel side, insertion direction.
+	float arc_length = 0.0f;								// Length of the path since the last reset. Unit: m
+	Eigen::Vector3f rigid_tip = Eigen::Vector3f::Zero();	// Tip of the rigid needle at the last update.
+	Eigen::Vector3f rigid_bevel = Eigen::Vector3f::UnitY();	// Bevel side of the rigid needle at the last update.
+	std::vector<sBevelPathPoint> path;						// Points of the path since the last reset, the reset point first.
+
+	// Put the tip back onto the rigid needle, e.g. while it is outside the tissue.
+	void reset(const Eigen::Vector3f& tip, const Eigen::Vector3f& direction, const Eigen::Vector3f& bevel);
+	// Distance between the curved tip and the tip of the rigid needle. Unit: m
+	float deflection() const;
+};
+
+// Advance the tip by the motion of the rigid needle since the last update.
+// tip: position of the rigid needle tip. direction: unit insertion direction.
+// bevelSide: direction the bevel faces (any vector not parallel to direction). curvature: of the tissue the tip is in. Unit: 1/m
+void advanceBevelTip(sBevelTip& bevel, const Eigen::Vector3f& tip, const Eigen::Vector3f& direction,
+	const Eigen::Vector3f& bevelSide, float curvature);
@@ -0,0 +1,120 @@
+// Peter: Extrapolation of the needle force between simulation steps. See forceExtrapolation.h.
+
+#include "forceExtrapolation.h"
+
+#include <algorithm>
+#include <math.h>
+
+void sExtrapolationHistory::add(float velocity, float speed, float force)
+{
+	times[next] = time;
+	values[HISTORY_VELOCITY][next] = velocity;
+	values[HISTORY_SPEED][next] = speed;
+	values[HISTORY_FORCE][next] = force;
+	next = (next + 1) % EXTRAPOLATION_HISTORY;
+	count = std::min(count + 1, EXTRAPOLATION_HISTORY);
+}
+
+float sExtrapolationHistory::slope(int signal) const
+{
+	if (count < 2)
+		return 0.0f;
+	// Relative to the newest time, the absolute model time would cost precision.
+	double newest = times[(next + EXTRAPOLATION_HISTORY - 1) % EXTRAPOLATION_HISTORY];
+	double mean_t = 0.0, mean_y = 0.0;
+	for (int i = 0; i < count; i++)
+	{
+		mean_t += times[i] - newest;
+		mean_y += values[signal][i];
+	}
+	mean_t /= count;
+	mean_y /= count;
+	double covariance = 0.0, variance = 0.0;
+	for (int i = 0; i < count; i++)
+	{
+		double t = times[i] - newest - mean_t;
+		covariance += t * (values[signal][i] - mean_y);
+		variance += t * t;
+	}
+	return (variance > 0.0) ? (float)(covariance / variance) : 0.0f;
+}
+
+void sExtrapolationHistory::reset()
+{
+	*this = sExtrapolationHistory();
+}
+
+// Force model of the snapshot tau after its step, without the scale.
+static float snapshotModelForce(const sForceSnapshot& snapshot, float tau)
+{
+	if (snapshot.model == SNAPSHOT_RATE)
+		return snapshot.c0 + snapshot.force_rate * tau;
+	float depth = snapshot.velocity * tau + 0.5f * snapshot.acceleration * tau * tau;
+	depth = std::min(std::max(depth, snapshot.min_depth_change), snapshot.max_depth_change);
+	float speed = std::max(snapshot.speed + snapshot.speed_rate * tau, 0.0f);
+	float length = std::max(snapshot.c0 + snapshot.c1 * depth, 0.0f);
+	return length * ((speed < snapshot.stick_speed) ? snapshot.stick : snapshot.s0 + snapshot.s1 * speed);
+}
+
+float snapshotAxialForce(const sForceSnapshot& snapshot, float tau)
+{
+	if (snapshot.model == SNAPSHOT_HOLD)
+		return snapshot.axial;
+	tau = std::min(std::max(tau, 0.0f), snapshot.horizon);
+	// Offset so that tau = 0 gives the force of the step exactly, whatever the model left out.
+	return snapshot.axial + snapshot.scale * (snapshotModelForce(snapshot, tau) - snapshotModelForce(snapshot, 0.0f));
+}
+
+static void snapshotForce(const sForceSnapshot& snapshot, float tau, float force[3])
+{
+	float axial = snapshotAxialForce(snapshot, tau);
+	for (int i = 0; i < 3; i++)
+		force[i] = snapshot.held[i] + axial * snapshot.direction[i];
+}
+
+/**
+* @brief Take a new snapshot. The output blends over from the extrapolation of the last one.
+* @param now: device clock. Unit: s
+*/
+void sForceExtrapolator::receive(const sForceSnapshot& snapshot, double now)
+{
+	if (valid)
+	{
+		// The simulation does not have to run in real time, the model time is mapped to the device clock.
+		if ((now > arrival) && (snapshot.time > current.time))
+		{
+			double scale = (snapshot.time - current.time) / (now - arrival);
+			time_scale = std::min(std::max(0.5 * (time_scale + scale), 0.01), 100.0);
+		}
+		previous = current;
+		previous_arrival = arrival;
+		blending = (snapshot.event == 0);
+	}
+	current = snapshot;
+	arrival = now;
+	valid = true;
+}
+
+/**
+* @brief Force to render at the device rate, O(1)
+* @param now: device clock. Unit: s
+* @param force: receives the force, world frame. Unit: N
+*/
+void sForceExtrapolator::evaluate(double now, float force[3]) const
+{
+	if (!valid)
+	{
+		force[0] = force[1] = force[2] = 0.0f;
+		return;
+	}
+	snapshotForce(current, (float)((now - arrival) * time_scale), force);
+	float weight = (blend_time > 0.0f) ? (float)((now - arrival) / blend_time) : 1.0f;
+	if (blending && (weight < 1.0f))
+	{
+		float old_force[3];
+		snapshotForce(previous, (float)((now - previous_arrival) * time_scale), old_force);
+		weight = std::max(weight, 0.0f);
+		for (int i = 0; i < 3; i++)
+			force[i] = weight * force[i] + (1.0f - weight) * old_force[i];
+	}
+}
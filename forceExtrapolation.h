@@ -0,0 +1,96 @@
+// Peter: Extrapolation of the needle force between simulation steps, for the haptic device.
+//
+// The simulation step is 50 ms, the device runs at 1 kHz, so a step-held f_ext feels like a staircase.
+// Every step the model (stepNeedle()) writes a snapshot: the force of the step split into a part that is
+// held and an axial part of the active force model, the coefficients of that model, a local model of the
+// insertion, and the limits of the next events. The device side then evaluates, at its own rate,
+//   depth:     dd(tau) = v0 tau + a tau^2 / 2            (a: slope of the axial velocity over the last steps)
+//   velocity:  v(tau)  = v0 + a tau
+//   force:     the force model at the extrapolated depth and velocity
+// with dd clamped to [min_depth_change, max_depth_change]: the innermost layer is left at min_depth_change,
+// and a touched tissue is punctured at max_depth_change, both change the force discontinuously and are
+// left to the next real step. When a new snapshot arrives, the output blends from the extrapolation
+// of the old one to the new one over blend_time, unless the step had such an event, which is rendered as
+// the step it is.
+//
+// Plain data without Eigen, so that the snapshot can be published through shared memory (hapticChannel.h)
+// and evaluated by the driver. Evaluation is a few dozen flops and does not allocate.
+
+#pragma once
+
+#include <stdint.h>
+
+// The force models are written as (c0 + c1 dd) (s0 + s1 |v|), and (c0 + c1 dd) s_stick below the stick speed:
+//   Kelvin-Voigt:  c0 = sum(B_i pen_i), c1 = B of the innermost puncture, s0 = 0, s1 = 1
+//   Karnopp:       c0 = L, c1 = 1, s0 = C_p, s1 = b_p, s_stick = D_p (times the 0.1 of the model)
+// (only the innermost puncture gets longer while the needle moves).
+// The stateful models (prony, lugre, shaft) are extrapolated with the rate of their force over the last steps.
+enum eSnapshotModel {
+	SNAPSHOT_HOLD = 0,								// Nothing to extrapolate (no punctures).
+	SNAPSHOT_BILINEAR = 1,
+	SNAPSHOT_RATE = 2,
+};
+
+struct sForceSnapshot {
+	int32_t model;									// eSnapshotModel
+	int32_t event;									// Punctured, left a tissue or touched one in this step: switch without blending.
+	double time;									// Model time of the step. Unit: s
+	float held[3];									// Part of f_device that is not extrapolated. Unit: N
+	float direction[3];								// Direction of the axial part (the dummy direction).
+	float axial;									// Axial part of this step: engine force + scaled model force. Unit: N
+	float engine;									// Engine part of axial, held. Unit: N
+	float scale;									// model_force_scalar
+	float velocity;									// Axial velocity, positive when inserting. Unit: m/s
+	float acceleration;								// Slope of the axial velocity over the last steps. Unit: m/s^2
+	float speed;									// Speed the force models use (needleVelocity). Unit: m/s
+	float speed_rate;								// Slope of the speed over the last steps. Unit: m/s^2
+	float c0, c1;									// Length factor of the bilinear model, see above.
+	float s0, s1;									// Speed factor.
+	float stick_speed;								// Unit: m/s
+	float stick;
+	float force_rate;								// Rate of the model force over the last steps (SNAPSHOT_RATE). Unit: N/s
+	float min_depth_change;							// The innermost layer is left here. Unit: m
+	float max_depth_change;							// A touched tissue is punctured here. Unit: m
+	float horizon;									// Longest extrapolation, the force is held after it. Unit: s
+};
+
+// Last steps of the model, to fit the rates of the snapshot. Fixed size ring.
+const int EXTRAPOLATION_HISTORY = 4;
+enum eHistorySignal {
+	HISTORY_VELOCITY = 0,							// Axial velocity.
+	HISTORY_SPEED = 1,
+	HISTORY_FORCE = 2,								// Model force, for SNAPSHOT_RATE.
+	HISTORY_SIGNALS = 3,
+};
+struct sExtrapolationHistory {
+	double time = 0.0;								// Model time, the sum of the step times. Unit: s
+	int count = 0;
+	int next = 0;
+	double times[EXTRAPOLATION_HISTORY];
+	float values[HISTORY_SIGNALS][EXTRAPOLATION_HISTORY];
+
+	void add(float velocity, float speed, float force);
+	// Least squares slope of a signal over the history, 0 with fewer than two entries.
+	float slope(int signal) const;
+	void reset();
+};
+
+// Axial force of a snapshot tau seconds (model time) after its step. Equal to snapshot.axial at tau = 0.
+float snapshotAxialForce(const sForceSnapshot& snapshot, float tau);
+
+// Device side: receives the snapshots and evaluates the force at the device rate.
+struct sForceExtrapolator {
+	float blend_time = 0.01f;						// Unit: s
+	bool valid = false;
+	bool blending = false;
+	sForceSnapshot current;
+	sForceSnapshot previous;
+	double arrival = 0.0;							// Device time the current snapshot arrived. Unit: s
+	double previous_arrival = 0.0;
+	double time_scale = 1.0;						// Model time per device time, estimated from the arrivals.
+
+	// now: device clock. Unit: s
+	void receive(const sForceSnapshot& snapshot, double now);
+	// Force to render at now, world frame.
+	void evaluate(double now, float force[3]) const;
+};
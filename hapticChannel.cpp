@@ -0,0 +1,230 @@
+// Peter: Shared-memory channel between the plugin and the haptic driver process. See hapticChannel.h.
+
+#include "hapticChannel.h"
+
+#include <chrono>
+#include <new>
+
+#ifdef _WIN32
+	#define NOMINMAX
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+static_assert(ATOMIC_INT_LOCK_FREE == 2, "The seqlock needs lock-free atomics to work across processes");
+
+CSharedSegment::CSharedSegment()
+	: _data(NULL), _size(0), _owner(false)
+#ifdef _WIN32
+	, _mapping(NULL)
+#endif
+{
+}
+
+CSharedSegment::~CSharedSegment()
+{
+	close();
+}
+
+/**
+* @brief Create a zeroed segment. A stale segment of the same name (e.g. after a crash) is replaced.
+*/
+bool CSharedSegment::create(const std::string& name, size_t size)
+{
+	close();
+#ifdef _WIN32
+	_mapping = CreateFileMappingA(INVALID_HANDLE_VALUE, NULL, PAGE_READWRITE, 0, (DWORD)size, ("Local\\" + name.substr(1)).c_str());
+	if (_mapping == NULL)
+		return false;
+	_data = MapViewOfFile(_mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+#else
+	shm_unlink(name.c_str());
+	int file = shm_open(name.c_str(), O_CREAT | O_EXCL | O_RDWR, 0666);
+	if (file < 0)
+		return false;
+	if (ftruncate(file, (off_t)size) == 0)
+	{
+		_data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+		if (_data == MAP_FAILED)
+			_data = NULL;
+	}
+	::close(file);
+	if (_data == NULL)
+		shm_unlink(name.c_str());
+#endif
+	if (_data == NULL)
+	{
+		close();
+		return false;
+	}
+	std::memset(_data, 0, size);
+	_name = name;
+	_size = size;
+	_owner = true;
+	return true;
+}
+
+bool CSharedSegment::open(const std::string& name, size_t size)
+{
+	close();
+#ifdef _WIN32
+	_mapping = OpenFileMappingA(FILE_MAP_ALL_ACCESS, FALSE, ("Local\\" + name.substr(1)).c_str());
+	if (_mapping == NULL)
+		return false;
+	_data = MapViewOfFile(_mapping, FILE_MAP_ALL_ACCESS, 0, 0, size);
+#else
+	int file = shm_open(name.c_str(), O_RDWR, 0);
+	if (file < 0)
+		return false;
+	struct stat status;
+	if ((fstat(file, &status) == 0) && (status.st_size >= (off_t)size))
+	{
+		_data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, file, 0);
+		if (_data == MAP_FAILED)
+			_data = NULL;
+	}
+	::close(file);
+#endif
+	if (_data == NULL)
+	{
+		close();
+		return false;
+	}
+	_name = name;
+	_size = size;
+	_owner = false;
+	return true;
+}
+
+void CSharedSegment::close()
+{
+#ifdef _WIN32
+	if (_data != NULL)
+		UnmapViewOfFile(_data);
+	if (_mapping != NULL)
+		CloseHandle(_mapping);
+	_mapping = NULL;
+#else
+	if (_data != NULL)
+		munmap(_data, _size);
+	if (_owner)
+		shm_unlink(_name.c_str());
+#endif
+	_data = NULL;
+	_size = 0;
+	_owner = false;
+	_name.clear();
+}
+
+void* CSharedSegment::getData() const
+{
+	return _data;
+}
+
+template <typename T>
+static void initSegment(void* data)
+{
+	sHapticSegment<T>* segment = new (data) sHapticSegment<T>();
+	std::memcpy(segment->magic, HAPTIC_CHANNEL_MAGIC, sizeof(segment->magic));
+	segment->version = HAPTIC_CHANNEL_VERSION;
+	segment->record_size = sizeof(T);
+	segment->slot.sequence.store(0, std::memory_order_release);
+}
+
+template <typename T>
+static bool validSegment(const void* data)
+{
+	const sHapticSegment<T>* segment = (const sHapticSegment<T>*)data;
+	return (std::memcmp(segment->magic, HAPTIC_CHANNEL_MAGIC, sizeof(segment->magic)) == 0)
+		&& (segment->version == HAPTIC_CHANNEL_VERSION) && (segment->record_size == sizeof(T));
+}
+
+bool CHapticChannel::create(const std::string& id)
+{
+	close();
+	if (!_needleSegment.create(segmentName(id, false), sizeof(sHapticSegment<sNeedlePublication>))
+		|| !_deviceSegment.create(segmentName(id, true), sizeof(sHapticSegment<sDevicePose>)))
+	{
+		close();
+		return false;
+	}
+	initSegment<sNeedlePublication>(_needleSegment.getData());
+	initSegment<sDevicePose>(_deviceSegment.getData());
+	return true;
+}
+
+bool CHapticChannel::open(const std::string& id)
+{
+	close();
+	if (!_needleSegment.open(segmentName(id, false), sizeof(sHapticSegment<sNeedlePublication>))
+		|| !_deviceSegment.open(segmentName(id, true), sizeof(sHapticSegment<sDevicePose>))
+		|| !validSegment<sNeedlePublication>(_needleSegment.getData()) || !validSegment<sDevicePose>(_deviceSegment.getData()))
+	{
+		close();
+		return false;
+	}
+	return true;
+}
+
+void CHapticChannel::close()
+{
+	_needleSegment.close();
+	_deviceSegment.close();
+}
+
+bool CHapticChannel::isOpen() const
+{
+	return (_needleSegment.getData() != NULL) && (_deviceSegment.getData() != NULL);
+}
+
+void CHapticChannel::publishNeedle(const sNeedlePublication& publication)
+{
+	seqlockWrite(_needle()->slot, publication);
+}
+
+void CHapticChannel::readNeedle(sNeedlePublication& publication) const
+{
+	while (!seqlockTryRead(_needle()->slot, publication))
+		;
+}
+
+void CHapticChannel::publishDevice(const sDevicePose& pose)
+{
+	seqlockWrite(_device()->slot, pose);
+}
+
+void CHapticChannel::readDevice(sDevicePose& pose) const
+{
+	while (!seqlockTryRead(_device()->slot, pose))
+		;
+}
+
+std::string CHapticChannel::segmentName(const std::string& id, bool device)
+{
+	std::string name = device ? "/vrepNeedleDevice" : "/vrepNeedle";
+	for (char c : id)
+	{
+		if (c != '#')
+			name += c;
+	}
+	return name;
+}
+
+uint64_t CHapticChannel::steadyNanoseconds()
+{
+	return (uint64_t)std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+sHapticSegment<sNeedlePublication>* CHapticChannel::_needle() const
+{
+	return (sHapticSegment<sNeedlePublication>*)_needleSegment.getData();
+}
+
+sHapticSegment<sDevicePose>* CHapticChannel::_device() const
+{
+	return (sHapticSegment<sDevicePose>*)_deviceSegment.getData();
+}
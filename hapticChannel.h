@@ -0,0 +1,141 @@
+// Peter: Shared-memory channel between the plugin and the haptic driver process.
+//
+// Two shared-memory segments per needle, both created by the plugin at simulation start:
+//   /vrepNeedle<id>         written by the plugin every step: f_device, tip pose, puncture state
+//   /vrepNeedleDevice<id>   written by the driver: pose of the haptic device
+// where <id> is the needle's suffix without the '#' ("", "0", "1", ...).
+//
+// Each segment holds one record behind a seqlock. The writer makes the sequence odd, writes the
+// record and makes the sequence even again. A reader copies the record straight out of the mapping
+// and retries if the sequence was odd or changed in the meantime. Once the segments are mapped,
+// neither side makes a system call or takes a lock, and a slow reader never blocks the writer.
+// The records are plain data with fixed-size fields, so the driver does not need this code base
+// (see hapticReader.cpp for a reference reader).
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstring>
+#include <stdint.h>
+#include <string>
+
+#include "forceExtrapolation.h"
+
+const char HAPTIC_CHANNEL_MAGIC[8] = { 'V', 'R', 'E', 'P', 'N', 'D', 'L', 'E' };
+const uint32_t HAPTIC_CHANNEL_VERSION = 2;
+
+// Written by the plugin. Matrices are 3x4 and row major like V-REP object matrices.
+struct sNeedlePublication {
+	uint64_t step;									// Steps published since the channel was created.
+	uint64_t publish_ns;							// Steady clock at publication, for latency measurements. Unit: ns
+	double sim_time;								// Unit: s
+	float force[3];									// f_device, world frame. Unit: N
+	float tip_matrix[12];							// Pose of the needle tip (LWR_tip).
+	float penetration;								// full_penetration_length. Unit: m
+	int32_t punctures;								// Number of punctured tissues.
+	int32_t fixture_active;							// The virtual fixture holds the needle on its insertion line.
+	int32_t padding;
+	sForceSnapshot snapshot;						// Extrapolation of force until the next step, see forceExtrapolation.h.
+};
+
+// Written by the driver.
+struct sDevicePose {
+	uint64_t count;									// Poses written since the channel was created, 0: none yet.
+	uint64_t publish_ns;							// Steady clock at publication. Unit: ns
+	float matrix[12];								// Pose for Dummy_device, world frame.
+	int32_t buttons;
+	int32_t padding;
+};
+
+template <typename T>
+struct sSeqlock {
+	std::atomic<uint32_t> sequence;					// Odd while the record is written.
+	uint32_t padding;
+	T record;
+};
+
+// Layout of a segment.
+template <typename T>
+struct sHapticSegment {
+	char magic[8];
+	uint32_t version;
+	uint32_t record_size;							// sizeof(T) of the writer, checked by readers.
+	alignas(64) sSeqlock<T> slot;					// Keep the seqlock off the cache line of the header.
+};
+
+template <typename T>
+void seqlockWrite(sSeqlock<T>& lock, const T& record)
+{
+	uint32_t sequence = lock.sequence.load(std::memory_order_relaxed);
+	lock.sequence.store(sequence + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	std::memcpy(&lock.record, &record, sizeof(T));
+	lock.sequence.store(sequence + 2, std::memory_order_release);
+}
+
+// False if the writer was busy, the record is then not consistent and should be read again.
+template <typename T>
+bool seqlockTryRead(const sSeqlock<T>& lock, T& record)
+{
+	uint32_t before = lock.sequence.load(std::memory_order_acquire);
+	if ((before & 1) != 0)
+		return false;
+	std::memcpy(&record, &lock.record, sizeof(T));
+	std::atomic_thread_fence(std::memory_order_acquire);
+	return lock.sequence.load(std::memory_order_relaxed) == before;
+}
+
+// One mapped shared-memory segment. The creator removes the name again on close.
+class CSharedSegment
+{
+public:
+	CSharedSegment();
+	virtual ~CSharedSegment();
+
+	bool create(const std::string& name, size_t size);
+	bool open(const std::string& name, size_t size);
+	void close();
+	void* getData() const;
+
+private:
+	CSharedSegment(const CSharedSegment&);
+	CSharedSegment& operator=(const CSharedSegment&);
+
+	std::string _name;
+	void* _data;
+	size_t _size;
+	bool _owner;
+#ifdef _WIN32
+	void* _mapping;
+#endif
+};
+
+class CHapticChannel
+{
+public:
+	// Plugin side: creates both segments. id: suffix of the needle.
+	bool create(const std::string& id);
+	// Driver side: maps the segments the plugin created.
+	bool open(const std::string& id);
+	void close();
+	bool isOpen() const;
+
+	void publishNeedle(const sNeedlePublication& publication);
+	// Latest record, retries while the writer is busy.
+	void readNeedle(sNeedlePublication& publication) const;
+	void publishDevice(const sDevicePose& pose);
+	void readDevice(sDevicePose& pose) const;
+
+	// Name of a segment for a needle suffix ("#0" -> "/vrepNeedle0").
+	static std::string segmentName(const std::string& id, bool device);
+	// Steady clock in ns, the same clock in all processes of the machine.
+	static uint64_t steadyNanoseconds();
+
+private:
+	sHapticSegment<sNeedlePublication>* _needle() const;
+	sHapticSegment<sDevicePose>* _device() const;
+
+	CSharedSegment _needleSegment;
+	CSharedSegment _deviceSegment;
+};
@@ -0,0 +1,169 @@
+// Peter: Reference reader of the shared-memory channel (hapticChannel.h), the part a haptic driver needs.
+// Does not need V-REP or a device. The force is extrapolated between simulation steps (forceExtrapolation.h).
+//
+// Build with "make haptics" and run e.g.
+//   bin/needleHapticReader --needle 0 --rate 1000
+// while a simulation with simExtSkeleton_setSharedMemory(true) runs. With --simulate the reader also plays
+// the plugin: it creates the segments and publishes a synthetic insertion from a second thread.
+//
+// Options:
+//   --needle ID       suffix of the needle without '#' (default: the first needle)
+//   --rate HZ         update rate of the driver loop (default 1000)
+//   --duration S      seconds to run (default 10)
+//   --circle R        radius of the circle the synthetic device pose moves on (default 0.01)
+//   --simulate        create the segments and publish synthetic needle data
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "hapticChannel.h"
+
+// Stand-in for the plugin: a needle moving 5 cm in and out at 1 kHz, with a force growing with depth.
+static void simulatePlugin(CHapticChannel& channel, const std::atomic<bool>& stop)
+{
+	sNeedlePublication publication;
+	std::memset(&publication, 0, sizeof(publication));
+	std::chrono::steady_clock::time_point next = std::chrono::steady_clock::now();
+	while (!stop.load())
+	{
+		publication.step++;
+		publication.sim_time = 1.0e-3 * publication.step;
+		float depth = 0.025f * (1.0f - cosf((float)publication.sim_time));
+		publication.tip_matrix[0] = publication.tip_matrix[5] = publication.tip_matrix[10] = 1.0f;
+		publication.tip_matrix[11] = -depth;
+		publication.force[2] = 40.0f * depth;
+		publication.penetration = depth;
+		publication.punctures = (depth > 0.01f) ? 1 + (int)(depth / 0.02f) : 0;
+		publication.fixture_active = (publication.punctures > 0) ? 1 : 0;
+		publication.snapshot.model = SNAPSHOT_HOLD;
+		publication.snapshot.time = publication.sim_time;
+		publication.snapshot.axial = publication.force[2];
+		publication.snapshot.direction[2] = 1.0f;
+		publication.publish_ns = CHapticChannel::steadyNanoseconds();
+		channel.publishNeedle(publication);
+		next += std::chrono::milliseconds(1);
+		std::this_thread::sleep_until(next);
+	}
+}
+
+int main(int argc, char* argv[])
+{
+	std::string id;
+	double rate = 1000.0, duration = 10.0;
+	float radius = 0.01f;
+	bool simulate = false;
+	for (int i = 1; i < argc; i++)
+	{
+		std::string option(argv[i]);
+		if (option == "--simulate")
+		{
+			simulate = true;
+			continue;
+		}
+		if (i + 1 >= argc)
+		{
+			std::fprintf(stderr, "Missing value for %s\n", option.c_str());
+			return 1;
+		}
+		const char* value = argv[++i];
+		if (option == "--needle")
+			id = value;
+		else if (option == "--rate")
+			rate = std::atof(value);
+		else if (option == "--duration")
+			duration = std::atof(value);
+		else if (option == "--circle")
+			radius = (float)std::atof(value);
+		else
+		{
+			std::fprintf(stderr, "Unknown option %s\n", option.c_str());
+			return 1;
+		}
+	}
+
+	CHapticChannel publisher, channel;
+	std::atomic<bool> stop(false);
+	std::thread plugin;
+	if (simulate)
+	{
+		if (!publisher.create(id))
+		{
+			std::fprintf(stderr, "Could not create %s\n", CHapticChannel::segmentName(id, false).c_str());
+			return 1;
+		}
+		plugin = std::thread(simulatePlugin, std::ref(publisher), std::cref(stop));
+	}
+	if (!channel.open(id))
+	{
+		std::fprintf(stderr, "Could not open %s, is the simulation running with shared memory enabled?\n", CHapticChannel::segmentName(id, false).c_str());
+		stop.store(true);
+		if (plugin.joinable())
+			plugin.join();
+		return 1;
+	}
+
+	// Driver loop: read the newest needle record, render its force (printed here), send the device pose.
+	const std::chrono::nanoseconds period((long long)(1.0e9 / rate));
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	std::chrono::steady_clock::time_point next = start;
+	std::chrono::steady_clock::time_point report = start + std::chrono::seconds(1);
+	sDevicePose pose;
+	std::memset(&pose, 0, sizeof(pose));
+	uint64_t last_step = 0, updates = 0, fresh = 0;
+	std::vector<double> ages;
+	sForceExtrapolator extrapolator;
+	while (std::chrono::steady_clock::now() - start < std::chrono::duration<double>(duration))
+	{
+		sNeedlePublication publication;
+		channel.readNeedle(publication);
+		updates++;
+		if (publication.step != last_step)
+		{
+			fresh++;
+			ages.push_back(1.0e-3 * (CHapticChannel::steadyNanoseconds() - publication.publish_ns));
+			last_step = publication.step;
+			extrapolator.receive(publication.snapshot, 1.0e-9 * CHapticChannel::steadyNanoseconds());
+		}
+		// This is the force a driver sends to the device.
+		float force[3];
+		extrapolator.evaluate(1.0e-9 * CHapticChannel::steadyNanoseconds(), force);
+
+		double t = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+		pose.count++;
+		pose.matrix[0] = pose.matrix[5] = pose.matrix[10] = 1.0f;
+		pose.matrix[3] = radius * cosf((float)t);
+		pose.matrix[7] = radius * sinf((float)t);
+		pose.publish_ns = CHapticChannel::steadyNanoseconds();
+		channel.publishDevice(pose);
+
+		if (std::chrono::steady_clock::now() >= report)
+		{
+			std::sort(ages.begin(), ages.end());
+			std::printf("step %llu  force %7.3f %7.3f %7.3f N  punctures %d  fixture %d  |  %llu updates, %llu new records",
+				(unsigned long long)publication.step, force[0], force[1], force[2],
+				publication.punctures, publication.fixture_active, (unsigned long long)updates, (unsigned long long)fresh);
+			if (!ages.empty())
+				std::printf(", age p50 %.1f us max %.1f us", ages[ages.size() / 2], ages.back());
+			std::printf("\n");
+			std::fflush(stdout);
+			ages.clear();
+			updates = fresh = 0;
+			report += std::chrono::seconds(1);
+		}
+		next += period;
+		std::this_thread::sleep_until(next);
+	}
+
+	stop.store(true);
+	if (plugin.joinable())
+		plugin.join();
+	return 0;
+}
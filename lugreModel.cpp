@@ -0,0 +1,70 @@
+// Peter: LuGre friction model. See lugreModel.h.
+
+#include "lugreModel.h"
+
+#include <math.h>
+
+int sLuGreState::size() const
+{
+	return (int)z.size();
+}
+
+void sLuGreState::reset()
+{
+	truncate(0);
+}
+
+void sLuGreState::truncate(int count)
+{
+	if (count >= size())
+		return;
+	z.conservativeResize(count);
+	sigma0.conservativeResize(count);
+	sigma1.conservativeResize(count);
+	sigma2.conservativeResize(count);
+	coulomb_force.conservativeResize(count);
+	static_force.conservativeResize(count);
+	stribeck_velocity.conservativeResize(count);
+}
+
+void sLuGreState::append(const sLuGreParameters& parameters)
+{
+	int row = size();
+	z.conservativeResize(row + 1);
+	sigma0.conservativeResize(row + 1);
+	sigma1.conservativeResize(row + 1);
+	sigma2.conservativeResize(row + 1);
+	coulomb_force.conservativeResize(row + 1);
+	static_force.conservativeResize(row + 1);
+	stribeck_velocity.conservativeResize(row + 1);
+	z(row) = 0.0f;
+	sigma0(row) = parameters.sigma0;
+	sigma1(row) = parameters.sigma1;
+	sigma2(row) = parameters.sigma2;
+	coulomb_force(row) = parameters.coulomb_force;
+	static_force(row) = parameters.static_force;
+	stribeck_velocity(row) = parameters.stribeck_velocity;
+}
+
+/**
+* @brief LuGre friction of all punctures, see lugreModel.h
+* @param state: bristles of all active punctures. state.penetration has to hold the current penetration lengths.
+* @param v: axial velocity of the needle, positive when inserting. Unit: m/s
+* @param dt: time step. Unit: s
+* @return total friction force
+*/
+float lugreModel(sLuGreState& state, float v, float dt)
+{
+	float force = 0.0f;
+	const float speed = fabsf(v);
+	for (int i = 0; i < state.size(); i++)
+	{
+		float ratio = v / state.stribeck_velocity(i);
+		float g = state.coulomb_force(i) + (state.static_force(i) - state.coulomb_force(i)) * expf(-ratio * ratio);
+		float z = (state.z(i) + dt * v) / (1.0f + dt * state.sigma0(i) * speed / g);
+		float dz = (z - state.z(i)) / dt;
+		state.z(i) = z;
+		force += state.penetration(i) * (state.sigma0(i) * z + state.sigma1(i) * dz + state.sigma2(i) * v);
+	}
+	return force;
+}
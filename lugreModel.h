@@ -0,0 +1,53 @@
+// Peter: LuGre friction model, one bristle state per puncture layer.
+//
+// The friction of every puncture is the average deflection z of elastic bristles between shaft
+// and tissue, scaled with the penetration length L of the puncture:
+//
+//   dz/dt = v - sigma0 * |v| / g(v) * z,    g(v) = F_c + (F_s - F_c) * exp(-(v / v_s)^2)
+//   F     = L * (sigma0 * z + sigma1 * dz/dt + sigma2 * v)
+//
+// Unlike karnoppModel() the force is continuous through v = 0, so there is no chatter around
+// zero_threshold. The velocity is held over the step and z is integrated implicitly. The bristle
+// equation is linear in z for a held velocity, so the implicit step is a closed form:
+//
+//   z <- (z + dt * v) / (1 + dt * sigma0 * |v| / g(v))
+//
+// It is stable for any dt and costs the same every step. As with pronyModel.h the states are
+// stored as structure of arrays, one row per puncture.
+
+#pragma once
+
+#include <vector>
+
+#include <Eigen/Core>
+
+// LuGre coefficients of one tissue, per meter of penetration.
+struct sLuGreParameters {
+	float sigma0;									// Bristle stiffness. Unit: N/m per m
+	float sigma1;									// Bristle damping. Unit: N-s/m per m
+	float sigma2;									// Viscous friction. Unit: N-s/m per m
+	float coulomb_force;							// F_c. Unit: N per m
+	float static_force;								// F_s. Unit: N per m
+	float stribeck_velocity;						// v_s. Unit: m/s
+};
+
+struct sLuGreState {
+	Eigen::ArrayXf z;								// Bristle deflection. Unit: m
+	Eigen::ArrayXf sigma0;
+	Eigen::ArrayXf sigma1;
+	Eigen::ArrayXf sigma2;
+	Eigen::ArrayXf coulomb_force;
+	Eigen::ArrayXf static_force;
+	Eigen::ArrayXf stribeck_velocity;
+	Eigen::ArrayXf penetration;						// Penetration length of this update, filled by the caller. Unit: m
+
+	int size() const;
+	void reset();
+	// Punctures are only ever removed from the back, so dropping rows keeps the others aligned.
+	void truncate(int count);
+	// Starts a new puncture with relaxed bristles.
+	void append(const sLuGreParameters& parameters);
+};
+
+// Advances the bristles of all punctures by dt at axial velocity v and returns the total friction force.
+float lugreModel(sLuGreState& state, float v, float dt);
@@ -0,0 +1,170 @@
+// Peter: Kinematics of the 7-DOF KUKA LWR and a damped least squares IK solver. See lwrKinematics.h.
+
+#include "lwrKinematics.h"
+
+#include <chrono>
+#include <math.h>
+
+#include <Eigen/SVD>
+
+using namespace Eigen;
+
+sLwrFrame sLwrFrame::operator*(const sLwrFrame& other) const
+{
+	sLwrFrame frame;
+	frame.rotation = rotation * other.rotation;
+	frame.position = rotation * other.position + position;
+	return frame;
+}
+
+sLwrFrame sLwrFrame::inverse() const
+{
+	sLwrFrame frame;
+	frame.rotation = rotation.transpose();
+	frame.position = -(frame.rotation * position);
+	return frame;
+}
+
+sLwrFrame simObjectMatrix2Frame(const float* objectMatrix)
+{
+	sLwrFrame frame;
+	for (int i = 0; i < 3; i++)
+	{
+		for (int j = 0; j < 3; j++)
+			frame.rotation(i, j) = objectMatrix[4 * i + j];
+		frame.position(i) = objectMatrix[4 * i + 3];
+	}
+	return frame;
+}
+
+// Translation along z followed by a rotation about the new x axis (one row of the DH table, a = 0).
+static sLwrFrame dhLink(float d, float alpha)
+{
+	sLwrFrame frame;
+	frame.rotation = AngleAxisf(alpha, Vector3f::UnitX()).toRotationMatrix();
+	frame.position = Vector3f(0.0f, 0.0f, d);
+	return frame;
+}
+
+sLwrChain lwr4Chain()
+{
+	const float half_pi = 1.5707963f;
+	const float d[LWR_JOINTS] = { 0.3105f, 0.0f, 0.4f, 0.0f, 0.39f, 0.0f, 0.078f };
+	const float alpha[LWR_JOINTS] = { half_pi, -half_pi, -half_pi, half_pi, half_pi, -half_pi, 0.0f };
+	const float limits[LWR_JOINTS] = { 2.967f, 2.094f, 2.967f, 2.094f, 2.967f, 2.094f, 2.967f };	// 170 and 120 degrees
+
+	sLwrChain chain;
+	for (int i = 0; i < LWR_JOINTS - 1; i++)
+		chain.links[i] = dhLink(d[i], alpha[i]);
+	chain.tool = dhLink(d[LWR_JOINTS - 1], alpha[LWR_JOINTS - 1]);
+	for (int i = 0; i < LWR_JOINTS; i++)
+	{
+		chain.lower(i) = -limits[i];
+		chain.upper(i) = limits[i];
+	}
+	chain.posture << 0.0f, 0.5f, 0.0f, -1.2f, 0.0f, 0.6f, 0.0f;
+	return chain;
+}
+
+/**
+* @brief Forward kinematics of the LWR
+* @param chain: geometry of the arm
+* @param q: joint positions
+* @param axes: if not NULL, receives the axis of every joint in the world
+* @param origins: if not NULL, receives the origin of every joint in the world
+* @return tool frame in the world
+*/
+sLwrFrame lwrForwardKinematics(const sLwrChain& chain, const LwrJoints& q, Matrix<float, 3, LWR_JOINTS>* axes, Matrix<float, 3, LWR_JOINTS>* origins)
+{
+	sLwrFrame frame = chain.base;
+	for (int i = 0; i < LWR_JOINTS; i++)
+	{
+		if (i > 0)
+			frame = frame * chain.links[i - 1];
+		if (axes != NULL)
+			axes->col(i) = frame.rotation.col(2);
+		if (origins != NULL)
+			origins->col(i) = frame.position;
+		frame.rotation = frame.rotation * AngleAxisf(q(i), Vector3f::UnitZ()).toRotationMatrix();
+	}
+	return frame * chain.tool;
+}
+
+/**
+* @brief Geometric Jacobian of the LWR, column i is (z_i x (p_tool - o_i), z_i)
+* @param tool: receives the tool frame in the world
+*/
+LwrJacobian lwrJacobian(const sLwrChain& chain, const LwrJoints& q, sLwrFrame& tool)
+{
+	Matrix<float, 3, LWR_JOINTS> axes, origins;
+	tool = lwrForwardKinematics(chain, q, &axes, &origins);
+	LwrJacobian jacobian;
+	for (int i = 0; i < LWR_JOINTS; i++)
+	{
+		jacobian.block<3, 1>(0, i) = axes.col(i).cross(tool.position - origins.col(i));
+		jacobian.block<3, 1>(3, i) = axes.col(i);
+	}
+	return jacobian;
+}
+
+static Vector3f clampNorm(const Vector3f& v, float max)
+{
+	float norm = v.norm();
+	return (norm > max) ? Vector3f(v * (max / norm)) : v;
+}
+
+/**
+* @brief Damped least squares inverse kinematics with null space posture control, see lwrKinematics.h
+* @param chain: geometry of the arm
+* @param target: frame the tool should reach
+* @param q: start value, receives the solution
+* @param settings: tolerances and gains
+* @return iterations, remaining error and solve time
+*/
+sIkResult lwrInverseKinematics(const sLwrChain& chain, const sLwrFrame& target, LwrJoints& q, const sIkSettings& settings)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	sIkResult result;
+	while (true)
+	{
+		sLwrFrame tool;
+		LwrJacobian jacobian = lwrJacobian(chain, q, tool);
+		Vector3f position_error = target.position - tool.position;
+		AngleAxisf rotation_error(target.rotation * tool.rotation.transpose());
+		Vector3f orientation_error = rotation_error.angle() * rotation_error.axis();
+		result.position_error = position_error.norm();
+		result.orientation_error = fabsf(rotation_error.angle());
+		result.converged = (result.position_error <= settings.position_tolerance) && (result.orientation_error <= settings.orientation_tolerance);
+		if (result.converged || (result.iterations == settings.max_iterations))
+			break;
+
+		Matrix<float, 6, 1> error;
+		error.head<3>() = clampNorm(position_error, settings.max_position_step);
+		error.tail<3>() = clampNorm(orientation_error, settings.max_orientation_step);
+
+		// Damped pseudo-inverse from the SVD, the damping fades in near a singularity.
+		JacobiSVD<LwrJacobian> svd(jacobian, ComputeFullU | ComputeFullV);
+		const Matrix<float, 6, 1>& sigma = svd.singularValues();
+		float smallest = sigma(5);
+		float damping = 0.0f;
+		if (smallest < settings.singular_region)
+		{
+			float ratio = smallest / settings.singular_region;
+			damping = (1.0f - ratio * ratio) * settings.max_damping * settings.max_damping;
+		}
+		Matrix<float, LWR_JOINTS, 6> pseudo_inverse = Matrix<float, LWR_JOINTS, 6>::Zero();
+		for (int i = 0; i < 6; i++)
+			pseudo_inverse += (sigma(i) / (sigma(i) * sigma(i) + damping)) * svd.matrixV().col(i) * svd.matrixU().col(i).transpose();
+
+		LwrJoints step = pseudo_inverse * error;
+		if (settings.posture_gain > 0.0f)
+		{
+			Matrix<float, LWR_JOINTS, LWR_JOINTS> null_space = Matrix<float, LWR_JOINTS, LWR_JOINTS>::Identity() - pseudo_inverse * jacobian;
+			step += null_space * (settings.posture_gain * (chain.posture - q));
+		}
+		q = (q + step).cwiseMax(chain.lower).cwiseMin(chain.upper);
+		result.iterations++;
+	}
+	result.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return result;
+}
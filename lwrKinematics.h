@@ -0,0 +1,69 @@
+// Peter: Kinematics of the 7-DOF KUKA LWR and a damped least squares inverse kinematics solver.
+//
+// Replaces V-REP's IK group that makes the LWR follow Dummy_tool_tip. The chain is a list of fixed
+// frames between the revolute joints, each joint rotates about its own z axis. The geometry is read
+// from the scene at simulation start (see CNeedleInstance), lwr4Chain() gives the nominal LWR4+.
+//
+// Each iteration solves J dq = e with the SVD of the 6x7 Jacobian, damped near singularities
+// (Maciejewski & Klein), and uses the remaining degree of freedom to pull the arm towards a posture:
+//   dq = J+ e + (I - J+ J) k (q_posture - q)
+// Everything is fixed-size, the solver does not allocate. Calls are warm started with the last solution.
+
+#pragma once
+
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+
+const int LWR_JOINTS = 7;
+
+typedef Eigen::Matrix<float, LWR_JOINTS, 1> LwrJoints;
+typedef Eigen::Matrix<float, 6, LWR_JOINTS> LwrJacobian;
+
+// Rigid transformation. Kept as rotation and translation, a 4x4 matrix would need aligned allocation.
+struct sLwrFrame {
+	Eigen::Matrix3f rotation = Eigen::Matrix3f::Identity();
+	Eigen::Vector3f position = Eigen::Vector3f::Zero();
+
+	sLwrFrame operator*(const sLwrFrame& other) const;
+	sLwrFrame inverse() const;
+};
+
+struct sLwrChain {
+	sLwrFrame base;									// Frame of joint 1 in the world.
+	sLwrFrame links[LWR_JOINTS - 1];				// Frame of joint i + 1 in the rotated frame of joint i.
+	sLwrFrame tool;									// Frame that should reach the target, in the rotated frame of joint 7.
+	LwrJoints lower = LwrJoints::Constant(-2.967f);	// Joint limits. Unit: rad
+	LwrJoints upper = LwrJoints::Constant(2.967f);
+	LwrJoints posture = LwrJoints::Zero();			// Preferred joint positions, used in the null space.
+};
+
+struct sIkSettings {
+	int max_iterations = 20;
+	float position_tolerance = 1.0e-4f;				// Unit: m
+	float orientation_tolerance = 1.0e-3f;			// Unit: rad
+	float max_damping = 0.05f;						// Damping at a singularity.
+	float singular_region = 0.05f;					// Damping starts below this singular value.
+	float posture_gain = 0.1f;						// Pull towards the posture per iteration, 0 disables it.
+	float max_position_step = 0.05f;				// Largest error corrected in one iteration. Unit: m
+	float max_orientation_step = 0.3f;				// Unit: rad
+};
+
+struct sIkResult {
+	int iterations = 0;
+	bool converged = false;
+	float position_error = 0.0f;					// Unit: m
+	float orientation_error = 0.0f;					// Unit: rad
+	double seconds = 0.0;							// Solve time.
+};
+
+// V-REP object matrix (3x4, row major, as simGetObjectMatrix writes it) as a frame.
+sLwrFrame simObjectMatrix2Frame(const float* objectMatrix);
+// Nominal geometry of the LWR4+ (Denavit-Hartenberg parameters from the KUKA data sheet), base at the origin.
+sLwrChain lwr4Chain();
+// Tool frame for the given joint positions. axes/origins: if not NULL, receive the joint axes and origins in the world.
+sLwrFrame lwrForwardKinematics(const sLwrChain& chain, const LwrJoints& q,
+	Eigen::Matrix<float, 3, LWR_JOINTS>* axes = NULL, Eigen::Matrix<float, 3, LWR_JOINTS>* origins = NULL);
+// Geometric Jacobian of the tool (linear velocity on top, angular velocity below) and the tool frame.
+LwrJacobian lwrJacobian(const sLwrChain& chain, const LwrJoints& q, sLwrFrame& tool);
+// Moves q towards joint positions that put the tool onto target. q is used as the start value.
+sIkResult lwrInverseKinematics(const sLwrChain& chain, const sLwrFrame& target, LwrJoints& q, const sIkSettings& settings);
@@ -0,0 +1,91 @@
+// Peter: Table-driven dispatch of the V-REP messages. See messageRouter.h.
+
+#include "messageRouter.h"
+
+#include <cctype>
+#include <chrono>
+
+CMessageRouter::CMessageRouter()
+	: _enter(NULL), _leave(NULL)
+{
+	for (sRoute& route : _routes)
+	{
+		route.handler = NULL;
+		route.flags = 0;
+	}
+}
+
+void CMessageRouter::setModuleName(const std::string& module)
+{
+	_module = module;
+}
+
+void CMessageRouter::setApiGuard(MessageGuard enter, MessageGuard leave)
+{
+	_enter = enter;
+	_leave = leave;
+}
+
+bool CMessageRouter::route(int message, MessageHandler handler, int flags)
+{
+	if ((message < 0) || (message >= MESSAGE_TABLE_SIZE))
+		return false;
+	_routes[message].handler = handler;
+	_routes[message].flags = flags;
+	return true;
+}
+
+bool CMessageRouter::_forThisModule(const void* customData) const
+{
+	if (customData == NULL)
+		return true;
+	const char* name = (const char*)customData;
+	size_t i = 0;
+	for (; (name[i] != 0) && (i < _module.size()); i++)
+	{
+		if (std::tolower((unsigned char)name[i]) != std::tolower((unsigned char)_module[i]))
+			return false;
+	}
+	return (name[i] == 0) && (i == _module.size());
+}
+
+/**
+* @brief Counts a message and calls its handler, if it has one
+* @return reply of the handler, NULL if the message is not handled
+*/
+void* CMessageRouter::dispatch(int message, int* auxiliaryData, void* customData, int* replyData)
+{
+	sRoute& route = _routes[((message >= 0) && (message < MESSAGE_TABLE_SIZE)) ? message : MESSAGE_TABLE_SIZE];
+	route.statistics.calls++;
+	if (route.handler == NULL)
+		return NULL;
+	if (((route.flags & MESSAGE_MODULE) != 0) && !_forThisModule(customData))
+		return NULL;
+
+	route.statistics.handled++;
+	if ((route.flags & MESSAGE_API) == 0)
+		return route.handler(auxiliaryData, customData, replyData);
+
+	// Reading the clock costs as much as a cheap handler, only the API handlers are timed.
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	bool guarded = (_enter != NULL) && (_leave != NULL);
+	int saved = 0;
+	if (guarded)
+		_enter(saved);
+	void* reply = route.handler(auxiliaryData, customData, replyData);
+	if (guarded)
+		_leave(saved);
+	route.statistics.seconds += std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+	return reply;
+}
+
+const sMessageStatistics& CMessageRouter::getStatistics(int message) const
+{
+	return _routes[((message >= 0) && (message < MESSAGE_TABLE_SIZE)) ? message : MESSAGE_TABLE_SIZE].statistics;
+}
+
+void CMessageRouter::resetStatistics()
+{
+	for (sRoute& route : _routes)
+		route.statistics = sMessageStatistics();
+}
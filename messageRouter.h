@@ -0,0 +1,66 @@
+// Peter: Table-driven dispatch of the V-REP messages (v_repMessage).
+//
+// V-REP calls v_repMessage for every event, most of which the plugin does not handle: the instance pass
+// after every rendered frame, the GUI pass, the main script calls, ... The router looks the message up
+// in a table indexed by the message id and returns at once if nobody handles it. Only handlers that are
+// registered with MESSAGE_API get the error report mode of V-REP saved, silenced and restored around
+// them (set by setApiGuard()), the module messages are filtered by name before the handler is called.
+// Every message is counted, the time spent is measured for the MESSAGE_API handlers.
+//
+// The router does not call V-REP itself, so that its overhead can be measured without it
+// (bin/needleBenchmark router).
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+
+const int MESSAGE_TABLE_SIZE = 256;					// Message ids at or above this are counted in one overflow slot.
+
+// Handler flags
+const int MESSAGE_API = 1;							// Calls the V-REP API, the error report mode is silenced around it.
+const int MESSAGE_MODULE = 2;						// simOpenModule/simHandleModule/simCloseModule: only called if
+													// customData is NULL or the name of this module.
+
+// Same signature as v_repMessage without the message id. Returns the reply of v_repMessage.
+typedef void* (*MessageHandler)(int* auxiliaryData, void* customData, int* replyData);
+// Called before and after a MESSAGE_API handler, e.g. to save and restore the error report mode.
+typedef void (*MessageGuard)(int& saved);
+
+struct sMessageStatistics {
+	uint64_t calls = 0;								// Messages of this id received.
+	uint64_t handled = 0;							// Calls that reached the handler.
+	double seconds = 0.0;							// Time spent in a MESSAGE_API handler, 0 for the others. Unit: s
+};
+
+class CMessageRouter
+{
+public:
+	CMessageRouter();
+
+	// module: name compared with customData of the module messages, case insensitive.
+	void setModuleName(const std::string& module);
+	void setApiGuard(MessageGuard enter, MessageGuard leave);
+	// Replaces the handler of message. false if the id is out of the table.
+	bool route(int message, MessageHandler handler, int flags);
+
+	void* dispatch(int message, int* auxiliaryData, void* customData, int* replyData);
+
+	// Statistics of a message id, of the overflow slot for ids out of the table.
+	const sMessageStatistics& getStatistics(int message) const;
+	void resetStatistics();
+
+private:
+	struct sRoute {
+		MessageHandler handler;
+		int flags;
+		sMessageStatistics statistics;
+	};
+
+	bool _forThisModule(const void* customData) const;
+
+	sRoute _routes[MESSAGE_TABLE_SIZE + 1];
+	std::string _module;
+	MessageGuard _enter;
+	MessageGuard _leave;
+};
@@ -0,0 +1,116 @@
+// Peter: Command line front end of the batch simulator (batchSimulator.h). Does not need V-REP.
+//
+// Build with "make batch" and run e.g.
+//   bin/needleBatch --runs 10000 --seed 7 --model karnopp --csv runs.csv
+//
+// Options:
+//   --runs N          number of simulated insertions (default 1000)
+//   --seed S          seed of the scenario sampling (default 1)
+//   --threads T       number of worker threads besides the main thread (default: all cores)
+//   --model NAME      force model, "kelvin-voigt" or "karnopp" (default kelvin-voigt)
+//   --dt SECONDS      model step (default 0.001)
+//   --precision P     "model" (the full model, float), or "float" or "double" (its straight-needle core in that
+//                     precision, see punctureCore.h) (default model)
+//   --spread X        relative spread of thicknesses and coefficients (default 0.3)
+//   --csv PATH        also write the result of every run to PATH
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include "batchSimulator.h"
+#include "threadPool.h"
+
+static void printStatistic(const char* name, const sSummaryStatistic& statistic)
+{
+	std::printf("%-24s %10.4f %10.4f %10.4f %10.4f %10.4f %10.4f %10.4f\n", name,
+		statistic.mean, statistic.stddev, statistic.min, statistic.p5, statistic.p50, statistic.p95, statistic.max);
+}
+
+static bool writeCsv(const char* path, const std::vector<sInsertionResult>& results)
+{
+	FILE* file = std::fopen(path, "w");
+	if (file == NULL)
+		return false;
+	std::fprintf(file, "run,steps,punctures,peak_force,mean_force,max_penetration,first_puncture_time\n");
+	for (size_t run = 0; run < results.size(); run++)
+	{
+		const sInsertionResult& result = results[run];
+		std::fprintf(file, "%d,%d,%d,%g,%g,%g,%g\n", (int)run, result.steps, result.punctures,
+			result.peak_force, result.mean_force, result.max_penetration, result.first_puncture_time);
+	}
+	std::fclose(file);
+	return true;
+}
+
+int main(int argc, char* argv[])
+{
+	sBatchSettings settings = defaultBatchSettings();
+	size_t workers = CThreadPool::defaultWorkerCount();
+	const char* csvPath = NULL;
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string option(argv[i]);
+		if (i + 1 >= argc)
+		{
+			std::fprintf(stderr, "Missing value for %s\n", option.c_str());
+			return 1;
+		}
+		const char* value = argv[++i];
+		if (option == "--runs")
+			settings.runs = std::atoi(value);
+		else if (option == "--seed")
+			settings.seed = (unsigned int)std::strtoul(value, NULL, 10);
+		else if (option == "--threads")
+			workers = (size_t)std::atoi(value);
+		else if (option == "--model")
+			settings.config.force_model = value;
+		else if (option == "--dt")
+			settings.dt = (float)std::atof(value);
+		else if (option == "--precision")
+			settings.precision = value;
+		else if (option == "--spread")
+			settings.thickness_spread = settings.coefficient_spread = (float)std::atof(value);
+		else if (option == "--csv")
+			csvPath = value;
+		else
+		{
+			std::fprintf(stderr, "Unknown option %s\n", option.c_str());
+			return 1;
+		}
+	}
+	if ((settings.runs <= 0) || (settings.dt <= 0.0f))
+	{
+		std::fprintf(stderr, "--runs and --dt have to be positive\n");
+		return 1;
+	}
+	if ((settings.precision != "model") && (settings.precision != "float") && (settings.precision != "double"))
+	{
+		std::fprintf(stderr, "--precision has to be model, float or double\n");
+		return 1;
+	}
+
+	CThreadPool pool(workers);
+	std::vector<sInsertionResult> results;
+	sBatchSummary summary = runBatch(settings, pool, (csvPath != NULL) ? &results : NULL);
+
+	std::printf("%d runs, %lld steps, %.3f s on %d thread(s): %.2f M steps/s, %.2f M steps/s per thread\n",
+		summary.runs, summary.steps, summary.seconds, summary.threads,
+		1.0e-6 * summary.steps / summary.seconds, 1.0e-6 * summary.steps / summary.seconds / summary.threads);
+	std::printf("%-24s %10s %10s %10s %10s %10s %10s %10s\n", "", "mean", "stddev", "min", "p5", "p50", "p95", "max");
+	printStatistic("peak force [N]", summary.peak_force);
+	printStatistic("mean force [N]", summary.mean_force);
+	printStatistic("max penetration [m]", summary.max_penetration);
+	printStatistic("punctures", summary.punctures);
+	printStatistic("first puncture [s]", summary.first_puncture_time);
+
+	if ((csvPath != NULL) && !writeCsv(csvPath, results))
+	{
+		std::fprintf(stderr, "Could not write %s\n", csvPath);
+		return 1;
+	}
+	return 0;
+}
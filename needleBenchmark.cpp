@@ -0,0 +1,2015 @@
+// Peter: Headless benchmarks of the needle-tissue model. Does not need V-REP.
+//
+// Build with "make benchmark" and run "bin/needleBenchmark [benchmark name]".
+// Without a name all benchmarks are run.
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <strings.h>
+#include <functional>
+#include <map>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "batchSimulator.h"
+#include "hapticChannel.h"
+#include "lwrKinematics.h"
+#include "messageRouter.h"
+#include "needleCheckpoint.h"
+#include "needleModel.h"
+#include "punctureCore.h"
+#include "shaftKernel.h"
+#include "stepBudget.h"
+#include "stepTracer.h"
+#include "threadPool.h"
+
+using namespace Eigen;
+
+typedef std::chrono::high_resolution_clock benchClock;
+
+// Results of benchmarked computations are written here so that they are not optimized away.
+static volatile float benchSink;
+
+static double secondsSince(const benchClock::time_point& start)
+{
+	return std::chrono::duration<double>(benchClock::now() - start).count();
+}
+
+// Failed self-checks of the benchmarks that have them. Any failure makes the program exit with 1 (ctest).
+static int benchFailures = 0;
+
+/**
+* @brief Reports a self-check of a benchmark, counting it if it failed.
+* @param passed: result of the check
+* @param what: what was checked, printed on failure
+* @return passed
+*/
+static bool benchCheck(bool passed, const char* what)
+{
+	if (!passed)
+	{
+		std::printf("  FAILED: %s\n", what);
+		benchFailures++;
+	}
+	return passed;
+}
+
+// --------------------------------------------------------------------------------------
+// Synthetic scene: a needle moving in and out of a stack of flat tissue layers.
+// --------------------------------------------------------------------------------------
+struct sSyntheticLayer {
+	int handle;
+	const char* name;
+	float depth;									// Depth of the layer surface below the phantom surface. Unit: m
+};
+
+static const sSyntheticLayer syntheticLayers[] = {
+	{ 1, "Fat", 0.0f },
+	{ 2, "muscle", 0.01f },
+	{ 3, "lung", 0.025f },
+	{ 4, "bone", 0.05f },
+};
+
+struct sSyntheticNeedle {
+	sNeedleState state;
+	sNeedleStepInput input;
+	float phase;
+};
+
+/**
+* @brief Fill the step input of a synthetic needle for time t. The tip oscillates between above the phantom and inside the bone.
+*/
+static void syntheticNeedleInput(sSyntheticNeedle& needle, float t)
+{
+	const float amplitude = 0.035f;
+	float depth = amplitude * sinf(6.0f * t + needle.phase) + 0.02f;
+	float velocity = 6.0f * amplitude * cosf(6.0f * t + needle.phase);
+	needle.input.toolTipPoint = Vector3f(0.0f, 0.0f, -depth);
+	needle.input.needleAxis = Vector3f::UnitZ();
+	needle.input.needleVelocity = fabsf(velocity);
+	needle.input.needleAxialVelocity = velocity;
+	needle.input.needleLinearVelocity = Vector3f(0.0f, 0.0f, -velocity);
+	needle.input.commandedTip = needle.input.toolTipPoint;
+	needle.input.contacts.clear();
+	for (const sSyntheticLayer& layer : syntheticLayers)
+	{
+		if (depth < layer.depth)
+			break;
+		bool punctured = false;
+		for (const sPuncture& puncture : needle.state.punctures)
+			punctured = punctured || (puncture.handle == layer.handle);
+		if (punctured)
+			continue;
+		sContact contact;
+		contact.handle = layer.handle;
+		contact.name = layer.name;
+		contact.tissue = tissueParameters(layer.name);
+		contact.force = Vector3f(0.0f, 0.0f, 2.0f);
+		contact.respondable = true;
+		needle.input.contacts.push_back(contact);
+		break;
+	}
+}
+
+/**
+* @brief Fill the step input of a synthetic needle that is inserted straight down at constant speed.
+*        It touches the shallowest layer it has reached but not punctured yet.
+*/
+static void syntheticInsertionInput(sSyntheticNeedle& needle, float depth, float speed, float dt)
+{
+	needle.input.toolTipPoint = Vector3f(0.0f, 0.0f, -depth);
+	needle.input.needleAxis = Vector3f::UnitZ();
+	needle.input.needleVelocity = speed;
+	needle.input.needleAxialVelocity = speed;
+	needle.input.needleLinearVelocity = Vector3f(0.0f, 0.0f, -speed);
+	needle.input.commandedTip = needle.input.toolTipPoint;
+	needle.input.dt = dt;
+	needle.input.contacts.clear();
+	for (const sSyntheticLayer& layer : syntheticLayers)
+	{
+		bool punctured = false;
+		for (const sPuncture& puncture : needle.state.punctures)
+			punctured = punctured || (puncture.handle == layer.handle);
+		if (punctured || (depth < layer.depth))
+			continue;
+		sContact contact;
+		contact.handle = layer.handle;
+		contact.name = layer.name;
+		contact.tissue = tissueParameters(layer.name);
+		contact.force = Vector3f(0.0f, 0.0f, 2.0f);
+		contact.respondable = true;
+		needle.input.contacts.push_back(contact);
+		break;
+	}
+}
+
+// --------------------------------------------------------------------------------------
+// multi_needle: per-step cost of N needles, serial and on the thread pool.
+// --------------------------------------------------------------------------------------
+static void benchMultiNeedle()
+{
+	const int steps = 2000;
+	const float dt = 0.001f;
+	sNeedleConfig config;
+	CThreadPool pool(CThreadPool::defaultWorkerCount());
+	std::printf("multi_needle: %d steps, %d worker thread(s)\n", steps, (int)pool.getWorkerCount());
+	std::printf("%8s %16s %16s\n", "needles", "serial us/step", "pool us/step");
+	for (int count = 1; count <= 64; count *= 2)
+	{
+		double seconds[2];
+		for (int parallel = 0; parallel < 2; parallel++)
+		{
+			std::vector<sSyntheticNeedle> needles(count);
+			for (int i = 0; i < count; i++)
+				needles[i].phase = 0.37f * i;
+			benchClock::time_point start = benchClock::now();
+			for (int step = 0; step < steps; step++)
+			{
+				for (sSyntheticNeedle& needle : needles)
+					syntheticNeedleInput(needle, step * dt);
+				std::function<void(size_t)> task = [&needles, &config](size_t i) { stepNeedle(needles[i].state, needles[i].input, config); };
+				if (parallel)
+					pool.parallelFor(needles.size(), task);
+				else
+					for (size_t i = 0; i < needles.size(); i++)
+						task(i);
+			}
+			seconds[parallel] = secondsSince(start);
+		}
+		std::printf("%8d %16.2f %16.2f\n", count, 1.0e6 * seconds[0] / steps, 1.0e6 * seconds[1] / steps);
+	}
+}
+
+// --------------------------------------------------------------------------------------
+// batch: Monte Carlo insertion throughput, on one thread and on all cores.
+// --------------------------------------------------------------------------------------
+static void benchBatch()
+{
+	sBatchSettings settings = defaultBatchSettings();
+	settings.runs = 500;
+	std::printf("batch: %d insertions\n", settings.runs);
+	std::printf("%8s %16s %22s\n", "threads", "M steps/s", "M steps/s per thread");
+	size_t workerCounts[] = { 0, CThreadPool::defaultWorkerCount() };
+	for (size_t workers : workerCounts)
+	{
+		CThreadPool pool(workers);
+		sBatchSummary summary = runBatch(settings, pool, NULL);
+		double rate = 1.0e-6 * summary.steps / summary.seconds;
+		std::printf("%8d %16.2f %22.2f\n", summary.threads, rate, rate / summary.threads);
+		if (workers == CThreadPool::defaultWorkerCount())
+			break;
+	}
+}
+
+// Needle with the given number of punctures into muscle, all of the same length.
+static sNeedleState muscleNeedle(int punctureCount, float penetration_length)
+{
+	sNeedleState state;
+	for (int i = 0; i < punctureCount; i++)
+	{
+		sPuncture puncture;
+		puncture.handle = i + 1;
+		puncture.name = "muscle";
+		puncture.tissue = tissueParameters(puncture.name);
+		puncture.penetration_length = penetration_length;
+		state.punctures.push_back(puncture);
+	}
+	state.full_penetration_length = punctureCount * penetration_length;
+	return state;
+}
+
+// --------------------------------------------------------------------------------------
+// prony: cost of the Prony series update against Kelvin-Voigt, by number of active punctures,
+// and the force while the needle pauses mid-insertion.
+// --------------------------------------------------------------------------------------
+static void benchProny()
+{
+	const int steps = 20000;
+	const float dt = 0.001f;
+	std::printf("prony: %d steps, %d terms\n", steps, PRONY_TERMS);
+	std::printf("%10s %18s %18s\n", "punctures", "kelvin-voigt ns", "prony ns");
+	for (int count = 1; count <= 64; count *= 2)
+	{
+		sNeedleState state = muscleNeedle(count, 0.0f);
+		benchClock::time_point start = benchClock::now();
+		for (int step = 0; step < steps; step++)
+			benchSink = kelvinVoigtModel(state.punctures, 0.01f);
+		double kelvinVoigt = secondsSince(start);
+		start = benchClock::now();
+		for (int step = 0; step < steps; step++)
+		{
+			for (sPuncture& puncture : state.punctures)
+				puncture.penetration_length = 1.0e-5f * step;
+			benchSink = pronyModel(state, dt);
+		}
+		double prony = secondsSince(start);
+		std::printf("%10d %18.1f %18.1f\n", count, 1.0e9 * kelvinVoigt / steps, 1.0e9 * prony / steps);
+	}
+
+	// Insert 2 cm into muscle at 1 cm/s, then hold still.
+	sNeedleState state = muscleNeedle(1, 0.0f);
+	std::printf("relaxation after a 2 cm insertion into muscle:\n%10s %10s\n", "time [s]", "force [N]");
+	for (int step = 0; step <= 10000; step++)
+	{
+		float t = step * dt;
+		state.punctures[0].penetration_length = std::min(t, 2.0f) * 0.01f;
+		float force = pronyModel(state, dt);
+		if ((step >= 2000) && (step % 1000 == 0))
+			std::printf("%10.1f %10.4f\n", t, force);
+	}
+}
+
+// --------------------------------------------------------------------------------------
+// lugre: cost of the LuGre update against Karnopp, and the force chatter of both while the needle
+// creeps back and forth around zero velocity, at the haptic rate and at the largest sim step.
+// --------------------------------------------------------------------------------------
+static void benchLuGre()
+{
+	const int steps = 20000;
+	std::printf("lugre: %d steps\n", steps);
+	std::printf("%10s %12s %12s\n", "punctures", "karnopp ns", "lugre ns");
+	for (int count = 1; count <= 64; count *= 2)
+	{
+		sNeedleState state = muscleNeedle(count, 0.02f);
+		benchClock::time_point start = benchClock::now();
+		for (int step = 0; step < steps; step++)
+			benchSink = karnoppModel(state.full_penetration_length, 1.0e-3f * sinf(0.01f * step));
+		double karnopp = secondsSince(start);
+		start = benchClock::now();
+		for (int step = 0; step < steps; step++)
+			benchSink = lugreModel(state, 1.0e-3f * sinf(0.01f * step), 1.0e-3f);
+		double lugre = secondsSince(start);
+		std::printf("%10d %12.1f %12.1f\n", count, 1.0e9 * karnopp / steps, 1.0e9 * lugre / steps);
+	}
+
+	// Velocity creeping around zero (a few times zero_threshold), 2 cm inside muscle.
+	std::printf("chatter over 20 s of creeping around v = 0:\n");
+	std::printf("%8s %8s %22s %22s\n", "dt [s]", "model", "total variation [N]", "largest jump [N]");
+	const float dts[] = { 1.0e-3f, 5.0e-2f };
+	for (float dt : dts)
+	{
+		for (int model = 0; model < 2; model++)
+		{
+			sNeedleState state = muscleNeedle(1, 0.02f);
+			float previous = 0.0f, variation = 0.0f, jump = 0.0f;
+			int count = (int)(20.0f / dt);
+			for (int step = 0; step < count; step++)
+			{
+				float t = step * dt;
+				float v = 3.0f * zero_threshold * sinf(2.0f * t) + 2.0f * zero_threshold * sinf(37.0f * t);
+				float force = (model == 0) ? karnoppModel(state.full_penetration_length, v) : lugreModel(state, v, dt);
+				if (step > 0)
+				{
+					variation += fabsf(force - previous);
+					jump = std::max(jump, fabsf(force - previous));
+				}
+				previous = force;
+			}
+			std::printf("%8.3f %8s %22.4f %22.4f\n", dt, (model == 0) ? "karnopp" : "lugre", variation, jump);
+		}
+	}
+}
+
+// --------------------------------------------------------------------------------------
+// shaft: cost of the segmented shaft by number of segments, with the needle 6 cm deep in all
+// synthetic layers and tilted away from its entry line, against the 1 ms haptic budget.
+// --------------------------------------------------------------------------------------
+static void benchShaft()
+{
+	const int steps = 20000;
+	std::printf("shaft: %d steps, 4 layers\n", steps);
+	std::printf("%10s %12s %14s %14s %16s\n", "segments", "us/step", "% of 1 ms", "axial [N]", "lateral [N]");
+	for (int segments = 50; segments <= 1600; segments *= 2)
+	{
+		sNeedleConfig config;
+		config.shaft_segments = segments;
+		sNeedleState state;
+		sNeedleStepInput input;
+		const float tip_depth = 0.06f;
+		for (const sSyntheticLayer& layer : syntheticLayers)
+		{
+			sPuncture puncture;
+			puncture.handle = layer.handle;
+			puncture.name = layer.name;
+			puncture.tissue = tissueParameters(layer.name);
+			puncture.position = Vector3f(0.0f, 0.0f, -layer.depth);
+			puncture.direction = Vector3f::UnitZ();
+			puncture.penetration_length = tip_depth - layer.depth;
+			state.punctures.push_back(puncture);
+		}
+		// Tip 2 mm off the entry line, shaft tilted by 0.05 rad.
+		input.toolTipPoint = Vector3f(0.002f, 0.0f, -tip_depth);
+		input.needleAxis = Vector3f(-0.05f, 0.0f, 1.0f).normalized();
+
+		benchClock::time_point start = benchClock::now();
+		float axial = 0.0f;
+		for (int step = 0; step < steps; step++)
+		{
+			input.needleAxialVelocity = 0.01f * sinf(0.01f * step);
+			axial = shaftModel(state, input, config);
+			benchSink = axial;
+		}
+		double seconds = secondsSince(start);
+		input.needleAxialVelocity = 0.01f;
+		axial = shaftModel(state, input, config);
+		std::printf("%10d %12.2f %14.3f %14.4f %16.4f\n", segments, 1.0e6 * seconds / steps, 100.0 * 1.0e3 * seconds / steps,
+			axial, state.shaft_lateral_force.norm());
+	}
+	sNeedleState reference = muscleNeedle(1, 0.06f);
+	std::printf("karnopp, 6 cm of muscle at the same velocity: %.4f N\n", karnoppModel(reference.full_penetration_length, 0.01f));
+}
+
+// --------------------------------------------------------------------------------------
+// simd: the segment loop of the shaft model in every SIMD variant this build and CPU have (see shaftKernel.h),
+// against the Eigen loop of the baseline build.
+// --------------------------------------------------------------------------------------
+static void benchSimd()
+{
+	std::printf("simd: supported %s, in use %s\n", simdLevelName(supportedSimdLevel()), simdLevelName(simdLevel()));
+	std::printf("%10s %10s %12s %12s %18s\n", "segments", "variant", "ns/call", "speedup", "max rel. diff.");
+	std::vector<sShaftLayer> layers;
+	const float tip_depth = 0.06f;
+	for (const sSyntheticLayer& layer : syntheticLayers)
+	{
+		sShaftLayer shaftLayer;
+		shaftLayer.begin = 0.0f;
+		shaftLayer.end = tip_depth - layer.depth;
+		if (!layers.empty())
+			layers.back().begin = shaftLayer.end;
+		shaftLayer.entry = Vector3f(0.0f, 0.0f, -layer.depth);
+		shaftLayer.direction = -Vector3f::UnitZ();
+		sTissueParameters tissue = tissueParameters(layer.name);
+		shaftLayer.friction = tissue.shaft_friction;
+		shaftLayer.damping = tissue.shaft_damping;
+		shaftLayer.lateral_stiffness = tissue.lateral_stiffness;
+		layers.push_back(shaftLayer);
+	}
+	// Tip 2 mm off the entry line, shaft tilted by 0.05 rad.
+	const Vector3f tip(0.002f, 0.0f, -tip_depth);
+	const Vector3f axis = Vector3f(-0.05f, 0.0f, 1.0f).normalized();
+	eSimdLevel used = simdLevel();
+	for (int segments = 50; segments <= 12800; segments *= 4)
+	{
+		sShaftState state;
+		state.resize(segments, 0.2f);
+		state.tag(layers);
+		const int calls = std::max(2000, 4000000 / segments);
+		double generic = 0.0;
+		sShaftForces reference;
+		reference.axial = 0.0f;
+		reference.lateral.setZero();
+		for (int level = SIMD_GENERIC; level <= supportedSimdLevel(); level++)
+		{
+			setSimdLevel((eSimdLevel)level);
+			benchClock::time_point start = benchClock::now();
+			for (int i = 0; i < calls; i++)
+				benchSink = shaftModel(state, tip, axis, 0.01f * (i & 1 ? 1.0f : -1.0f)).axial;
+			double seconds = secondsSince(start) / calls;
+			sShaftForces forces = shaftModel(state, tip, axis, 0.01f);
+			if (level == SIMD_GENERIC)
+			{
+				generic = seconds;
+				reference = forces;
+			}
+			float difference = std::max(fabsf(forces.axial - reference.axial) / fabsf(reference.axial),
+				(forces.lateral - reference.lateral).norm() / reference.lateral.norm());
+			std::printf("%10d %10s %12.1f %12.2f %18.2e\n", segments, simdLevelName((eSimdLevel)level), 1.0e9 * seconds,
+				generic / seconds, difference);
+		}
+	}
+	setSimdLevel(used);
+}
+
+// --------------------------------------------------------------------------------------
+// bevel: cost of a step with the curved bevel-tip path against the straight path, and the tip
+// deflection after inserting through all synthetic layers, with and without rolling the needle
+// half-way (which turns the bend into an S and brings the tip back towards the axis). The punctures
+// of the curved path are measured at its tip, which reaches less deep than the straight tip, so its
+// penetration and force must differ from the straight path.
+// --------------------------------------------------------------------------------------
+static void benchBevel()
+{
+	const float dt = 0.001f;
+	const float speed = 0.01f;
+	const int steps = 7000;								// 7 cm at 1 cm/s
+	std::printf("bevel: %d steps of %.0f ms, %.0f cm/s\n", steps, 1.0e3f * dt, 100.0f * speed);
+	std::printf("%10s %8s %12s %18s %18s %14s\n", "path", "roll", "us/step", "penetration [mm]", "deflection [mm]", "f_ext [N]");
+	const char* paths[] = { "straight", "bevel", "bevel" };
+	float penetration[3], force[3];
+	for (int run = 0; run < 3; run++)
+	{
+		sNeedleConfig config;
+		config.needle_path = paths[run];
+		config.use_only_z_force_on_engine = false;
+		bool roll = (run == 2);
+		sSyntheticNeedle needle;
+		needle.phase = 0.0f;
+		double seconds = 0.0;
+		for (int step = 0; step < steps; step++)
+		{
+			float depth = step * dt * speed - 0.005f;
+			syntheticInsertionInput(needle, depth, speed, dt);
+			if (roll && (depth > 0.03f))
+				needle.input.tipRotation = AngleAxisf(3.14159265f, Vector3f::UnitZ()).toRotationMatrix();
+			benchClock::time_point start = benchClock::now();
+			stepNeedle(needle.state, needle.input, config);
+			seconds += secondsSince(start);
+		}
+		penetration[run] = needle.state.full_penetration_length;
+		force[run] = needle.state.f_ext_magnitude;
+		std::printf("%10s %8s %12.3f %18.4f %18.3f %14.6f\n", paths[run], roll ? "yes" : "no", 1.0e6 * seconds / steps,
+			1.0e3f * penetration[run], 1.0e3f * needle.state.bevel.deflection(), force[run]);
+	}
+	benchCheck((penetration[1] < penetration[0]) && (force[1] != force[0]), "curved path reaches less deep and changes the force");
+
+	// The tip update on its own.
+	const int updates = 1000000;
+	sBevelTip tip;
+	tip.reset(Vector3f::Zero(), -Vector3f::UnitZ(), Vector3f::UnitY());
+	benchClock::time_point start = benchClock::now();
+	for (int i = 1; i <= updates; i++)
+		advanceBevelTip(tip, Vector3f(0.0f, 0.0f, -1.0e-5f * i), -Vector3f::UnitZ(), Vector3f::UnitY(), 2.5f);
+	benchSink = tip.position.x();
+	std::printf("advanceBevelTip: %.1f ns per update\n", 1.0e9 * secondsSince(start) / updates);
+}
+
+// --------------------------------------------------------------------------------------
+// beam: steps per second of the bending needle by number of beam elements, while the needle is
+// inserted through all synthetic layers and the robot drifts sideways, with the factorization reused
+// and warm started against factorizing and solving from scratch every step.
+// --------------------------------------------------------------------------------------
+static void benchBeam()
+{
+	const float dt = 0.001f;
+	const float speed = 0.01f;
+	const int steps = 7000;
+	std::printf("beam: %d steps of %.0f ms, %.0f cm/s, 1 mm sideways drift per cm\n", steps, 1.0e3f * dt, 100.0f * speed);
+	std::printf("%10s %8s %12s %16s %16s %18s\n", "elements", "reuse", "steps/s", "factorizations", "deflection [mm]", "tissue force [N]");
+	const int elementCounts[] = { 50, 100, 200, 500 };
+	for (int elements : elementCounts)
+	{
+		for (int reuse = 1; reuse >= 0; reuse--)
+		{
+			sNeedleConfig config;
+			config.use_only_z_force_on_engine = false;
+			config.beam_elements = elements;
+			sSyntheticNeedle needle;
+			needle.phase = 0.0f;
+			int factorizations = 0;
+			double seconds = 0.0;
+			for (int step = 0; step < steps; step++)
+			{
+				float depth = step * dt * speed - 0.005f;
+				syntheticInsertionInput(needle, depth, speed, dt);
+				needle.input.toolTipPoint.x() = 0.1f * std::max(depth, 0.0f);
+				if (!reuse)
+				{
+					needle.state.beam.factorized = false;
+					needle.state.beam.displacement.setZero();
+				}
+				benchClock::time_point start = benchClock::now();
+				stepNeedle(needle.state, needle.input, config);
+				seconds += secondsSince(start);
+				factorizations += needle.state.bending.factorized ? 1 : 0;
+			}
+			std::printf("%10d %8s %12.0f %16d %16.4f %18.4f\n", elements, reuse ? "yes" : "no", steps / seconds,
+				factorizations, 1.0e3f * needle.state.bending.tip_deflection.norm(), needle.state.bending.tissue_force.norm());
+		}
+	}
+}
+
+// --------------------------------------------------------------------------------------
+// ik: the native LWR inverse kinematics. Cold solves of random reachable poses from the posture,
+// and tracking a tool tip that moves on a 5 cm circle at 1 kHz with warm starts.
+// --------------------------------------------------------------------------------------
+static void benchIk()
+{
+	sLwrChain chain = lwr4Chain();
+	sIkSettings settings;
+	std::mt19937 rng(1);
+	std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+
+	const int poses = 2000;
+	int converged = 0, iterations = 0, most = 0;
+	double seconds = 0.0, slowest = 0.0;
+	for (int i = 0; i < poses; i++)
+	{
+		LwrJoints goal;
+		for (int j = 0; j < LWR_JOINTS; j++)
+			goal(j) = chain.posture(j) + 0.5f * unit(rng);
+		sLwrFrame target = lwrForwardKinematics(chain, goal);
+		LwrJoints q = chain.posture;
+		sIkResult result = lwrInverseKinematics(chain, target, q, settings);
+		converged += result.converged ? 1 : 0;
+		iterations += result.iterations;
+		most = std::max(most, result.iterations);
+		seconds += result.seconds;
+		slowest = std::max(slowest, result.seconds);
+	}
+	std::printf("ik: cold start, %d random poses within 0.5 rad of the posture\n", poses);
+	std::printf("  converged %.1f %%, iterations mean %.2f max %d, time mean %.1f us max %.1f us\n",
+		100.0 * converged / poses, (double)iterations / poses, most, 1.0e6 * seconds / poses, 1.0e6 * slowest);
+
+	const int steps = 10000;
+	LwrJoints q = chain.posture;
+	sLwrFrame center = lwrForwardKinematics(chain, q);
+	converged = iterations = most = 0;
+	seconds = slowest = 0.0;
+	float worst = 0.0f;
+	for (int step = 0; step < steps; step++)
+	{
+		float angle = 2.0f * 3.14159265f * step / 2000.0f;			// One circle every 2 s
+		sLwrFrame target = center;
+		target.position += 0.05f * Vector3f(cosf(angle) - 1.0f, sinf(angle), 0.0f);
+		sIkResult result = lwrInverseKinematics(chain, target, q, settings);
+		converged += result.converged ? 1 : 0;
+		iterations += result.iterations;
+		most = std::max(most, result.iterations);
+		seconds += result.seconds;
+		slowest = std::max(slowest, result.seconds);
+		worst = std::max(worst, result.position_error);
+	}
+	std::printf("ik: warm start, tracking a 5 cm circle at 1 kHz for %d steps\n", steps);
+	std::printf("  converged %.1f %%, iterations mean %.2f max %d, time mean %.1f us max %.1f us, worst error %.3f mm\n",
+		100.0 * converged / steps, (double)iterations / steps, most, 1.0e6 * seconds / steps, 1.0e6 * slowest, 1.0e3f * worst);
+}
+
+// --------------------------------------------------------------------------------------
+// fixture: cost of one evaluation of the virtual fixture against the 1 ms haptic budget, and the
+// constraint force while the device wobbles 5 mm sideways during an insertion through all layers.
+// --------------------------------------------------------------------------------------
+static void benchFixture()
+{
+	const int evaluations = 10000000;
+	sFixtureParameters parameters;
+	sVirtualFixture fixture;
+	fixture.engage(Vector3f(0.01f, 0.0f, 0.0f), Vector3f(0.1f, 0.0f, -1.0f));
+	benchClock::time_point start = benchClock::now();
+	for (int i = 0; i < evaluations; i++)
+	{
+		float t = 1.0e-3f * i;
+		evaluateFixture(fixture, parameters, Vector3f(1.0e-3f * (i & 7), 0.0f, -1.0e-6f * (i & 1023)), Vector3f(0.0f, 0.01f, -t));
+		benchSink = fixture.force.x();
+	}
+	double seconds = secondsSince(start);
+	std::printf("fixture: %.1f ns per evaluation, %.5f %% of 1 ms\n", 1.0e9 * seconds / evaluations, 100.0 * 1.0e3 * seconds / evaluations);
+
+	const float dt = 0.001f;
+	const float speed = 0.01f;
+	const int steps = 7000;
+	sNeedleConfig config;
+	config.use_only_z_force_on_engine = false;
+	sSyntheticNeedle needle;
+	needle.phase = 0.0f;
+	float peak_error = 0.0f, peak_force = 0.0f, peak_projection = 0.0f;
+	for (int step = 0; step < steps; step++)
+	{
+		float depth = step * dt * speed - 0.005f;
+		syntheticInsertionInput(needle, depth, speed, dt);
+		float wobble = 0.005f * sinf(2.0f * 3.14159265f * step * dt);
+		needle.input.commandedTip.x() += wobble;
+		needle.input.needleLinearVelocity.x() = 0.005f * 2.0f * 3.14159265f * cosf(2.0f * 3.14159265f * step * dt);
+		stepNeedle(needle.state, needle.input, config);
+		if (!needle.state.fixture.active)
+			continue;
+		peak_error = std::max(peak_error, needle.state.fixture.lateral_error);
+		peak_force = std::max(peak_force, needle.state.fixture.force.norm());
+		peak_projection = std::max(peak_projection, needle.state.fixture.projected.head<2>().norm());
+	}
+	std::printf("fixture: insertion with a 5 mm / 1 Hz sideways wobble, K %.0f N/m, B %.0f N-s/m, saturation %.1f N\n",
+		parameters.stiffness, parameters.damping, parameters.max_force);
+	std::printf("  peak lateral error %.3f mm, peak constraint force %.3f N, projected target off the line %.6f mm\n",
+		1.0e3f * peak_error, peak_force, 1.0e3f * peak_projection);
+}
+
+// --------------------------------------------------------------------------------------
+// passivity: cost of one passivity update, and a stiff wall rendered with one update of latency at
+// 1 kHz against a light, lightly damped device pushed by the user. Without the controller the wall
+// generates energy and the device keeps bouncing; with it the observed energy stays near zero and the
+// device comes to rest. The force/velocity trace of the stiffest run without controller is then
+// replayed through the controller open loop, which must keep the energy bounded below at every update.
+// --------------------------------------------------------------------------------------
+struct sPassivitySample {
+	Vector3f force;
+	Vector3f velocity;
+};
+
+// Wall at z = 0 with stiffness k, rendered every update_dt from the position of the last update.
+static double runDelayedWall(float k, float update_dt, bool controlled, std::vector<sPassivitySample>* trace, float& peak_penetration, float& late_speed)
+{
+	const double physics_dt = 1.0e-5;
+	const double mass = 0.1, device_damping = 0.5, push = 1.0;	// Device and hand mass [kg], damping [N-s/m], user force [N]
+	const double duration = 3.0;
+	sPassivityParameters parameters;
+	sPassivityState passivity;
+	double z = 0.01, v = 0.0;
+	double rendered = 0.0, last_z = z;
+	double min_energy = 0.0;
+	peak_penetration = late_speed = 0.0f;
+	int substeps = (int)(update_dt / physics_dt + 0.5);
+	for (int update = 0; update * update_dt < duration; update++)
+	{
+		// Force of the environment from the position one update ago, the device velocity is measured now.
+		Vector3f force(0.0f, 0.0f, (last_z < 0.0) ? (float)(-k * last_z) : 0.0f);
+		Vector3f velocity(0.0f, 0.0f, (float)v);
+		if (trace != NULL)
+			trace->push_back(sPassivitySample{ force, velocity });
+		// Without the controller the observer still runs, its damping is just not applied.
+		Vector3f output = passivityControl(passivity, parameters, force, velocity, update_dt);
+		if (!controlled)
+		{
+			output = force;
+			passivity.last_force = force;
+		}
+		min_energy = std::min(min_energy, passivity.energy);
+		rendered = output.z();
+		last_z = z;
+		for (int i = 0; i < substeps; i++)
+		{
+			double a = (rendered - push - device_damping * v) / mass;
+			v += a * physics_dt;
+			z += v * physics_dt;
+		}
+		peak_penetration = std::max(peak_penetration, (float)-z);
+		if (update * update_dt > duration - 1.0)
+			late_speed = std::max(late_speed, (float)fabs(v));
+	}
+	return min_energy;
+}
+
+static void benchPassivity()
+{
+	const int updates = 10000000;
+	sPassivityParameters parameters;
+	sPassivityState state;
+	benchClock::time_point start = benchClock::now();
+	for (int i = 0; i < updates; i++)
+	{
+		Vector3f force(0.0f, 0.0f, 2.0f * sinf(1.0e-3f * i));
+		Vector3f velocity(0.0f, 0.01f, 0.02f * cosf(1.1e-3f * i));
+		benchSink = passivityControl(state, parameters, force, velocity, 1.0e-3f).z();
+	}
+	double seconds = secondsSince(start);
+	std::printf("passivity: %.1f ns per update (includes the test signal)\n", 1.0e9 * seconds / updates);
+
+	const float update_dt = 0.001f;
+	std::printf("passivity: wall rendered at %.0f Hz with one update of latency, 3 s of pushing with 1 N\n", 1.0f / update_dt);
+	std::printf("%12s %12s %16s %22s %18s\n", "K [N/m]", "controller", "min energy [mJ]", "peak penetration [mm]", "speed in last s [m/s]");
+	const float stiffnesses[] = { 500.0f, 2000.0f, 5000.0f };
+	std::vector<sPassivitySample> trace;
+	double uncontrolled_energy = 0.0;
+	for (float k : stiffnesses)
+	{
+		for (int controlled = 0; controlled <= 1; controlled++)
+		{
+			float penetration, speed;
+			double min_energy = runDelayedWall(k, update_dt, controlled != 0, (!controlled && (k == 5000.0f)) ? &trace : NULL, penetration, speed);
+			if (!controlled && (k == 5000.0f))
+				uncontrolled_energy = min_energy;
+			std::printf("%12.0f %12s %16.3f %22.3f %18.4f\n", k, controlled ? "yes" : "no", 1.0e3 * min_energy, 1.0e3f * penetration, speed);
+		}
+	}
+
+	// Open loop replay of the unstable trace. Unless the controller was at its damping limit, the observed
+	// energy may only be negative by the error of the last prediction, the work of the held force against
+	// the change of velocity during that update.
+	sPassivityState replay;
+	double min_energy = 0.0;
+	int violations = 0;
+	bool saturated = false;
+	Vector3f last_velocity = Vector3f::Zero();
+	for (const sPassivitySample& sample : trace)
+	{
+		double bound = 0.5 * replay.last_force.norm() * (sample.velocity - last_velocity).norm() * update_dt;
+		passivityControl(replay, parameters, sample.force, sample.velocity, update_dt);
+		bool negative = (replay.energy < -1.001 * bound - 1.0e-9);		// Float rounding of the velocities.
+		// The energy is observed before this update's damping acts, so it is checked against the last one.
+		if (negative && !saturated)
+			violations++;
+		min_energy = std::min(min_energy, replay.energy);
+		saturated = (replay.damping >= parameters.max_damping) || (sample.velocity.norm() <= parameters.min_velocity);
+		last_velocity = sample.velocity;
+	}
+	std::printf("passivity: replayed K = 5000 trace, %d updates, min energy %.3f mJ (%.3f mJ without controller), dissipated %.3f mJ\n",
+		(int)trace.size(), 1.0e3 * min_energy, 1.0e3 * uncontrolled_energy, 1.0e3 * replay.dissipated);
+	std::printf("  energy bound %s (%d updates below it)\n", (violations == 0) ? "held" : "VIOLATED", violations);
+	benchCheck(violations == 0, "energy bound of the replayed trace");
+}
+
+// --------------------------------------------------------------------------------------
+// haptics: the shared-memory channel to the haptic driver. Cost of a publication and of a read from
+// the mapping, and the latency from publication to the reader seeing it, with the writer and the reader
+// on different threads of this process (the same segments and code a separate driver process uses).
+// The waiting loops yield, so the numbers on a single core include scheduling.
+// --------------------------------------------------------------------------------------
+static void benchHaptics()
+{
+	CHapticChannel writer, reader;
+	if (!writer.create("Benchmark") || !reader.open("Benchmark"))
+	{
+		std::printf("haptics: could not create the shared-memory segments\n");
+		return;
+	}
+	const int calls = 10000000;
+	sNeedlePublication publication;
+	std::memset(&publication, 0, sizeof(publication));
+	benchClock::time_point start = benchClock::now();
+	for (int i = 0; i < calls; i++)
+	{
+		publication.step = i;
+		writer.publishNeedle(publication);
+	}
+	double publish = secondsSince(start);
+	start = benchClock::now();
+	for (int i = 0; i < calls; i++)
+	{
+		reader.readNeedle(publication);
+		benchSink = publication.force[0];
+	}
+	double read = secondsSince(start);
+	std::printf("haptics: publish %.1f ns, read %.1f ns (%d byte record, uncontended)\n",
+		1.0e9 * publish / calls, 1.0e9 * read / calls, (int)sizeof(sNeedlePublication));
+
+	const int records = 20000;
+	const uint64_t period_ns = 100000;				// 10 kHz
+	std::memset(&publication, 0, sizeof(publication));
+	writer.publishNeedle(publication);
+	std::vector<double> latencies;
+	latencies.reserve(records);
+	std::thread plugin([&writer, records, period_ns]() {
+		sNeedlePublication record;
+		std::memset(&record, 0, sizeof(record));
+		uint64_t next = CHapticChannel::steadyNanoseconds();
+		for (int i = 1; i <= records; i++)
+		{
+			while (CHapticChannel::steadyNanoseconds() < next)
+				std::this_thread::yield();
+			record.step = i;
+			record.publish_ns = CHapticChannel::steadyNanoseconds();
+			writer.publishNeedle(record);
+			next += period_ns;
+		}
+	});
+	uint64_t last = 0;
+	int missed = 0;
+	while (last < (uint64_t)records)
+	{
+		sNeedlePublication record;
+		reader.readNeedle(record);
+		if (record.step == last)
+		{
+			std::this_thread::yield();
+			continue;
+		}
+		latencies.push_back(1.0e-3 * (CHapticChannel::steadyNanoseconds() - record.publish_ns));
+		missed += (int)(record.step - last - 1);
+		last = record.step;
+	}
+	plugin.join();
+	std::sort(latencies.begin(), latencies.end());
+	std::printf("haptics: %d records at %.0f kHz, %d seen, %d overwritten before the reader saw them\n",
+		records, 1.0e6 / period_ns, (int)latencies.size(), missed);
+	std::printf("  latency p50 %.2f us, p99 %.2f us, max %.2f us (%u hardware threads)\n", latencies[latencies.size() / 2],
+		latencies[latencies.size() * 99 / 100], latencies.back(), std::thread::hardware_concurrency());
+}
+
+// --------------------------------------------------------------------------------------
+// extrapolation: cost of one evaluation of the force extrapolation, and the error of the force rendered
+// at 1 kHz from a 20 Hz simulation against the same insertion simulated at 1 kHz. The insertion speed
+// varies smoothly between 2 and 18 mm/s. The error is given over the whole insertion and between
+// punctures, where both simulations have the same punctures and no contact force.
+// --------------------------------------------------------------------------------------
+static float extrapolationDepth(float t)
+{
+	return 0.002f + 0.01f * t + 0.008f / 3.0f * (1.0f - cosf(3.0f * t));
+}
+
+static float extrapolationSpeed(float t)
+{
+	return 0.01f + 0.008f * sinf(3.0f * t);
+}
+
+static void benchExtrapolation()
+{
+	const int evaluations = 10000000;
+	sSyntheticNeedle needle;
+	needle.phase = 0.0f;
+	sNeedleConfig config;
+	config.use_only_z_force_on_engine = false;
+	for (int step = 0; step < 500; step++)
+	{
+		syntheticInsertionInput(needle, extrapolationDepth(0.05f * step), extrapolationSpeed(0.05f * step), 0.05f);
+		stepNeedle(needle.state, needle.input, config);
+	}
+	sForceExtrapolator extrapolator;
+	extrapolator.receive(needle.state.snapshot, 0.0);
+	float force[3];
+	benchClock::time_point start = benchClock::now();
+	for (int i = 0; i < evaluations; i++)
+	{
+		extrapolator.evaluate(1.0e-3 * (i % 50), force);
+		benchSink = force[2];
+	}
+	double seconds = secondsSince(start);
+	std::printf("extrapolation: %.1f ns per evaluation, sizeof(sForceSnapshot) %d bytes\n", 1.0e9 * seconds / evaluations, (int)sizeof(sForceSnapshot));
+
+	const float fine_dt = 0.001f;
+	const int ratio = 50;
+	const int steps = 4000;
+	const char* models[] = { "kelvin-voigt", "karnopp", "prony", "lugre" };
+	std::printf("RMS error of the rendered axial force against a %.0f Hz simulation, %.0f Hz simulation, %.1f s insertion:\n",
+		1.0f / fine_dt, 1.0f / (ratio * fine_dt), steps * fine_dt);
+	std::printf("%14s %10s | %10s %12s %10s | %10s %12s %10s\n", "model", "peak N", "held N", "extrapol. N", "blended N",
+		"held N", "extrapol. N", "blended N");
+	std::printf("%25s | %34s | %34s\n", "", "whole insertion", "between punctures");
+	for (const char* model : models)
+	{
+		config.force_model = model;
+		sSyntheticNeedle fine, coarse;
+		fine.phase = coarse.phase = 0.0f;
+		sForceExtrapolator blended;
+		double squared[2][3] = { { 0.0, 0.0, 0.0 }, { 0.0, 0.0, 0.0 } };
+		double peak = 0.0;								// Largest model force, between punctures.
+		int samples[2] = { 0, 0 };
+		for (int step = 0; step < steps; step++)
+		{
+			float t = step * fine_dt;
+			syntheticInsertionInput(fine, extrapolationDepth(t), extrapolationSpeed(t), fine_dt);
+			stepNeedle(fine.state, fine.input, config);
+			if (step % ratio == 0)
+			{
+				// The coarse step at t covers [t - 50 ms, t] and is available from t on.
+				syntheticInsertionInput(coarse, extrapolationDepth(t), extrapolationSpeed(t), ratio * fine_dt);
+				stepNeedle(coarse.state, coarse.input, config);
+				blended.receive(coarse.state.snapshot, t);
+			}
+			float tau = (step % ratio) * fine_dt;
+			double truth = fine.state.f_ext_magnitude;
+			double errors[3];
+			errors[0] = coarse.state.f_ext_magnitude - truth;
+			errors[1] = snapshotAxialForce(coarse.state.snapshot, tau) - truth;
+			blended.evaluate(t, force);
+			errors[2] = force[2] - truth;
+			// The 2 N contact force of a puncture lasts one step, 1 ms in the fine and 50 ms in the coarse simulation.
+			bool between = (fine.state.punctures.size() == coarse.state.punctures.size())
+				&& (fine.state.lwr_tip_engine_force_magnitude == 0.0f) && (coarse.state.lwr_tip_engine_force_magnitude == 0.0f);
+			if (between)
+				peak = std::max(peak, fabs(truth));
+			for (int part = 0; part < 2; part++)
+			{
+				if ((part == 1) && !between)
+					continue;
+				samples[part]++;
+				for (int i = 0; i < 3; i++)
+					squared[part][i] += errors[i] * errors[i];
+			}
+		}
+		std::printf("%14s %10.3f", model, peak);
+		for (int part = 0; part < 2; part++)
+		{
+			std::printf(" |");
+			for (int i = 0; i < 3; i++)
+				std::printf(" %*.4f", (i == 1) ? 12 : 10, sqrt(squared[part][i] / std::max(samples[part], 1)));
+		}
+		std::printf("\n");
+	}
+}
+
+// --------------------------------------------------------------------------------------
+// sdf: signed distance field of a tissue mesh (a 3 cm sphere): build time on one thread and on the
+// pool, memory against a dense grid, loading from the cache, accuracy against the analytic distance,
+// and the cost of the queries of a step against the entry-plane test they replace.
+// --------------------------------------------------------------------------------------
+static sSdfMesh icosphereMesh(float radius, int subdivisions)
+{
+	const float g = 1.618034f;
+	std::vector<Vector3f> vertices = { Vector3f(-1, g, 0), Vector3f(1, g, 0), Vector3f(-1, -g, 0), Vector3f(1, -g, 0),
+		Vector3f(0, -1, g), Vector3f(0, 1, g), Vector3f(0, -1, -g), Vector3f(0, 1, -g),
+		Vector3f(g, 0, -1), Vector3f(g, 0, 1), Vector3f(-g, 0, -1), Vector3f(-g, 0, 1) };
+	std::vector<int> triangles = { 0, 11, 5, 0, 5, 1, 0, 1, 7, 0, 7, 10, 0, 10, 11, 1, 5, 9, 5, 11, 4, 11, 10, 2, 10, 7, 6, 7, 1, 8,
+		3, 9, 4, 3, 4, 2, 3, 2, 6, 3, 6, 8, 3, 8, 9, 4, 9, 5, 2, 4, 11, 6, 2, 10, 8, 6, 7, 9, 8, 1 };
+	for (int level = 0; level < subdivisions; level++)
+	{
+		std::map<std::pair<int, int>, int> middles;
+		std::function<int(int, int)> middle = [&](int a, int b) {
+			std::pair<int, int> key(std::min(a, b), std::max(a, b));
+			std::map<std::pair<int, int>, int>::iterator it = middles.find(key);
+			if (it != middles.end())
+				return it->second;
+			vertices.push_back(0.5f * (vertices[a] + vertices[b]));
+			middles[key] = (int)vertices.size() - 1;
+			return (int)vertices.size() - 1;
+		};
+		std::vector<int> finer;
+		for (size_t t = 0; t < triangles.size(); t += 3)
+		{
+			int a = triangles[t], b = triangles[t + 1], c = triangles[t + 2];
+			int ab = middle(a, b), bc = middle(b, c), ca = middle(c, a);
+			int split[12] = { a, ab, ca, b, bc, ab, c, ca, bc, ab, bc, ca };
+			finer.insert(finer.end(), split, split + 12);
+		}
+		triangles.swap(finer);
+	}
+	sSdfMesh mesh;
+	for (const Vector3f& vertex : vertices)
+	{
+		Vector3f p = radius * vertex.normalized();
+		mesh.vertices.insert(mesh.vertices.end(), p.data(), p.data() + 3);
+	}
+	mesh.indices = triangles;
+	return mesh;
+}
+
+static void benchSdf()
+{
+	const float radius = 0.03f;
+	sSdfMesh mesh = icosphereMesh(radius, 4);
+	sSdfSettings settings;
+	settings.cache_directory = "";
+	CThreadPool serial(1), pool(CThreadPool::defaultWorkerCount());
+	CTissueSdf sdf;
+	benchClock::time_point start = benchClock::now();
+	sdf.build(mesh, settings, serial);
+	double serialSeconds = secondsSince(start);
+	start = benchClock::now();
+	sdf.build(mesh, settings, pool);
+	double poolSeconds = secondsSince(start);
+	const sSdfHeader& header = sdf.getHeader();
+	size_t bricks = (size_t)header.bricks[0] * header.bricks[1] * header.bricks[2];
+	double dense = (double)bricks * SDF_BRICK * SDF_BRICK * SDF_BRICK * sizeof(float);
+	std::printf("sdf: sphere r %.0f mm, %d triangles, voxel %.2f mm, band %.1f mm\n", 1.0e3f * radius, (int)mesh.indices.size() / 3,
+		1.0e3f * header.voxel_size, 1.0e3f * header.band);
+	std::printf("  build %.3f s on 1 thread, %.3f s on %d worker thread(s)\n", serialSeconds, poolSeconds, (int)pool.getWorkerCount());
+	std::printf("  %d of %d bricks stored, %.1f KiB (dense float grid: %.1f KiB)\n", header.stored_bricks, (int)bricks,
+		sdf.memoryBytes() / 1024.0, dense / 1024.0);
+
+	std::string path = sdfCachePath(".", header.mesh_hash);
+	sdf.save(path);
+	CTissueSdf loaded;
+	start = benchClock::now();
+	bool ok = loaded.load(path, sdfMeshHash(mesh, settings));
+	std::printf("  load from the cache %.2f ms (%s)\n", 1.0e3 * secondsSince(start), ok ? "valid" : "FAILED");
+	std::remove(path.c_str());
+	if (!benchCheck(ok, "load of the cached field"))
+		return;
+
+	// Accuracy: distance within band and sign everywhere, against the exact sphere.
+	std::mt19937 random(7);
+	std::uniform_real_distribution<float> coordinate(-1.3f * radius, 1.3f * radius);
+	const int points = 200000;
+	float max_error = 0.0f;
+	int wrong_sign = 0;
+	std::vector<Vector3f> queries(points);
+	for (int i = 0; i < points; i++)
+	{
+		Vector3f p(coordinate(random), coordinate(random), coordinate(random));
+		queries[i] = p;
+		float exact = p.norm() - radius;
+		float d = loaded.distance(p);
+		if (fabsf(exact) < header.band - header.voxel_size)
+			max_error = std::max(max_error, fabsf(d - exact));
+		if ((fabsf(exact) > header.voxel_size) && ((d < 0.0f) != (exact < 0.0f)))
+			wrong_sign++;
+	}
+	std::printf("  max distance error in band %.4f mm, wrong signs %d of %d\n", 1.0e3f * max_error, wrong_sign, points);
+	benchCheck((max_error < header.voxel_size) && (wrong_sign == 0), "distances within a voxel and signs");
+
+	// Puncture lengths: straight insertions at random points and up to 40 degrees off the normal, 0..7 cm deep.
+	std::uniform_real_distribution<float> unit(-1.0f, 1.0f);
+	std::vector<Vector3f> entries, tips;
+	float max_length_error = 0.0f;
+	while (entries.size() < 10000)
+	{
+		Vector3f normal(unit(random), unit(random), unit(random));
+		Vector3f direction = -normal + 0.7f * Vector3f(unit(random), unit(random), unit(random));
+		if (!(normal.norm() > 0.1f) || (direction.normalized().dot(-normal.normalized()) < cosf(0.7f)))
+			continue;
+		normal.normalize();
+		direction.normalize();
+		float depth = 0.035f * (unit(random) + 1.0f);
+		Vector3f entry = radius * normal;
+		float chord = 2.0f * radius * direction.dot(-normal);
+		max_length_error = std::max(max_length_error, fabsf(loaded.insideLength(entry, entry + depth * direction) - std::min(depth, chord)));
+		entries.push_back(entry);
+		tips.push_back(entry + depth * direction);
+	}
+	std::printf("  max puncture length error %.4f mm\n", 1.0e3f * max_length_error);
+	benchCheck(max_length_error < header.voxel_size, "puncture lengths within a voxel");
+
+	const int evaluations = 2000000;
+	start = benchClock::now();
+	for (int i = 0; i < evaluations; i++)
+		benchSink = loaded.distance(queries[i % points]);
+	double distanceSeconds = secondsSince(start);
+	const int segments = 200000;
+	start = benchClock::now();
+	for (int i = 0; i < segments; i++)
+		benchSink = loaded.insideLength(entries[i % entries.size()], tips[i % tips.size()]);
+	double lengthSeconds = secondsSince(start);
+	sPuncture puncture;
+	puncture.position = Vector3f(0.0f, 0.0f, radius);
+	puncture.direction = Vector3f::UnitZ();
+	start = benchClock::now();
+	for (int i = 0; i < evaluations; i++)
+		benchSink = punctureLength(puncture, queries[i % points]);
+	double planeSeconds = secondsSince(start);
+	std::printf("  %.1f ns per distance, %.1f ns per puncture length (entry plane: %.1f ns)\n", 1.0e9 * distanceSeconds / evaluations,
+		1.0e9 * lengthSeconds / segments, 1.0e9 * planeSeconds / evaluations);
+
+	// The needle goes through the sphere, out at the far side 6 cm deep, on to 8 cm and back out.
+	for (int withField = 0; withField < 2; withField++)
+	{
+		sNeedleConfig config;
+		config.use_only_z_force_on_engine = false;
+		sNeedleState state;
+		sNeedleStepInput input;
+		input.dt = 1.0e-3f;
+		input.needleVelocity = 0.01f;
+		sTissueField field;
+		field.handle = 1;
+		field.sdf = &loaded;
+		field.rotation = Matrix3f::Identity();
+		field.position = Vector3f::Zero();
+		if (withField)
+			input.fields.push_back(field);
+		float exit_depth = -1.0f, deepest = 0.0f;
+		for (int step = 0; step <= 1620; step++)
+		{
+			float depth = 1.0e-4f * ((step <= 800) ? step : 1600 - step);
+			input.toolTipPoint = Vector3f(0.0f, 0.0f, radius - depth);
+			input.needleAxialVelocity = (step <= 800) ? 0.01f : -0.01f;
+			input.contacts.clear();
+			// The surface pushes back until the puncture is through the entry hysteresis (sPunctureHysteresis).
+			if (step < config.hysteresis.entry_steps)
+			{
+				sContact contact;
+				contact.handle = 1;
+				contact.name = "muscle";
+				contact.tissue = tissueParameters(contact.name);
+				contact.force = Vector3f(0.0f, 0.0f, 2.0f);
+				contact.respondable = true;
+				input.contacts.push_back(contact);
+			}
+			stepNeedle(state, input, config);
+			if (step == 800)
+				deepest = state.full_penetration_length;
+			if (!state.exited_punctures.empty())
+				exit_depth = depth;
+		}
+		char left[32] = "never";
+		if (exit_depth > -1.0f)
+			std::snprintf(left, sizeof(left), "%.2f mm", 1.0e3f * exit_depth);
+		std::printf("  needle 8 cm through the sphere and back, %-11s: penetration %.2f mm, puncture left at %s\n",
+			withField ? "field" : "entry plane", 1.0e3f * deepest, left);
+		// Less the depth the tip goes on through the entry hysteresis: the whole 8 cm, or the 6 cm chord of the sphere.
+		float expected = withField ? 2.0f * radius : 0.08f;
+		benchCheck(fabsf(deepest - expected) < 0.5e-3f, withField ? "penetration of the field" : "penetration of the entry plane");
+		benchCheck(exit_depth > -1.0f, withField ? "puncture of the field left" : "puncture of the entry plane left");
+	}
+}
+
+// --------------------------------------------------------------------------------------
+// CT volume: a 512^3 phantom of flat fat and muscle layers around a bone sphere, marched by needles.
+// --------------------------------------------------------------------------------------
+// Resident memory of the process, 0 where /proc is not available. Unit: KiB
+static long residentKiB()
+{
+	long pages = 0, resident = 0;
+	FILE* file = std::fopen("/proc/self/statm", "r");
+	if (file == NULL)
+		return 0;
+	if (std::fscanf(file, "%ld %ld", &pages, &resident) != 2)
+		resident = 0;
+	std::fclose(file);
+	return resident * 4;
+}
+
+static void benchVolume()
+{
+	const int n = 512;
+	const float voxel = 5.0e-4f;
+	const float fatTop = 0.2f, muscleTop = 0.18f, boneRadius = 0.03f;
+	const Vector3f boneCentre(0.128f, 0.128f, 0.1f);
+	int dims[3] = { n, n, n };
+	float spacing[3] = { voxel, voxel, voxel };
+	float origin[3] = { 0.0f, 0.0f, 0.0f };
+	std::vector<std::string> names = { "air", "Fat", "muscle", "bone" };
+	const std::string path = "benchPhantom.vol";
+	{
+		std::vector<uint8_t> labels((size_t)n * n * n);
+		for (int z = 0; z < n; z++)
+		{
+			for (int y = 0; y < n; y++)
+			{
+				for (int x = 0; x < n; x++)
+				{
+					Vector3f centre = voxel * Vector3f(x + 0.5f, y + 0.5f, z + 0.5f);
+					uint8_t label = (centre.z() > fatTop) ? 0 : ((centre.z() > muscleTop) ? 1 : 2);
+					if ((centre - boneCentre).norm() < boneRadius)
+						label = 3;
+					labels[((size_t)z * n + y) * n + x] = label;
+				}
+			}
+		}
+		benchClock::time_point start = benchClock::now();
+		if (!benchCheck(writeTissueVolume(path, dims, spacing, origin, names, labels.data()), "write of the volume"))
+		{
+			std::printf("volume: could not write %s\n", path.c_str());
+			return;
+		}
+		std::printf("volume: %d^3 voxels of %.1f mm, written in %.2f s\n", n, 1.0e3f * voxel, secondsSince(start));
+	}
+
+	CTissueVolume volume;
+	benchClock::time_point start = benchClock::now();
+	bool ok = volume.open(path);
+	double openSeconds = secondsSince(start);
+	if (!benchCheck(ok, "open of the volume"))
+	{
+		std::printf("  could not open %s\n", path.c_str());
+		std::remove(path.c_str());
+		return;
+	}
+	const sVolumeHeader& header = volume.getHeader();
+	std::printf("  %d of %d bricks stored, file %.1f MiB (dense %.1f MiB), mapped in %.3f ms\n", header.stored_bricks,
+		header.bricks[0] * header.bricks[1] * header.bricks[2], volume.fileBytes() / 1048576.0, (double)n * n * n / 1048576.0,
+		1.0e3 * openSeconds);
+
+	// Needles 12 cm long, up to 30 degrees off vertical, tips at random depths.
+	std::mt19937 random(7);
+	std::uniform_real_distribution<float> unit(0.0f, 1.0f);
+	const int needles = 100000;
+	const float shaft = 0.12f;
+	std::vector<Vector3f> ends, tips;
+	for (int i = 0; i < needles; i++)
+	{
+		float tilt = 0.5236f * unit(random), azimuth = 6.2832f * unit(random);
+		Vector3f direction(sinf(tilt) * cosf(azimuth), sinf(tilt) * sinf(azimuth), -cosf(tilt));
+		Vector3f tip(0.06f + 0.136f * unit(random), 0.06f + 0.136f * unit(random), 0.04f + 0.13f * unit(random));
+		tips.push_back(tip);
+		ends.push_back(tip - shaft * direction);
+	}
+
+	// Fat: the shaft crosses the whole layer, 2 cm / cos(tilt). The voxels of the bone only approximate the sphere,
+	// so its runs are compared against sampling the voxels every 1/50 voxel along the shaft instead.
+	std::vector<sVolumeSegment> segments;
+	float maxFatError = 0.0f, maxSampledError = 0.0f;
+	for (int i = 0; i < needles; i++)
+	{
+		volume.march(ends[i], tips[i], segments);
+		Vector3f direction = (tips[i] - ends[i]) / shaft;
+		float lengths[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+		for (const sVolumeSegment& segment : segments)
+			lengths[segment.label] += segment.end - segment.begin;
+		if ((ends[i].z() > fatTop) && (tips[i].z() < muscleTop - 0.01f))
+			maxFatError = std::max(maxFatError, fabsf(lengths[1] - (fatTop - muscleTop) / -direction.z()));
+		if (i % 100 != 0)
+			continue;
+		const int fine = (int)(50.0f * shaft / voxel);
+		float sampled[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+		for (int k = 0; k < fine; k++)
+			sampled[volume.label(ends[i] + ((k + 0.5f) / fine) * (tips[i] - ends[i]))] += shaft / fine;
+		for (int label = 1; label < 4; label++)
+			maxSampledError = std::max(maxSampledError, fabsf(lengths[label] - sampled[label]));
+	}
+	std::printf("  max error of the shaft length in the fat %.3f mm, of the runs against fine sampling %.3f mm\n",
+		1.0e3f * maxFatError, 1.0e3f * maxSampledError);
+	benchCheck((maxFatError < 0.01e-3f) && (maxSampledError < 0.1f * voxel), "shaft lengths of the march");
+
+	long before = residentKiB();
+	start = benchClock::now();
+	size_t runs = 0;
+	for (int i = 0; i < needles; i++)
+	{
+		volume.march(ends[i], tips[i], segments);
+		runs += segments.size();
+	}
+	double marchSeconds = secondsSince(start);
+	// The same shafts sampled point by point every half voxel, without the brick layout.
+	start = benchClock::now();
+	int sampled = 0;
+	const int samples = (int)(shaft / (0.5f * voxel));
+	for (int i = 0; i < needles / 10; i++)
+	{
+		for (int k = 0; k <= samples; k++)
+			sampled += volume.label(ends[i] + (tips[i] - ends[i]) * ((float)k / samples));
+	}
+	double sampleSeconds = 10.0 * secondsSince(start);
+	benchSink = (float)(runs + sampled);
+	std::printf("  march of a %.0f cm shaft %.2f us (%.1f runs), point sampling %.2f us, resident %ld KiB after %d marches\n",
+		1.0e2f * shaft, 1.0e6 * marchSeconds / needles, (double)runs / needles, 1.0e6 * sampleSeconds / needles,
+		residentKiB() - before, needles);
+
+	// A needle pushed straight down through fat and muscle into the bone at 1 cm/s.
+	std::vector<sTissueParameters> tissues;
+	for (const std::string& name : names)
+		tissues.push_back(tissueParameters(name));
+	sNeedleConfig config;
+	config.use_only_z_force_on_engine = false;
+	sNeedleState state;
+	sNeedleStepInput input;
+	input.dt = 1.0e-3f;
+	input.needleVelocity = 0.01f;
+	input.needleAxialVelocity = 0.01f;
+	input.volume.volume = &volume;
+	input.volume.tissues = &tissues;
+	double stepSeconds = 0.0;
+	int steps = 0;
+	std::string punctured;
+	for (float depth = 0.0f; depth < 0.1f; depth += 1.0e-5f, steps++)
+	{
+		input.toolTipPoint = Vector3f(boneCentre.x(), boneCentre.y(), 0.21f - depth);
+		start = benchClock::now();
+		stepNeedle(state, input, config);
+		stepSeconds += secondsSince(start);
+		for (const sPuncture& puncture : state.new_punctures)
+		{
+			std::printf("  tip at %.1f mm: punctured %s\n", 1.0e3f * (input.toolTipPoint.z() - boneCentre.z()), puncture.name.c_str());
+			punctured += punctured.empty() ? puncture.name : " " + puncture.name;
+		}
+	}
+	std::printf("  %d steps of the needle, %.2f us per step, penetration %.1f mm in %d tissues\n", steps, 1.0e6 * stepSeconds / steps,
+		1.0e3f * state.full_penetration_length, (int)state.punctures.size());
+	benchCheck(punctured == names[1] + " " + names[2] + " " + names[3], "punctures of fat, muscle and bone in turn");
+	volume.close();
+	std::remove(path.c_str());
+}
+
+// --------------------------------------------------------------------------------------
+// Message dispatch: the idle path of v_repMessage, the old if chain against the router.
+// --------------------------------------------------------------------------------------
+// Stand-ins for the V-REP API, called through pointers like the functions of the loaded library.
+static volatile int benchErrorMode;
+static int benchGetIntegerParameter(int parameter, int* value)
+{
+	*value = benchErrorMode + parameter;
+	return 1;
+}
+static int benchSetIntegerParameter(int parameter, int value)
+{
+	benchErrorMode = value - parameter;
+	return 1;
+}
+static int (*volatile benchGetParameter)(int, int*) = benchGetIntegerParameter;
+static int (*volatile benchSetParameter)(int, int) = benchSetIntegerParameter;
+
+// The shape of the former v_repMessage: error mode saved and restored on every call, then every id tested.
+static void* legacyMessage(int message, int* auxiliaryData, void* customData, int* replyData)
+{
+	static bool refreshDlgFlag = true;
+	int errorModeSaved;
+	benchGetParameter(1, &errorModeSaved);
+	benchSetParameter(1, 2);
+	if (message == 3)
+		refreshDlgFlag = true;
+	if (message == 4)
+		benchSink = 1.0f;
+	if (message == 5)
+	{
+		if ((auxiliaryData[0] & (1 + 2 + 4 + 8 + 16 + 32 + 64 + 256)) != 0)
+			refreshDlgFlag = true;
+	}
+	if (message == 6)
+		benchSink = 2.0f;
+	if (message == 7)
+		benchSink = 3.0f;
+	if (message == 8)
+		benchSink = 4.0f;
+	if (message == 9)
+	{
+		if ((customData == NULL) || (strcasecmp("PluginSkeleton", (char*)customData) == 0))
+			benchSink = 5.0f;
+	}
+	if (message == 10)
+	{
+		if ((customData == NULL) || (strcasecmp("PluginSkeleton", (char*)customData) == 0))
+			benchSink = 6.0f;
+	}
+	if (message == 11)
+	{
+		if ((customData == NULL) || (strcasecmp("PluginSkeleton", (char*)customData) == 0))
+			benchSink = 7.0f;
+	}
+	if (message == 12)
+		benchSink = 8.0f;
+	if (message == 13)
+		benchSink = 9.0f;
+	if (message == 14)
+		benchSink = 10.0f;
+	if ((message == 15) && refreshDlgFlag)
+		refreshDlgFlag = false;
+	benchSetParameter(1, errorModeSaved);
+	return NULL;
+}
+
+static bool benchRefreshFlag = true;
+static void* benchInstancePass(int* auxiliaryData, void* customData, int* replyData)
+{
+	if ((auxiliaryData[0] & (1 + 2 + 4 + 8 + 16 + 32 + 64 + 256)) != 0)
+		benchRefreshFlag = true;
+	return NULL;
+}
+static void* benchGuiPass(int* auxiliaryData, void* customData, int* replyData)
+{
+	benchRefreshFlag = false;
+	return NULL;
+}
+static void* benchModuleHandle(int* auxiliaryData, void* customData, int* replyData)
+{
+	benchSink = 6.0f;
+	return NULL;
+}
+static void benchEnterApi(int& saved)
+{
+	benchGetParameter(1, &saved);
+	benchSetParameter(1, 2);
+}
+static void benchLeaveApi(int& saved)
+{
+	benchSetParameter(1, saved);
+}
+
+static void benchRouter()
+{
+	CMessageRouter router;
+	router.setModuleName("PluginSkeleton");
+	router.setApiGuard(benchEnterApi, benchLeaveApi);
+	router.route(5, benchInstancePass, 0);
+	router.route(15, benchGuiPass, 0);
+	router.route(10, benchModuleHandle, MESSAGE_API | MESSAGE_MODULE);
+
+	// An idle editor: instance and GUI passes every frame, and messages nobody handles.
+	struct sCase {
+		const char* name;
+		int message;
+		const char* customData;
+	};
+	const sCase cases[] = {
+		{ "unhandled message", 40, NULL },
+		{ "instance pass", 5, NULL },
+		{ "module handle, other module", 10, "OtherPlugin" },
+		{ "module handle, this module", 10, "PluginSkeleton" },
+	};
+	const int calls = 5000000;
+	int auxiliaryData[4] = { 0, 0, 0, 0 };
+	std::printf("router: ns per v_repMessage call (API stand-ins without the cost of V-REP)\n");
+	std::printf("  %-30s %10s %10s\n", "message", "if chain", "router");
+	for (const sCase& c : cases)
+	{
+		benchClock::time_point start = benchClock::now();
+		for (int i = 0; i < calls; i++)
+			legacyMessage(c.message, auxiliaryData, (void*)c.customData, NULL);
+		double legacy = secondsSince(start);
+		start = benchClock::now();
+		for (int i = 0; i < calls; i++)
+			router.dispatch(c.message, auxiliaryData, (void*)c.customData, NULL);
+		double routed = secondsSince(start);
+		std::printf("  %-30s %10.2f %10.2f\n", c.name, 1.0e9 * legacy / calls, 1.0e9 * routed / calls);
+	}
+	const sMessageStatistics& statistics = router.getStatistics(10);
+	std::printf("  module handle: %llu calls, %llu handled, %.1f ns per handled call\n", (unsigned long long)statistics.calls,
+		(unsigned long long)statistics.handled, 1.0e9 * statistics.seconds / std::max<uint64_t>(statistics.handled, 1));
+}
+
+// --------------------------------------------------------------------------------------
+// checkpoint: branching from a mid-insertion state. Every model is run into the muscle, checkpointed, run on,
+// restored into a fresh needle and run on again: both branches must give the same forces, bit for bit.
+// --------------------------------------------------------------------------------------
+static void benchCheckpoint()
+{
+	const float dt = 0.001f;
+	const float speed = 0.01f;
+	const int before = 2000;						// Steps to the checkpoint: 15 mm deep, through the fat into the muscle.
+	const int after = 1500;							// Steps of each branch, on into the lung.
+	const int repeats = 10000;
+	struct sCase {
+		const char* model;
+		int beam_elements;
+		const char* path;
+	};
+	const sCase cases[] = {
+		{ "kelvin-voigt", 0, "straight" },
+		{ "prony", 0, "straight" },
+		{ "lugre", 0, "straight" },
+		{ "shaft", 0, "straight" },
+		{ "shaft", 50, "bevel" },
+	};
+	std::printf("checkpoint: %d steps to the checkpoint, %d steps per branch, %.0f cm/s\n", before, after, 100.0f * speed);
+	std::printf("%14s %6s %10s %8s %10s %12s %14s %10s\n", "model", "beam", "path", "bytes", "save us", "restore us", "replay steps", "identical");
+	for (const sCase& c : cases)
+	{
+		sNeedleConfig config;
+		config.use_only_z_force_on_engine = false;
+		config.force_model = c.model;
+		config.beam_elements = c.beam_elements;
+		config.needle_path = c.path;
+		sSyntheticNeedle needle;
+		needle.phase = 0.0f;
+		for (int step = 0; step < before; step++)
+		{
+			float depth = step * dt * speed - 0.005f;
+			syntheticInsertionInput(needle, depth, speed, dt);
+			needle.input.toolTipPoint.x() = 0.05f * std::max(depth, 0.0f);
+			stepNeedle(needle.state, needle.input, config);
+		}
+
+		std::string blob;
+		benchClock::time_point start = benchClock::now();
+		for (int i = 0; i < repeats; i++)
+		{
+			blob.clear();
+			CCheckpointWriter writer(blob);
+			saveNeedleState(writer, needle.state);
+		}
+		double saveSeconds = secondsSince(start);
+		sSyntheticNeedle branch;
+		branch.phase = 0.0f;
+		bool restored = true;
+		start = benchClock::now();
+		for (int i = 0; i < repeats; i++)
+		{
+			CCheckpointReader reader(blob);
+			restored = restoreNeedleState(reader, branch.state) && restored;
+		}
+		double restoreSeconds = secondsSince(start);
+
+		// Run on from the checkpoint in the original needle and in the restored one.
+		bool identical = restored;
+		for (int step = before; step < before + after; step++)
+		{
+			float depth = step * dt * speed - 0.005f;
+			for (sSyntheticNeedle* run : { &needle, &branch })
+			{
+				syntheticInsertionInput(*run, depth, speed, dt);
+				run->input.toolTipPoint.x() = 0.05f * std::max(depth, 0.0f);
+				stepNeedle(run->state, run->input, config);
+			}
+			identical = identical && (needle.state.f_ext == branch.state.f_ext) && (needle.state.f_device == branch.state.f_device)
+				&& (needle.state.punctures.size() == branch.state.punctures.size());
+		}
+
+		// A cut blob must be refused and leave the needle alone.
+		sSyntheticNeedle cut;
+		CCheckpointReader reader(blob.substr(0, blob.size() / 2));
+		identical = identical && !restoreNeedleState(reader, cut.state) && cut.state.punctures.empty();
+		std::printf("%14s %6d %10s %8d %10.2f %12.2f %14d %10s\n", c.model, c.beam_elements, c.path, (int)blob.size(),
+			1.0e6 * saveSeconds / repeats, 1.0e6 * restoreSeconds / repeats, before, identical ? "yes" : "NO");
+		benchCheck(identical, "branch from the checkpoint identical");
+	}
+}
+
+// --------------------------------------------------------------------------------------
+// trace: cost of the step tracer when it is off and when it records, and the size of the trace.
+// --------------------------------------------------------------------------------------
+static void benchTrace()
+{
+	const int spans = 10000000;
+	const int steps = 2000;
+	const int count = 16;
+	const float dt = 0.001f;
+	const char* path = "needleTrace.json";
+	sNeedleConfig config;
+	config.use_only_z_force_on_engine = false;
+	CThreadPool pool(CThreadPool::defaultWorkerCount());
+
+	traceStop();
+	benchClock::time_point start = benchClock::now();
+	for (int i = 0; i < spans; i++)
+	{
+		CTraceSpan span("bench", "index", i);
+		benchSink = benchSink + 1.0f;
+	}
+	double offSeconds = secondsSince(start);
+	start = benchClock::now();
+	for (int i = 0; i < spans; i++)
+		benchSink = benchSink + 1.0f;
+	double loopSeconds = secondsSince(start);
+	std::printf("trace: span when off %.2f ns (loop alone %.2f ns)\n", 1.0e9 * offSeconds / spans, 1.0e9 * loopSeconds / spans);
+
+	// The module-handle stages of the plugin around the needle steps, off and recording. The trace is left in
+	// needleTrace.json to be opened in Perfetto.
+	std::printf("%d needles, %d steps, %d worker thread(s)\n", count, steps, (int)pool.getWorkerCount());
+	std::printf("%10s %12s %10s %10s %10s\n", "tracing", "us/step", "events", "dropped", "file kB");
+	for (int on = 0; on < 2; on++)
+	{
+		std::vector<sSyntheticNeedle> needles(count);
+		for (int i = 0; i < count; i++)
+			needles[i].phase = 0.37f * i;
+		if (on)
+			traceStart(1 << 18);
+		start = benchClock::now();
+		for (int step = 0; step < steps; step++)
+		{
+			CTraceSpan stepSpan("moduleHandle");
+			{
+				CTraceSpan span("readSimState");
+				for (sSyntheticNeedle& needle : needles)
+					syntheticNeedleInput(needle, step * dt);
+			}
+			CTraceSpan span("compute");
+			pool.parallelFor(needles.size(), [&needles, &config](size_t i) {
+				CTraceSpan needleSpan("needle", "index", (int)i);
+				stepNeedle(needles[i].state, needles[i].input, config);
+			});
+		}
+		double seconds = secondsSince(start);
+		traceStop();
+		long kiB = 0;
+		if (on && traceWrite(path))
+		{
+			FILE* file = std::fopen(path, "rb");
+			if (file != NULL)
+			{
+				std::fseek(file, 0, SEEK_END);
+				kiB = std::ftell(file) / 1024;
+				std::fclose(file);
+			}
+		}
+		std::printf("%10s %12.2f %10d %10d %10ld\n", on ? "on" : "off", 1.0e6 * seconds / steps,
+			on ? (int)traceEventCount() : 0, on ? (int)traceDroppedCount() : 0, kiB);
+	}
+}
+
+// --------------------------------------------------------------------------------------
+// budget: the governor of stepBudget.h on passes that get 8 times heavier for a while, and a check that
+// f_ext and the punctures come out the same as without it.
+// --------------------------------------------------------------------------------------
+struct sBudgetPhase {
+	const char* name;
+	int needles;
+	int passes;
+};
+
+// One module-handle pass as the plugin runs it, with a busy wait standing in for the graph calls of V-REP.
+static double budgetPass(std::vector<sSyntheticNeedle>& needles, std::vector<LwrJoints>& joints, int active, int pass,
+	CStepBudget& budget, const sNeedleConfig& needleConfig, const sLwrChain& chain, const sLwrFrame& center)
+{
+	const double graphSeconds = 5.0e-6;				// Per needle, about a dozen simSetGraphUserData calls.
+	benchClock::time_point start = benchClock::now();
+	budget.beginPass();
+	sNeedleConfig config = needleConfig;
+	budget.degrade(config);
+	for (int i = 0; i < active; i++)
+	{
+		syntheticNeedleInput(needles[i], pass * 0.001f);
+		stepNeedle(needles[i].state, needles[i].input, config);
+		float angle = 2.0f * 3.14159265f * (pass + 25 * i) / 100.0f;
+		sLwrFrame target = center;
+		target.position += 0.05f * Vector3f(cosf(angle) - 1.0f, sinf(angle), 0.0f);
+		benchSink = benchSink + lwrInverseKinematics(chain, target, joints[i], config.ik).position_error;
+	}
+	if (budget.graphsDue())
+	{
+		benchClock::time_point graphs = benchClock::now();
+		while (secondsSince(graphs) < graphSeconds * active)
+			;
+	}
+	double seconds = secondsSince(start);
+	budget.endPass(seconds);
+	return seconds;
+}
+
+static void benchBudget()
+{
+	const sBudgetPhase phases[] = {
+		{ "light", 4, 1000 },
+		{ "heavy", 32, 1000 },
+		{ "light", 4, 1000 },
+	};
+	const int maxNeedles = 32;
+	sLwrChain chain = lwr4Chain();
+	sLwrFrame center = lwrForwardKinematics(chain, chain.posture);
+	sNeedleConfig needleConfig;
+	needleConfig.use_only_z_force_on_engine = false;
+
+	// The budget is just above a heavy pass with everything shed, so that the governor has to go deep.
+	double heavy[2];
+	for (int level = 0; level < 2; level++)
+	{
+		std::vector<sSyntheticNeedle> needles(maxNeedles);
+		std::vector<LwrJoints> joints(maxNeedles, chain.posture);
+		CStepBudget budget;
+		sStepBudgetSettings settings;
+		settings.budget = level ? 1.0e-9 : 0.0;
+		settings.shed_after = 1;
+		budget.configure(settings);
+		for (int pass = 0; pass < 50; pass++)
+			budgetPass(needles, joints, maxNeedles, pass, budget, needleConfig, chain, center);
+		heavy[level] = 0.0;
+		for (int pass = 50; pass < 250; pass++)
+			heavy[level] += budgetPass(needles, joints, maxNeedles, pass, budget, needleConfig, chain, center) / 200;
+	}
+	sStepBudgetSettings settings;
+	settings.budget = heavy[1] + 0.1 * (heavy[0] - heavy[1]);
+	std::printf("budget: heavy pass %.1f us with everything, %.1f us with everything shed, budget %.1f us\n",
+		1.0e6 * heavy[0], 1.0e6 * heavy[1], 1.0e6 * settings.budget);
+	std::printf("%8s %8s %12s %12s %10s %8s %8s %10s\n", "phase", "needles", "mean us", "max us", "overruns", "sheds", "restores", "level");
+
+	std::vector<Vector3f> reference, governed;
+	for (int run = 0; run < 2; run++)
+	{
+		std::vector<sSyntheticNeedle> needles(maxNeedles);
+		std::vector<LwrJoints> joints(maxNeedles, chain.posture);
+		for (int i = 0; i < maxNeedles; i++)
+			needles[i].phase = 0.37f * i;
+		CStepBudget budget;
+		sStepBudgetSettings runSettings = settings;
+		runSettings.budget = run ? settings.budget : 0.0;
+		budget.configure(runSettings);
+		std::vector<Vector3f>& forces = run ? governed : reference;
+		int pass = 0;
+		for (const sBudgetPhase& phase : phases)
+		{
+			sStepBudgetStatistics before = budget.getStatistics();
+			double total = 0.0, slowest = 0.0;
+			for (int i = 0; i < phase.passes; i++, pass++)
+			{
+				double seconds = budgetPass(needles, joints, phase.needles, pass, budget, needleConfig, chain, center);
+				total += seconds;
+				slowest = std::max(slowest, seconds);
+				for (int j = 0; j < phase.needles; j++)
+				{
+					forces.push_back(needles[j].state.f_ext);
+					forces.push_back(Vector3f((float)needles[j].state.punctures.size(), needles[j].state.full_penetration_length, 0.0f));
+				}
+			}
+			const sStepBudgetStatistics& after = budget.getStatistics();
+			if (run)
+				std::printf("%8s %8d %12.1f %12.1f %10d %8d %8d %10s\n", phase.name, phase.needles, 1.0e6 * total / phase.passes,
+					1.0e6 * slowest, (int)(after.overruns - before.overruns), (int)(after.sheds - before.sheds),
+					(int)(after.restores - before.restores), CStepBudget::levelName(budget.getLevel()));
+		}
+	}
+	std::printf("f_ext and punctures as without the governor: %s\n", (reference == governed) ? "yes" : "NO");
+	benchCheck(reference == governed, "f_ext and punctures as without the governor");
+}
+
+// --------------------------------------------------------------------------------------
+// precision: the float and double instantiations of punctureCore.h in the realtime path (a step of several
+// needles) and in the batch path (Monte Carlo insertions), next to the full model in float.
+// --------------------------------------------------------------------------------------
+template<typename Scalar> struct sSyntheticCoreNeedle {
+	sCoreState<Scalar> state;
+	sCoreInput<Scalar> input;
+	Scalar phase;
+};
+
+// syntheticNeedleInput() in the precision of the core.
+template<typename Scalar> static void syntheticCoreInput(sSyntheticCoreNeedle<Scalar>& needle, Scalar t)
+{
+	const Scalar amplitude = Scalar(0.035);
+	Scalar depth = amplitude * std::sin(Scalar(6) * t + needle.phase) + Scalar(0.02);
+	Scalar velocity = Scalar(6) * amplitude * std::cos(Scalar(6) * t + needle.phase);
+	needle.input.toolTipPoint = tVector3<Scalar>(Scalar(0), Scalar(0), -depth);
+	needle.input.needleVelocity = std::abs(velocity);
+	needle.input.contacts.clear();
+	for (const sSyntheticLayer& layer : syntheticLayers)
+	{
+		if (depth < Scalar(layer.depth))
+			break;
+		bool punctured = false;
+		for (const sCorePuncture<Scalar>& puncture : needle.state.punctures)
+			punctured = punctured || (puncture.handle == layer.handle);
+		if (punctured)
+			continue;
+		sTissueParameters tissue = tissueParameters(layer.name);
+		sCoreContact<Scalar> contact;
+		contact.handle = layer.handle;
+		contact.damping = Scalar(tissue.damping);
+		contact.puncture_force = Scalar(tissue.puncture_force);
+		contact.force = tVector3<Scalar>(Scalar(0), Scalar(0), Scalar(2));
+		contact.respondable = true;
+		needle.input.contacts.push_back(contact);
+		break;
+	}
+}
+
+template<typename Scalar> static double coreRealtime(int count, int steps, const sCoreSettings<Scalar>& settings, std::vector<double>& forces)
+{
+	const Scalar dt = Scalar(0.001);
+	std::vector<sSyntheticCoreNeedle<Scalar>> needles(count);
+	for (int i = 0; i < count; i++)
+		needles[i].phase = Scalar(0.37) * Scalar(i);
+	forces.clear();
+	benchClock::time_point start = benchClock::now();
+	for (int step = 0; step < steps; step++)
+	{
+		for (sSyntheticCoreNeedle<Scalar>& needle : needles)
+		{
+			syntheticCoreInput(needle, Scalar(step) * dt);
+			stepPunctureCore(needle.state, needle.input, settings);
+		}
+		forces.push_back((double)needles[0].state.f_ext_magnitude);
+	}
+	return secondsSince(start);
+}
+
+static void benchPrecision()
+{
+	const int count = 16;
+	const int steps = 20000;
+	const char* models[] = { "kelvin-voigt", "karnopp" };
+	std::printf("precision: realtime path, %d needles, %d steps\n", count, steps);
+	std::printf("%14s %16s %16s %16s %18s\n", "model", "full us/step", "float us/step", "double us/step", "max |f - d| [N]");
+	for (const char* model : models)
+	{
+		sNeedleConfig config;
+		config.use_only_z_force_on_engine = false;
+		config.force_model = model;
+		std::vector<sSyntheticNeedle> needles(count);
+		for (int i = 0; i < count; i++)
+			needles[i].phase = 0.37f * i;
+		benchClock::time_point start = benchClock::now();
+		for (int step = 0; step < steps; step++)
+		{
+			for (sSyntheticNeedle& needle : needles)
+			{
+				syntheticNeedleInput(needle, step * 0.001f);
+				stepNeedle(needle.state, needle.input, config);
+			}
+		}
+		double full = secondsSince(start);
+
+		sCoreSettings<float> floatSettings;
+		sCoreSettings<double> doubleSettings;
+		floatSettings.force_model = doubleSettings.force_model = (config.force_model == "karnopp") ? CORE_KARNOPP : CORE_KELVIN_VOIGT;
+		floatSettings.use_only_z_force_on_engine = doubleSettings.use_only_z_force_on_engine = false;
+		std::vector<double> floatForces, doubleForces;
+		double floatSeconds = coreRealtime(count, steps, floatSettings, floatForces);
+		double doubleSeconds = coreRealtime(count, steps, doubleSettings, doubleForces);
+		double difference = 0.0;
+		for (size_t i = 0; i < floatForces.size(); i++)
+			difference = std::max(difference, std::abs(floatForces[i] - doubleForces[i]));
+		std::printf("%14s %16.3f %16.3f %16.3f %18.3g\n", model, 1.0e6 * full / steps, 1.0e6 * floatSeconds / steps,
+			1.0e6 * doubleSeconds / steps, difference);
+	}
+
+	CThreadPool pool(CThreadPool::defaultWorkerCount());
+	const char* precisions[] = { "model", "float", "double" };
+	std::printf("precision: batch path, 1000 runs on %d thread(s)\n", (int)pool.getParticipantCount());
+	std::printf("%14s %10s %14s %16s\n", "model", "precision", "M steps/s", "mean peak [N]");
+	for (const char* model : models)
+	{
+		for (const char* precision : precisions)
+		{
+			sBatchSettings settings = defaultBatchSettings();
+			settings.runs = 1000;
+			settings.config.force_model = model;
+			settings.precision = precision;
+			sBatchSummary summary = runBatch(settings, pool, NULL);
+			std::printf("%14s %10s %14.2f %16.6f\n", model, precision, 1.0e-6 * summary.steps / summary.seconds, summary.peak_force.mean);
+		}
+	}
+}
+
+// --------------------------------------------------------------------------------------
+// hysteresis: a needle that dithers at the surface of the fat, with and without the hysteresis of the punctures.
+// Every entry and exit would set the respondable flag of the tissue in the scene.
+// --------------------------------------------------------------------------------------
+static void benchHysteresis()
+{
+	const float dt = 1.0e-3f;
+	const int steps = 10000;
+	const float stiffness = 200.0f;					// Of the fat surface, a contact of 0.05 mm reaches its threshold.
+	sPunctureHysteresis<float> off;
+	off.entry_margin = 0.0f;
+	off.exit_depth = 0.0f;
+	off.entry_steps = 1;
+	off.exit_steps = 1;
+	const sPunctureHysteresis<float> on;
+
+	std::printf("hysteresis: %d steps of a tip dithering 0.5 mm around the fat surface, then pulled out\n", steps);
+	std::printf("%6s %9s %9s %16s %14s %10s\n", "", "entries", "exits", "entries avoided", "exits avoided", "inside");
+	sPunctureEventCounts counts[2];
+	for (int run = 0; run < 2; run++)
+	{
+		sNeedleConfig config;
+		config.use_only_z_force_on_engine = false;
+		config.hysteresis = run ? on : off;
+		sSyntheticNeedle needle;
+		int inside = 0;
+		for (int step = 0; step < steps; step++)
+		{
+			float t = step * dt;
+			// A slow tremor with a fast jitter on top: the tip crosses the surface and the entry point many times.
+			// In the last second it is pulled out 5 mm.
+			float depth = 0.5e-3f * sinf(2.0f * 3.14159265f * 3.0f * t) + 0.05e-3f * sinf(2.0f * 3.14159265f * 170.0f * t);
+			float velocity = 0.5e-3f * 6.0f * 3.14159265f * cosf(2.0f * 3.14159265f * 3.0f * t);
+			if (step >= steps - 1000)
+			{
+				depth -= 5.0e-3f * (step - (steps - 1000)) / 1000.0f;
+				velocity -= 5.0e-3f;
+			}
+			needle.input.toolTipPoint = Vector3f(0.0f, 0.0f, -depth);
+			needle.input.needleAxis = Vector3f::UnitZ();
+			needle.input.needleVelocity = fabsf(velocity);
+			needle.input.needleAxialVelocity = velocity;
+			needle.input.needleLinearVelocity = Vector3f(0.0f, 0.0f, -velocity);
+			needle.input.commandedTip = needle.input.toolTipPoint;
+			needle.input.dt = dt;
+			needle.input.contacts.clear();
+			if (needle.state.punctures.empty() && (depth > 0.0f))
+			{
+				sContact contact;
+				contact.handle = 1;
+				contact.name = "Fat";
+				contact.tissue = tissueParameters(contact.name);
+				contact.force = Vector3f(0.0f, 0.0f, stiffness * depth);
+				contact.respondable = true;
+				needle.input.contacts.push_back(contact);
+			}
+			stepNeedle(needle.state, needle.input, config);
+			inside += needle.state.punctures.empty() ? 0 : 1;
+		}
+		const sPunctureEventCounts& events = needle.state.puncture_events;
+		std::printf("%6s %9d %9d %16d %14d %9.1f%%\n", run ? "on" : "off", (int)events.entries, (int)events.exits,
+			(int)events.entries_avoided, (int)events.exits_avoided, 100.0 * inside / steps);
+		counts[run] = events;
+	}
+	// With the hysteresis the dithering tip enters once and leaves once, when it is pulled out.
+	benchCheck((counts[1].entries == 1) && (counts[1].exits == 1), "one entry and one exit with the hysteresis");
+	benchCheck(counts[1].entries < counts[0].entries, "fewer entries with the hysteresis");
+}
+
+// --------------------------------------------------------------------------------------
+// contacts: clustering the contacts of a step by tissue, for a rotated tip and up to 20 contacts (the most the
+// plugin reads), checked against projecting every contact on its own.
+// --------------------------------------------------------------------------------------
+static void benchContacts()
+{
+	const int steps = 100000;
+	const int counts[] = { 1, 4, 8, 20 };
+	const char* names[] = { "Fat", "muscle", "lung", "bone" };
+	sNeedleConfig config;
+	config.use_only_z_force_on_engine = true;
+	std::printf("contacts: ns per step of clusterContacts() and checkContacts(), tissues in turn\n");
+	std::printf("%9s %9s %12s %22s\n", "contacts", "tissues", "ns/step", "max error vs single");
+	for (int count : counts)
+	{
+		sNeedleState state;
+		sNeedleStepInput input;
+		input.tipRotation = AngleAxisf(0.3f, Vector3f(1.0f, 2.0f, 3.0f).normalized()).toRotationMatrix();
+		for (int i = 0; i < count; i++)
+		{
+			sContact contact;
+			contact.handle = 1 + i % 4;
+			contact.name = names[i % 4];
+			contact.tissue = tissueParameters(contact.name);
+			// Below the thresholds, nothing is punctured and the clusters stay the same every step.
+			contact.force = 1.0e-3f * Vector3f(0.1f * i, -0.2f, 1.0f + 0.05f * i);
+			contact.respondable = true;
+			input.contacts.push_back(contact);
+		}
+		benchClock::time_point start = benchClock::now();
+		for (int step = 0; step < steps; step++)
+		{
+			clusterContacts(state, input);
+			checkContacts(state, input, config);
+		}
+		double seconds = secondsSince(start);
+
+		float error = 0.0f;
+		for (const sContactCluster<float>& cluster : state.contact_clusters)
+		{
+			Vector3f tip = Vector3f::Zero();
+			for (const sContact& contact : input.contacts)
+			{
+				// Components along the axes of the tip, which are the columns of tipRotation in the world.
+				if (contact.handle == cluster.handle)
+					tip += Vector3f(input.tipRotation.col(0).dot(contact.force), input.tipRotation.col(1).dot(contact.force),
+						input.tipRotation.col(2).dot(contact.force));
+			}
+			error = std::max(error, (tip - cluster.tip_force).norm());
+			error = std::max(error, std::abs(tip.z() - cluster.axial));
+		}
+		std::printf("%9d %9d %12.1f %22.3g\n", count, (int)state.contact_clusters.size(), 1.0e9 * seconds / steps, error);
+	}
+
+	// A tip turned 90 degrees about x points its z axis along world -y: a push along world y is axial, against z.
+	// The rotation comes from the object matrix as simGetObjectMatrix writes it, the way the plugin reads it.
+	const float objectMatrix[12] = {
+		1.0f, 0.0f, 0.0f, 0.1f,
+		0.0f, 0.0f, -1.0f, 0.2f,
+		0.0f, 1.0f, 0.0f, 0.3f,
+	};
+	sNeedleState state;
+	sNeedleStepInput input;
+	input.tipRotation = simObjectMatrix2Frame(objectMatrix).rotation;
+	sContact contact;
+	contact.handle = 1;
+	contact.name = "Fat";
+	contact.tissue = tissueParameters(contact.name);
+	contact.force = Vector3f(0.0f, 1.0e-3f, 0.0f);
+	contact.respondable = true;
+	input.contacts.push_back(contact);
+	clusterContacts(state, input);
+	const sContactCluster<float>& cluster = state.contact_clusters.front();
+	bool known = (fabsf(cluster.axial + 1.0e-3f) < 1.0e-6f) && (cluster.lateral < 1.0e-6f) && (fabsf(tipAxialForce(input.tipRotation, contact.force) + 1.0e-3f) < 1.0e-6f);
+	std::printf("tip turned 90 deg about x, 1 mN along world y: axial %.3f mN, lateral %.3f mN (expected -1, 0): %s\n",
+		1.0e3f * cluster.axial, 1.0e3f * cluster.lateral, known ? "ok" : "WRONG");
+	benchCheck(known, "forces of a known tip rotation in the tip frame");
+}
+
+// --------------------------------------------------------------------------------------
+
+struct sBenchmark {
+	const char* name;
+	void(*run)();
+};
+
+static const sBenchmark benchmarks[] = {
+	{ "multi_needle", benchMultiNeedle },
+	{ "batch", benchBatch },
+	{ "prony", benchProny },
+	{ "lugre", benchLuGre },
+	{ "shaft", benchShaft },
+	{ "simd", benchSimd },
+	{ "bevel", benchBevel },
+	{ "beam", benchBeam },
+	{ "ik", benchIk },
+	{ "fixture", benchFixture },
+	{ "passivity", benchPassivity },
+	{ "haptics", benchHaptics },
+	{ "extrapolation", benchExtrapolation },
+	{ "sdf", benchSdf },
+	{ "volume", benchVolume },
+	{ "router", benchRouter },
+	{ "checkpoint", benchCheckpoint },
+	{ "trace", benchTrace },
+	{ "budget", benchBudget },
+	{ "precision", benchPrecision },
+	{ "hysteresis", benchHysteresis },
+	{ "contacts", benchContacts },
+};
+
+int main(int argc, char* argv[])
+{
+	bool found = false;
+	for (const sBenchmark& benchmark : benchmarks)
+	{
+		if ((argc > 1) && (std::strcmp(argv[1], benchmark.name) != 0))
+			continue;
+		found = true;
+		benchmark.run();
+		std::printf("\n");
+	}
+	if (!found)
+	{
+		std::printf("Unknown benchmark '%s'. Available:", argv[1]);
+		for (const sBenchmark& benchmark : benchmarks)
+			std::printf(" %s", benchmark.name);
+		std::printf("\n");
+		return 1;
+	}
+	if (benchFailures > 0)
+	{
+		std::printf("%d self-check(s) FAILED\n", benchFailures);
+		return 1;
+	}
+	return 0;
+}
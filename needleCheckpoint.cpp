@@ -0,0 +1,348 @@
+// Peter: Checkpoints of the needle state. See needleCheckpoint.h.
+
+#include "needleCheckpoint.h"
+
+#include <cstring>
+
+using namespace Eigen;
+
+CCheckpointWriter::CCheckpointWriter(std::string& blob)
+	: _blob(blob)
+{
+}
+
+void CCheckpointWriter::write(const void* data, size_t size)
+{
+	_blob.append((const char*)data, size);
+}
+
+void CCheckpointWriter::string(const std::string& value)
+{
+	this->value((uint32_t)value.size());
+	write(value.data(), value.size());
+}
+
+CCheckpointReader::CCheckpointReader(const std::string& blob, size_t offset)
+	: _blob(blob), _offset(offset), _ok(offset <= blob.size())
+{
+}
+
+bool CCheckpointReader::_fits(size_t count, size_t size)
+{
+	if (!_ok || ((size != 0) && (count > (_blob.size() - _offset) / size)))
+		return _fail();
+	return true;
+}
+
+bool CCheckpointReader::_fail()
+{
+	_ok = false;
+	return false;
+}
+
+bool CCheckpointReader::read(void* data, size_t size)
+{
+	if (!_fits(size, 1))
+		return false;
+	if (size > 0)
+		std::memcpy(data, _blob.data() + _offset, size);
+	_offset += size;
+	return true;
+}
+
+bool CCheckpointReader::string(std::string& value)
+{
+	uint32_t size = 0;
+	if (!this->value(size) || !_fits(size, 1))
+		return false;
+	value.assign(_blob.data() + _offset, size);
+	_offset += size;
+	return true;
+}
+
+bool CCheckpointReader::ok() const
+{
+	return _ok;
+}
+
+size_t CCheckpointReader::offset() const
+{
+	return _offset;
+}
+
+static void savePuncture(CCheckpointWriter& writer, const sPuncture& puncture)
+{
+	writer.value((int32_t)puncture.handle);
+	writer.dense(puncture.position);
+	writer.dense(puncture.direction);
+	writer.string(puncture.name);
+	writer.value(puncture.penetration_length);
+	writer.value(puncture.path_length);
+	writer.value((int32_t)puncture.exit_steps);
+}
+
+static bool restorePuncture(CCheckpointReader& reader, sPuncture& puncture)
+{
+	int32_t handle = 0;
+	int32_t exitSteps = 0;
+	reader.value(handle);
+	reader.dense(puncture.position);
+	reader.dense(puncture.direction);
+	reader.string(puncture.name);
+	reader.value(puncture.penetration_length);
+	reader.value(puncture.path_length);
+	reader.value(exitSteps);
+	puncture.handle = handle;
+	puncture.exit_steps = exitSteps;
+	puncture.tissue = tissueParameters(puncture.name);
+	return reader.ok();
+}
+
+static void saveContact(CCheckpointWriter& writer, const sContact& contact)
+{
+	writer.value((int32_t)contact.handle);
+	writer.string(contact.name);
+	writer.dense(contact.force);
+	writer.value((uint8_t)contact.respondable);
+}
+
+static bool restoreContact(CCheckpointReader& reader, sContact& contact)
+{
+	int32_t handle = 0;
+	uint8_t respondable = 0;
+	reader.value(handle);
+	reader.string(contact.name);
+	reader.dense(contact.force);
+	reader.value(respondable);
+	contact.handle = handle;
+	contact.respondable = (respondable != 0);
+	contact.tissue = tissueParameters(contact.name);
+	return reader.ok();
+}
+
+static void saveShaftLayer(CCheckpointWriter& writer, const sShaftLayer& layer)
+{
+	writer.value(layer.begin);
+	writer.value(layer.end);
+	writer.dense(layer.entry);
+	writer.dense(layer.direction);
+	writer.value(layer.friction);
+	writer.value(layer.damping);
+	writer.value(layer.lateral_stiffness);
+}
+
+static bool restoreShaftLayer(CCheckpointReader& reader, sShaftLayer& layer)
+{
+	reader.value(layer.begin);
+	reader.value(layer.end);
+	reader.dense(layer.entry);
+	reader.dense(layer.direction);
+	reader.value(layer.friction);
+	reader.value(layer.damping);
+	reader.value(layer.lateral_stiffness);
+	return reader.ok();
+}
+
+// Lists of structs with strings or Eigen members, one save/restore function per element.
+template<typename T> static void saveList(CCheckpointWriter& writer, const std::vector<T>& list,
+	void(*save)(CCheckpointWriter&, const T&))
+{
+	writer.value((uint32_t)list.size());
+	for (const T& element : list)
+		save(writer, element);
+}
+
+template<typename T> static bool restoreList(CCheckpointReader& reader, std::vector<T>& list,
+	bool(*restore)(CCheckpointReader&, T&))
+{
+	uint32_t count = 0;
+	if (!reader.value(count))
+		return false;
+	list.clear();
+	for (uint32_t i = 0; i < count; i++)
+	{
+		T element;
+		if (!restore(reader, element))
+			return false;
+		list.push_back(element);
+	}
+	return true;
+}
+
+/**
+* @brief Append the state of a needle, see needleCheckpoint.h
+*/
+void saveNeedleState(CCheckpointWriter& writer, const sNeedleState& state)
+{
+	saveList(writer, state.punctures, savePuncture);
+	writer.values(state.puncture_candidates);
+	writer.value(state.puncture_events);
+	writer.value((uint8_t)state.virtual_fixture);
+	writer.value(state.full_penetration_length);
+	writer.value(state.f_ext_magnitude);
+	writer.value(state.lwr_tip_engine_force_magnitude);
+	writer.dense(state.lwr_tip_enging_force);
+	writer.dense(state.f_ext);
+	writer.dense(state.f_device);
+	writer.value(state.passivity.energy);
+	writer.value(state.passivity.dissipated);
+	writer.value(state.passivity.damping);
+	writer.dense(state.passivity.last_force);
+	writer.dense(state.passivity.last_velocity);
+	writer.value(state.model_force);
+	writer.value(state.history);
+	writer.value(state.snapshot);
+
+	writer.dense(state.prony.q);
+	writer.dense(state.prony.alpha);
+	writer.dense(state.prony.gain);
+	writer.dense(state.prony.equilibrium);
+	writer.dense(state.prony.previous);
+	writer.dense(state.prony.penetration);
+	writer.values(state.prony.terms);
+	writer.value(state.prony.dt);
+
+	writer.dense(state.lugre.z);
+	writer.dense(state.lugre.sigma0);
+	writer.dense(state.lugre.sigma1);
+	writer.dense(state.lugre.sigma2);
+	writer.dense(state.lugre.coulomb_force);
+	writer.dense(state.lugre.static_force);
+	writer.dense(state.lugre.stribeck_velocity);
+	writer.dense(state.lugre.penetration);
+
+	saveList(writer, state.shaft_layers, saveShaftLayer);
+	writer.dense(state.shaft_lateral_force);
+
+	// The beam matrices follow from its size, only the last solution is kept.
+	writer.value((int32_t)state.beam.elements);
+	writer.value(state.beam.length);
+	writer.value(state.beam.bending_stiffness);
+	writer.dense(state.beam.displacement);
+	writer.dense(state.bending.tip_deflection);
+	writer.dense(state.bending.tissue_force);
+
+	writer.dense(state.bevel.position);
+	writer.dense(state.bevel.frame);
+	writer.value(state.bevel.arc_length);
+	writer.dense(state.bevel.rigid_tip);
+	writer.dense(state.bevel.rigid_bevel);
+	writer.values(state.bevel.path);
+
+	writer.value((uint8_t)state.fixture.active);
+	writer.dense(state.fixture.centre);
+	writer.dense(state.fixture.axis);
+	writer.dense(state.fixture.force);
+	writer.dense(state.fixture.projected);
+	writer.value(state.fixture.lateral_error);
+	writer.value(state.fixture.depth);
+
+	writer.values(state.volume_segments);
+	saveList(writer, state.volume_contacts, saveContact);
+}
+
+/**
+* @brief Read a state written by saveNeedleState(), see needleCheckpoint.h
+* @param state: only changed if the whole state could be read
+*/
+bool restoreNeedleState(CCheckpointReader& reader, sNeedleState& state)
+{
+	// Read into a copy, so that a blob that is cut short leaves the needle as it was.
+	sNeedleState restored = state;
+	restored.new_punctures.clear();
+	restored.exited_punctures.clear();
+	uint8_t flag = 0;
+
+	restoreList(reader, restored.punctures, restorePuncture);
+	reader.values(restored.puncture_candidates);
+	reader.value(restored.puncture_events);
+	reader.value(flag);
+	restored.virtual_fixture = (flag != 0);
+	reader.value(restored.full_penetration_length);
+	reader.value(restored.f_ext_magnitude);
+	reader.value(restored.lwr_tip_engine_force_magnitude);
+	reader.dense(restored.lwr_tip_enging_force);
+	reader.dense(restored.f_ext);
+	reader.dense(restored.f_device);
+	reader.value(restored.passivity.energy);
+	reader.value(restored.passivity.dissipated);
+	reader.value(restored.passivity.damping);
+	reader.dense(restored.passivity.last_force);
+	reader.dense(restored.passivity.last_velocity);
+	reader.value(restored.model_force);
+	reader.value(restored.history);
+	reader.value(restored.snapshot);
+
+	reader.dense(restored.prony.q);
+	reader.dense(restored.prony.alpha);
+	reader.dense(restored.prony.gain);
+	reader.dense(restored.prony.equilibrium);
+	reader.dense(restored.prony.previous);
+	reader.dense(restored.prony.penetration);
+	reader.values(restored.prony.terms);
+	reader.value(restored.prony.dt);
+
+	reader.dense(restored.lugre.z);
+	reader.dense(restored.lugre.sigma0);
+	reader.dense(restored.lugre.sigma1);
+	reader.dense(restored.lugre.sigma2);
+	reader.dense(restored.lugre.coulomb_force);
+	reader.dense(restored.lugre.static_force);
+	reader.dense(restored.lugre.stribeck_velocity);
+	reader.dense(restored.lugre.penetration);
+
+	restoreList(reader, restored.shaft_layers, restoreShaftLayer);
+	reader.dense(restored.shaft_lateral_force);
+
+	int32_t elements = 0;
+	float length = 0.0f, bendingStiffness = 0.0f;
+	MatrixXd displacement;
+	reader.value(elements);
+	reader.value(length);
+	reader.value(bendingStiffness);
+	reader.dense(displacement);
+	reader.dense(restored.bending.tip_deflection);
+	reader.dense(restored.bending.tissue_force);
+
+	reader.dense(restored.bevel.position);
+	reader.dense(restored.bevel.frame);
+	reader.value(restored.bevel.arc_length);
+	reader.dense(restored.bevel.rigid_tip);
+	reader.dense(restored.bevel.rigid_bevel);
+	reader.values(restored.bevel.path);
+
+	reader.value(flag);
+	restored.fixture.active = (flag != 0);
+	reader.dense(restored.fixture.centre);
+	reader.dense(restored.fixture.axis);
+	reader.dense(restored.fixture.force);
+	reader.dense(restored.fixture.projected);
+	reader.value(restored.fixture.lateral_error);
+	reader.value(restored.fixture.depth);
+
+	reader.values(restored.volume_segments);
+	restoreList(reader, restored.volume_contacts, restoreContact);
+
+	// The rows of the models are truncated and appended together, a blob with ragged rows is broken.
+	const sPronyState& prony = restored.prony;
+	const sLuGreState& lugre = restored.lugre;
+	int rows = prony.size();
+	bool pronyValid = (prony.q.rows() == rows) && (prony.alpha.rows() == rows) && (prony.gain.rows() == rows) &&
+		(prony.previous.size() == rows) && ((int)prony.terms.size() == rows);
+	rows = lugre.size();
+	bool lugreValid = (lugre.sigma0.size() == rows) && (lugre.sigma1.size() == rows) && (lugre.sigma2.size() == rows) &&
+		(lugre.coulomb_force.size() == rows) && (lugre.static_force.size() == rows) && (lugre.stribeck_velocity.size() == rows);
+	// The beam is only assembled for a displacement of its size, 2 dofs per node and one column per bending plane.
+	bool beamValid = (elements >= 0) && (elements <= CHECKPOINT_MAX_BEAM_ELEMENTS) &&
+		((elements == 0) || ((displacement.rows() == 2 * elements) && (displacement.cols() == 2)));
+	if (!reader.ok() || !pronyValid || !lugreValid || !beamValid)
+		return false;
+	if (elements > 0)
+	{
+		restored.beam.resize(elements, length, bendingStiffness);
+		restored.beam.displacement = displacement;
+		restored.beam.factorized = false;
+	}
+	state = restored;
+	return true;
+}
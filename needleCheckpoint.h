@@ -0,0 +1,108 @@
+// Peter: Checkpoints of the needle state, to branch many trials from one mid-insertion state.
+//
+// A checkpoint is a binary blob with everything a needle carries from one step to the next: the puncture
+// stack with its penetration lengths, the forces and the passivity observer, the extrapolation history, the
+// internal states of the Prony, LuGre, beam and bevel models, the virtual fixture and the CT volume runs.
+// The coefficients of the tissues are not stored, they are looked up by name again (tissueParameters()), and
+// nothing that is rebuilt every step (the shaft segments, the puncture events) is stored either.
+//
+// The blob is meant to be restored by the same build on the same machine: numbers are stored in the byte
+// order of the machine, the version is checked and every length is checked against the size of the blob.
+// Does not call V-REP, the plugin adds the poses of the scene objects (see CNeedleInstance::saveCheckpoint()).
+
+#pragma once
+
+#include <cstddef>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <Eigen/Core>
+
+#include "needleModel.h"
+
+const char CHECKPOINT_MAGIC[8] = { 'N', 'E', 'E', 'D', 'L', 'C', 'K', 'P' };
+const int32_t CHECKPOINT_VERSION = 3;					// 2: puncture hysteresis (punctureCore.h), 3: path of the bevel tip.
+const int32_t CHECKPOINT_MAX_BEAM_ELEMENTS = 10000;		// A blob with a longer beam is refused before the beam is assembled.
+
+// Appends plain values, strings and Eigen matrices to a blob.
+class CCheckpointWriter
+{
+public:
+	explicit CCheckpointWriter(std::string& blob);
+
+	void write(const void* data, size_t size);
+	void string(const std::string& value);
+
+	// Plain data only: numbers and structs of numbers.
+	template<typename T> void value(const T& value)
+	{
+		write(&value, sizeof(T));
+	}
+	template<typename T> void values(const std::vector<T>& values)
+	{
+		value((uint32_t)values.size());
+		write(values.data(), values.size() * sizeof(T));
+	}
+	template<typename Derived> void dense(const Eigen::PlainObjectBase<Derived>& matrix)
+	{
+		value((int32_t)matrix.rows());
+		value((int32_t)matrix.cols());
+		write(matrix.data(), matrix.size() * sizeof(typename Derived::Scalar));
+	}
+
+private:
+	std::string& _blob;
+};
+
+// Reads what CCheckpointWriter wrote. Once a read fails, all further reads fail and leave their target alone.
+class CCheckpointReader
+{
+public:
+	CCheckpointReader(const std::string& blob, size_t offset = 0);
+
+	bool read(void* data, size_t size);
+	bool string(std::string& value);
+	bool ok() const;
+	size_t offset() const;
+
+	template<typename T> bool value(T& value)
+	{
+		return read(&value, sizeof(T));
+	}
+	template<typename T> bool values(std::vector<T>& values)
+	{
+		uint32_t count = 0;
+		if (!value(count) || !_fits(count, sizeof(T)))
+			return false;
+		values.resize(count);
+		return read(values.data(), count * sizeof(T));
+	}
+	// Fails if the stored size does not fit the fixed dimensions of the matrix.
+	template<typename Derived> bool dense(Eigen::PlainObjectBase<Derived>& matrix)
+	{
+		int32_t rows = 0, cols = 0;
+		if (!value(rows) || !value(cols) || (rows < 0) || (cols < 0))
+			return _fail();
+		if (((Derived::RowsAtCompileTime != Eigen::Dynamic) && (rows != Derived::RowsAtCompileTime)) ||
+			((Derived::ColsAtCompileTime != Eigen::Dynamic) && (cols != Derived::ColsAtCompileTime)) ||
+			!_fits((size_t)rows * cols, sizeof(typename Derived::Scalar)))
+			return _fail();
+		matrix.resize(rows, cols);
+		return read(matrix.data(), matrix.size() * sizeof(typename Derived::Scalar));
+	}
+
+private:
+	bool _fits(size_t count, size_t size);
+	bool _fail();
+
+	const std::string& _blob;
+	size_t _offset;
+	bool _ok;
+};
+
+// Appends the state of a needle.
+void saveNeedleState(CCheckpointWriter& writer, const sNeedleState& state);
+// Reads a state written by saveNeedleState(). state is only changed if the whole state could be read.
+// The puncture events of the last step are cleared, the scene is expected to match the restored punctures.
+bool restoreNeedleState(CCheckpointReader& reader, sNeedleState& state);
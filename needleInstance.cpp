@@ -0,0 +1,613 @@
+// Peter: One simulated needle in the scene. See needleInstance.h.
+
+#include "needleInstance.h"
+
+#include <cstring>
+#include <iostream>
+
+#include "stepTracer.h"
+#include "v_repLib.h"
+
+using namespace Eigen;
+
+// CoppeliaSim object parameter IDs
+const int RESPONDABLE = 3004;                       // Object parameter id for toggling respondable.
+const int RESPONDABLE_MASK = 3019;                  // Object parameter id for toggling respondable mask.
+
+const std::string& CTissueRegistry::name(int handle)
+{
+	std::map<int, std::string>::iterator it = _names.find(handle);
+	if (it == _names.end())
+	{
+		simChar* name = simGetObjectName(handle);
+		it = _names.insert(std::make_pair(handle, std::string(name != NULL ? name : ""))).first;
+		if (name != NULL)
+			simReleaseBuffer(name);
+	}
+	return it->second;
+}
+
+void CTissueRegistry::acquire(int handle)
+{
+	if (isVolumeHandle(handle))
+		return;
+	int& count = _punctureCount[handle];
+	if (count++ == 0)
+		_pending.insert(std::make_pair(handle, true));
+}
+
+void CTissueRegistry::release(int handle)
+{
+	std::map<int, int>::iterator it = _punctureCount.find(handle);
+	if (it == _punctureCount.end())
+		return;
+	if (--it->second <= 0)
+	{
+		_punctureCount.erase(it);
+		_pending.insert(std::make_pair(handle, false));
+	}
+}
+
+void CTissueRegistry::flush()
+{
+	for (const std::pair<const int, bool>& tissue : _pending)
+	{
+		bool respondable = (_punctureCount.find(tissue.first) == _punctureCount.end());
+		if (respondable != tissue.second)
+			_setRespondable(tissue.first, respondable);
+		else
+			_statistics.writes_avoided++;
+	}
+	_pending.clear();
+}
+
+void CTissueRegistry::clearNames()
+{
+	_names.clear();
+}
+
+void CTissueRegistry::assign(const std::map<int, int>& punctureCount)
+{
+	flush();
+	for (const std::pair<const int, int>& tissue : _punctureCount)
+	{
+		if (punctureCount.find(tissue.first) == punctureCount.end())
+			_setRespondable(tissue.first, true);
+	}
+	std::map<int, int> counts;
+	for (const std::pair<const int, int>& tissue : punctureCount)
+	{
+		if (isVolumeHandle(tissue.first) || (tissue.second <= 0))
+			continue;
+		if (_punctureCount.find(tissue.first) == _punctureCount.end())
+			_setRespondable(tissue.first, false);
+		counts.insert(tissue);
+	}
+	_punctureCount.swap(counts);
+}
+
+const sTissueRegistryStatistics& CTissueRegistry::getStatistics() const
+{
+	return _statistics;
+}
+
+void CTissueRegistry::_setRespondable(int handle, bool respondable)
+{
+	simSetObjectIntParameter(handle, RESPONDABLE, respondable ? 1 : 0);
+	_statistics.writes++;
+}
+
+static Vector3f simObjectMatrix2EigenDirection(const float* objectMatrix)
+{
+	return Vector3f(objectMatrix[2], objectMatrix[6], objectMatrix[10]);
+}
+
+static int getSuffixedHandle(const std::string& name, const std::string& suffix)
+{
+	return simGetObjectHandle((name + suffix).c_str());
+}
+
+/**
+* @brief Look up an object of a needle and check its type.
+* @param type: sim_object_..._type the object must have, -1 for any.
+* @param consequence: what does not work without the object, for the report.
+* @return handle, -1 if the object is missing or has another type.
+*/
+static int bindObject(const std::string& name, const std::string& suffix, int type, const char* consequence,
+	std::vector<std::string>& problems)
+{
+	int handle = getSuffixedHandle(name, suffix);
+	if (handle == -1)
+	{
+		problems.push_back(name + suffix + " is missing: " + consequence);
+		return -1;
+	}
+	if ((type != -1) && (simGetObjectType(handle) != type))
+	{
+		problems.push_back(name + suffix + " has the wrong object type: " + consequence);
+		return -1;
+	}
+	return handle;
+}
+
+CNeedleInstance::CNeedleInstance()
+	: _dummyHandle(-1), _dummyToolTipHandle(-1), _phantomHandle(-1), _needleHandle(-1), _needleTipHandle(-1),
+	_extForceGraphHandle(-1), _lwrTipHandle(-1), _needleForceGraphHandle(-1), _armBound(false), _ikSolved(false),
+	_publishedSteps(0), _devicePoses(0)
+{
+	for (int i = 0; i < LWR_JOINTS; i++)
+	{
+		_jointHandles[i] = -1;
+		_jointForceMode[i] = false;
+	}
+	_jointPositions.setZero();
+}
+
+bool CNeedleInstance::bind(const std::string& suffix, int phantomHandle, std::vector<std::string>& problems)
+{
+	_suffix = suffix;
+	_phantomHandle = phantomHandle;
+	_needleHandle = bindObject("Needle", suffix, -1, "the needle is not simulated", problems);
+	_lwrTipHandle = bindObject("LWR_tip", suffix, sim_object_dummy_type, "the needle is not simulated", problems);
+	_dummyHandle = bindObject("Dummy_device", suffix, sim_object_dummy_type, "the force is not along the device", problems);
+	_dummyToolTipHandle = bindObject("Dummy_tool_tip", suffix, sim_object_dummy_type, "no native IK", problems);
+	_needleTipHandle = getSuffixedHandle("Needle_tip", suffix);
+	_extForceGraphHandle = bindObject("Force_Graph", suffix, sim_object_graph_type, "the forces are not plotted", problems);
+	_needleForceGraphHandle = bindObject("Needle_force_graph", suffix, sim_object_graph_type, "the tip force is not plotted", problems);
+	_bindArm(problems);
+	return (_needleHandle != -1) && (_lwrTipHandle != -1);
+}
+
+void CNeedleInstance::start()
+{
+	_state.reset();
+	_ikSolved = false;
+	if (_armBound)
+		_readArm();
+}
+
+/**
+* @brief Resolve the joints of the LWR, LWR_joint1 ... LWR_joint7 with the needle's suffix.
+* @return false if the arm is not complete, the native IK is then not available for this needle.
+*/
+bool CNeedleInstance::_bindArm(std::vector<std::string>& problems)
+{
+	_armBound = false;
+	_ikSolved = false;
+	std::vector<std::string> jointProblems;
+	for (int i = 0; i < LWR_JOINTS; i++)
+		_jointHandles[i] = bindObject("LWR_joint" + std::to_string(i + 1), _suffix, sim_object_joint_type, "no native IK", jointProblems);
+	// A needle without an arm is one problem, not one per joint.
+	if (jointProblems.size() == LWR_JOINTS)
+		problems.push_back("LWR_joint1" + _suffix + " ... LWR_joint" + std::to_string(LWR_JOINTS) + _suffix + " are missing: no native IK");
+	else
+		problems.insert(problems.end(), jointProblems.begin(), jointProblems.end());
+	_armBound = jointProblems.empty() && (_dummyToolTipHandle != -1);
+	return _armBound;
+}
+
+/**
+* @brief Read the geometry of the chain between the joints of the LWR. Done once at simulation start,
+*        the geometry does not change during the simulation. The tool frame is where Dummy_tool_tip is now,
+*        so the arm does not jump when the native IK takes over.
+*/
+void CNeedleInstance::_readArm()
+{
+	// The matrix of a joint does not contain its own rotation, only that of the joints before it.
+	float objectMatrix[12];
+	sLwrFrame rotated[LWR_JOINTS];
+	for (int i = 0; i < LWR_JOINTS; i++)
+	{
+		simGetObjectMatrix(_jointHandles[i], -1, objectMatrix);
+		sLwrFrame joint = simObjectMatrix2Frame(objectMatrix);
+		float position;
+		simGetJointPosition(_jointHandles[i], &position);
+		_jointPositions(i) = position;
+		if (i == 0)
+			_chain.base = joint;
+		else
+			_chain.links[i - 1] = rotated[i - 1].inverse() * joint;
+		rotated[i] = joint;
+		rotated[i].rotation = joint.rotation * AngleAxisf(position, Vector3f::UnitZ()).toRotationMatrix();
+
+		simBool cyclic;
+		float interval[2];
+		if ((simGetJointInterval(_jointHandles[i], &cyclic, interval) != -1) && !cyclic)
+		{
+			_chain.lower(i) = interval[0];
+			_chain.upper(i) = interval[0] + interval[1];
+		}
+		else
+		{
+			_chain.lower(i) = -1.0e6f;
+			_chain.upper(i) = 1.0e6f;
+		}
+		int mode;
+		_jointForceMode[i] = ((simGetJointMode(_jointHandles[i], &mode) != -1) && (mode == sim_jointmode_force));
+	}
+	simGetObjectMatrix(_dummyToolTipHandle, -1, objectMatrix);
+	_chain.tool = rotated[LWR_JOINTS - 1].inverse() * simObjectMatrix2Frame(objectMatrix);
+	_chain.posture = _jointPositions;
+}
+
+const std::string& CNeedleInstance::getSuffix() const
+{
+	return _suffix;
+}
+
+const sNeedleState& CNeedleInstance::getState() const
+{
+	return _state;
+}
+
+const sIkResult& CNeedleInstance::getIkResult() const
+{
+	return _ikResult;
+}
+
+bool CNeedleInstance::hasArm() const
+{
+	return _armBound;
+}
+
+std::vector<CNeedleInstance> CNeedleInstance::discover(int phantomHandle, std::vector<std::string>& problems)
+{
+	// A needle exists if its "Needle" object does, the copies are numbered without gaps.
+	std::vector<CNeedleInstance> needles;
+	for (int i = -1; ; i++)
+	{
+		std::string suffix = (i < 0) ? "" : "#" + std::to_string(i);
+		if (getSuffixedHandle("Needle", suffix) == -1)
+			break;
+		CNeedleInstance needle;
+		if (needle.bind(suffix, phantomHandle, problems))
+			needles.push_back(needle);
+	}
+	return needles;
+}
+
+/**
+* @brief Add the field of a tissue with its current pose to the step input, once per tissue.
+*/
+void CNeedleInstance::_addTissueField(int handle, const std::map<int, std::shared_ptr<CTissueSdf> >& tissueFields)
+{
+	std::map<int, std::shared_ptr<CTissueSdf> >::const_iterator it = tissueFields.find(handle);
+	if ((it == tissueFields.end()) || (findTissueField(_input, handle) != NULL))
+		return;
+	float objectMatrix[12];
+	simGetObjectMatrix(handle, -1, objectMatrix);
+	sLwrFrame frame = simObjectMatrix2Frame(objectMatrix);
+	sTissueField field;
+	field.handle = handle;
+	field.sdf = it->second.get();
+	field.rotation = frame.rotation;
+	field.position = frame.position;
+	_input.fields.push_back(field);
+}
+
+/**
+* @brief Read everything the step needs from the scene. Main thread only.
+* @param tissues: tissues of the scene, caches their names.
+* @param tissueFields: signed distance fields of the tissues, empty if they are not used.
+* @param volume: CT volume of the phantom and the pose of the phantom in this step, see tissueVolume.h.
+*/
+void CNeedleInstance::readSimState(CTissueRegistry& tissues, const std::map<int, std::shared_ptr<CTissueSdf> >& tissueFields,
+	const sVolumeInput& volume)
+{
+	float needleTipPos[3];
+	simGetObjectPosition(_lwrTipHandle, -1, needleTipPos);
+	_input.toolTipPoint = Vector3f(needleTipPos[0], needleTipPos[1], needleTipPos[2]);
+
+	simFloat needleVelocities[3];
+	if (simGetObjectVelocity(_lwrTipHandle, needleVelocities, NULL) == -1)			// To add Low-pass filter, I think a good place to add it would be here.
+		std::cerr << "Needle tip velocity retrieval failed" << std::endl;
+	_input.needleLinearVelocity = Vector3f(needleVelocities[0], needleVelocities[1], needleVelocities[2]);
+	_input.needleVelocity = _input.needleLinearVelocity.norm();
+	_input.dt = simGetSimulationTimeStep();
+
+	float objectMatrix[12];
+	simGetObjectMatrix(_lwrTipHandle, -1, objectMatrix);
+	_input.needleDirection = simObjectMatrix2EigenDirection(objectMatrix);
+	_input.tipRotation = simObjectMatrix2Frame(objectMatrix).rotation;
+
+	simGetObjectMatrix(_needleHandle, -1, objectMatrix);
+	_input.needleAxis = simObjectMatrix2EigenDirection(objectMatrix);
+	_input.needleAxialVelocity = -_input.needleAxis.dot(Vector3f(needleVelocities[0], needleVelocities[1], needleVelocities[2]));
+
+	if (_dummyHandle != -1)
+	{
+		simGetObjectMatrix(_dummyHandle, -1, objectMatrix);
+		_input.dummyDirection = simObjectMatrix2EigenDirection(objectMatrix);
+	}
+
+	_input.contacts.clear();
+	for (int a = 0; a<20; a++)
+	{
+		simInt contactHandles[2];
+		simFloat contactInfo[6];
+		if (simGetContactInfo(sim_handle_all, _needleHandle, a, contactHandles, contactInfo) <= 0)
+			break;
+		if (contactHandles[1] < 1000)
+		{
+			sContact contact;
+			contact.handle = contactHandles[1];
+			contact.force = Vector3f(contactInfo[3], contactInfo[4], contactInfo[5]);
+			int respondableValue;
+			simGetObjectIntParameter(contact.handle, RESPONDABLE, &respondableValue);
+			contact.respondable = (respondableValue != 0 && _phantomHandle != -1 && simGetObjectParent(contact.handle) == _phantomHandle);
+			if (contact.respondable)
+			{
+				contact.name = tissues.name(contact.handle);
+				contact.tissue = tissueParameters(contact.name);
+			}
+			_input.contacts.push_back(contact);
+		}
+	}
+
+	_input.volume = volume;
+	_input.fields.clear();
+	for (const sPuncture& puncture : _state.punctures)
+		_addTissueField(puncture.handle, tissueFields);
+	for (const sContact& contact : _input.contacts)
+	{
+		if (contact.respondable)
+			_addTissueField(contact.handle, tissueFields);
+	}
+
+	_input.commandedTip = _input.toolTipPoint;
+	if (_dummyToolTipHandle != -1)
+	{
+		simGetObjectMatrix(_dummyToolTipHandle, -1, objectMatrix);
+		_ikTarget = simObjectMatrix2Frame(objectMatrix);
+		_input.commandedTip = _ikTarget.position;
+	}
+}
+
+/**
+* @brief Pure-compute part of the step. Does not call V-REP, safe to run on a worker thread.
+*/
+void CNeedleInstance::compute(const sNeedleConfig& config)
+{
+	{
+		CTraceSpan span("stepNeedle");
+		stepNeedle(_state, _input, config);
+	}
+
+	_ikSolved = config.native_ik && _armBound;
+	// The fixture only lets the arm follow the device along the insertion line.
+	if (_ikSolved && config.use_virtual_fixture && _state.fixture.active)
+		_ikTarget.position = _state.fixture.projected;
+	if (_ikSolved)
+	{
+		CTraceSpan span("inverseKinematics");
+		_ikResult = lwrInverseKinematics(_chain, _ikTarget, _jointPositions, config.ik);
+	}
+}
+
+/**
+* @brief Write the puncture events and the IK solution of the last step back to the scene. Main thread only.
+*/
+void CNeedleInstance::applySimState(CTissueRegistry& tissues)
+{
+	for (const sPuncture& puncture : _state.exited_punctures)
+	{
+		tissues.release(puncture.handle);
+		puncture.printPuncture(false);
+	}
+	for (const sPuncture& puncture : _state.new_punctures)
+	{
+		tissues.acquire(puncture.handle);
+		puncture.printPuncture(true);
+	}
+	if (_haptics)
+		_exchangeHaptics();
+	if (_ikSolved)
+	{
+		for (int i = 0; i < LWR_JOINTS; i++)
+		{
+			if (_jointForceMode[i])
+				simSetJointTargetPosition(_jointHandles[i], _jointPositions(i));
+			else
+				simSetJointPosition(_jointHandles[i], _jointPositions(i));
+		}
+	}
+}
+
+/**
+* @brief Append this needle to a checkpoint: its suffix, its state (see needleCheckpoint.h) and the poses of the
+*        objects that move it, Dummy_tool_tip, Dummy_device and the joints of the arm. Main thread only.
+*/
+void CNeedleInstance::saveCheckpoint(CCheckpointWriter& writer) const
+{
+	writer.string(_suffix);
+	saveNeedleState(writer, _state);
+	uint8_t objects = ((_dummyToolTipHandle != -1) ? 1 : 0) | ((_dummyHandle != -1) ? 2 : 0) | (_armBound ? 4 : 0);
+	writer.value(objects);
+	float objectMatrix[12];
+	if (_dummyToolTipHandle != -1)
+	{
+		simGetObjectMatrix(_dummyToolTipHandle, -1, objectMatrix);
+		writer.write(objectMatrix, sizeof(objectMatrix));
+	}
+	if (_dummyHandle != -1)
+	{
+		simGetObjectMatrix(_dummyHandle, -1, objectMatrix);
+		writer.write(objectMatrix, sizeof(objectMatrix));
+	}
+	if (_armBound)
+	{
+		LwrJoints joints;
+		for (int i = 0; i < LWR_JOINTS; i++)
+			simGetJointPosition(_jointHandles[i], &joints(i));
+		writer.dense(joints);
+	}
+}
+
+bool CNeedleInstance::readCheckpoint(CCheckpointReader& reader, sNeedleCheckpoint& checkpoint)
+{
+	uint8_t objects = 0;
+	if (!reader.string(checkpoint.suffix) || !restoreNeedleState(reader, checkpoint.state) || !reader.value(objects))
+		return false;
+	checkpoint.hasToolTip = ((objects & 1) != 0);
+	checkpoint.hasDevice = ((objects & 2) != 0);
+	checkpoint.hasArm = ((objects & 4) != 0);
+	if (checkpoint.hasToolTip)
+		reader.read(checkpoint.toolTip, sizeof(checkpoint.toolTip));
+	if (checkpoint.hasDevice)
+		reader.read(checkpoint.device, sizeof(checkpoint.device));
+	if (checkpoint.hasArm)
+		reader.dense(checkpoint.joints);
+	return reader.ok();
+}
+
+/**
+* @brief Continue from a checkpoint of this needle. Main thread only.
+*/
+void CNeedleInstance::restoreCheckpoint(const sNeedleCheckpoint& checkpoint)
+{
+	_state = checkpoint.state;
+	_ikSolved = false;
+	if (checkpoint.hasToolTip && (_dummyToolTipHandle != -1))
+		simSetObjectMatrix(_dummyToolTipHandle, -1, checkpoint.toolTip);
+	if (checkpoint.hasDevice && (_dummyHandle != -1))
+		simSetObjectMatrix(_dummyHandle, -1, checkpoint.device);
+	if (checkpoint.hasArm && _armBound)
+	{
+		_jointPositions = checkpoint.joints;
+		for (int i = 0; i < LWR_JOINTS; i++)
+		{
+			simSetJointPosition(_jointHandles[i], _jointPositions(i));
+			if (_jointForceMode[i])
+				simSetJointTargetPosition(_jointHandles[i], _jointPositions(i));
+		}
+	}
+}
+
+bool CNeedleInstance::openHapticChannel()
+{
+	if (_haptics)
+		return true;
+	std::shared_ptr<CHapticChannel> channel(new CHapticChannel());
+	if (!channel->create(_suffix))
+		return false;
+	_haptics = channel;
+	_publishedSteps = 0;
+	_devicePoses = 0;
+	return true;
+}
+
+void CNeedleInstance::closeHapticChannel()
+{
+	_haptics.reset();
+}
+
+/**
+* @brief Publish the force and the tip of this step to the haptic driver and move Dummy_device to the
+*        newest device pose, if the driver wrote one since the last step. Main thread only.
+*/
+void CNeedleInstance::_exchangeHaptics()
+{
+	sNeedlePublication publication;
+	std::memset(&publication, 0, sizeof(publication));
+	publication.step = ++_publishedSteps;
+	publication.sim_time = simGetSimulationTime();
+	for (int i = 0; i < 3; i++)
+		publication.force[i] = _state.f_device(i);
+	simGetObjectMatrix(_lwrTipHandle, -1, publication.tip_matrix);
+	publication.penetration = _state.full_penetration_length;
+	publication.punctures = (int32_t)_state.punctures.size();
+	publication.fixture_active = _state.fixture.active ? 1 : 0;
+	publication.snapshot = _state.snapshot;
+	publication.publish_ns = CHapticChannel::steadyNanoseconds();
+	_haptics->publishNeedle(publication);
+
+	sDevicePose pose;
+	_haptics->readDevice(pose);
+	if ((pose.count != _devicePoses) && (_dummyHandle != -1))
+		simSetObjectMatrix(_dummyHandle, -1, pose.matrix);
+	_devicePoses = pose.count;
+}
+
+// Graph streams of the tissues that have them.
+struct sGraphTissue {
+	const char* name;
+	const char* penetration;
+	const char* axial;								// Contact forces before the tissue is punctured.
+	const char* lateral;
+};
+
+static const sGraphTissue graphTissues[] = {
+	{ "Fat", "fat_penetration", "fat_axial_F", "fat_lateral_F" },
+	{ "muscle", "muscle_penetration", "muscle_axial_F", "muscle_lateral_F" },
+	{ "lung", "lung_penetration", "lung_axial_F", "lung_lateral_F" },
+	{ "bronchus", "bronchus_penetration", "bronchus_axial_F", "bronchus_lateral_F" },
+};
+
+static const sGraphTissue* graphTissue(const std::string& name)
+{
+	for (const sGraphTissue& tissue : graphTissues)
+	{
+		if (name == tissue.name)
+			return &tissue;
+	}
+	return NULL;
+}
+
+void CNeedleInstance::setForceGraph()
+{
+	if (_extForceGraphHandle != -1)
+	{
+		simSetGraphUserData(_extForceGraphHandle, "measured_F", _state.f_ext_magnitude);
+		simSetGraphUserData(_extForceGraphHandle, "device_F", _state.f_device.norm());
+		simSetGraphUserData(_extForceGraphHandle, "passivity_damping", _state.passivity.damping);
+		for (const sPuncture& puncture : _state.punctures)
+		{
+			const sGraphTissue* tissue = graphTissue(puncture.name);
+			if (tissue != NULL)
+				simSetGraphUserData(_extForceGraphHandle, tissue->penetration, puncture.penetration_length);
+		}
+		// Contact forces of the tissues that are touched but not punctured.
+		for (const sContactCluster<float>& cluster : _state.contact_clusters)
+		{
+			const sGraphTissue* tissue = cluster.respondable ? graphTissue(_contactName(cluster.first)) : NULL;
+			if (tissue == NULL)
+				continue;
+			simSetGraphUserData(_extForceGraphHandle, tissue->axial, cluster.axial);
+			simSetGraphUserData(_extForceGraphHandle, tissue->lateral, cluster.lateral);
+		}
+		simSetGraphUserData(_extForceGraphHandle, "full_penetration", _state.full_penetration_length);
+		if (_state.fixture.active)
+			simSetGraphUserData(_extForceGraphHandle, "fixture_error", _state.fixture.lateral_error);
+		if (_ikSolved)
+		{
+			simSetGraphUserData(_extForceGraphHandle, "ik_iterations", (float)_ikResult.iterations);
+			simSetGraphUserData(_extForceGraphHandle, "ik_solve_time", (float)(1.0e6 * _ikResult.seconds));
+		}
+	}
+	if (_needleForceGraphHandle != -1)
+	{
+		const Vector3f& extf = _state.tip_engine_force;
+		simSetGraphUserData(_needleForceGraphHandle, "x", extf(0));
+		simSetGraphUserData(_needleForceGraphHandle, "y", extf(1));
+		simSetGraphUserData(_needleForceGraphHandle, "z", extf(2));
+	}
+}
+
+// Name of the tissue of a contact of the last step, see clusterContacts().
+const std::string& CNeedleInstance::_contactName(int index) const
+{
+	if (index < (int)_input.contacts.size())
+		return _input.contacts[(size_t)index].name;
+	return _state.volume_contacts[(size_t)index - _input.contacts.size()].name;
+}
+
+void CNeedleInstance::reactivateTissues(CTissueRegistry& tissues)
+{
+	std::cout << "Needle" << _suffix << ": " << _state.punctures.size() << std::endl;
+	for (const sPuncture& puncture : _state.punctures) {
+		tissues.release(puncture.handle);
+		std::cout << "Reactivated respondable for object " << puncture.name << std::endl;
+	}
+	tissues.flush();
+	_state.reset();
+}
@@ -0,0 +1,153 @@
+// Peter: One simulated needle in the scene.
+//
+// Needles are discovered from the scene naming convention: the first needle uses the plain
+// object names ("Needle", "LWR_tip", "Dummy_device", ...), copies of the needle model use the
+// V-REP copy suffixes "#0", "#1", ... on all of its objects.
+//
+// The objects are bound when the scene is loaded or its content changes, not at simulation start:
+// bind() looks them up once, checks their types and reports every object that is missing. A needle
+// without its required objects is not simulated, a missing optional object switches off what it is
+// used for, so the step never calls V-REP with an invalid handle.
+//
+// A step is split in three phases so that the middle one can run on worker threads:
+// readSimState() and applySimState() call V-REP and must run on the main thread,
+// compute() only touches the instance's own data.
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include "hapticChannel.h"
+#include "needleCheckpoint.h"
+#include "needleModel.h"
+
+// Respondable flags the registry wrote, and the ones it did not have to write.
+struct sTissueRegistryStatistics {
+	uint64_t writes = 0;
+	uint64_t writes_avoided = 0;					// Tissues that were left and punctured again (or the other way round)
+													// before the flags were flushed.
+};
+
+// Tissues of one scene. Respondable is a property of the tissue, not of the needle: the registry counts how
+// many needles are inside each tissue so that it only becomes respondable again when the last one leaves.
+// The flags are written in flush(), once per step, and only for the tissues whose flag changed in the step,
+// so that the engine rebuilds a tissue at most once per step. It also caches the names of the tissues, so
+// that every tissue is only looked up once. Main thread only.
+class CTissueRegistry
+{
+public:
+	// Name of a tissue shape, looked up at the first call.
+	const std::string& name(int handle);
+	// A needle punctured/left a tissue. The tissues of the CT volume are no scene objects and are left alone.
+	void acquire(int handle);
+	void release(int handle);
+	// Writes the respondable flags changed by acquire() and release() since the last flush.
+	void flush();
+	// Forget the names, e.g. after the scene changed. The puncture counts stay.
+	void clearNames();
+	// Replaces the puncture counts of all tissues at once, e.g. when a checkpoint is restored. Only the
+	// tissues whose respondable flag changes are written.
+	void assign(const std::map<int, int>& punctureCount);
+	const sTissueRegistryStatistics& getStatistics() const;
+
+private:
+	void _setRespondable(int handle, bool respondable);
+
+	std::map<int, std::string> _names;
+	std::map<int, int> _punctureCount;
+	std::map<int, bool> _pending;					// Respondable flag in the scene of the tissues touched since the last flush.
+	sTissueRegistryStatistics _statistics;
+};
+
+// Needle read from a checkpoint, see CNeedleInstance::saveCheckpoint().
+struct sNeedleCheckpoint {
+	std::string suffix;
+	sNeedleState state;
+	bool hasToolTip = false;						// Pose of Dummy_tool_tip.
+	float toolTip[12];
+	bool hasDevice = false;							// Pose of Dummy_device.
+	float device[12];
+	bool hasArm = false;							// Positions of LWR_joint1 ... LWR_joint7.
+	LwrJoints joints = LwrJoints::Zero();
+};
+
+class CNeedleInstance
+{
+public:
+	CNeedleInstance();
+
+	// Resolves and validates the objects of the needle with the given name suffix, one line per missing or
+	// invalid object is appended to problems. Returns false if a required object is missing. Keeps the state,
+	// so that a needle can be bound again while it is simulated.
+	bool bind(const std::string& suffix, int phantomHandle, std::vector<std::string>& problems);
+	// Resets the state and reads the pose of the arm. At simulation start, does not look up any object.
+	void start();
+	const std::string& getSuffix() const;
+
+	// tissueFields: signed distance fields of the tissues by handle, see tissueSdf.h. volume: CT volume of the phantom.
+	void readSimState(CTissueRegistry& tissues, const std::map<int, std::shared_ptr<CTissueSdf> >& tissueFields,
+		const sVolumeInput& volume);
+	void compute(const sNeedleConfig& config);
+	void applySimState(CTissueRegistry& tissues);
+	void setForceGraph();
+	void reactivateTissues(CTissueRegistry& tissues);
+
+	// Appends the suffix, the state and the poses of the device dummies and of the arm to a checkpoint.
+	void saveCheckpoint(CCheckpointWriter& writer) const;
+	static bool readCheckpoint(CCheckpointReader& reader, sNeedleCheckpoint& checkpoint);
+	// Takes over the state and moves the dummies and the arm back. The tissues are left to the caller, so that
+	// the respondable flags of all needles are set at once (CTissueRegistry::assign()).
+	void restoreCheckpoint(const sNeedleCheckpoint& checkpoint);
+
+	// Shared memory to the haptic driver, see hapticChannel.h. Published in applySimState().
+	bool openHapticChannel();
+	void closeHapticChannel();
+
+	const sNeedleState& getState() const;
+	const sIkResult& getIkResult() const;
+	bool hasArm() const;
+
+	// Finds and binds all needles in the current scene, see bind().
+	static std::vector<CNeedleInstance> discover(int phantomHandle, std::vector<std::string>& problems);
+
+private:
+	bool _bindArm(std::vector<std::string>& problems);
+	void _readArm();
+	void _addTissueField(int handle, const std::map<int, std::shared_ptr<CTissueSdf> >& tissueFields);
+	void _exchangeHaptics();
+	const std::string& _contactName(int index) const;
+
+	std::string _suffix;
+
+	// Handles
+	int _dummyHandle;								// This is the handle of the dummy device. That is the virtual
+													// representation of the position of the haptic device in the scene.
+	int _dummyToolTipHandle;						// The tool tip dummy that is used to move the robot.
+	int _phantomHandle;
+	int _needleHandle;
+	int _needleTipHandle;
+	int _extForceGraphHandle;
+	int _lwrTipHandle;								// A dummy that is always connected to the needle tip.
+	int _needleForceGraphHandle;
+
+	sNeedleStepInput _input;
+	sNeedleState _state;
+
+	// LWR driven by the native IK solver. Joints are "LWR_joint1" ... "LWR_joint7" with the needle's suffix.
+	bool _armBound;									// All joints and Dummy_tool_tip are bound.
+	int _jointHandles[LWR_JOINTS];
+	bool _jointForceMode[LWR_JOINTS];				// Joint is in torque/force mode and is moved through its target position.
+	sLwrChain _chain;								// Read from the scene at simulation start.
+	sLwrFrame _ikTarget;							// Pose of Dummy_tool_tip.
+	LwrJoints _jointPositions;						// Last IK solution, start value of the next solve.
+	bool _ikSolved;									// The IK was solved in this step and should be applied.
+	sIkResult _ikResult;
+
+	std::shared_ptr<CHapticChannel> _haptics;		// Shared by the copies made during discovery, NULL if not published.
+	uint64_t _publishedSteps;
+	uint64_t _devicePoses;							// Count of the last device pose that was applied.
+};
@@ -0,0 +1,850 @@
+// Peter: Needle-tissue model that does not depend on V-REP. See needleModel.h.
+
+#include "needleModel.h"
+
+#include <algorithm>
+#include <iterator>
+#include <math.h>
+#include <iostream>
+
+#include "stepTracer.h"
+
+using namespace Eigen;
+
+void sPuncture::printPuncture(bool puncture) const
+{
+	if (puncture) {
+		std::cout << "New puncture: " << name << std::endl;
+	}
+	else {
+		std::cout << "Exit puncture: " << name << std::endl;
+	}
+	std::cout << "Position: " << position(0) << ", " << position(1) << ", " << position(2) << std::endl;
+	std::cout << "Direction: " << direction(0) << ", " << direction(1) << ", " << direction(2) << std::endl;
+}
+
+void sNeedleState::reset()
+{
+	punctures.clear();
+	puncture_candidates.clear();
+	puncture_events = sPunctureEventCounts();
+	new_punctures.clear();
+	exited_punctures.clear();
+	virtual_fixture = false;
+	full_penetration_length = 0.0f;
+	f_ext_magnitude = 0.0f;
+	lwr_tip_engine_force_magnitude = 0.0f;
+	lwr_tip_enging_force.setZero();
+	tip_engine_force.setZero();
+	contact_clusters.clear();
+	f_ext.setZero();
+	f_device.setZero();
+	passivity.reset();
+	model_force = 0.0f;
+	history.reset();
+	snapshot = sForceSnapshot();
+	prony.reset();
+	lugre.reset();
+	shaft_layers.clear();
+	shaft_lateral_force.setZero();
+	beam.reset();
+	bending = sBeamResult();
+	bevel = sBevelTip();
+	fixture.release();
+	volume_segments.clear();
+	volume_contacts.clear();
+}
+
+/**
+* @brief Check if a puncture is still active.
+* @param puncture: puncture
+* @param toolTipPoint: current position of the needle tip
+* @return 1 if still active, -1 if not.
+*/
+int checkSinglePuncture(const sPuncture& puncture, const Vector3f& toolTipPoint)
+{
+	return punctureSide(puncture.position, puncture.direction, toolTipPoint);
+}
+
+/**
+* @brief Calculate length of a puncture
+* @param puncture: puncture
+* @param toolTipPoint: current position of the needle tip
+* @return penetration distance of puncture. Value bellow zero means distance is "outside" of the tissue.
+*/
+float punctureLength(const sPuncture& puncture, const Vector3f& toolTipPoint)
+{
+	return punctureDepth(puncture.position, puncture.direction, toolTipPoint);
+}
+
+/**
+* @brief Length of a puncture along the curved path of a bevel-tip needle
+* @param puncture: puncture
+* @param bevel: tip on the curved path
+* @return arc length from the entry point to the tip. Value bellow zero means the tip is back "outside" of the tissue.
+*/
+float pathPunctureLength(const sPuncture& puncture, const sBevelTip& bevel)
+{
+	return bevel.arc_length - puncture.path_length;
+}
+
+/**
+* @brief Walk the curved path of a bevel-tip needle in chords, from a point of it to the tip
+* @param from: point of the path, e.g. the entry point of a puncture
+* @param fromArc: arc length of the path at from
+* @param chord: called with the ends of every chord
+*/
+template<typename Chord> static void forEachPathChord(const sBevelTip& bevel, const Vector3f& from, float fromArc, Chord chord)
+{
+	Vector3f previous = from;
+	for (const sBevelPathPoint& point : bevel.path)
+	{
+		if ((point.arc_length <= fromArc) || (point.arc_length >= bevel.arc_length))
+			continue;
+		chord(previous, point.position);
+		previous = point.position;
+	}
+	chord(previous, bevel.position);
+}
+
+/**
+* @brief Field of a tissue in this step
+* @return NULL if the tissue has none
+*/
+const sTissueField* findTissueField(const sNeedleStepInput& input, int handle)
+{
+	for (const sTissueField& field : input.fields)
+	{
+		if (field.handle == handle)
+			return &field;
+	}
+	return NULL;
+}
+
+/**
+* @brief Length of the shaft between the entry point and the tip that lies inside the tissue, see tissueSdf.h
+* @param field: field of the punctured tissue
+* @param puncture: puncture
+* @param toolTipPoint: current position of the needle tip
+*/
+float fieldPunctureLength(const sTissueField& field, const sPuncture& puncture, const Vector3f& toolTipPoint)
+{
+	// Once the tip is back behind the entry point, no part of the shaft is in the tissue. A puncture that was
+	// confirmed below the surface (sPunctureHysteresis) would otherwise keep the tissue between its entry and the surface.
+	if (checkSinglePuncture(puncture, toolTipPoint) < 0)
+		return 0.0f;
+	Matrix3f toShape = field.rotation.transpose();
+	return field.sdf->insideLength(toShape * (puncture.position - field.position), toShape * (toolTipPoint - field.position));
+}
+
+/**
+* @brief Length of the curved path of a bevel-tip needle between the entry point and the tip that lies inside the
+*        tissue, measured along the chords of the path, see bevelModel.h
+* @param field: field of the punctured tissue
+* @param puncture: puncture, entered on the path
+* @param bevel: tip on the curved path
+*/
+float fieldPathLength(const sTissueField& field, const sPuncture& puncture, const sBevelTip& bevel)
+{
+	// As fieldPunctureLength(): behind the entry point no part of the path is in the tissue.
+	if (pathPunctureLength(puncture, bevel) < 0.0f)
+		return 0.0f;
+	Matrix3f toShape = field.rotation.transpose();
+	float length = 0.0f;
+	forEachPathChord(bevel, puncture.position, puncture.path_length, [&](const Vector3f& from, const Vector3f& to) {
+		length += field.sdf->insideLength(toShape * (from - field.position), toShape * (to - field.position));
+	});
+	return length;
+}
+
+int volumeHandle(int label)
+{
+	return VOLUME_HANDLE_BASE - label;
+}
+
+bool isVolumeHandle(int handle)
+{
+	return handle <= VOLUME_HANDLE_BASE;
+}
+
+/**
+* @brief Length of the shaft inside a tissue of the CT volume, from the last marchVolume()
+* @param handle: volumeHandle() of the label
+*/
+float volumePunctureLength(const sNeedleState& state, int handle)
+{
+	float length = 0.0f;
+	for (const sVolumeSegment& segment : state.volume_segments)
+	{
+		if (volumeHandle(segment.label) == handle)
+			length += segment.end - segment.begin;
+	}
+	return length;
+}
+
+/**
+* @brief March the shaft through the CT volume, see tissueVolume.h. Fills state.volume_segments and, if the tip
+*        is in a tissue the needle has not punctured, state.volume_contacts with a contact that pushes the tip back.
+* @param curvedPath: the shaft follows state.bevel in chords from where its path starts, and is straight before
+*/
+void marchVolume(sNeedleState& state, const sNeedleStepInput& input, const sNeedleConfig& config, bool curvedPath)
+{
+	std::vector<sVolumeSegment>& segments = state.volume_segments;
+	segments.clear();
+	state.volume_contacts.clear();
+	const sVolumeInput& volume = input.volume;
+	if ((volume.volume == NULL) || (volume.tissues == NULL))
+		return;
+	Matrix3f toPhantom = volume.rotation.transpose();
+	float marched = config.shaft_length;
+	if (!curvedPath)
+	{
+		Vector3f shaftEnd = input.toolTipPoint + config.shaft_length * input.needleAxis;
+		volume.volume->march(toPhantom * (shaftEnd - volume.position), toPhantom * (input.toolTipPoint - volume.position), segments);
+	}
+	else
+	{
+		// The runs of the chords are put end to end, a run that goes on over the end of a chord is merged.
+		marched = 0.0f;
+		auto marchChord = [&](const Vector3f& from, const Vector3f& to) {
+			volume.volume->march(toPhantom * (from - volume.position), toPhantom * (to - volume.position), state.volume_chord);
+			for (const sVolumeSegment& run : state.volume_chord)
+			{
+				if (!segments.empty() && (segments.back().label == run.label) && (segments.back().end == marched + run.begin))
+					segments.back().end = marched + run.end;
+				else
+				{
+					sVolumeSegment segment = { run.label, marched + run.begin, marched + run.end };
+					segments.push_back(segment);
+				}
+			}
+			marched += (to - from).norm();
+		};
+		const sBevelTip& bevel = state.bevel;
+		Vector3f start = bevel.path.empty() ? bevel.position : bevel.path.front().position;
+		marchChord(start + std::max(config.shaft_length - bevel.arc_length, 0.0f) * input.needleAxis, start);
+		forEachPathChord(bevel, start, 0.0f, marchChord);
+	}
+	if (segments.empty() || (segments.back().end < marched))
+		return;
+
+	const sVolumeSegment& tip = state.volume_segments.back();
+	int handle = volumeHandle(tip.label);
+	for (const sPuncture& puncture : state.punctures)
+	{
+		if (puncture.handle == handle)
+			return;
+	}
+	sContact contact;
+	contact.handle = handle;
+	contact.name = volume.volume->labelName(tip.label);
+	contact.tissue = (tip.label < (int)volume.tissues->size()) ? (*volume.tissues)[tip.label] : tissueParameters(contact.name);
+	contact.force = config.volume_stiffness * (tip.end - tip.begin) * input.needleAxis;
+	contact.respondable = true;
+	state.volume_contacts.push_back(contact);
+}
+
+/**
+* @brief Length of a puncture measured in the field or the CT volume of its tissue
+* @param curvedPath: measure along the path of state.bevel instead of the straight shaft
+* @param length: receives the length
+* @return false if the tissue has neither
+*/
+static bool measuredPunctureLength(const sNeedleState& state, const sNeedleStepInput& input, const sPuncture& puncture, bool curvedPath,
+	float& length)
+{
+	if (isVolumeHandle(puncture.handle))
+	{
+		length = volumePunctureLength(state, puncture.handle);
+		return true;
+	}
+	const sTissueField* field = findTissueField(input, puncture.handle);
+	if (field == NULL)
+		return false;
+	length = curvedPath ? fieldPathLength(*field, puncture, state.bevel) : fieldPunctureLength(*field, puncture, input.toolTipPoint);
+	return true;
+}
+
+/**
+* @brief Check if the needle is still in the punctures. This is where full_penetration_length is incremented.
+*        Punctures the needle has left are moved to state.exited_punctures, after the exit hysteresis of
+*        config.hysteresis. A puncture of a tissue with a field or in the CT volume is left when no part of the
+*        shaft is inside it any more, the others use the entry plane.
+* @param curvedPath: the tip is at state.bevel.position and the shaft follows its path, see bevelModel.h
+*/
+void checkPunctures(sNeedleState& state, const sNeedleStepInput& input, const sNeedleConfig& config, bool curvedPath)
+{
+	std::vector<sPuncture>& punctures = state.punctures;
+	const Vector3f& toolTipPoint = curvedPath ? state.bevel.position : input.toolTipPoint;
+	// Iterate through punctures backwards, because if a puncture still is active, all punctures before will also still be active.
+	for (auto it = punctures.rbegin(); it != punctures.rend(); ++it)
+	{
+		float puncture_length;
+		bool signedLength = true;
+		if (measuredPunctureLength(state, input, *it, curvedPath, puncture_length))
+			signedLength = false;
+		else
+			puncture_length = punctureLength(*it, toolTipPoint);
+		bool active = !debouncePunctureExit(it->exit_steps, state.puncture_events, puncture_length, signedLength, config.hysteresis);
+		// If this puncture is still active, all punctures before it in the vector will be unchanged.
+		if (active)
+		{
+			// A puncture that is exiting counts with no length.
+			puncture_length = std::max(puncture_length, 0.0f);
+			state.full_penetration_length -= it->penetration_length;
+			state.full_penetration_length += puncture_length;
+			// This penetration length might have been updated, so update.
+			it->penetration_length = puncture_length;
+			// A field or the volume measures the shaft in the outer tissues too.
+			for (auto outer = std::next(it); outer != punctures.rend(); ++outer)
+			{
+				float outer_length;
+				if (!measuredPunctureLength(state, input, *outer, curvedPath, outer_length))
+					continue;
+				state.full_penetration_length -= outer->penetration_length;
+				outer->penetration_length = outer_length;
+				state.full_penetration_length += outer->penetration_length;
+			}
+			// Set punctures to be from the first puncture up until the current.
+			punctures.erase(it.base(), punctures.end());
+			return;
+		}
+		else {
+			// The needle isn't puncturing this tissue anymore. The tissue is set respondable again on the main thread.
+			state.full_penetration_length -= it->penetration_length;
+			state.exited_punctures.push_back(*it);
+			traceInstant("punctureExit", "handle", it->handle, it->name);
+		}
+
+	}
+	// No punctures had length > 0
+	punctures.clear();
+}
+
+/**
+* @brief Add new puncture to the punctures of a needle
+* @param state: state of the needle
+* @param input: scene data of this step
+* @param contact: contact with the tissue that was punctured
+* @param curvedPath: the tissue is entered at state.bevel.position, along the direction of the curved tip
+*/
+void addPuncture(sNeedleState& state, const sNeedleStepInput& input, const sContact& contact, bool curvedPath)
+{
+	sPuncture puncture;
+	puncture.position = curvedPath ? state.bevel.position : input.toolTipPoint;
+	puncture.direction = curvedPath ? Vector3f(-state.bevel.frame.col(2)) : input.needleAxis;
+	puncture.handle = contact.handle;
+	puncture.name = contact.name;
+	puncture.tissue = contact.tissue;
+	if (!measuredPunctureLength(state, input, puncture, curvedPath, puncture.penetration_length))
+		puncture.penetration_length = punctureLength(puncture, puncture.position);
+	puncture.path_length = state.bevel.arc_length;
+	puncture.exit_steps = 0;
+	state.full_penetration_length += puncture.penetration_length;
+	state.punctures.push_back(puncture);
+	state.new_punctures.push_back(puncture);
+	traceInstant("puncture", "handle", puncture.handle, puncture.name);
+}
+
+/**
+* @brief Project a force onto the z axis of the LWR tip.
+* @param tipRotation: rotation of the LWR tip
+* @param force: force in world coordinates
+*/
+float generalForce2NeedleTipZ(const Matrix3f& tipRotation, const Vector3f& force)
+{
+	return tipAxialForce(tipRotation, force);
+}
+
+/**
+* @brief Contact of the step with the given index: the contacts of the scene, then those of the CT volume
+*/
+static const sContact& stepContact(const sNeedleState& state, const sNeedleStepInput& input, int index)
+{
+	if (index < (int)input.contacts.size())
+		return input.contacts[(size_t)index];
+	return state.volume_contacts[(size_t)index - input.contacts.size()];
+}
+
+/**
+* @brief Sum the contacts of this step by tissue into state.contact_clusters and split the sums up in the frame of
+*        the LWR tip. The tissues of the CT volume the tip pushes into (see marchVolume()) count as contacts too.
+*/
+void clusterContacts(sNeedleState& state, const sNeedleStepInput& input)
+{
+	state.contact_clusters.clear();
+	int count = (int)(input.contacts.size() + state.volume_contacts.size());
+	for (int i = 0; i < count; i++)
+	{
+		const sContact& contact = stepContact(state, input, i);
+		clusterContact(state.contact_clusters, contact.handle, i, contact.force, contact.respondable);
+	}
+	projectContactClusters(state.contact_clusters, input.tipRotation);
+}
+
+/**
+* @brief Check if the contacts of a tissue result in a puncture, and add their force to the engine force on the tip
+*/
+static void checkContact(sNeedleState& state, const sNeedleStepInput& input, const sNeedleConfig& config, const sContactCluster<float>& cluster)
+{
+	const sContact& contact = stepContact(state, input, cluster.first);
+	float force_magnitude = config.use_only_z_force_on_engine ? cluster.axial : cluster.normal;
+	if (cluster.respondable)
+	{
+		state.lwr_tip_engine_force_magnitude += force_magnitude;
+		state.lwr_tip_enging_force += cluster.force;
+		state.tip_engine_force += cluster.tip_force;
+	}
+
+	// A tissue left in this step is entered again in the next step at the earliest.
+	bool left = false;
+	for (const sPuncture& puncture : state.exited_punctures)
+		left = left || (puncture.handle == cluster.handle);
+	if (cluster.respondable && !left && debouncePunctureEntry(state.puncture_candidates, state.puncture_events, cluster.handle,
+		force_magnitude, punctureThreshold(contact, config), config.hysteresis))
+	{
+		addPuncture(state, input, contact, config.needle_path == "bevel");
+	}
+}
+
+/**
+* @brief Check which tissues will be punctured, one cluster of contacts per tissue (see clusterContacts()).
+*/
+void checkContacts(sNeedleState& state, const sNeedleStepInput& input, const sNeedleConfig& config)
+{
+	state.lwr_tip_engine_force_magnitude = 0.0f;
+	state.lwr_tip_enging_force.setZero();
+	state.tip_engine_force.setZero();
+	for (const sContactCluster<float>& cluster : state.contact_clusters)
+		checkContact(state, input, config, cluster);
+	endPunctureEntries(state.puncture_candidates, state.puncture_events);
+}
+
+/**
+* @brief Sign function
+*/
+float sgn(float x) {
+	return signum(x);
+}
+
+/**
+* @brief Model external forces that act upon the needle. Updates f_ext_magnitude and f_ext
+* @param config: config describing the model that should be used for modeling the forces
+*/
+void modelExternalForces(sNeedleState& state, const sNeedleStepInput& input, const sNeedleConfig& config)
+{
+	state.shaft_lateral_force.setZero();
+	if (config.force_model == "kelvin-voigt") {
+		state.f_ext_magnitude = kelvinVoigtModel(state.punctures, input.needleVelocity);
+	}
+	else if (config.force_model == "karnopp")
+	{
+		state.f_ext_magnitude = karnoppModel(state.full_penetration_length, input.needleVelocity) * sKarnopp<float>::scale();
+	}
+	else if (config.force_model == "prony")
+	{
+		state.f_ext_magnitude = pronyModel(state, input.dt);
+	}
+	else if (config.force_model == "lugre")
+	{
+		state.f_ext_magnitude = lugreModel(state, input.needleAxialVelocity, input.dt);
+	}
+	else if (config.force_model == "shaft")
+	{
+		state.f_ext_magnitude = shaftModel(state, input, config);
+	}
+	else
+	{
+		std::cout << "No valid friction model was chosen, automatically set Kelvin-Voigt" << std::endl;
+		state.f_ext_magnitude = kelvinVoigtModel(state.punctures, input.needleVelocity);
+	}
+	// The bending needle replaces the lateral force of the straight shaft.
+	if (config.beam_elements > 0)
+		state.shaft_lateral_force = bendingModel(state, input, config);
+	state.model_force = state.f_ext_magnitude;
+	state.f_ext_magnitude *= config.model_force_scalar;
+	// Obtain the forces in the z direction in the reference frame of the lwr needle tip.
+	// Add the z force to the magnitude of the forces
+	if (config.use_only_z_force_on_engine)
+		state.f_ext_magnitude += state.tip_engine_force.z() * config.engine_force_scalar;
+	else
+		state.f_ext_magnitude += state.lwr_tip_enging_force.norm() * config.engine_force_scalar;
+	// Get direction of the dummy so that the forces get distributed on all the axis. (They did this in the other project, but is this correct?)
+	// Shouldn't we rather map all the calculated forces onto the z direction of the needle? The other directions should be handled by the virtual fixture.
+	state.f_ext = state.f_ext_magnitude * input.dummyDirection; // Should we normalize dir?				Peter: Multiplying with dummy dir creates equal force in all directions of the dummy. Is this right?
+	// Only the shaft model produces lateral forces, they are zero otherwise.
+	state.f_ext += state.shaft_lateral_force * config.model_force_scalar;
+	if (config.use_virtual_fixture)
+		state.f_ext += state.fixture.force;
+}
+
+/**
+* @brief Passivity controller between f_ext and the device, see passivityControl.h. Updates f_device.
+*/
+void controlPassivity(sNeedleState& state, const sNeedleStepInput& input, const sNeedleConfig& config)
+{
+	if (config.use_passivity_control)
+		state.f_device = passivityControl(state.passivity, config.passivity, state.f_ext, input.needleLinearVelocity, input.dt);
+	else
+		state.f_device = state.f_ext;
+}
+
+/**
+* @brief Snapshot of the force model of this step for the extrapolation on the device side, see forceExtrapolation.h
+*/
+void updateForceSnapshot(sNeedleState& state, const sNeedleStepInput& input, const sNeedleConfig& config)
+{
+	state.history.time += (double)input.dt;
+	state.history.add(input.needleAxialVelocity, input.needleVelocity, state.model_force);
+
+	sForceSnapshot& snapshot = state.snapshot;
+	bool touched = (state.lwr_tip_engine_force_magnitude > 0.0f) != (snapshot.engine > 0.0f);
+	snapshot = sForceSnapshot();
+	snapshot.event = (touched || !state.new_punctures.empty() || !state.exited_punctures.empty()) ? 1 : 0;
+	snapshot.time = state.history.time;
+	Vector3f held = state.f_device - state.f_ext_magnitude * input.dummyDirection;
+	for (int i = 0; i < 3; i++)
+	{
+		snapshot.held[i] = held(i);
+		snapshot.direction[i] = input.dummyDirection(i);
+	}
+	snapshot.axial = state.f_ext_magnitude;
+	snapshot.scale = config.model_force_scalar;
+	snapshot.engine = state.f_ext_magnitude - config.model_force_scalar * state.model_force;
+	snapshot.velocity = input.needleAxialVelocity;
+	snapshot.acceleration = state.history.slope(HISTORY_VELOCITY);
+	snapshot.speed = input.needleVelocity;
+	snapshot.speed_rate = state.history.slope(HISTORY_SPEED);
+	snapshot.horizon = 2.0f * input.dt;
+	if (state.punctures.empty())
+	{
+		snapshot.model = SNAPSHOT_HOLD;
+		return;
+	}
+
+	// Leaving the innermost layer, or puncturing the tissue the tip pushes against, is left to the next step.
+	snapshot.min_depth_change = -state.punctures.back().penetration_length;
+	snapshot.max_depth_change = (state.lwr_tip_engine_force_magnitude > 0.0f) ? 0.0f : 1.0e3f;
+	if (config.force_model == "kelvin-voigt")
+	{
+		// Only the innermost puncture gets longer, see checkPunctures().
+		snapshot.model = SNAPSHOT_BILINEAR;
+		for (const sPuncture& puncture : state.punctures)
+			snapshot.c0 += B(puncture) * puncture.penetration_length;
+		snapshot.c1 = B(state.punctures.back());
+		snapshot.s1 = 1.0f;
+	}
+	else if (config.force_model == "karnopp")
+	{
+		snapshot.model = SNAPSHOT_BILINEAR;
+		snapshot.c0 = state.full_penetration_length;
+		snapshot.c1 = 1.0f;
+		snapshot.s0 = sKarnopp<float>::scale() * C_p;
+		snapshot.s1 = sKarnopp<float>::scale() * b_p;
+		snapshot.stick_speed = zero_threshold;
+		snapshot.stick = sKarnopp<float>::scale() * D_p;
+	}
+	else
+	{
+		snapshot.model = SNAPSHOT_RATE;
+		snapshot.c0 = state.model_force;
+		snapshot.force_rate = state.history.slope(HISTORY_FORCE);
+	}
+}
+
+/**
+* @brief Engage the virtual fixture on the entry line of the first puncture and evaluate it for the commanded
+*        tip position, see virtualFixture.h. The fixture is released when the needle leaves the first tissue.
+*/
+void updateVirtualFixture(sNeedleState& state, const sNeedleStepInput& input, const sNeedleConfig& config)
+{
+	if (state.punctures.empty())
+	{
+		if (state.fixture.active)
+			state.fixture.release();
+		return;
+	}
+	const sPuncture& first = state.punctures.front();
+	if (!state.fixture.active || (state.fixture.centre != first.position))
+		state.fixture.engage(first.position, -first.direction);
+	evaluateFixture(state.fixture, config.fixture, input.commandedTip, input.needleLinearVelocity);
+}
+
+/**
+* @brief Move the tip of a bevel-tip needle along its curved path, see bevelModel.h. The tip bends with the
+*        curvature of the innermost punctured tissue and follows the rigid needle while it is outside the tissue.
+*        The bevel faces the y axis of the LWR tip.
+*/
+void updateBevelTip(sNeedleState& state, const sNeedleStepInput& input)
+{
+	Vector3f direction = -input.needleAxis;
+	Vector3f bevelSide = input.tipRotation.col(1);
+	if (state.punctures.empty())
+		state.bevel.reset(input.toolTipPoint, direction, bevelSide);
+	else
+		advanceBevelTip(state.bevel, input.toolTipPoint, direction, bevelSide, state.punctures.back().tissue.curvature);
+}
+
+/**
+* @brief Advance one needle by one simulation step. Does not call V-REP, so it is safe to run on a worker thread.
+* @param state: state of the needle
+* @param input: scene data of this step
+* @param config: model configuration
+*/
+void stepNeedle(sNeedleState& state, const sNeedleStepInput& input, const sNeedleConfig& config)
+{
+	state.new_punctures.clear();
+	state.exited_punctures.clear();
+
+	if (state.punctures.size() == 0)
+	{
+		state.full_penetration_length = 0.0f;
+		state.virtual_fixture = false;
+	}
+	else
+		state.virtual_fixture = true;
+
+	bool curvedPath = (config.needle_path == "bevel");
+	if (curvedPath)
+		updateBevelTip(state, input);
+
+	marchVolume(state, input, config, curvedPath);
+
+	checkPunctures(state, input, config, curvedPath);
+
+	clusterContacts(state, input);
+
+	checkContacts(state, input, config);
+
+	updateVirtualFixture(state, input, config);
+
+	modelExternalForces(state, input, config);
+
+	controlPassivity(state, input, config);
+
+	if (config.force_snapshot)
+		updateForceSnapshot(state, input, config);
+}
+
+/**
+* @brief Distance between two points
+* @param point1: point 1
+* @param point2: point 2
+* @return distance between the points
+*/
+float distance3d(const Vector3f& point1, const Vector3f& point2) {
+	return (point1 - point2).norm();
+}
+
+float karnoppModel(float full_penetration_length, float needleVelocity)
+{
+	return karnoppForce(full_penetration_length, needleVelocity);
+}
+
+/**
+* @brief Coefficients of a tissue
+* @param name: name of tissue (as set in v-rep)
+*/
+sTissueParameters tissueParameters(const std::string& name)
+{
+	sTissueParameters tissue;
+	if (name == "Fat")
+	{
+		tissue.damping = 3.0f * 100.0f;
+	}
+	else if (name == "muscle")
+	{
+		tissue.damping = 3.0f * 100.0f;
+	}
+	else if (name == "lung")
+	{
+		tissue.damping = 3.0f * 100.0f;
+	}
+	else if (name == "bone")
+	{
+		tissue.damping = 30.0f * 100.05f;
+	}
+	else
+	{
+		tissue.damping = 3.0f * 100.0f;
+	}
+	tissue.puncture_force = K(name);
+
+	// Relaxation: initial guesses, to be calibrated against the pause-and-hold insertions.
+	float scale = (name == "bone") ? 10.0f : 1.0f;
+	sPronyTerms prony = { 2.0f * scale, { 10.0f * scale, 5.0f * scale, 2.0f * scale }, { 0.05f, 0.5f, 5.0f } };
+	tissue.prony = prony;
+
+	// Friction: steady state matches the positive branch of the Karnopp model (F_c = C_p, F_s = D_p, sigma2 = b_p).
+	sLuGreParameters lugre = { 1.0e4f * scale, 100.0f * scale, b_p * scale, C_p * scale, D_p * scale, 1.0e-3f };
+	tissue.lugre = lugre;
+
+	// Shaft: same positive branch of the Karnopp model, spread over the segments. Lateral stiffness is a guess.
+	tissue.shaft_friction = C_p * scale;
+	tissue.shaft_damping = b_p * scale;
+	tissue.lateral_stiffness = 1.0e4f * scale;
+
+	// Bevel-tip path: radius of curvature of a few decimetres in soft tissue. Bone does not let the tip bend.
+	if (name == "bone")
+		tissue.curvature = 0.0f;
+	else if (name == "Fat")
+		tissue.curvature = 1.5f;
+	else if (name == "lung")
+		tissue.curvature = 1.0f;
+	else
+		tissue.curvature = 2.5f;
+	return tissue;
+}
+
+float B(const sPuncture& puncture)
+{
+	return puncture.tissue.damping;
+}
+
+float K(const std::string& name)
+{
+	if (name == "Fat")
+	{
+		return 1.0e-2f;
+	}
+
+	else if (name == "muscle")
+	{
+		return 1.0e-2f;
+	}
+	else if (name == "lung")
+	{
+		return 1.0e-2f;
+	}
+	else if (name == "bone")
+	{
+		return 1.0f;
+	}
+	else
+	{
+		return 1.0e-2f;
+	}
+}
+
+/**
+* @brief Force a contact has to exceed to puncture its tissue
+*/
+float punctureThreshold(const sContact& contact, const sNeedleConfig& config)
+{
+	return config.constant_puncture_threshold ? config.puncture_threshold : contact.tissue.puncture_force;
+}
+
+float kelvinVoigtModel(const std::vector<sPuncture>& punctures, float needleVelocity) {
+	float f_magnitude = 0.0f;
+	for (auto puncture_it = punctures.begin(); puncture_it != punctures.end(); puncture_it++)
+	{
+		f_magnitude += (B(*puncture_it) * puncture_it->penetration_length);
+	}
+	f_magnitude *= needleVelocity;
+	return f_magnitude;
+}
+
+/**
+* @brief Number of punctures that were already there before this step. The per-puncture rows of the
+*        stateful models follow the puncture stack, which only changes at the back: rows beyond this
+*        count belong to punctures that were left, punctures beyond it were added in this step.
+*/
+static int survivingPunctures(const sNeedleState& state)
+{
+	return (int)(state.punctures.size() - state.new_punctures.size());
+}
+
+static void copyPenetrationLengths(const std::vector<sPuncture>& punctures, Eigen::ArrayXf& penetration)
+{
+	penetration.resize(punctures.size());
+	for (size_t i = 0; i < punctures.size(); i++)
+		penetration(i) = punctures[i].penetration_length;
+}
+
+/**
+* @brief Prony series model of all punctures of a needle, see pronyModel.h
+* @param state: state of the needle. Keeps the Maxwell elements of the punctures in state.prony.
+* @param dt: time step
+* @return force magnitude
+*/
+float pronyModel(sNeedleState& state, float dt)
+{
+	sPronyState& prony = state.prony;
+	prony.truncate(survivingPunctures(state));
+	prony.setTimeStep(dt);
+	for (size_t i = prony.size(); i < state.punctures.size(); i++)
+		prony.append(state.punctures[i].tissue.prony, state.punctures[i].penetration_length);
+	copyPenetrationLengths(state.punctures, prony.penetration);
+	return pronyModel(prony);
+}
+
+/**
+* @brief LuGre friction of all punctures of a needle, see lugreModel.h
+* @param state: state of the needle. Keeps the bristles of the punctures in state.lugre.
+* @param v: axial velocity of the needle, positive when inserting
+* @param dt: time step
+* @return force magnitude
+*/
+float lugreModel(sNeedleState& state, float v, float dt)
+{
+	sLuGreState& lugre = state.lugre;
+	lugre.truncate(survivingPunctures(state));
+	for (size_t i = lugre.size(); i < state.punctures.size(); i++)
+		lugre.append(state.punctures[i].tissue.lugre);
+	copyPenetrationLengths(state.punctures, lugre.penetration);
+	return lugreModel(lugre, v, dt);
+}
+
+/**
+* @brief Part of the shaft in each punctured tissue. The layer of a puncture reaches from its entry point
+*        to the entry point of the next puncture.
+*/
+static void updateShaftLayers(sNeedleState& state)
+{
+	std::vector<sShaftLayer>& layers = state.shaft_layers;
+	layers.resize(state.punctures.size());
+	for (size_t i = 0; i < state.punctures.size(); i++)
+	{
+		const sPuncture& puncture = state.punctures[i];
+		sShaftLayer& layer = layers[i];
+		layer.end = std::max(puncture.penetration_length, 0.0f);
+		layer.begin = (i + 1 < state.punctures.size()) ? std::max(state.punctures[i + 1].penetration_length, 0.0f) : 0.0f;
+		layer.entry = puncture.position;
+		layer.direction = puncture.direction;
+		layer.friction = puncture.tissue.shaft_friction;
+		layer.damping = puncture.tissue.shaft_damping;
+		layer.lateral_stiffness = puncture.tissue.lateral_stiffness;
+	}
+}
+
+/**
+* @brief Segmented shaft model of a needle, see shaftModel.h
+* @param state: state of the needle. Keeps the segments in state.shaft and sets state.shaft_lateral_force.
+* @param input: scene data of this step
+* @param config: number of segments and length of the shaft
+* @return axial force magnitude
+*/
+float shaftModel(sNeedleState& state, const sNeedleStepInput& input, const sNeedleConfig& config)
+{
+	state.shaft.resize(std::max(config.shaft_segments, 1), config.shaft_length);
+	updateShaftLayers(state);
+	state.shaft.tag(state.shaft_layers);
+	sShaftForces forces = shaftModel(state.shaft, input.toolTipPoint, input.needleAxis, input.needleAxialVelocity);
+	state.shaft_lateral_force = forces.lateral;
+	return forces.axial;
+}
+
+/**
+* @brief Bending of the needle in the tissue, see beamModel.h
+* @param state: state of the needle. Keeps the beam in state.beam and the deflection in state.bending.
+* @param input: scene data of this step
+* @param config: number of elements, length and bending stiffness of the needle
+* @return lateral force of the tissues on the needle
+*/
+Vector3f bendingModel(sNeedleState& state, const sNeedleStepInput& input, const sNeedleConfig& config)
+{
+	state.beam.resize(config.beam_elements, config.shaft_length, config.bending_stiffness);
+	updateShaftLayers(state);
+	state.bending = beamModel(state.beam, state.shaft_layers, input.toolTipPoint, input.needleAxis, Vector3f::Zero());
+	return state.bending.tissue_force;
+}
@@ -0,0 +1,213 @@
+// Peter: Needle-tissue model that does not depend on V-REP.
+//
+// Everything in here is pure computation on plain data, so it can be run from worker
+// threads and from standalone tools. The scene is read on the main thread into an
+// sNeedleStepInput, stepNeedle() updates the sNeedleState, and the resulting puncture
+// events are written back to the scene on the main thread again (see needleInstance.h).
+
+#pragma once
+
+#include <string>
+#include <vector>
+
+#include <Eigen/Core>
+#include <Eigen/Geometry>
+
+#include "beamModel.h"
+#include "bevelModel.h"
+#include "forceExtrapolation.h"
+#include "lugreModel.h"
+#include "lwrKinematics.h"
+#include "passivityControl.h"
+#include "pronyModel.h"
+#include "punctureCore.h"
+#include "shaftModel.h"
+#include "tissueSdf.h"
+#include "tissueVolume.h"
+#include "virtualFixture.h"
+
+// Coefficients for bidirectional Karnopp friction model, see sKarnopp (punctureCore.h)
+const float D_p = sKarnopp<float>::D_p();          // Positive static friction coefficient. Unit: N/m
+const float D_n = sKarnopp<float>::D_n();          // Negative static friction coefficient. Unit: N/m
+const float b_p = sKarnopp<float>::b_p();          // Positive damping coefficient. Unit: N-s/m^2
+const float b_n = sKarnopp<float>::b_n();          // Negative damping coefficient. Unit: N-s/m^2
+const float C_p = sKarnopp<float>::C_p();          // Positive dynamic friction coefficient. Unit: N/m
+const float C_n = sKarnopp<float>::C_n();          // Negative dynamic friction coefficient. Unit: N/m
+const float zero_threshold = sKarnopp<float>::zero_threshold();	// (delta v/2 in paper) Threshold on static and dynamic fricion. Unit: m/s
+
+// Coefficients of one tissue. Looked up by name once, when the tissue is touched.
+struct sTissueParameters {
+	float damping;									// Kelvin-Voigt damping per penetration length, see B(). Unit: N-s/m^2
+	float puncture_force;							// Force needed to puncture the tissue, see K(). Unit: N
+	sPronyTerms prony;								// Relaxation of the tissue, see pronyModel.h.
+	sLuGreParameters lugre;							// Friction of the tissue, see lugreModel.h.
+	float shaft_friction;							// Dynamic friction per length of shaft, see shaftModel.h. Unit: N/m
+	float shaft_damping;							// Damping per length of shaft. Unit: N-s/m^2
+	float lateral_stiffness;						// Resistance against moving the shaft off its entry line. Unit: N/m^2
+	float curvature;								// Curvature of the path of a bevel-tip needle, see bevelModel.h. Unit: 1/m
+};
+
+struct sPuncture {
+	int handle;
+	Eigen::Vector3f position;
+	Eigen::Vector3f direction;
+	std::string name;
+	sTissueParameters tissue;
+	float penetration_length;
+	float path_length;								// Arc length of the bevel-tip path at the entry point, see bevelModel.h.
+	int exit_steps = 0;								// Steps in a row the tip was outside, see sPunctureHysteresis.
+
+	void printPuncture(bool puncture) const;
+};
+
+struct sContact {
+	int handle;										// Handle of the touched shape.
+	std::string name;								// Name of the touched shape, resolved on the main thread.
+	sTissueParameters tissue;						// Coefficients of the touched shape, resolved on the main thread.
+	Eigen::Vector3f force;							// Contact force in world coordinates.
+	bool respondable;								// Shape is respondable and part of the phantom.
+};
+
+// Signed distance field of a tissue and where its shape is in this step, see tissueSdf.h.
+struct sTissueField {
+	int handle;										// Handle of the tissue shape.
+	const CTissueSdf* sdf;							// Owned by the plugin, valid while the simulation runs.
+	Eigen::Matrix3f rotation;						// Frame of the shape in the world.
+	Eigen::Vector3f position;
+};
+
+// Punctures of label l of the CT volume have the handle VOLUME_HANDLE_BASE - l, below all scene handles.
+const int VOLUME_HANDLE_BASE = -1000;
+
+// CT volume of the phantom and where the phantom is in this step, see tissueVolume.h.
+struct sVolumeInput {
+	const CTissueVolume* volume = NULL;				// Owned by the plugin, NULL if there is none.
+	const std::vector<sTissueParameters>* tissues = NULL;	// Coefficients of each label.
+	Eigen::Matrix3f rotation = Eigen::Matrix3f::Identity();	// Frame of the phantom in the world.
+	Eigen::Vector3f position = Eigen::Vector3f::Zero();
+};
+
+// Config variables: Use these to configurate the details of the execution.
+struct sNeedleConfig {
+	float engine_force_scalar = 1.0f;				// How much of the v-rep engine force should be counted.
+	float model_force_scalar = 1.0f;				// How much of the calculated force should be used.
+	std::string force_model = "kelvin-voigt";		// Which model should be used to model the forces: "kelvin-voigt", "karnopp", "lugre", "prony" or "shaft".
+	bool use_only_z_force_on_engine = true;			// When using the engine for both checking punctures and calculating forces,
+													// Should only z direction be used, or should the full magnitude.
+	bool constant_puncture_threshold = false;		// Use the same puncture threshold for all tissues.
+	float puncture_threshold = 1.0e-2f;				// Set constant puncture threshold (only used if constant_puncture_threshold==true)
+	sPunctureHysteresis<float> hysteresis;			// Entry and exit of the punctures, see punctureCore.h.
+	int shaft_segments = 200;						// Number of segments of the shaft (only used by the "shaft" model).
+	float shaft_length = 0.2f;						// Length of the needle shaft. Unit: m
+	int beam_elements = 0;							// Elements of the bending needle, see beamModel.h. 0: the needle does not bend.
+	float bending_stiffness = 0.02f;				// EI of the needle (18G steel). Unit: N m^2
+	std::string needle_path = "straight";			// Path of the tip in the tissue: "straight" or "bevel" (curved, see bevelModel.h).
+	bool native_ik = false;							// Move the LWR to Dummy_tool_tip with the plugin's IK solver (see lwrKinematics.h)
+													// instead of V-REP's IK group. The IK group should then be set to explicit handling.
+	sIkSettings ik;
+	bool use_virtual_fixture = true;				// Add the constraint force of the virtual fixture to f_ext and, with native_ik,
+													// keep the IK target on the insertion line (see virtualFixture.h).
+	sFixtureParameters fixture;
+	bool use_passivity_control = true;				// Add damping to f_device when the rendered environment generates energy.
+	sPassivityParameters passivity;
+	bool force_snapshot = true;						// Write the extrapolation snapshot for the haptic device (see forceExtrapolation.h).
+	bool shared_memory = false;						// Publish f_device to and read the device pose from the haptic driver
+													// through shared memory (see hapticChannel.h).
+	bool use_tissue_sdf = true;						// Measure the punctures of the straight needle with the signed distance fields of the
+													// tissue meshes (see tissueSdf.h). Read when the scene is bound.
+	sSdfSettings sdf;
+	float volume_stiffness = 500.0f;				// Force per depth of the tip in a tissue of the CT volume it has not punctured yet,
+													// stands in for the contact force of the engine. Unit: N/m
+};
+
+// Everything a step needs from the scene. Filled on the main thread.
+struct sNeedleStepInput {
+	Eigen::Vector3f toolTipPoint = Eigen::Vector3f::Zero();
+	Eigen::Vector3f needleAxis = Eigen::Vector3f::UnitZ();		// z axis of the needle, used as puncture direction.
+	Eigen::Vector3f needleDirection = Eigen::Vector3f::UnitZ();	// z axis of the LWR tip.
+	Eigen::Vector3f dummyDirection = Eigen::Vector3f::UnitZ();	// z axis of the device dummy, f_ext is rendered along it.
+	Eigen::Matrix3f tipRotation = Eigen::Matrix3f::Identity();	// Rotation of the LWR tip, tip frame to world. Its transpose expresses
+																// the engine forces in the tip frame.
+	float needleVelocity = 0.0f;					// Speed of the LWR tip. Unit: m/s
+	float needleAxialVelocity = 0.0f;				// Velocity along the needle, positive when inserting (along -needleAxis). Unit: m/s
+	Eigen::Vector3f needleLinearVelocity = Eigen::Vector3f::Zero();	// Velocity of the LWR tip. Unit: m/s
+	Eigen::Vector3f commandedTip = Eigen::Vector3f::Zero();	// Tip position commanded by the device (Dummy_tool_tip).
+	float dt = 5.0e-2f;								// Simulation time step. Unit: s
+	std::vector<sContact> contacts;
+	std::vector<sTissueField> fields;				// Fields of the touched and punctured tissues that have one.
+	sVolumeInput volume;
+};
+
+// State of one needle. Only touched by stepNeedle() during the compute phase.
+struct sNeedleState {
+	std::vector<sPuncture> punctures;
+	bool virtual_fixture = false;					// Is the needle in the tissue/ should the virtual fixture be activated?
+	float full_penetration_length = 0.0f;
+	float f_ext_magnitude = 0.0f;					// Magnitude of all external forces on the needle.
+	float lwr_tip_engine_force_magnitude = 0.0f;	// Magnitude of external forces on the needle_tip created by the physics engine.
+	Eigen::Vector3f lwr_tip_enging_force = Eigen::Vector3f::Zero(); // Force vector of external forces on the needle_tip created by the physics engine.
+	Eigen::Vector3f tip_engine_force = Eigen::Vector3f::Zero();	// lwr_tip_enging_force in the frame of the LWR tip.
+	std::vector<sContactCluster<float>> contact_clusters;	// Contacts of the last step by tissue, see clusterContacts().
+	Eigen::Vector3f f_ext = Eigen::Vector3f::Zero();	// Total forces on the needle created by the physics engine AND the modeled forces, relative to the dummy.
+	Eigen::Vector3f f_device = Eigen::Vector3f::Zero();	// f_ext after the passivity controller, the force for the haptic device.
+	sPassivityState passivity;						// Energy observed at the device.
+	float model_force = 0.0f;						// Force of the force model before model_force_scalar. Unit: N
+	sExtrapolationHistory history;					// Last steps, for the snapshot.
+	sForceSnapshot snapshot = sForceSnapshot();		// Extrapolation of f_device until the next step, see forceExtrapolation.h.
+	sPronyState prony;								// Maxwell elements of the punctures, one row per puncture.
+	sLuGreState lugre;								// Bristles of the punctures, one row per puncture.
+	sShaftState shaft;								// Segments of the shaft.
+	std::vector<sShaftLayer> shaft_layers;			// Part of the shaft in each punctured tissue, one per puncture.
+	Eigen::Vector3f shaft_lateral_force = Eigen::Vector3f::Zero();	// Lateral force of the tissues on the shaft, world frame.
+	sBeamState beam;								// Bending needle (only used if beam_elements > 0).
+	sBeamResult bending;							// Deflection of the last step.
+	sBevelTip bevel;								// Tip on the curved path (only updated if needle_path == "bevel").
+	sVirtualFixture fixture;						// Insertion line of the first puncture, active while it lasts.
+	std::vector<sVolumeSegment> volume_segments;	// Tissues of the CT volume along the shaft, from its end to the tip.
+	std::vector<sVolumeSegment> volume_chord;		// Runs of one chord of a curved shaft, scratch of marchVolume().
+	std::vector<sContact> volume_contacts;			// Tissue of the CT volume the tip pushes into, if it is not punctured yet.
+
+	std::vector<sPunctureCandidate> puncture_candidates;	// Contacts that are entering their tissue.
+	sPunctureEventCounts puncture_events;
+
+	// Puncture events of the last step. They are applied to the scene on the main thread. A tissue is in at
+	// most one of them.
+	std::vector<sPuncture> new_punctures;
+	std::vector<sPuncture> exited_punctures;
+
+	void reset();
+};
+
+int checkSinglePuncture(const sPuncture& puncture, const Eigen::Vector3f& toolTipPoint);
+float punctureLength(const sPuncture& puncture, const Eigen::Vector3f& toolTipPoint);
+float pathPunctureLength(const sPuncture& puncture, const sBevelTip& bevel);
+const sTissueField* findTissueField(const sNeedleStepInput& input, int handle);
+float fieldPunctureLength(const sTissueField& field, const sPuncture& puncture, const Eigen::Vector3f& toolTipPoint);
+float fieldPathLength(const sTissueField& field, const sPuncture& puncture, const sBevelTip& bevel);
+int volumeHandle(int label);
+bool isVolumeHandle(int handle);
+float volumePunctureLength(const sNeedleState& state, int handle);
+void marchVolume(sNeedleState& state, const sNeedleStepInput& input, const sNeedleConfig& config, bool curvedPath = false);
+void checkPunctures(sNeedleState& state, const sNeedleStepInput& input, const sNeedleConfig& config, bool curvedPath = false);
+void updateBevelTip(sNeedleState& state, const sNeedleStepInput& input);
+void addPuncture(sNeedleState& state, const sNeedleStepInput& input, const sContact& contact, bool curvedPath = false);
+void clusterContacts(sNeedleState& state, const sNeedleStepInput& input);
+void checkContacts(sNeedleState& state, const sNeedleStepInput& input, const sNeedleConfig& config);
+void updateVirtualFixture(sNeedleState& state, const sNeedleStepInput& input, const sNeedleConfig& config);
+void modelExternalForces(sNeedleState& state, const sNeedleStepInput& input, const sNeedleConfig& config);
+void controlPassivity(sNeedleState& state, const sNeedleStepInput& input, const sNeedleConfig& config);
+void updateForceSnapshot(sNeedleState& state, const sNeedleStepInput& input, const sNeedleConfig& config);
+void stepNeedle(sNeedleState& state, const sNeedleStepInput& input, const sNeedleConfig& config);
+
+sTissueParameters tissueParameters(const std::string& name);
+float B(const sPuncture& puncture);
+float K(const std::string& name);
+float punctureThreshold(const sContact& contact, const sNeedleConfig& config);
+float distance3d(const Eigen::Vector3f& point1, const Eigen::Vector3f& point2);
+float karnoppModel(float full_penetration_length, float needleVelocity);
+float kelvinVoigtModel(const std::vector<sPuncture>& punctures, float needleVelocity);
+float pronyModel(sNeedleState& state, float dt);
+float lugreModel(sNeedleState& state, float v, float dt);
+float shaftModel(sNeedleState& state, const sNeedleStepInput& input, const sNeedleConfig& config);
+Eigen::Vector3f bendingModel(sNeedleState& state, const sNeedleStepInput& input, const sNeedleConfig& config);
+float sgn(float x);
@@ -0,0 +1,40 @@
+// Peter: Time-domain passivity observer and controller. See passivityControl.h.
+
+#include "passivityControl.h"
+
+#include <algorithm>
+
+using namespace Eigen;
+
+void sPassivityState::reset()
+{
+	*this = sPassivityState();
+}
+
+/**
+* @brief One update of the passivity observer and controller, see passivityControl.h
+* @param state: observed energy, updated
+* @param parameters: limits of the controller
+* @param force: force of the environment on the device
+* @param velocity: velocity of the device
+* @param dt: time since the last update. Unit: s
+* @return force to render, force with the added damping
+*/
+Vector3f passivityControl(sPassivityState& state, const sPassivityParameters& parameters, const Vector3f& force, const Vector3f& velocity, float dt)
+{
+	// Work of the force held over the last update, with the mean velocity of that update.
+	state.energy -= (double)state.last_force.dot(0.5f * (state.last_velocity + velocity)) * dt;
+
+	// Damp just enough that holding the new force for the next update does not make the energy negative.
+	double predicted = state.energy - (double)force.dot(velocity) * dt;
+	state.damping = 0.0f;
+	float speed_squared = velocity.squaredNorm();
+	if ((predicted < 0.0) && (speed_squared > parameters.min_velocity * parameters.min_velocity) && (dt > 0.0f))
+	{
+		state.damping = std::min((float)(-predicted / (dt * speed_squared)), parameters.max_damping);
+		state.dissipated += (double)state.damping * speed_squared * dt;
+	}
+	state.last_force = force - state.damping * velocity;
+	state.last_velocity = velocity;
+	return state.last_force;
+}
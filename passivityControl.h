@@ -0,0 +1,36 @@
+// Peter: Time-domain passivity observer and controller for the force sent to the haptic device
+// (Hannaford & Ryu, "Time-domain passivity control of haptic interfaces", 2002).
+//
+// f_ext is rendered with the latency of a simulation step, so a stiff tissue or a large
+// model_force_scalar can make the virtual environment generate energy and the device oscillate.
+// The observer sums the energy that flows from the user into the environment through the rendered force,
+//   E(n) = E(n - 1) - f_out(n - 1) . (v(n - 1) + v(n)) / 2 dt
+// where f_out is the force held on the device over the last update and v the device velocity. A passive
+// environment keeps E >= 0. If holding the new force f for the next update would make E negative, the
+// controller adds just enough damping to prevent it,
+//   alpha = -(E(n) - f . v dt) / (dt |v|^2),   f_out = f - alpha v,
+// limited to max_damping. Constant work per update, only the last force and velocity are kept.
+
+#pragma once
+
+#include <Eigen/Core>
+
+struct sPassivityParameters {
+	float max_damping = 50.0f;						// Largest damping the controller adds. Held for dt, damping above
+													// 2 m / dt (m: mass of device and hand) is itself unstable. Unit: N-s/m
+	float min_velocity = 1.0e-4f;					// No damping is added below this speed, alpha would blow up. Unit: m/s
+};
+
+struct sPassivityState {
+	double energy = 0.0;							// Observed energy that flowed into the environment. Unit: J
+	double dissipated = 0.0;						// Energy removed by the controller. Unit: J
+	float damping = 0.0f;							// Damping added in the last update. Unit: N-s/m
+	Eigen::Vector3f last_force = Eigen::Vector3f::Zero();	// Force rendered since the last update.
+	Eigen::Vector3f last_velocity = Eigen::Vector3f::Zero();
+
+	void reset();
+};
+
+// Force to render on the device. force: force of the environment on the device, velocity: of the device.
+Eigen::Vector3f passivityControl(sPassivityState& state, const sPassivityParameters& parameters,
+	const Eigen::Vector3f& force, const Eigen::Vector3f& velocity, float dt);
@@ -0,0 +1,90 @@
+// Peter: Generalized Maxwell (Prony series) tissue model. See pronyModel.h.
+
+#include "pronyModel.h"
+
+#include <math.h>
+
+int sPronyState::size() const
+{
+	return (int)equilibrium.size();
+}
+
+void sPronyState::reset()
+{
+	truncate(0);
+}
+
+void sPronyState::truncate(int count)
+{
+	if (count >= size())
+		return;
+	q.conservativeResize(count, PRONY_TERMS);
+	alpha.conservativeResize(count, PRONY_TERMS);
+	gain.conservativeResize(count, PRONY_TERMS);
+	equilibrium.conservativeResize(count);
+	previous.conservativeResize(count);
+	terms.resize(count);
+}
+
+static void pronyCoefficients(const sPronyTerms& terms, float dt, float* alpha, float* gain)
+{
+	for (int k = 0; k < PRONY_TERMS; k++)
+	{
+		float tau = terms.relaxation_time[k];
+		alpha[k] = expf(-dt / tau);
+		gain[k] = terms.stiffness[k] * tau * (1.0f - alpha[k]) / dt;
+	}
+}
+
+void sPronyState::append(const sPronyTerms& puncture_terms, float penetration_length)
+{
+	int row = size();
+	q.conservativeResize(row + 1, PRONY_TERMS);
+	alpha.conservativeResize(row + 1, PRONY_TERMS);
+	gain.conservativeResize(row + 1, PRONY_TERMS);
+	equilibrium.conservativeResize(row + 1);
+	previous.conservativeResize(row + 1);
+	terms.push_back(puncture_terms);
+
+	float rowAlpha[PRONY_TERMS], rowGain[PRONY_TERMS];
+	pronyCoefficients(puncture_terms, dt, rowAlpha, rowGain);
+	for (int k = 0; k < PRONY_TERMS; k++)
+	{
+		q(row, k) = 0.0f;
+		alpha(row, k) = rowAlpha[k];
+		gain(row, k) = rowGain[k];
+	}
+	equilibrium(row) = puncture_terms.equilibrium_stiffness;
+	previous(row) = penetration_length;
+}
+
+void sPronyState::setTimeStep(float step)
+{
+	if ((step <= 0.0f) || (step == dt))
+		return;
+	dt = step;
+	for (int row = 0; row < size(); row++)
+	{
+		float rowAlpha[PRONY_TERMS], rowGain[PRONY_TERMS];
+		pronyCoefficients(terms[row], dt, rowAlpha, rowGain);
+		for (int k = 0; k < PRONY_TERMS; k++)
+		{
+			alpha(row, k) = rowAlpha[k];
+			gain(row, k) = rowGain[k];
+		}
+	}
+}
+
+/**
+* @brief Generalized Maxwell model, see pronyModel.h
+* @param state: series of all active punctures. state.penetration has to hold the current penetration lengths.
+* @return total force of all punctures
+*/
+float pronyModel(sPronyState& state)
+{
+	if (state.size() == 0)
+		return 0.0f;
+	state.q = state.alpha * state.q + state.gain.colwise() * (state.penetration - state.previous);
+	state.previous = state.penetration;
+	return (state.equilibrium * state.penetration).sum() + state.q.sum();
+}
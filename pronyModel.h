@@ -0,0 +1,56 @@
+// Peter: Generalized Maxwell (Prony series) tissue model.
+//
+// Every puncture is a spring E_inf in parallel with PRONY_TERMS Maxwell elements (spring E_k in
+// series with a damper of relaxation time tau_k), driven by the penetration length x of the puncture:
+//
+//   F = sum over punctures ( E_inf * x + sum_k q_k ),    dq_k/dt = -q_k / tau_k + E_k * dx/dt
+//
+// q_k is updated recursively, exact for a constant penetration rate over the step:
+//
+//   q_k <- alpha_k * q_k + E_k * tau_k * (1 - alpha_k) / dt * dx,    alpha_k = exp(-dt / tau_k)
+//
+// so a step costs O(PRONY_TERMS) per puncture no matter how long the history is. When the needle
+// stops, dx = 0 and the q_k decay: the force relaxes towards E_inf * x.
+//
+// The state is kept as structure of arrays (one row per puncture, one column per term) and updated
+// with Eigen array expressions, so the update is vectorized across all active punctures.
+
+#pragma once
+
+#include <vector>
+
+#include <Eigen/Core>
+
+const int PRONY_TERMS = 3;
+
+// Prony series of one tissue.
+struct sPronyTerms {
+	float equilibrium_stiffness;					// E_inf. Unit: N/m
+	float stiffness[PRONY_TERMS];					// E_k. Unit: N/m
+	float relaxation_time[PRONY_TERMS];				// tau_k. Unit: s
+};
+
+typedef Eigen::Array<float, Eigen::Dynamic, PRONY_TERMS> PronyArray;
+
+struct sPronyState {
+	PronyArray q;									// Force in each Maxwell element. Unit: N
+	PronyArray alpha;								// exp(-dt / tau)
+	PronyArray gain;								// E * tau * (1 - alpha) / dt
+	Eigen::ArrayXf equilibrium;						// E_inf
+	Eigen::ArrayXf previous;						// Penetration length at the last update. Unit: m
+	Eigen::ArrayXf penetration;						// Penetration length of this update, filled by the caller. Unit: m
+	std::vector<sPronyTerms> terms;					// Series of each puncture, to recompute alpha and gain.
+	float dt = 1.0e-3f;								// Step alpha and gain were computed for. Unit: s
+
+	int size() const;
+	void reset();
+	// Punctures are only ever removed from the back, so dropping rows keeps the others aligned.
+	void truncate(int count);
+	// Starts the history of a new puncture at rest.
+	void append(const sPronyTerms& terms, float penetration_length);
+	// Recomputes alpha and gain if the step changed.
+	void setTimeStep(float step);
+};
+
+// Advances the Maxwell elements to state.penetration and returns the total force.
+float pronyModel(sPronyState& state);
@@ -0,0 +1,320 @@
+// Peter: Precision-templated core of the needle-tissue model. See punctureCore.h.
+
+#include "punctureCore.h"
+
+#include <algorithm>
+
+template<typename Scalar> void sCoreState<Scalar>::reset()
+{
+	punctures.clear();
+	exited_handles.clear();
+	candidates.clear();
+	clusters.clear();
+	tip_engine_force.setZero();
+	events = sPunctureEventCounts();
+	full_penetration_length = Scalar(0);
+	engine_force_magnitude = Scalar(0);
+	engine_force.setZero();
+	f_ext_magnitude = Scalar(0);
+	f_ext.setZero();
+	new_punctures = 0;
+	exited_punctures = 0;
+}
+
+template<typename Scalar> Scalar signum(Scalar x)
+{
+	if (x > Scalar(0))
+		return Scalar(1);
+	if (x < Scalar(0))
+		return Scalar(-1);
+	return Scalar(0);
+}
+
+/**
+* @brief Check if a puncture is still active.
+* @param entry: entry point of the puncture
+* @param direction: needle axis at the entry
+* @param tip: current position of the needle tip
+* @return 1 if still active, -1 if not.
+*/
+template<typename Scalar> int punctureSide(const tVector3<Scalar>& entry, const tVector3<Scalar>& direction, const tVector3<Scalar>& tip)
+{
+	// If the dot product of the two vectors is positive, we are still in the tissue. The tip right at the entry
+	// point is inside; the tolerance against leaving at once is the exit hysteresis, see sPunctureHysteresis.
+	if ((entry - tip).dot(direction) >= Scalar(0))
+		return 1;
+	return -1;
+}
+
+/**
+* @brief Calculate length of a puncture
+* @return penetration distance of puncture. Value bellow zero means distance is "outside" of the tissue.
+*/
+template<typename Scalar> Scalar punctureDepth(const tVector3<Scalar>& entry, const tVector3<Scalar>& direction, const tVector3<Scalar>& tip)
+{
+	return (entry - tip).norm() * Scalar(punctureSide(entry, direction, tip));
+}
+
+template<typename Scalar> Scalar tipAxialForce(const tMatrix3<Scalar>& tipRotation, const tVector3<Scalar>& force)
+{
+	// tipRotation maps the tip frame to the world, the z axis of the tip in the world is its last column.
+	return tipRotation.col(2).dot(force);
+}
+
+template<typename Scalar> Scalar karnoppForce(Scalar full_penetration_length, Scalar needleVelocity)
+{
+	typedef sKarnopp<Scalar> k;
+	if (needleVelocity <= -k::zero_threshold())
+		return full_penetration_length * (k::C_n() * signum(needleVelocity) + k::b_n() * needleVelocity);
+	else if ((-k::zero_threshold() < needleVelocity) && (needleVelocity <= Scalar(0)))
+		return full_penetration_length * k::D_n();
+	else if ((Scalar(0) < needleVelocity) && (needleVelocity < k::zero_threshold()))
+		return full_penetration_length * k::D_p();
+	else if (needleVelocity >= k::zero_threshold())
+		return full_penetration_length * (k::C_p() * signum(needleVelocity) + k::b_p() * needleVelocity);
+	return Scalar(-1);
+}
+
+template<typename Scalar> Scalar kelvinVoigtForce(const std::vector<sCorePuncture<Scalar>>& punctures, Scalar needleVelocity)
+{
+	Scalar f_magnitude = Scalar(0);
+	for (const sCorePuncture<Scalar>& puncture : punctures)
+		f_magnitude += puncture.damping * puncture.penetration_length;
+	return f_magnitude * needleVelocity;
+}
+
+template<typename Scalar> void clusterContact(std::vector<sContactCluster<Scalar>>& clusters, int handle, int index,
+	const tVector3<Scalar>& force, bool respondable)
+{
+	for (sContactCluster<Scalar>& cluster : clusters)
+	{
+		if (cluster.handle == handle)
+		{
+			cluster.force += force;
+			cluster.contacts++;
+			return;
+		}
+	}
+	sContactCluster<Scalar> cluster;
+	cluster.handle = handle;
+	cluster.first = index;
+	cluster.contacts = 1;
+	cluster.respondable = respondable;
+	cluster.force = force;
+	clusters.push_back(cluster);
+}
+
+// Clusters per matrix product in projectContactClusters(). The block lives on the stack.
+const int CLUSTER_BLOCK = 8;
+
+template<typename Scalar> void projectContactClusters(std::vector<sContactCluster<Scalar>>& clusters, const tMatrix3<Scalar>& tipRotation)
+{
+	typedef Eigen::Matrix<Scalar, 3, Eigen::Dynamic, 0, 3, CLUSTER_BLOCK> tBlock;
+	for (size_t begin = 0; begin < clusters.size(); begin += CLUSTER_BLOCK)
+	{
+		Eigen::Index count = (Eigen::Index)std::min(clusters.size() - begin, (size_t)CLUSTER_BLOCK);
+		tBlock world(3, count);
+		for (Eigen::Index i = 0; i < count; i++)
+			world.col(i) = clusters[begin + (size_t)i].force;
+		// tipRotation maps the tip frame to the world, its transpose brings the forces into the tip frame.
+		tBlock tip(3, count);
+		tip.noalias() = tipRotation.transpose() * world;
+		for (Eigen::Index i = 0; i < count; i++)
+		{
+			sContactCluster<Scalar>& cluster = clusters[begin + (size_t)i];
+			cluster.tip_force = tip.col(i);
+			cluster.normal = world.col(i).norm();
+			cluster.axial = tip(2, i);
+			cluster.lateral = tip.col(i).template head<2>().norm();
+		}
+	}
+}
+
+/**
+* @brief Count one step of a contact that is entering its tissue, see sPunctureHysteresis
+* @param force: contact force that is compared with the threshold. Unit: N
+* @param threshold: puncture threshold of the tissue. Unit: N
+* @return true if the tissue is punctured in this step
+*/
+template<typename Scalar> bool debouncePunctureEntry(std::vector<sPunctureCandidate>& candidates, sPunctureEventCounts& events,
+	int handle, Scalar force, Scalar threshold, const sPunctureHysteresis<Scalar>& hysteresis)
+{
+	if (force <= threshold)
+		return false;
+	std::vector<sPunctureCandidate>::iterator candidate = candidates.begin();
+	while ((candidate != candidates.end()) && (candidate->handle != handle))
+		++candidate;
+	bool above = (force > (Scalar(1) + hysteresis.entry_margin) * threshold);
+	if (candidate == candidates.end())
+	{
+		if (!above)
+			return false;
+		sPunctureCandidate entering = { handle, 0, false };
+		candidate = candidates.insert(candidates.end(), entering);
+	}
+	// Several contacts with the same tissue count as one step.
+	if (above && !candidate->held)
+		candidate->steps++;
+	candidate->held = true;
+	if (candidate->steps < hysteresis.entry_steps)
+		return false;
+	candidates.erase(candidate);
+	events.entries++;
+	return true;
+}
+
+void endPunctureEntries(std::vector<sPunctureCandidate>& candidates, sPunctureEventCounts& events)
+{
+	size_t kept = 0;
+	for (size_t i = 0; i < candidates.size(); i++)
+	{
+		if (!candidates[i].held)
+		{
+			events.entries_avoided++;
+			continue;
+		}
+		candidates[kept] = candidates[i];
+		candidates[kept].held = false;
+		kept++;
+	}
+	candidates.resize(kept);
+}
+
+/**
+* @brief Count one step of a puncture that may be exiting, see sPunctureHysteresis
+* @param exitSteps: steps in a row the tip was outside, kept with the puncture
+* @param length: penetration length of this step. Unit: m
+* @param signedLength: length is negative behind the entry point, exit_depth applies
+* @return true if the puncture is left in this step
+*/
+template<typename Scalar> bool debouncePunctureExit(int& exitSteps, sPunctureEventCounts& events, Scalar length, bool signedLength,
+	const sPunctureHysteresis<Scalar>& hysteresis)
+{
+	bool outside = signedLength ? (length <= -hysteresis.exit_depth) : (length <= Scalar(0));
+	if (outside)
+	{
+		if (++exitSteps < hysteresis.exit_steps)
+			return false;
+		exitSteps = 0;
+		events.exits++;
+		return true;
+	}
+	if ((length > Scalar(0)) && (exitSteps > 0))
+	{
+		exitSteps = 0;
+		events.exits_avoided++;
+	}
+	return false;
+}
+
+// Punctures the tip has left are dropped from the back of the stack, see checkPunctures().
+template<typename Scalar> static void checkCorePunctures(sCoreState<Scalar>& state, const sCoreInput<Scalar>& input,
+	const sCoreSettings<Scalar>& settings)
+{
+	std::vector<sCorePuncture<Scalar>>& punctures = state.punctures;
+	while (!punctures.empty())
+	{
+		sCorePuncture<Scalar>& puncture = punctures.back();
+		state.full_penetration_length -= puncture.penetration_length;
+		Scalar length = punctureDepth(puncture.position, puncture.direction, input.toolTipPoint);
+		if (!debouncePunctureExit(puncture.exit_steps, state.events, length, true, settings.hysteresis))
+		{
+			puncture.penetration_length = std::max(length, Scalar(0));
+			state.full_penetration_length += puncture.penetration_length;
+			return;
+		}
+		state.exited_handles.push_back(puncture.handle);
+		punctures.pop_back();
+		state.exited_punctures++;
+	}
+}
+
+// Same as checkContact(): adds the force of a respondable tissue to the engine force and punctures if it is too high.
+template<typename Scalar> static void checkCoreContact(sCoreState<Scalar>& state, const sCoreInput<Scalar>& input,
+	const sCoreSettings<Scalar>& settings, const sContactCluster<Scalar>& cluster)
+{
+	const sCoreContact<Scalar>& contact = input.contacts[(size_t)cluster.first];
+	Scalar force_magnitude = settings.use_only_z_force_on_engine ? cluster.axial : cluster.normal;
+	if (cluster.respondable)
+	{
+		state.engine_force_magnitude += force_magnitude;
+		state.engine_force += cluster.force;
+		state.tip_engine_force += cluster.tip_force;
+	}
+
+	// A tissue left in this step is entered again in the next step at the earliest.
+	bool left = (std::find(state.exited_handles.begin(), state.exited_handles.end(), cluster.handle) != state.exited_handles.end());
+	Scalar threshold = settings.constant_puncture_threshold ? settings.puncture_threshold : contact.puncture_force;
+	if (cluster.respondable && !left && debouncePunctureEntry(state.candidates, state.events, cluster.handle, force_magnitude, threshold, settings.hysteresis))
+	{
+		sCorePuncture<Scalar> puncture;
+		puncture.handle = cluster.handle;
+		puncture.position = input.toolTipPoint;
+		puncture.direction = input.needleAxis;
+		puncture.damping = contact.damping;
+		puncture.penetration_length = punctureDepth(puncture.position, puncture.direction, input.toolTipPoint);
+		puncture.exit_steps = 0;
+		state.full_penetration_length += puncture.penetration_length;
+		state.punctures.push_back(puncture);
+		state.new_punctures++;
+	}
+}
+
+/**
+* @brief One step of the straight needle with an analytic force model, see punctureCore.h
+*/
+template<typename Scalar> void stepPunctureCore(sCoreState<Scalar>& state, const sCoreInput<Scalar>& input, const sCoreSettings<Scalar>& settings)
+{
+	state.new_punctures = 0;
+	state.exited_punctures = 0;
+	state.exited_handles.clear();
+	if (state.punctures.empty())
+		state.full_penetration_length = Scalar(0);
+
+	checkCorePunctures(state, input, settings);
+
+	state.clusters.clear();
+	for (size_t i = 0; i < input.contacts.size(); i++)
+	{
+		const sCoreContact<Scalar>& contact = input.contacts[i];
+		clusterContact(state.clusters, contact.handle, (int)i, contact.force, contact.respondable);
+	}
+	projectContactClusters(state.clusters, input.tipRotation);
+
+	state.engine_force_magnitude = Scalar(0);
+	state.engine_force.setZero();
+	state.tip_engine_force.setZero();
+	for (const sContactCluster<Scalar>& cluster : state.clusters)
+		checkCoreContact(state, input, settings, cluster);
+	endPunctureEntries(state.candidates, state.events);
+
+	if (settings.force_model == CORE_KARNOPP)
+		state.f_ext_magnitude = karnoppForce(state.full_penetration_length, input.needleVelocity) * sKarnopp<Scalar>::scale();
+	else
+		state.f_ext_magnitude = kelvinVoigtForce(state.punctures, input.needleVelocity);
+	state.f_ext_magnitude *= settings.model_force_scalar;
+	if (settings.use_only_z_force_on_engine)
+		state.f_ext_magnitude += state.tip_engine_force.z() * settings.engine_force_scalar;
+	else
+		state.f_ext_magnitude += state.engine_force.norm() * settings.engine_force_scalar;
+	state.f_ext = state.f_ext_magnitude * input.dummyDirection;
+}
+
+// The only instantiations: the haptic path in float and offline calibration in double.
+#define INSTANTIATE_PUNCTURE_CORE(Scalar) \
+	template struct sCoreState<Scalar>; \
+	template Scalar signum<Scalar>(Scalar); \
+	template int punctureSide<Scalar>(const tVector3<Scalar>&, const tVector3<Scalar>&, const tVector3<Scalar>&); \
+	template Scalar punctureDepth<Scalar>(const tVector3<Scalar>&, const tVector3<Scalar>&, const tVector3<Scalar>&); \
+	template Scalar tipAxialForce<Scalar>(const tMatrix3<Scalar>&, const tVector3<Scalar>&); \
+	template Scalar karnoppForce<Scalar>(Scalar, Scalar); \
+	template Scalar kelvinVoigtForce<Scalar>(const std::vector<sCorePuncture<Scalar>>&, Scalar); \
+	template void clusterContact<Scalar>(std::vector<sContactCluster<Scalar>>&, int, int, const tVector3<Scalar>&, bool); \
+	template void projectContactClusters<Scalar>(std::vector<sContactCluster<Scalar>>&, const tMatrix3<Scalar>&); \
+	template bool debouncePunctureEntry<Scalar>(std::vector<sPunctureCandidate>&, sPunctureEventCounts&, int, Scalar, Scalar, \
+		const sPunctureHysteresis<Scalar>&); \
+	template bool debouncePunctureExit<Scalar>(int&, sPunctureEventCounts&, Scalar, bool, const sPunctureHysteresis<Scalar>&); \
+	template void stepPunctureCore<Scalar>(sCoreState<Scalar>&, const sCoreInput<Scalar>&, const sCoreSettings<Scalar>&);
+
+INSTANTIATE_PUNCTURE_CORE(float)
+INSTANTIATE_PUNCTURE_CORE(double)
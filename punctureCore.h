@@ -0,0 +1,171 @@
+// Peter: Core of the needle-tissue model templated on the scalar type: the puncture geometry, the puncture
+// stack of a straight needle and the analytic force models (Kelvin-Voigt, Karnopp).
+//
+// The haptic path wants float, to keep the SIMD width of the rest of the step; offline calibration wants
+// double. stepNeedle() (needleModel.h) measures its punctures and evaluates the two analytic models with the
+// float instantiation. stepPunctureCore() is the straight-needle step of these models on its own, and is
+// what the batch simulator runs in either precision (sBatchSettings::precision). The templates are defined in
+// punctureCore.cpp and instantiated there for float and double only.
+//
+// Literals are written as Scalar(...) and every conversion between the precisions is explicit, so that neither
+// instantiation converts implicitly (MSVC C4244/C4305).
+
+#pragma once
+
+#include <stdint.h>
+#include <vector>
+
+#include <Eigen/Core>
+
+template<typename Scalar> using tVector3 = Eigen::Matrix<Scalar, 3, 1>;
+template<typename Scalar> using tMatrix3 = Eigen::Matrix<Scalar, 3, 3>;
+
+// Coefficients of the bidirectional Karnopp friction model, in the precision of the instantiation.
+template<typename Scalar> struct sKarnopp {
+	static constexpr Scalar D_p() { return Scalar(18.45); }		// Positive static friction coefficient. Unit: N/m
+	static constexpr Scalar D_n() { return Scalar(-18.23); }	// Negative static friction coefficient. Unit: N/m
+	static constexpr Scalar b_p() { return Scalar(212.13); }	// Positive damping coefficient. Unit: N-s/m^2
+	static constexpr Scalar b_n() { return Scalar(-293.08); }	// Negative damping coefficient. Unit: N-s/m^2
+	static constexpr Scalar C_p() { return Scalar(10.57); }		// Positive dynamic friction coefficient. Unit: N/m
+	static constexpr Scalar C_n() { return Scalar(-11.96); }	// Negative dynamic friction coefficient. Unit: N/m
+	static constexpr Scalar zero_threshold() { return Scalar(5.0e-6); }	// (delta v/2 in paper) Threshold on static and dynamic friction. Unit: m/s
+	static constexpr Scalar scale() { return Scalar(0.1); }		// The model force is scaled down by this.
+};
+
+// Puncture state machine of one tissue, shared by stepNeedle() and stepPunctureCore():
+//   outside   the tissue is not touched, or only below its puncture threshold
+//   entering  a contact is above (1 + entry_margin) * threshold; it punctures after entry_steps steps in a row,
+//             dropping to the threshold or below (or the contact going away) calls it off
+//   inside    the tissue is punctured and not respondable
+//   exiting   the tip is exit_depth or more behind the entry point; the puncture is left after exit_steps
+//             steps in a row, the tip getting in front of the entry point again calls it off
+// Between the levels the count is held. A tissue changes from outside to inside or back at most once per step,
+// so that a needle dithering at a surface does not make the engine rebuild the tissue every step.
+template<typename Scalar> struct sPunctureHysteresis {
+	Scalar entry_margin = Scalar(0.2);				// Relative to the puncture threshold.
+	Scalar exit_depth = Scalar(1.0e-3);				// Unit: m
+	int entry_steps = 2;
+	int exit_steps = 2;
+};
+
+// A contact that is entering its tissue.
+struct sPunctureCandidate {
+	int handle;
+	int steps;										// Steps in a row above the entry force.
+	bool held;										// A contact above the threshold was seen in this step.
+};
+
+// Puncture events of a needle since its reset.
+struct sPunctureEventCounts {
+	uint64_t entries = 0;
+	uint64_t exits = 0;
+	uint64_t entries_avoided = 0;					// Candidates called off before entry_steps.
+	uint64_t exits_avoided = 0;						// Exits called off before exit_steps.
+};
+
+// Contacts of one tissue in a step, summed. Puncture detection and the force graphs work on these instead of on
+// the single contacts the engine reports, which can be many per tissue.
+template<typename Scalar> struct sContactCluster {
+	int handle;
+	int first;										// Index of the first contact of the tissue, for its coefficients.
+	int contacts;									// Number of contacts of the tissue.
+	bool respondable;
+	tVector3<Scalar> force = tVector3<Scalar>::Zero();	// Sum of the contact forces in world coordinates.
+	tVector3<Scalar> tip_force = tVector3<Scalar>::Zero();	// The same in the frame of the LWR tip.
+	Scalar normal = Scalar(0);						// |force|. The engine reports the forces normal to the contact surface.
+	Scalar axial = Scalar(0);						// Along the z axis of the LWR tip, the needle.
+	Scalar lateral = Scalar(0);						// Across the needle.
+};
+
+// Puncture of the core: where the needle entered and the coefficients the analytic models need.
+template<typename Scalar> struct sCorePuncture {
+	int handle;
+	tVector3<Scalar> position;						// Entry point.
+	tVector3<Scalar> direction;						// Needle axis at the entry.
+	Scalar damping;									// Kelvin-Voigt damping per penetration length. Unit: N-s/m^2
+	Scalar penetration_length;						// Unit: m
+	int exit_steps;									// Steps in a row the tip was behind the exit depth.
+};
+
+template<typename Scalar> struct sCoreContact {
+	int handle;
+	tVector3<Scalar> force;							// Contact force in world coordinates.
+	Scalar damping;									// Of the touched tissue, copied into its puncture.
+	Scalar puncture_force;							// Puncture threshold of the touched tissue. Unit: N
+	bool respondable;
+};
+
+template<typename Scalar> struct sCoreInput {
+	tVector3<Scalar> toolTipPoint = tVector3<Scalar>::Zero();
+	tVector3<Scalar> needleAxis = tVector3<Scalar>::UnitZ();
+	tVector3<Scalar> dummyDirection = tVector3<Scalar>::UnitZ();
+	tMatrix3<Scalar> tipRotation = tMatrix3<Scalar>::Identity();	// LWR tip frame to world.
+	Scalar needleVelocity = Scalar(0);				// Unit: m/s
+	std::vector<sCoreContact<Scalar>> contacts;
+};
+
+enum eCoreForceModel {
+	CORE_KELVIN_VOIGT = 0,
+	CORE_KARNOPP = 1,
+};
+
+// The part of sNeedleConfig the core uses.
+template<typename Scalar> struct sCoreSettings {
+	eCoreForceModel force_model = CORE_KELVIN_VOIGT;
+	bool use_only_z_force_on_engine = true;
+	bool constant_puncture_threshold = false;		// Use puncture_threshold for all tissues instead of their puncture_force.
+	Scalar puncture_threshold = Scalar(1.0e-2);		// Unit: N
+	sPunctureHysteresis<Scalar> hysteresis;
+	Scalar model_force_scalar = Scalar(1);
+	Scalar engine_force_scalar = Scalar(1);
+};
+
+template<typename Scalar> struct sCoreState {
+	std::vector<sCorePuncture<Scalar>> punctures;
+	Scalar full_penetration_length = Scalar(0);
+	Scalar engine_force_magnitude = Scalar(0);
+	tVector3<Scalar> engine_force = tVector3<Scalar>::Zero();
+	Scalar f_ext_magnitude = Scalar(0);
+	tVector3<Scalar> f_ext = tVector3<Scalar>::Zero();
+	int new_punctures = 0;							// Punctures added and left in the last step.
+	int exited_punctures = 0;
+	std::vector<int> exited_handles;				// Tissues left in the last step.
+	std::vector<sContactCluster<Scalar>> clusters;	// Contacts of the last step by tissue.
+	tVector3<Scalar> tip_engine_force = tVector3<Scalar>::Zero();	// engine_force in the frame of the LWR tip.
+	std::vector<sPunctureCandidate> candidates;
+	sPunctureEventCounts events;
+
+	void reset();
+};
+
+template<typename Scalar> Scalar signum(Scalar x);
+// 1 while the tip is on the inner side of the entry plane of a puncture, -1 once it is back out.
+template<typename Scalar> int punctureSide(const tVector3<Scalar>& entry, const tVector3<Scalar>& direction, const tVector3<Scalar>& tip);
+// Distance of the tip from the entry point, negative once it is back out.
+template<typename Scalar> Scalar punctureDepth(const tVector3<Scalar>& entry, const tVector3<Scalar>& direction, const tVector3<Scalar>& tip);
+// Force along the z axis of the LWR tip. tipRotation: tip frame to world, force: world frame.
+template<typename Scalar> Scalar tipAxialForce(const tMatrix3<Scalar>& tipRotation, const tVector3<Scalar>& force);
+// Karnopp friction of the whole penetration length, before sKarnopp::scale().
+template<typename Scalar> Scalar karnoppForce(Scalar full_penetration_length, Scalar needleVelocity);
+template<typename Scalar> Scalar kelvinVoigtForce(const std::vector<sCorePuncture<Scalar>>& punctures, Scalar needleVelocity);
+
+// Adds a contact to the cluster of its tissue. index: position of the contact in the list of the step.
+template<typename Scalar> void clusterContact(std::vector<sContactCluster<Scalar>>& clusters, int handle, int index,
+	const tVector3<Scalar>& force, bool respondable);
+// Expresses the sums of all clusters in the tip frame, several clusters per matrix product, and splits them up.
+template<typename Scalar> void projectContactClusters(std::vector<sContactCluster<Scalar>>& clusters, const tMatrix3<Scalar>& tipRotation);
+
+// Entering: called for the contacts of every respondable tissue that is neither punctured nor left in this step.
+// True in the step the tissue is punctured. Call endPunctureEntries() once all contacts of the step are done.
+template<typename Scalar> bool debouncePunctureEntry(std::vector<sPunctureCandidate>& candidates, sPunctureEventCounts& events,
+	int handle, Scalar force, Scalar threshold, const sPunctureHysteresis<Scalar>& hysteresis);
+// Drops the candidates that were not held in this step.
+void endPunctureEntries(std::vector<sPunctureCandidate>& candidates, sPunctureEventCounts& events);
+// Exiting: called every step for the innermost puncture with its length. A signed length is negative behind the
+// entry point, other lengths (fields, CT volume) are only inside (> 0) or outside. True in the step it is left.
+template<typename Scalar> bool debouncePunctureExit(int& exitSteps, sPunctureEventCounts& events, Scalar length, bool signedLength,
+	const sPunctureHysteresis<Scalar>& hysteresis);
+
+// Straight-needle step: the same bookkeeping as checkPunctures(), clusterContacts() and checkContacts() of stepNeedle() without
+// fields, volume or bevel, then the Kelvin-Voigt or Karnopp force with the engine force, as modelExternalForces().
+template<typename Scalar> void stepPunctureCore(sCoreState<Scalar>& state, const sCoreInput<Scalar>& input, const sCoreSettings<Scalar>& settings);
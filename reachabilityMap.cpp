@@ -0,0 +1,309 @@
+// Peter: Precomputed reachability of needle entry poses. See reachabilityMap.h.
+
+#include "reachabilityMap.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <math.h>
+
+#include "threadPool.h"
+
+#ifdef _WIN32
+	#define NOMINMAX
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+using namespace Eigen;
+
+static const float TWO_PI = 6.2831853f;
+
+sReachabilitySettings defaultReachabilitySettings()
+{
+	sReachabilitySettings settings;
+	settings.chain = lwr4Chain();
+	settings.ik.max_iterations = 100;				// Most poses are cold starts far from the last solution.
+	return settings;
+}
+
+size_t reachabilityCellCount(const sReachabilityHeader& header)
+{
+	return (size_t)header.cells[0] * header.cells[1] * header.cells[2] * header.polar_bins * header.azimuth_bins;
+}
+
+sLwrFrame reachabilityTarget(const Vector3f& position, const Vector3f& direction, float roll)
+{
+	Vector3f z = direction.normalized();
+	Vector3f x = z.unitOrthogonal();
+	x = AngleAxisf(roll, z) * x;
+	sLwrFrame frame;
+	frame.rotation.col(0) = x;
+	frame.rotation.col(1) = z.cross(x);
+	frame.rotation.col(2) = z;
+	frame.position = position;
+	return frame;
+}
+
+// Centre of cell i of n over [min, max]; the cells are the grid points, a single cell sits in the middle.
+static float cellCentre(float min, float max, int n, int i)
+{
+	return (n > 1) ? min + (max - min) * i / (n - 1) : 0.5f * (min + max);
+}
+
+// Direction at the centre of a direction bin.
+static Vector3f binDirection(const sReachabilityHeader& header, int polar, int azimuth)
+{
+	float theta = (polar + 0.5f) * header.max_polar / header.polar_bins;
+	float phi = (azimuth + 0.5f) * TWO_PI / header.azimuth_bins;
+	return Vector3f(sinf(theta) * cosf(phi), sinf(theta) * sinf(phi), -cosf(theta));
+}
+
+static float manipulability(const sLwrChain& chain, const LwrJoints& q)
+{
+	sLwrFrame tool;
+	LwrJacobian jacobian = lwrJacobian(chain, q, tool);
+	Matrix<float, 6, 6> product = jacobian * jacobian.transpose();
+	return sqrtf(std::max(product.determinant(), 0.0f));
+}
+
+/**
+* @brief Reachability of all poses of the map, see reachabilityMap.h
+* @param settings: arm, box of the entry positions and resolution
+* @param pool: runs the entry positions in parallel
+* @param header: receives the header of the map
+* @param cells: receives one byte per cell
+*/
+void buildReachabilityMap(const sReachabilitySettings& settings, CThreadPool& pool, sReachabilityHeader& header, std::vector<uint8_t>& cells)
+{
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, REACHABILITY_MAGIC, sizeof(header.magic));
+	header.version = REACHABILITY_VERSION;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		header.cells[axis] = std::max(settings.cells[axis], 1);
+		header.min[axis] = settings.min[axis];
+		header.max[axis] = settings.max[axis];
+	}
+	header.polar_bins = std::max(settings.polar_bins, 1);
+	header.azimuth_bins = std::max(settings.azimuth_bins, 1);
+	header.max_polar = settings.max_polar;
+
+	sLwrChain chain = settings.chain;
+	sLwrFrame needle;
+	needle.position = Vector3f(0.0f, 0.0f, settings.needle_length);
+	chain.tool = chain.tool * needle;
+
+	// One task per entry position; the directions of a position are warm started from each other,
+	// so the result does not depend on the number of threads.
+	const int directions = header.polar_bins * header.azimuth_bins;
+	const int positions = header.cells[0] * header.cells[1] * header.cells[2];
+	std::vector<float> values((size_t)positions * directions, 0.0f);
+	pool.parallelFor(positions, [&](size_t index) {
+		int x = (int)(index % header.cells[0]);
+		int y = (int)((index / header.cells[0]) % header.cells[1]);
+		int z = (int)(index / ((size_t)header.cells[0] * header.cells[1]));
+		Vector3f position(cellCentre(header.min[0], header.max[0], header.cells[0], x),
+			cellCentre(header.min[1], header.max[1], header.cells[1], y),
+			cellCentre(header.min[2], header.max[2], header.cells[2], z));
+		LwrJoints warm = chain.posture;
+		for (int polar = 0; polar < header.polar_bins; polar++)
+		{
+			for (int azimuth = 0; azimuth < header.azimuth_bins; azimuth++)
+			{
+				Vector3f direction = binDirection(header, polar, azimuth);
+				float best = 0.0f;
+				for (int roll = 0; roll < settings.rolls; roll++)
+				{
+					sLwrFrame target = reachabilityTarget(position, direction, roll * TWO_PI / settings.rolls);
+					LwrJoints q = warm;
+					bool converged = lwrInverseKinematics(chain, target, q, settings.ik).converged;
+					if (!converged && (warm != chain.posture))
+					{
+						q = chain.posture;
+						converged = lwrInverseKinematics(chain, target, q, settings.ik).converged;
+					}
+					if (!converged)
+						continue;
+					warm = q;
+					best = std::max(best, manipulability(chain, q));
+				}
+				values[index * directions + polar * header.azimuth_bins + azimuth] = best;
+			}
+		}
+	});
+
+	float scale = *std::max_element(values.begin(), values.end());
+	header.manipulability_scale = scale;
+	cells.resize(values.size());
+	for (size_t i = 0; i < values.size(); i++)
+	{
+		if (values[i] <= 0.0f)
+			cells[i] = 0;
+		else
+			cells[i] = (uint8_t)std::min(std::max((int)lroundf(1.0f + 254.0f * values[i] / scale), 1), 255);
+	}
+}
+
+bool writeReachabilityMap(const std::string& path, const sReachabilityHeader& header, const std::vector<uint8_t>& cells)
+{
+	FILE* file = std::fopen(path.c_str(), "wb");
+	if (file == NULL)
+		return false;
+	bool written = (std::fwrite(&header, sizeof(header), 1, file) == 1)
+		&& (std::fwrite(cells.data(), 1, cells.size(), file) == cells.size());
+	return (std::fclose(file) == 0) && written;
+}
+
+CReachabilityMap::CReachabilityMap()
+	: _header(NULL), _cells(NULL), _size(0)
+#ifdef _WIN32
+	, _file(INVALID_HANDLE_VALUE), _mapping(NULL)
+#else
+	, _file(-1)
+#endif
+{
+}
+
+CReachabilityMap::~CReachabilityMap()
+{
+	close();
+}
+
+/**
+* @brief Maps a map file read-only. An open map is closed first.
+* @return false if the file is missing, truncated or not a map of this version
+*/
+bool CReachabilityMap::open(const std::string& path)
+{
+	close();
+	void* view = NULL;
+#ifdef _WIN32
+	_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (_file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	if (GetFileSizeEx(_file, &size) && (size.QuadPart >= (LONGLONG)sizeof(sReachabilityHeader)))
+	{
+		_size = (size_t)size.QuadPart;
+		_mapping = CreateFileMappingA(_file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (_mapping != NULL)
+			view = MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+	}
+#else
+	_file = ::open(path.c_str(), O_RDONLY);
+	if (_file < 0)
+		return false;
+	struct stat status;
+	if ((fstat(_file, &status) == 0) && (status.st_size >= (off_t)sizeof(sReachabilityHeader)))
+	{
+		_size = (size_t)status.st_size;
+		view = mmap(NULL, _size, PROT_READ, MAP_SHARED, _file, 0);
+		if (view == MAP_FAILED)
+			view = NULL;
+	}
+#endif
+	_header = (const sReachabilityHeader*)view;
+	if ((_header == NULL) || (std::memcmp(_header->magic, REACHABILITY_MAGIC, sizeof(_header->magic)) != 0)
+		|| (_header->version != REACHABILITY_VERSION)
+		|| (_header->cells[0] < 1) || (_header->cells[1] < 1) || (_header->cells[2] < 1)
+		|| (_header->polar_bins < 1) || (_header->azimuth_bins < 1)
+		|| (_size != sizeof(sReachabilityHeader) + reachabilityCellCount(*_header)))
+	{
+		close();
+		return false;
+	}
+	_cells = (const uint8_t*)view + sizeof(sReachabilityHeader);
+	return true;
+}
+
+void CReachabilityMap::close()
+{
+#ifdef _WIN32
+	if (_header != NULL)
+		UnmapViewOfFile(_header);
+	if (_mapping != NULL)
+		CloseHandle(_mapping);
+	if (_file != INVALID_HANDLE_VALUE)
+		CloseHandle(_file);
+	_mapping = NULL;
+	_file = INVALID_HANDLE_VALUE;
+#else
+	if (_header != NULL)
+		munmap((void*)_header, _size);
+	if (_file >= 0)
+		::close(_file);
+	_file = -1;
+#endif
+	_header = NULL;
+	_cells = NULL;
+	_size = 0;
+}
+
+bool CReachabilityMap::isOpen() const
+{
+	return _header != NULL;
+}
+
+const sReachabilityHeader& CReachabilityMap::getHeader() const
+{
+	return *_header;
+}
+
+// Cell of a coordinate on one axis, the nearest grid point; an axis with a single cell takes any coordinate.
+static bool axisCell(float value, float min, float max, int n, int& cell)
+{
+	if (n == 1)
+	{
+		cell = 0;
+		return true;
+	}
+	float spacing = (max - min) / (n - 1);
+	float position = (value - min) / spacing;
+	if (!(position >= -0.5f) || !(position < n - 0.5f))
+		return false;
+	cell = std::min(std::max((int)floorf(position + 0.5f), 0), n - 1);
+	return true;
+}
+
+/**
+* @brief Reachability of an insertion pose, O(1)
+* @param position: needle tip at the entry point, in the world
+* @param direction: insertion direction, does not need to be normalized
+*/
+sReachability CReachabilityMap::query(const Vector3f& position, const Vector3f& direction) const
+{
+	sReachability result;
+	if (_header == NULL)
+		return result;
+	const sReachabilityHeader& header = *_header;
+
+	int cell[3];
+	for (int axis = 0; axis < 3; axis++)
+		if (!axisCell(position(axis), header.min[axis], header.max[axis], header.cells[axis], cell[axis]))
+			return result;
+
+	float norm = direction.norm();
+	if (!(norm > 0.0f))
+		return result;
+	float theta = acosf(std::min(std::max(-direction.z() / norm, -1.0f), 1.0f));
+	if (theta > header.max_polar)
+		return result;
+	int polar = std::min((int)(theta / header.max_polar * header.polar_bins), header.polar_bins - 1);
+	float phi = atan2f(direction.y(), direction.x());
+	if (phi < 0.0f)
+		phi += TWO_PI;
+	int azimuth = std::min((int)(phi / TWO_PI * header.azimuth_bins), header.azimuth_bins - 1);
+
+	size_t index = ((((size_t)cell[2] * header.cells[1] + cell[1]) * header.cells[0] + cell[0]) * header.polar_bins + polar) * header.azimuth_bins + azimuth;
+	uint8_t value = _cells[index];
+	result.inside = true;
+	result.reachable = (value != 0);
+	if (result.reachable)
+		result.manipulability = (value - 1) * header.manipulability_scale / 254.0f;
+	return result;
+}
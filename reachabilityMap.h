@@ -0,0 +1,101 @@
+// Peter: Precomputed reachability of needle entry poses for the LWR.
+//
+// The map is a grid over the entry positions (a box around the phantom surface) times a grid over
+// the insertion directions (angle from straight down, -z, and azimuth about z). Every cell holds one
+// byte: 0 if the IK found no solution that puts the needle tip onto the cell centre with the needle
+// along the cell direction, otherwise the Yoshikawa manipulability sqrt(det(J J^T)) of the best
+// solution, quantized to 1..255. The roll about the needle is free, a few rolls are tried.
+//
+// The map is built offline (bin/lwrReachability, see reachabilityTool.cpp) with the IK of
+// lwrKinematics.h, in parallel over the entry positions. The file is a sReachabilityHeader followed
+// by the bytes, the plugin maps it read-only when a scene is bound, a query is one array lookup.
+
+#pragma once
+
+#include <cstddef>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <Eigen/Core>
+
+#include "lwrKinematics.h"
+
+class CThreadPool;
+
+const char REACHABILITY_MAGIC[8] = { 'L', 'W', 'R', 'R', 'E', 'A', 'C', 'H' };
+const int32_t REACHABILITY_VERSION = 1;
+
+// Plain data at the start of the file. Cell (x, y, z, polar, azimuth) is byte
+// (((z * cells[1] + y) * cells[0] + x) * polar_bins + polar) * azimuth_bins + azimuth after the header.
+struct sReachabilityHeader {
+	char magic[8];
+	int32_t version;
+	int32_t cells[3];								// Entry position cells along x, y and z.
+	int32_t polar_bins;								// Bins of the angle between the insertion direction and -z.
+	int32_t azimuth_bins;							// Bins of the azimuth of the insertion direction, over 360 degrees.
+	float min[3];									// Box of the entry positions in the world. Unit: m
+	float max[3];
+	float max_polar;								// Largest angle from -z in the map. Unit: rad
+	float manipulability_scale;						// Manipulability of the byte value 255.
+};
+
+struct sReachabilitySettings {
+	sLwrChain chain;								// Arm with the base in the world, the tool frame is the flange.
+	float needle_length = 0.15f;					// From the flange to the needle tip, along the flange z. Unit: m
+	float min[3] = { 0.4f, -0.2f, 0.1f };			// Box of the entry positions. Unit: m
+	float max[3] = { 0.8f, 0.2f, 0.1f };
+	int cells[3] = { 21, 21, 1 };
+	int polar_bins = 5;
+	int azimuth_bins = 12;
+	float max_polar = 0.785398f;					// 45 degrees
+	int rolls = 4;									// Rolls about the needle tried per pose.
+	sIkSettings ik;
+};
+
+// Result of a query, reachable is false outside the map too.
+struct sReachability {
+	bool reachable = false;
+	bool inside = false;							// The pose lies in the map.
+	float manipulability = 0.0f;					// Dequantized, 0 if not reachable.
+};
+
+// Read-only view of a map file, memory-mapped.
+class CReachabilityMap
+{
+public:
+	CReachabilityMap();
+	virtual ~CReachabilityMap();
+
+	bool open(const std::string& path);
+	void close();
+	bool isOpen() const;
+	const sReachabilityHeader& getHeader() const;
+
+	// Reachability of the cell that contains the pose. position: needle tip at entry, direction: insertion direction.
+	sReachability query(const Eigen::Vector3f& position, const Eigen::Vector3f& direction) const;
+
+private:
+	CReachabilityMap(const CReachabilityMap&);
+	CReachabilityMap& operator=(const CReachabilityMap&);
+
+	const sReachabilityHeader* _header;
+	const uint8_t* _cells;
+	size_t _size;
+#ifdef _WIN32
+	void* _file;
+	void* _mapping;
+#else
+	int _file;
+#endif
+};
+
+// Nominal LWR4+ at the origin and IK settings for cold starts.
+sReachabilitySettings defaultReachabilitySettings();
+// Number of bytes after the header.
+size_t reachabilityCellCount(const sReachabilityHeader& header);
+// Needle tip frame of a pose: z along the insertion direction, roll about it.
+sLwrFrame reachabilityTarget(const Eigen::Vector3f& position, const Eigen::Vector3f& direction, float roll);
+// Solves the IK for every cell, in parallel on pool. header/cells receive the map.
+void buildReachabilityMap(const sReachabilitySettings& settings, CThreadPool& pool, sReachabilityHeader& header, std::vector<uint8_t>& cells);
+bool writeReachabilityMap(const std::string& path, const sReachabilityHeader& header, const std::vector<uint8_t>& cells);
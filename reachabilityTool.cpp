@@ -0,0 +1,106 @@
+// Peter: Offline builder of the reachability map of needle entry poses (reachabilityMap.h). Does not need V-REP.
+//
+// Build with "make reachability" and run e.g.
+//   bin/lwrReachability --base 0 0 0 --min 0.4 -0.2 0.1 --max 0.8 0.2 0.1 --out reachability.map
+// and copy the map next to V-REP, the plugin loads reachability.map at simulation start.
+//
+// Options:
+//   --out PATH          map file (default reachability.map)
+//   --base X Y Z        position of the LWR base (joint 1) in the world, the base is upright (default 0 0 0)
+//   --min X Y Z         corner of the box of entry positions, e.g. the phantom surface (default 0.4 -0.2 0.1)
+//   --max X Y Z         other corner (default 0.8 0.2 0.1)
+//   --cells NX NY NZ    entry positions along each axis (default 21 21 1)
+//   --directions P A    bins of the angle from straight down and of the azimuth (default 5 12)
+//   --max-angle DEG     largest angle of the insertion direction from straight down (default 45)
+//   --needle LENGTH     flange to needle tip (default 0.15)
+//   --rolls N           rolls about the needle tried per pose (default 4)
+//   --threads T         number of worker threads besides the main thread (default: all cores)
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "reachabilityMap.h"
+#include "threadPool.h"
+
+int main(int argc, char* argv[])
+{
+	sReachabilitySettings settings = defaultReachabilitySettings();
+	size_t workers = CThreadPool::defaultWorkerCount();
+	std::string path = "reachability.map";
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string option(argv[i]);
+		int count = ((option == "--base") || (option == "--min") || (option == "--max") || (option == "--cells")) ? 3
+			: (option == "--directions") ? 2 : 1;
+		if (i + count >= argc)
+		{
+			std::fprintf(stderr, "Missing value for %s\n", option.c_str());
+			return 1;
+		}
+		const char* value = argv[i + 1];
+		float values[3] = { 0.0f, 0.0f, 0.0f };
+		for (int k = 0; k < count; k++)
+			values[k] = (float)std::atof(argv[++i]);
+
+		if (option == "--out")
+			path = value;
+		else if (option == "--base")
+			settings.chain.base.position = Eigen::Vector3f(values[0], values[1], values[2]);
+		else if ((option == "--min") || (option == "--max"))
+		{
+			for (int axis = 0; axis < 3; axis++)
+				((option == "--min") ? settings.min : settings.max)[axis] = values[axis];
+		}
+		else if (option == "--cells")
+		{
+			for (int axis = 0; axis < 3; axis++)
+				settings.cells[axis] = (int)values[axis];
+		}
+		else if (option == "--directions")
+		{
+			settings.polar_bins = (int)values[0];
+			settings.azimuth_bins = (int)values[1];
+		}
+		else if (option == "--max-angle")
+			settings.max_polar = values[0] * 3.14159265f / 180.0f;
+		else if (option == "--needle")
+			settings.needle_length = values[0];
+		else if (option == "--rolls")
+			settings.rolls = (int)values[0];
+		else if (option == "--threads")
+			workers = (size_t)values[0];
+		else
+		{
+			std::fprintf(stderr, "Unknown option %s\n", option.c_str());
+			return 1;
+		}
+	}
+
+	CThreadPool pool(workers);
+	sReachabilityHeader header;
+	std::vector<uint8_t> cells;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	buildReachabilityMap(settings, pool, header, cells);
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+	size_t reachable = 0;
+	for (uint8_t cell : cells)
+		reachable += (cell != 0);
+	std::printf("%d x %d x %d positions, %d x %d directions, %d rolls, %d threads\n",
+		header.cells[0], header.cells[1], header.cells[2], header.polar_bins, header.azimuth_bins,
+		settings.rolls, (int)pool.getParticipantCount());
+	std::printf("%d of %d poses reachable (%.1f%%), largest manipulability %g, %.2f s\n",
+		(int)reachable, (int)cells.size(), 100.0 * reachable / cells.size(), header.manipulability_scale, seconds);
+
+	if (!writeReachabilityMap(path, header, cells))
+	{
+		std::fprintf(stderr, "Could not write %s\n", path.c_str());
+		return 1;
+	}
+	std::printf("Wrote %s\n", path.c_str());
+	return 0;
+}
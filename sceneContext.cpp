@@ -0,0 +1,40 @@
+// Peter: Plugin state of one open scene. See sceneContext.h.
+
+#include "sceneContext.h"
+
+CSceneContexts::CSceneContexts()
+	: _current(NULL)
+{
+}
+
+sSceneContext& CSceneContexts::select(int scene)
+{
+	std::unique_ptr<sSceneContext>& context = _contexts[scene];
+	if (!context)
+	{
+		context.reset(new sSceneContext());
+		context->scene = scene;
+	}
+	_current = context.get();
+	return *_current;
+}
+
+void CSceneContexts::erase(int scene)
+{
+	std::map<int, std::unique_ptr<sSceneContext> >::iterator context = _contexts.find(scene);
+	if (context == _contexts.end())
+		return;
+	if (context->second.get() == _current)
+		_current = NULL;
+	_contexts.erase(context);
+}
+
+sSceneContext* CSceneContexts::current() const
+{
+	return _current;
+}
+
+size_t CSceneContexts::size() const
+{
+	return _contexts.size();
+}
@@ -0,0 +1,55 @@
+// Peter: Plugin state of one open scene.
+//
+// V-REP can have several scenes open at once (instances), and object handles are only unique within a scene.
+// Everything the plugin resolves or caches for a scene lives in its sSceneContext: the needles with their
+// handles and state, the tissues with their names and puncture counts, the signed distance fields and the
+// CT volume. The plugin keeps one context per scene, keyed by the unique id of the scene, so switching to
+// another scene only switches the current context and switching back finds everything as it was. The context
+// of a scene is dropped when the scene is closed, with its haptic channels, fields and mapped volume.
+//
+// The needles and the phantom are bound to the objects of the scene when it is loaded and whenever its
+// content changes (see CNeedleInstance::bind()), so that simulation start does not look up any object.
+
+#pragma once
+
+#include <map>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "needleInstance.h"
+#include "tissueSdf.h"
+#include "tissueVolume.h"
+
+struct sSceneContext {
+	int scene = -1;									// sim_intparam_scene_unique_id
+	int phantomHandle = -1;							// -1 if the scene has no _Phantom, nothing is punctured then.
+	std::vector<CNeedleInstance> needles;			// All needles of the scene with their required objects.
+	bool bound = false;								// phantomHandle and needles match the objects of the scene.
+	bool running = false;							// The scene is simulated, its needles are rebound in place.
+	std::vector<std::string> bindingReport;			// Last report of the binding, printed when it changes.
+	CTissueRegistry tissues;
+	std::map<int, std::shared_ptr<CTissueSdf> > tissueFields;	// Signed distance fields of the phantom's shapes, by handle.
+	bool fieldsValid = false;						// tissueFields match the scene, reset when its content changes.
+	CTissueVolume volume;							// Labeled CT volume of the phantom, see tissueVolume.h. Mapped across runs.
+	std::string volumePath;							// File volume is mapped from, empty if none.
+	std::vector<sTissueParameters> volumeTissues;	// Coefficients of the labels of volume.
+};
+
+class CSceneContexts
+{
+public:
+	CSceneContexts();
+
+	// Makes the context of a scene the current one, creates it at the first switch to the scene.
+	sSceneContext& select(int scene);
+	// Drops the context of a closed scene. The current context is NULL until the next select() if it was that one.
+	void erase(int scene);
+	// NULL before the first select().
+	sSceneContext* current() const;
+	size_t size() const;
+
+private:
+	std::map<int, std::unique_ptr<sSceneContext> > _contexts;
+	sSceneContext* _current;
+};
@@ -0,0 +1,106 @@
+// Peter: Run-time choice of the SIMD variant of the shaft loop. See shaftKernel.h.
+
+#include "shaftKernel.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+
+#if defined(NEEDLE_SIMD_DISPATCH) && defined(_MSC_VER)
+	#include <immintrin.h>
+	#include <intrin.h>
+#endif
+
+static std::atomic<int> currentLevel(-1);			// -1 until the first use.
+
+static eSimdLevel detectSimdLevel()
+{
+#if !defined(NEEDLE_SIMD_DISPATCH)
+	return SIMD_GENERIC;
+#elif defined(_MSC_VER)
+	int info[4];
+	__cpuid(info, 0);
+	if (info[0] < 7)
+		return SIMD_GENERIC;
+	__cpuid(info, 1);
+	bool fma = ((info[2] & (1 << 12)) != 0);
+	if ((info[2] & (1 << 27)) == 0)					// The OS does not save the AVX registers (no OSXSAVE).
+		return SIMD_GENERIC;
+	unsigned long long xcr0 = _xgetbv(0);
+	__cpuidex(info, 7, 0);
+	bool avx2 = ((info[1] & (1 << 5)) != 0);
+	bool avx512 = ((info[1] & (1 << 16)) != 0);
+	if (avx512 && ((xcr0 & 0xE6) == 0xE6))			// SSE, AVX, opmask and ZMM state.
+		return SIMD_AVX512;
+	if (avx2 && fma && ((xcr0 & 0x6) == 0x6))
+		return SIMD_AVX2;
+	return SIMD_GENERIC;
+#else
+	// libgcc and compiler-rt also check that the OS saves the registers.
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("avx512f"))
+		return SIMD_AVX512;
+	if (__builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		return SIMD_AVX2;
+	return SIMD_GENERIC;
+#endif
+}
+
+eSimdLevel supportedSimdLevel()
+{
+	static const eSimdLevel supported = detectSimdLevel();
+	return supported;
+}
+
+eSimdLevel simdLevel()
+{
+	int level = currentLevel.load(std::memory_order_relaxed);
+	if (level >= 0)
+		return (eSimdLevel)level;
+	// Several threads may get here at once, they all store the same level.
+	level = supportedSimdLevel();
+	const char* cap = std::getenv("NEEDLE_SIMD");
+	for (int i = SIMD_GENERIC; (cap != NULL) && (i < level); i++)
+	{
+		if (std::strcmp(cap, simdLevelName((eSimdLevel)i)) == 0)
+			level = i;
+	}
+	currentLevel.store(level, std::memory_order_relaxed);
+	return (eSimdLevel)level;
+}
+
+void setSimdLevel(eSimdLevel level)
+{
+	currentLevel.store((level < supportedSimdLevel()) ? level : supportedSimdLevel(), std::memory_order_relaxed);
+}
+
+const char* simdLevelName(eSimdLevel level)
+{
+	switch (level)
+	{
+	case SIMD_AVX2:
+		return "avx2";
+	case SIMD_AVX512:
+		return "avx512";
+	default:
+		return "generic";
+	}
+}
+
+bool shaftKernel(const sShaftKernelData& data, sShaftKernelSums& sums)
+{
+#if defined(NEEDLE_SIMD_DISPATCH)
+	switch (simdLevel())
+	{
+	case SIMD_AVX512:
+		shaftKernelAvx512(data, sums);
+		return true;
+	case SIMD_AVX2:
+		shaftKernelAvx2(data, sums);
+		return true;
+	default:
+		break;
+	}
+#endif
+	return false;
+}
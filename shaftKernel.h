@@ -0,0 +1,55 @@
+// Peter: SIMD variants of the segment loop of the shaft model (shaftModel.h), picked at run time.
+//
+// The CMake build with NEEDLE_SIMD_VARIANTS compiles the loop two more times, with AVX2 + FMA
+// (shaftKernelAvx2.cpp) and with AVX-512 (shaftKernelAvx512.cpp), and defines NEEDLE_SIMD_DISPATCH.
+// shaftModel() then runs the widest variant the CPU supports and falls back to its Eigen loop, which
+// uses the instruction set of the rest of the build (SSE2 on x86-64), everywhere else.
+//
+// The variants work on raw arrays with intrinsics and do not include Eigen: an inline function that is
+// compiled with AVX in one translation unit and without it in another could be merged by the linker into
+// the AVX copy, which would then also run on CPUs without AVX.
+//
+// The environment variable NEEDLE_SIMD (generic, avx2 or avx512) caps the variant, e.g. to compare them.
+
+#pragma once
+
+enum eSimdLevel {
+	SIMD_GENERIC = 0,								// Eigen loop of shaftModel().
+	SIMD_AVX2 = 1,
+	SIMD_AVX512 = 2,
+};
+
+// Segments of the shaft as structure of arrays, see sShaftState.
+struct sShaftKernelData {
+	int count;
+	const float* s;
+	const float* friction;
+	const float* damping;
+	const float* stiffness;
+	const float* entry[3];
+	const float* direction[3];
+	float tip[3];
+	float axis[3];
+	float sign;										// sgn(v)
+	float v;
+};
+
+// Sums over the segments, not yet multiplied by the segment length.
+struct sShaftKernelSums {
+	float axial;									// friction * sign + damping * v
+	float lateral[3];								// stiffness * (offset from the entry line)
+};
+
+void shaftKernelAvx2(const sShaftKernelData& data, sShaftKernelSums& sums);
+void shaftKernelAvx512(const sShaftKernelData& data, sShaftKernelSums& sums);
+
+// Widest variant this build has and the CPU supports.
+eSimdLevel supportedSimdLevel();
+// Variant shaftKernel() runs, supportedSimdLevel() capped by NEEDLE_SIMD unless set.
+eSimdLevel simdLevel();
+// Levels above the supported one are lowered to it.
+void setSimdLevel(eSimdLevel level);
+const char* simdLevelName(eSimdLevel level);
+
+// Runs the current variant. false for SIMD_GENERIC, the caller then runs its own loop.
+bool shaftKernel(const sShaftKernelData& data, sShaftKernelSums& sums);
@@ -0,0 +1,70 @@
+// Peter: AVX2 + FMA variant of the shaft loop. See shaftKernel.h. Only compiled with -mavx2 -mfma (or /arch:AVX2)
+// by the CMake build with NEEDLE_SIMD_VARIANTS.
+
+#include "shaftKernel.h"
+
+#if defined(__AVX2__)
+
+#include <immintrin.h>
+
+static inline float horizontalSum(__m256 v)
+{
+	__m128 sum = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+	sum = _mm_add_ps(sum, _mm_movehl_ps(sum, sum));
+	sum = _mm_add_ss(sum, _mm_shuffle_ps(sum, sum, 1));
+	return _mm_cvtss_f32(sum);
+}
+
+void shaftKernelAvx2(const sShaftKernelData& data, sShaftKernelSums& sums)
+{
+	const __m256 sign = _mm256_set1_ps(data.sign);
+	const __m256 v = _mm256_set1_ps(data.v);
+	__m256 tip[3], axis[3];
+	for (int k = 0; k < 3; k++)
+	{
+		tip[k] = _mm256_set1_ps(data.tip[k]);
+		axis[k] = _mm256_set1_ps(data.axis[k]);
+	}
+	__m256 axial = _mm256_setzero_ps();
+	__m256 lateral[3] = { _mm256_setzero_ps(), _mm256_setzero_ps(), _mm256_setzero_ps() };
+
+	int i = 0;
+	for (; i + 8 <= data.count; i += 8)
+	{
+		axial = _mm256_fmadd_ps(_mm256_loadu_ps(data.friction + i), sign, axial);
+		axial = _mm256_fmadd_ps(_mm256_loadu_ps(data.damping + i), v, axial);
+
+		// Offset of the segments from the entry points of their tissues, and its part along the entry directions.
+		__m256 s = _mm256_loadu_ps(data.s + i);
+		__m256 offset[3], direction[3];
+		__m256 along = _mm256_setzero_ps();
+		for (int k = 0; k < 3; k++)
+		{
+			offset[k] = _mm256_sub_ps(_mm256_fmadd_ps(s, axis[k], tip[k]), _mm256_loadu_ps(data.entry[k] + i));
+			direction[k] = _mm256_loadu_ps(data.direction[k] + i);
+			along = _mm256_fmadd_ps(offset[k], direction[k], along);
+		}
+		__m256 stiffness = _mm256_loadu_ps(data.stiffness + i);
+		for (int k = 0; k < 3; k++)
+			lateral[k] = _mm256_fmadd_ps(stiffness, _mm256_fnmadd_ps(along, direction[k], offset[k]), lateral[k]);
+	}
+
+	sums.axial = horizontalSum(axial);
+	for (int k = 0; k < 3; k++)
+		sums.lateral[k] = horizontalSum(lateral[k]);
+	for (; i < data.count; i++)
+	{
+		sums.axial += data.friction[i] * data.sign + data.damping[i] * data.v;
+		float offset[3];
+		float along = 0.0f;
+		for (int k = 0; k < 3; k++)
+		{
+			offset[k] = data.tip[k] + data.s[i] * data.axis[k] - data.entry[k][i];
+			along += offset[k] * data.direction[k][i];
+		}
+		for (int k = 0; k < 3; k++)
+			sums.lateral[k] += data.stiffness[i] * (offset[k] - along * data.direction[k][i]);
+	}
+}
+
+#endif
@@ -0,0 +1,61 @@
+// Peter: AVX-512 variant of the shaft loop. See shaftKernel.h. Only compiled with -mavx512f (or /arch:AVX512)
+// by the CMake build with NEEDLE_SIMD_VARIANTS.
+
+#include "shaftKernel.h"
+
+#if defined(__AVX512F__)
+
+#include <immintrin.h>
+
+// Once per call. _mm512_reduce_add_ps would do, but trips -Wuninitialized in the headers of GCC 12.
+static inline float horizontalSum(__m512 v)
+{
+	float lanes[16];
+	_mm512_storeu_ps(lanes, v);
+	float sum = 0.0f;
+	for (int i = 0; i < 16; i++)
+		sum += lanes[i];
+	return sum;
+}
+
+void shaftKernelAvx512(const sShaftKernelData& data, sShaftKernelSums& sums)
+{
+	const __m512 sign = _mm512_set1_ps(data.sign);
+	const __m512 v = _mm512_set1_ps(data.v);
+	__m512 tip[3], axis[3];
+	for (int k = 0; k < 3; k++)
+	{
+		tip[k] = _mm512_set1_ps(data.tip[k]);
+		axis[k] = _mm512_set1_ps(data.axis[k]);
+	}
+	__m512 axial = _mm512_setzero_ps();
+	__m512 lateral[3] = { _mm512_setzero_ps(), _mm512_setzero_ps(), _mm512_setzero_ps() };
+
+	// The last block is loaded with a mask, the lanes past the end read zeros and add nothing.
+	for (int i = 0; i < data.count; i += 16)
+	{
+		__mmask16 mask = (data.count - i >= 16) ? (__mmask16)0xFFFF : (__mmask16)((1u << (data.count - i)) - 1u);
+		axial = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, data.friction + i), sign, axial);
+		axial = _mm512_fmadd_ps(_mm512_maskz_loadu_ps(mask, data.damping + i), v, axial);
+
+		// Offset of the segments from the entry points of their tissues, and its part along the entry directions.
+		__m512 s = _mm512_maskz_loadu_ps(mask, data.s + i);
+		__m512 offset[3], direction[3];
+		__m512 along = _mm512_setzero_ps();
+		for (int k = 0; k < 3; k++)
+		{
+			offset[k] = _mm512_sub_ps(_mm512_fmadd_ps(s, axis[k], tip[k]), _mm512_maskz_loadu_ps(mask, data.entry[k] + i));
+			direction[k] = _mm512_maskz_loadu_ps(mask, data.direction[k] + i);
+			along = _mm512_fmadd_ps(offset[k], direction[k], along);
+		}
+		__m512 stiffness = _mm512_maskz_loadu_ps(mask, data.stiffness + i);
+		for (int k = 0; k < 3; k++)
+			lateral[k] = _mm512_fmadd_ps(stiffness, _mm512_fnmadd_ps(along, direction[k], offset[k]), lateral[k]);
+	}
+
+	sums.axial = horizontalSum(axial);
+	for (int k = 0; k < 3; k++)
+		sums.lateral[k] = horizontalSum(lateral[k]);
+}
+
+#endif
@@ -0,0 +1,110 @@
+// Peter: Needle shaft discretized into segments. See shaftModel.h.
+
+#include "shaftModel.h"
+#include "shaftKernel.h"
+
+#include <algorithm>
+#include <math.h>
+
+using namespace Eigen;
+
+int sShaftState::size() const
+{
+	return (int)s.size();
+}
+
+void sShaftState::resize(int segments, float shaft_length)
+{
+	float length = shaft_length / segments;
+	if ((segments == size()) && (length == segment_length))
+		return;
+	segment_length = length;
+	s = ArrayXf::LinSpaced(segments, 0.5f * length, (segments - 0.5f) * length);
+	ArrayXf* arrays[] = { &friction, &damping, &stiffness, &entryX, &entryY, &entryZ,
+		&directionX, &directionY, &directionZ, &offsetX, &offsetY, &offsetZ, &along };
+	for (ArrayXf* array : arrays)
+		array->setZero(segments);
+	tissue.assign(segments, -1);
+}
+
+void sShaftState::tag(const std::vector<sShaftLayer>& layers)
+{
+	friction.setZero();
+	damping.setZero();
+	stiffness.setZero();
+	std::fill(tissue.begin(), tissue.end(), -1);
+	for (size_t l = 0; l < layers.size(); l++)
+	{
+		const sShaftLayer& layer = layers[l];
+		// Segments whose center lies in [begin, end)
+		int first = std::max(0, (int)ceilf(layer.begin / segment_length - 0.5f));
+		int last = std::min(size(), (int)ceilf(layer.end / segment_length - 0.5f));
+		if (first >= last)
+			continue;
+		int count = last - first;
+		friction.segment(first, count).setConstant(layer.friction);
+		damping.segment(first, count).setConstant(layer.damping);
+		stiffness.segment(first, count).setConstant(layer.lateral_stiffness);
+		entryX.segment(first, count).setConstant(layer.entry.x());
+		entryY.segment(first, count).setConstant(layer.entry.y());
+		entryZ.segment(first, count).setConstant(layer.entry.z());
+		directionX.segment(first, count).setConstant(layer.direction.x());
+		directionY.segment(first, count).setConstant(layer.direction.y());
+		directionZ.segment(first, count).setConstant(layer.direction.z());
+		std::fill(tissue.begin() + first, tissue.begin() + last, (int)l);
+	}
+}
+
+/**
+* @brief Forces on all segments of the shaft, see shaftModel.h
+* @param state: tagged segments, see sShaftState::tag()
+* @param tip: position of the needle tip
+* @param axis: unit vector from the tip towards the back of the needle
+* @param v: axial velocity, positive when inserting. Unit: m/s
+* @return summed axial and lateral forces
+*/
+sShaftForces shaftModel(sShaftState& state, const Vector3f& tip, const Vector3f& axis, float v)
+{
+	sShaftForces forces;
+	const float ds = state.segment_length;
+	float sign = (v > 0.0f) ? 1.0f : ((v < 0.0f) ? -1.0f : 0.0f);
+
+	// AVX2/AVX-512 variant of the loop below, if the build has one for this CPU.
+	sShaftKernelData data;
+	data.count = state.size();
+	data.s = state.s.data();
+	data.friction = state.friction.data();
+	data.damping = state.damping.data();
+	data.stiffness = state.stiffness.data();
+	const ArrayXf* entry[3] = { &state.entryX, &state.entryY, &state.entryZ };
+	const ArrayXf* direction[3] = { &state.directionX, &state.directionY, &state.directionZ };
+	for (int k = 0; k < 3; k++)
+	{
+		data.entry[k] = entry[k]->data();
+		data.direction[k] = direction[k]->data();
+		data.tip[k] = tip(k);
+		data.axis[k] = axis(k);
+	}
+	data.sign = sign;
+	data.v = v;
+	sShaftKernelSums sums;
+	if (shaftKernel(data, sums))
+	{
+		forces.axial = ds * sums.axial;
+		forces.lateral = -ds * Vector3f(sums.lateral[0], sums.lateral[1], sums.lateral[2]);
+		return forces;
+	}
+
+	forces.axial = ds * (state.friction * sign + state.damping * v).sum();
+
+	// Offset of every segment from the entry point of its tissue, and its part along the entry direction.
+	state.offsetX = tip.x() + state.s * axis.x() - state.entryX;
+	state.offsetY = tip.y() + state.s * axis.y() - state.entryY;
+	state.offsetZ = tip.z() + state.s * axis.z() - state.entryZ;
+	state.along = state.offsetX * state.directionX + state.offsetY * state.directionY + state.offsetZ * state.directionZ;
+	// The tissue pulls each segment back onto its entry line.
+	forces.lateral.x() = -ds * (state.stiffness * (state.offsetX - state.along * state.directionX)).sum();
+	forces.lateral.y() = -ds * (state.stiffness * (state.offsetY - state.along * state.directionY)).sum();
+	forces.lateral.z() = -ds * (state.stiffness * (state.offsetZ - state.along * state.directionZ)).sum();
+	return forces;
+}
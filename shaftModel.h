@@ -0,0 +1,60 @@
+// Peter: Needle shaft discretized into segments, each with the friction of the tissue it sits in.
+//
+// The shaft is cut into N equal segments, measured from the tip backwards along the needle axis.
+// The puncture stack tells which tissue each segment is in: the layer of puncture i reaches from its
+// entry point to the entry point of puncture i + 1 (the innermost layer reaches to the tip).
+//
+// Every segment inside tissue contributes, per length ds,
+//   axial:    friction * sgn(v) + damping * v
+//   lateral:  -lateral_stiffness * (offset of the segment from the line the needle entered that tissue along)
+// so a needle that is tilted away from its insertion path is pushed back, and the axial force depends
+// on where along the shaft each tissue is instead of on full_penetration_length alone.
+//
+// The segment data is kept as structure of arrays and evaluated with Eigen array expressions,
+// which Eigen compiles to SIMD code. Builds with AVX2/AVX-512 variants pick one at run time, see shaftKernel.h.
+
+#pragma once
+
+#include <vector>
+
+#include <Eigen/Core>
+
+// Part of the shaft inside one tissue.
+struct sShaftLayer {
+	float begin;									// Distance from the tip where the layer starts. Unit: m
+	float end;										// Distance from the tip where the layer ends (entry point). Unit: m
+	Eigen::Vector3f entry;							// Entry point of the needle into this tissue.
+	Eigen::Vector3f direction;						// Direction of the needle when it entered this tissue.
+	float friction;									// Unit: N/m
+	float damping;									// Unit: N-s/m^2
+	float lateral_stiffness;						// Unit: N/m^2
+};
+
+struct sShaftForces {
+	float axial;									// Along the insertion direction. Unit: N
+	Eigen::Vector3f lateral;						// Perpendicular to the entry directions, world frame. Unit: N
+};
+
+struct sShaftState {
+	float segment_length = 0.0f;					// ds. Unit: m
+	Eigen::ArrayXf s;								// Distance of each segment center from the tip. Unit: m
+	Eigen::ArrayXf friction;						// Coefficients of the tissue of each segment, 0 outside tissue.
+	Eigen::ArrayXf damping;
+	Eigen::ArrayXf stiffness;
+	Eigen::ArrayXf entryX, entryY, entryZ;			// Entry point of the tissue of each segment.
+	Eigen::ArrayXf directionX, directionY, directionZ;	// Entry direction of the tissue of each segment.
+	Eigen::ArrayXf offsetX, offsetY, offsetZ;		// Scratch: segment position relative to its entry point.
+	Eigen::ArrayXf along;							// Scratch: offset along the entry direction.
+	std::vector<int> tissue;						// Index of the layer of each segment, -1 outside tissue.
+
+	int size() const;
+	// Allocates the segments. Only reallocates when the discretization changes.
+	void resize(int segments, float shaft_length);
+	// Tags every segment with the layer it sits in and gathers the layer coefficients.
+	void tag(const std::vector<sShaftLayer>& layers);
+};
+
+// Friction and lateral forces of all segments of a straight shaft.
+// tip: position of the needle tip. axis: unit vector from the tip towards the back of the needle.
+// v: axial velocity, positive when inserting.
+sShaftForces shaftModel(sShaftState& state, const Eigen::Vector3f& tip, const Eigen::Vector3f& axis, float v);
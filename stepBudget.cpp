@@ -0,0 +1,136 @@
+// Peter: Time budget of the module-handle pass. See stepBudget.h.
+
+#include "stepBudget.h"
+
+#include <algorithm>
+
+CStepBudget::CStepBudget()
+{
+	reset();
+}
+
+void CStepBudget::configure(const sStepBudgetSettings& settings)
+{
+	_settings = settings;
+	_settings.shed_after = std::max(settings.shed_after, 1);
+	_settings.restore_after = std::max(settings.restore_after, 1);
+	_settings.graph_period = std::max(settings.graph_period, 1);
+	_settings.trace_period = std::max(settings.trace_period, 1);
+	_settings.ik_iterations = std::max(settings.ik_iterations, 1);
+	if (_settings.budget <= 0.0)
+		_level = BUDGET_FULL;
+}
+
+const sStepBudgetSettings& CStepBudget::getSettings() const
+{
+	return _settings;
+}
+
+void CStepBudget::reset()
+{
+	_statistics = sStepBudgetStatistics();
+	_level = BUDGET_FULL;
+	_over = 0;
+	_under = 0;
+	_pass = 0;
+	_graphsDue = true;
+	_traceDue = true;
+}
+
+void CStepBudget::beginPass()
+{
+	_graphsDue = (_level < BUDGET_GRAPHS) || (_pass % _settings.graph_period == 0);
+	_traceDue = (_level < BUDGET_TELEMETRY) || (_pass % _settings.trace_period == 0);
+	_pass++;
+}
+
+/**
+* @brief End a pass: count it and shed or restore one level if the last passes were over the budget or had headroom
+* @param seconds: time of the pass
+* @param maxLevel: highest level that may be shed, e.g. lower than BUDGET_FILTERS while a haptic device is attached
+*/
+void CStepBudget::endPass(double seconds, eBudgetLevel maxLevel)
+{
+	sStepBudgetStatistics& statistics = _statistics;
+	statistics.average_seconds = (statistics.passes == 0) ? seconds : statistics.average_seconds + 0.01 * (seconds - statistics.average_seconds);
+	statistics.passes++;
+	statistics.last_seconds = seconds;
+	statistics.max_seconds = std::max(statistics.max_seconds, seconds);
+	if (_settings.budget <= 0.0)
+		return;
+
+	bool over = (seconds > _settings.budget);
+	bool headroom = (seconds < _settings.headroom * _settings.budget);
+	if (over)
+		statistics.overruns++;
+	_over = over ? _over + 1 : 0;
+	_under = headroom ? _under + 1 : 0;
+	if (_level > maxLevel)
+	{
+		// E.g. the haptic channel was opened: give the work back at once.
+		_level = maxLevel;
+		statistics.restores++;
+		_over = 0;
+		_under = 0;
+	}
+	else if ((_over >= _settings.shed_after) && (_level < maxLevel))
+	{
+		_level = (eBudgetLevel)(_level + 1);
+		statistics.sheds++;
+		_over = 0;
+	}
+	else if ((_under >= _settings.restore_after) && (_level > BUDGET_FULL))
+	{
+		_level = (eBudgetLevel)(_level - 1);
+		statistics.restores++;
+		_under = 0;
+	}
+}
+
+eBudgetLevel CStepBudget::getLevel() const
+{
+	return _level;
+}
+
+const sStepBudgetStatistics& CStepBudget::getStatistics() const
+{
+	return _statistics;
+}
+
+bool CStepBudget::graphsDue() const
+{
+	return _graphsDue;
+}
+
+bool CStepBudget::traceDue() const
+{
+	return _traceDue;
+}
+
+void CStepBudget::degrade(sNeedleConfig& config) const
+{
+	if (_level >= BUDGET_SUBSTEPS)
+		config.ik.max_iterations = std::min(config.ik.max_iterations, _settings.ik_iterations);
+	if (_level >= BUDGET_FILTERS)
+	{
+		config.use_passivity_control = false;
+		config.force_snapshot = false;
+	}
+}
+
+const char* CStepBudget::levelName(eBudgetLevel level)
+{
+	switch (level)
+	{
+	case BUDGET_GRAPHS:
+		return "graphs";
+	case BUDGET_TELEMETRY:
+		return "telemetry";
+	case BUDGET_SUBSTEPS:
+		return "substeps";
+	case BUDGET_FILTERS:
+		return "filters";
+	default:
+		return "full";
+	}
+}
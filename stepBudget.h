@@ -0,0 +1,85 @@
+// Peter: Time budget of the module-handle pass, with graceful degradation.
+//
+// The plugin measures every pass of onModuleHandle. When passes run over the budget, the governor sheds
+// optional work one level at a time, in this order:
+//   1. graphs     the force graphs are only updated every graph_period passes
+//   2. telemetry  the step trace (stepTracer.h) only records every trace_period passes
+//   3. substeps   the native IK runs at most ik_iterations iterations per pass (it starts from the joint
+//                 positions of the last pass, so it catches up over the next passes)
+//   4. filters    the passivity controller and the extrapolation snapshot are skipped, f_device is f_ext.
+//                 Both only feed the haptic device, this level is never used while the haptic channel is open.
+// and restores it one level at a time when the passes have headroom again. Reading the scene, the force
+// model (f_ext), the puncture bookkeeping and writing back are never shed.
+//
+// Shedding needs shed_after passes in a row over the budget, restoring restore_after passes in a row below
+// headroom * budget, so that a single slow pass does not flip the levels and a restored level that no longer
+// fits is not restored at once. Does not call V-REP, the plugin passes the measured times in.
+
+#pragma once
+
+#include <stdint.h>
+
+#include "needleModel.h"
+
+enum eBudgetLevel {
+	BUDGET_FULL = 0,								// Nothing shed.
+	BUDGET_GRAPHS = 1,
+	BUDGET_TELEMETRY = 2,
+	BUDGET_SUBSTEPS = 3,
+	BUDGET_FILTERS = 4,
+};
+
+struct sStepBudgetSettings {
+	double budget = 0.0;							// Time of one pass. 0: the governor is off. Unit: s
+	float headroom = 0.7f;							// Work is restored below this fraction of the budget.
+	int shed_after = 3;								// Passes in a row over the budget before the next level is shed.
+	int restore_after = 50;							// Passes in a row with headroom before the last level is restored.
+	int graph_period = 4;							// BUDGET_GRAPHS: graphs are updated every graph_period passes.
+	int trace_period = 10;							// BUDGET_TELEMETRY: one pass in trace_period is traced.
+	int ik_iterations = 5;							// BUDGET_SUBSTEPS: iterations of the native IK per pass.
+};
+
+struct sStepBudgetStatistics {
+	uint64_t passes = 0;
+	uint64_t overruns = 0;							// Passes over the budget.
+	uint64_t sheds = 0;								// Level changes up ...
+	uint64_t restores = 0;							// ... and down.
+	double last_seconds = 0.0;						// Time of the last pass. Unit: s
+	double average_seconds = 0.0;					// Moving average over about 100 passes. Unit: s
+	double max_seconds = 0.0;
+};
+
+class CStepBudget
+{
+public:
+	CStepBudget();
+
+	void configure(const sStepBudgetSettings& settings);
+	const sStepBudgetSettings& getSettings() const;
+	// Back to BUDGET_FULL, the statistics are cleared. Called at simulation start.
+	void reset();
+
+	// Starts a pass: decides whether its graphs and trace are due.
+	void beginPass();
+	// Ends a pass that took seconds and moves the level, up to maxLevel.
+	void endPass(double seconds, eBudgetLevel maxLevel = BUDGET_FILTERS);
+
+	eBudgetLevel getLevel() const;
+	const sStepBudgetStatistics& getStatistics() const;
+	bool graphsDue() const;
+	bool traceDue() const;
+	// Applies the substeps and filters levels to the configuration of this pass.
+	void degrade(sNeedleConfig& config) const;
+
+	static const char* levelName(eBudgetLevel level);
+
+private:
+	sStepBudgetSettings _settings;
+	sStepBudgetStatistics _statistics;
+	eBudgetLevel _level;
+	int _over;										// Passes in a row over the budget.
+	int _under;										// Passes in a row with headroom.
+	uint64_t _pass;									// Counts the passes since reset(), for the periods.
+	bool _graphsDue;
+	bool _traceDue;
+};
@@ -0,0 +1,218 @@
+// Peter: Per-thread event buffers of the step tracer and the Chrome trace-event writer. See stepTracer.h.
+
+#include "stepTracer.h"
+
+#include <stdint.h>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+const size_t TRACE_END_RESERVE = 64;				// Slots only the ends of spans may use, deeper nesting is not traced.
+
+struct sTraceEvent {
+	int64_t ns;										// Since traceStart(). Unit: ns
+	const char* name;
+	const char* argName;
+	int32_t arg;
+	char phase;
+	char label[TRACE_LABEL_SIZE];
+};
+
+struct sTraceBuffer {
+	std::vector<sTraceEvent> events;
+	std::atomic<size_t> count;						// Only the owning thread stores, with release, see traceWrite().
+	std::atomic<size_t> dropped;
+	int tid;
+	bool main;
+};
+
+std::atomic<bool> traceActive(false);
+static bool traceSession = false;					// Only touched by the thread that starts and stops the sessions.
+static bool tracePaused = false;
+
+static std::mutex traceMutex;						// Guards the list of buffers, not the buffers.
+static std::vector<std::unique_ptr<sTraceBuffer>> traceBuffers;
+static size_t traceCapacity = TRACE_DEFAULT_EVENTS;
+static std::chrono::steady_clock::time_point traceOrigin;
+
+// Buffer of the calling thread, registered by its first event. Buffers are never freed, a thread that ended
+// leaves its events for traceWrite().
+static sTraceBuffer* threadBuffer()
+{
+	static thread_local sTraceBuffer* buffer = NULL;
+	if (buffer != NULL)
+		return buffer;
+	std::lock_guard<std::mutex> lock(traceMutex);
+	std::unique_ptr<sTraceBuffer> created(new sTraceBuffer());
+	created->events.resize(traceCapacity);
+	created->count.store(0);
+	created->dropped.store(0);
+	created->tid = (int)traceBuffers.size() + 1;
+	created->main = false;
+	buffer = created.get();
+	traceBuffers.push_back(std::move(created));
+	return buffer;
+}
+
+void traceStart(size_t eventsPerThread)
+{
+	traceActive.store(false);
+	sTraceBuffer* own = threadBuffer();
+	std::lock_guard<std::mutex> lock(traceMutex);
+	traceCapacity = std::max(eventsPerThread, 2 * TRACE_END_RESERVE);
+	for (std::unique_ptr<sTraceBuffer>& buffer : traceBuffers)
+	{
+		if (buffer->events.size() != traceCapacity)
+			buffer->events.resize(traceCapacity);
+		buffer->count.store(0);
+		buffer->dropped.store(0);
+		buffer->main = (buffer.get() == own);
+	}
+	traceOrigin = std::chrono::steady_clock::now();
+	traceSession = true;
+	traceActive.store(!tracePaused);
+}
+
+void traceStop()
+{
+	traceSession = false;
+	traceActive.store(false);
+}
+
+bool traceStarted()
+{
+	return traceSession;
+}
+
+void tracePause(bool paused)
+{
+	tracePaused = paused;
+	traceActive.store(traceSession && !paused);
+}
+
+// Drops a UTF-8 sequence that strncpy cut in half, the JSON must stay valid UTF-8.
+static void cutUtf8(char* label)
+{
+	size_t length = std::strlen(label);
+	size_t lead = length;
+	while ((lead > 0) && ((label[lead - 1] & 0xC0) == 0x80))
+		lead--;
+	if (lead == 0)
+		return;
+	unsigned char c = (unsigned char)label[lead - 1];
+	size_t size = (c < 0x80) ? 1 : (c >= 0xF0) ? 4 : (c >= 0xE0) ? 3 : 2;
+	if (lead - 1 + size > length)
+		label[lead - 1] = 0;
+}
+
+bool traceRecord(char phase, const char* name, const char* argName, int arg, const char* label)
+{
+	sTraceBuffer* buffer = threadBuffer();
+	size_t count = buffer->count.load(std::memory_order_relaxed);
+	size_t limit = buffer->events.size() - ((phase == 'E') ? 0 : TRACE_END_RESERVE);
+	if (count >= limit)
+	{
+		buffer->dropped.store(buffer->dropped.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		return false;
+	}
+	sTraceEvent& event = buffer->events[count];
+	event.ns = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - traceOrigin).count();
+	event.name = name;
+	event.argName = argName;
+	event.arg = arg;
+	event.phase = phase;
+	event.label[0] = 0;
+	if (label != NULL)
+	{
+		std::strncpy(event.label, label, TRACE_LABEL_SIZE - 1);
+		event.label[TRACE_LABEL_SIZE - 1] = 0;
+		cutUtf8(event.label);
+	}
+	buffer->count.store(count + 1, std::memory_order_release);
+	return true;
+}
+
+size_t traceEventCount()
+{
+	std::lock_guard<std::mutex> lock(traceMutex);
+	size_t count = 0;
+	for (const std::unique_ptr<sTraceBuffer>& buffer : traceBuffers)
+		count += buffer->count.load(std::memory_order_acquire);
+	return count;
+}
+
+size_t traceDroppedCount()
+{
+	std::lock_guard<std::mutex> lock(traceMutex);
+	size_t dropped = 0;
+	for (const std::unique_ptr<sTraceBuffer>& buffer : traceBuffers)
+		dropped += buffer->dropped.load(std::memory_order_relaxed);
+	return dropped;
+}
+
+// JSON string without the quotes. Tissue names come from the scene and may contain anything.
+static void writeJsonString(FILE* file, const char* text)
+{
+	for (const unsigned char* c = (const unsigned char*)text; *c != 0; c++)
+	{
+		if ((*c == '"') || (*c == '\\'))
+			std::fprintf(file, "\\%c", *c);
+		else if (*c < 0x20)
+			std::fprintf(file, "\\u%04x", *c);
+		else
+			std::fputc(*c, file);
+	}
+}
+
+/**
+* @brief Write the events of the last session as Chrome trace-event JSON
+* @param path: file to write, replaced if it exists
+*/
+bool traceWrite(const std::string& path)
+{
+	FILE* file = std::fopen(path.c_str(), "w");
+	if (file == NULL)
+		return false;
+	std::lock_guard<std::mutex> lock(traceMutex);
+	std::fprintf(file, "{\"displayTimeUnit\":\"ns\",\"traceEvents\":[\n");
+	std::fprintf(file, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"needle simulation\"}}");
+	for (const std::unique_ptr<sTraceBuffer>& buffer : traceBuffers)
+	{
+		size_t count = buffer->count.load(std::memory_order_acquire);
+		if (count == 0)
+			continue;
+		if (buffer->main)
+			std::fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"main\"}}", buffer->tid);
+		else
+			std::fprintf(file, ",\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"thread %d\"}}", buffer->tid, buffer->tid);
+		for (size_t i = 0; i < count; i++)
+		{
+			const sTraceEvent& event = buffer->events[i];
+			// Microseconds with the nanoseconds as decimals.
+			std::fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%lld.%03d,\"pid\":1,\"tid\":%d", event.name, event.phase,
+				(long long)(event.ns / 1000), (int)(event.ns % 1000), buffer->tid);
+			if (event.phase == 'i')
+				std::fprintf(file, ",\"s\":\"t\"");
+			if ((event.argName != NULL) || (event.label[0] != 0))
+			{
+				std::fprintf(file, ",\"args\":{");
+				if (event.argName != NULL)
+					std::fprintf(file, "\"%s\":%d%s", event.argName, event.arg, (event.label[0] != 0) ? "," : "");
+				if (event.label[0] != 0)
+				{
+					std::fprintf(file, "\"label\":\"");
+					writeJsonString(file, event.label);
+					std::fprintf(file, "\"");
+				}
+				std::fprintf(file, "}");
+			}
+			std::fprintf(file, "}");
+		}
+	}
+	std::fprintf(file, "\n]}\n");
+	return (std::fclose(file) == 0);
+}
@@ -0,0 +1,75 @@
+// Peter: Opt-in tracer of the simulation step, written as Chrome trace-event JSON (chrome://tracing, Perfetto).
+//
+// The plugin marks the stages of onModuleHandle (reading the scene, the parallel compute of the needles, writing
+// back) as spans and the puncture events of the model as instants. Every thread records into its own buffer,
+// which it allocates once and then fills without locks; traceWrite() merges the buffers when the threads are
+// idle, i.e. at the end of the simulation.
+//
+// When tracing is off, a span or an instant costs one relaxed load of traceActive and a branch that is always
+// taken the same way. A full buffer drops further events of its thread and counts them; a few slots are kept
+// for the ends of the open spans, so that the spans in the file stay balanced.
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <string>
+
+const size_t TRACE_DEFAULT_EVENTS = 1 << 16;		// Per thread and session, 64 bytes each.
+const size_t TRACE_LABEL_SIZE = 32;					// Labels of the instants (tissue names) are cut to this, with the 0.
+
+// Set by traceStart(), traceStop() and tracePause(). Read it through tracing().
+extern std::atomic<bool> traceActive;
+
+inline bool tracing()
+{
+	return traceActive.load(std::memory_order_relaxed);
+}
+
+// Starts a session: clears the buffers of all threads and sets the time origin. The calling thread is named
+// "main" in the trace. Must not be called while other threads are recording.
+void traceStart(size_t eventsPerThread = TRACE_DEFAULT_EVENTS);
+// Stops recording, the events stay in the buffers until the next traceStart().
+void traceStop();
+// Between traceStart() and traceStop(): is a session open, paused or not.
+bool traceStarted();
+// Skips events without ending the session, e.g. to trace only some passes (see stepBudget.h).
+void tracePause(bool paused);
+// Writes the events of the last session. Must not be called while other threads are recording.
+bool traceWrite(const std::string& path);
+size_t traceEventCount();
+size_t traceDroppedCount();
+
+// Records one event of the calling thread, only call it if tracing(). phase is 'B', 'E' or 'i'.
+// name and argName must be string literals, label is copied. argName NULL: no argument.
+// false if the buffer of the thread is full.
+bool traceRecord(char phase, const char* name, const char* argName = NULL, int arg = 0, const char* label = NULL);
+
+// Span of the enclosing scope.
+class CTraceSpan
+{
+public:
+	explicit CTraceSpan(const char* name, const char* argName = NULL, int arg = 0)
+		: _name(NULL)
+	{
+		if (tracing() && traceRecord('B', name, argName, arg))
+			_name = name;
+	}
+	~CTraceSpan()
+	{
+		if (_name != NULL)
+			traceRecord('E', _name);
+	}
+
+private:
+	CTraceSpan(const CTraceSpan&);
+	CTraceSpan& operator=(const CTraceSpan&);
+
+	const char* _name;								// NULL if the start of the span was not recorded.
+};
+
+inline void traceInstant(const char* name, const char* argName, int arg, const std::string& label)
+{
+	if (tracing())
+		traceRecord('i', name, argName, arg, label.c_str());
+}
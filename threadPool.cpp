@@ -0,0 +1,146 @@
+// Peter: Small fixed-size work-stealing thread pool. See threadPool.h.
+
+#include "threadPool.h"
+
+CThreadPool::CThreadPool(size_t workerCount)
+	: _ranges(new sRange[workerCount + 1]), _task(NULL), _busyWorkers(0), _generation(0), _stop(false)
+{
+	for (size_t i = 0; i <= workerCount; i++)
+		_ranges[i].begin = _ranges[i].end = 0;
+	for (size_t i = 0; i < workerCount; i++)
+		_workers.push_back(std::thread(&CThreadPool::_workerLoop, this, i + 1));
+}
+
+CThreadPool::~CThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stop = true;
+	}
+	_wakeWorkers.notify_all();
+	for (std::thread& worker : _workers)
+		worker.join();
+}
+
+size_t CThreadPool::getWorkerCount() const
+{
+	return _workers.size();
+}
+
+size_t CThreadPool::getParticipantCount() const
+{
+	return _workers.size() + 1;
+}
+
+size_t CThreadPool::defaultWorkerCount()
+{
+	unsigned int cores = std::thread::hardware_concurrency();
+	return (cores > 1) ? cores - 1 : 0;
+}
+
+void CThreadPool::parallelFor(size_t count, const std::function<void(size_t)>& task)
+{
+	parallelForWithParticipant(count, [&task](size_t, size_t i) { task(i); });
+}
+
+void CThreadPool::parallelForWithParticipant(size_t count, const std::function<void(size_t participant, size_t i)>& task)
+{
+	if (count == 0)
+		return;
+	if ((count == 1) || _workers.empty())
+	{ // Not worth waking anybody up
+		for (size_t i = 0; i < count; i++)
+			task(0, i);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		size_t participants = getParticipantCount();
+		for (size_t i = 0; i < participants; i++)
+		{
+			std::lock_guard<std::mutex> rangeLock(_ranges[i].lock);
+			_ranges[i].begin = count * i / participants;
+			_ranges[i].end = count * (i + 1) / participants;
+		}
+		_task = &task;
+		_busyWorkers = _workers.size();
+		_generation++;
+	}
+	_wakeWorkers.notify_all();
+
+	_runTasks(0);
+
+	std::unique_lock<std::mutex> lock(_mutex);
+	_jobDone.wait(lock, [this] { return _busyWorkers == 0; });
+	_task = NULL;
+}
+
+bool CThreadPool::_popFront(size_t participant, size_t& index)
+{
+	sRange& range = _ranges[participant];
+	std::lock_guard<std::mutex> lock(range.lock);
+	if (range.begin >= range.end)
+		return false;
+	index = range.begin++;
+	return true;
+}
+
+bool CThreadPool::_steal(size_t participant)
+{
+	size_t participants = getParticipantCount();
+	for (size_t offset = 1; offset < participants; offset++)
+	{
+		sRange& victim = _ranges[(participant + offset) % participants];
+		size_t begin, end;
+		{
+			std::lock_guard<std::mutex> lock(victim.lock);
+			if (victim.begin >= victim.end)
+				continue;
+			// Take the back half (at least one task), the victim keeps working on the front.
+			end = victim.end;
+			begin = victim.end - (victim.end - victim.begin + 1) / 2;
+			victim.end = begin;
+		}
+		sRange& own = _ranges[participant];
+		std::lock_guard<std::mutex> lock(own.lock);
+		own.begin = begin;
+		own.end = end;
+		return true;
+	}
+	// Ranges only ever shrink, so when all are empty there is nothing left to do.
+	return false;
+}
+
+void CThreadPool::_runTasks(size_t participant)
+{
+	while (true)
+	{
+		size_t index;
+		if (_popFront(participant, index))
+			(*_task)(participant, index);
+		else if (!_steal(participant))
+			return;
+	}
+}
+
+void CThreadPool::_workerLoop(size_t participant)
+{
+	unsigned int seenGeneration = 0;
+	while (true)
+	{
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_wakeWorkers.wait(lock, [this, seenGeneration] { return _stop || (_generation != seenGeneration); });
+			if (_stop)
+				return;
+			seenGeneration = _generation;
+		}
+
+		_runTasks(participant);
+
+		std::lock_guard<std::mutex> lock(_mutex);
+		if (--_busyWorkers == 0)
+			_jobDone.notify_one();
+	}
+}
@@ -0,0 +1,61 @@
+// Peter: Small fixed-size work-stealing thread pool. It runs the pure-compute part of the step
+// (see stepNeedle()) for several needles at once, and the runs of the batch simulator.
+//
+// A parallelFor splits [0, count) into one contiguous range per participant. Every participant
+// works through its own range from the front; when it is empty it steals the back half of the
+// range of another participant. The calling thread takes part in the work, so a pool with zero
+// workers simply runs everything inline.
+
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+class CThreadPool
+{
+public:
+	CThreadPool(size_t workerCount);
+	virtual ~CThreadPool();
+
+	size_t getWorkerCount() const;
+	// Workers plus the calling thread. Participant 0 is always the calling thread.
+	size_t getParticipantCount() const;
+
+	// Calls task(i) for every i in [0, count) and returns when all calls are done.
+	// Must only be called from one thread at a time.
+	void parallelFor(size_t count, const std::function<void(size_t)>& task);
+	// Same, but also tells the task which participant runs it, e.g. to use per-thread accumulators.
+	void parallelForWithParticipant(size_t count, const std::function<void(size_t participant, size_t i)>& task);
+
+	// Number of workers that fits this machine (one core is left to the caller).
+	static size_t defaultWorkerCount();
+
+private:
+	struct sRange {
+		std::mutex lock;
+		size_t begin;
+		size_t end;
+		char padding[64];							// Keep ranges of different participants on different cache lines.
+	};
+
+	void _workerLoop(size_t participant);
+	void _runTasks(size_t participant);
+	bool _popFront(size_t participant, size_t& index);
+	bool _steal(size_t participant);
+
+	std::vector<std::thread> _workers;
+	std::unique_ptr<sRange[]> _ranges;
+	std::mutex _mutex;
+	std::condition_variable _wakeWorkers;
+	std::condition_variable _jobDone;
+
+	const std::function<void(size_t, size_t)>* _task;
+	size_t _busyWorkers;
+	unsigned int _generation;
+	bool _stop;
+};
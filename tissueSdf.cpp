@@ -0,0 +1,543 @@
+// Peter: Signed distance fields of the tissue meshes. See tissueSdf.h.
+
+#include "tissueSdf.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <math.h>
+
+#include <Eigen/Geometry>
+
+#include "threadPool.h"
+
+#ifdef _WIN32
+	#include <direct.h>
+#else
+	#include <sys/stat.h>
+#endif
+
+using namespace Eigen;
+
+static const float SDF_QUANTUM = 32767.0f;
+
+// Triangle of the mesh with the pseudo-normals of its features.
+struct sSdfTriangle {
+	int vertex[3];
+	Vector3f normal;
+	Vector3f edge_normal[3];						// Edge i runs from vertex i to vertex (i + 1) % 3.
+};
+
+// Mesh prepared for distance queries.
+struct sSdfGeometry {
+	std::vector<Vector3f> vertices;
+	std::vector<Vector3f> vertex_normals;			// Angle weighted.
+	std::vector<sSdfTriangle> triangles;
+};
+
+static uint64_t edgeKey(int a, int b)
+{
+	return ((uint64_t)(uint32_t)std::min(a, b) << 32) | (uint32_t)std::max(a, b);
+}
+
+static void prepareGeometry(const sSdfMesh& mesh, sSdfGeometry& geometry)
+{
+	int vertexCount = (int)(mesh.vertices.size() / 3);
+	geometry.vertices.resize(vertexCount);
+	geometry.vertex_normals.assign(vertexCount, Vector3f::Zero());
+	for (int i = 0; i < vertexCount; i++)
+		geometry.vertices[i] = Vector3f(mesh.vertices[3 * i], mesh.vertices[3 * i + 1], mesh.vertices[3 * i + 2]);
+
+	std::map<uint64_t, Vector3f> edgeNormals;
+	geometry.triangles.clear();
+	for (size_t t = 0; t + 2 < mesh.indices.size(); t += 3)
+	{
+		sSdfTriangle triangle;
+		bool valid = true;
+		for (int i = 0; i < 3; i++)
+		{
+			triangle.vertex[i] = mesh.indices[t + i];
+			valid = valid && (triangle.vertex[i] >= 0) && (triangle.vertex[i] < vertexCount);
+		}
+		if (!valid)
+			continue;
+		const Vector3f& a = geometry.vertices[triangle.vertex[0]];
+		const Vector3f& b = geometry.vertices[triangle.vertex[1]];
+		const Vector3f& c = geometry.vertices[triangle.vertex[2]];
+		Vector3f normal = (b - a).cross(c - a);
+		if (!(normal.norm() > 0.0f))
+			continue;
+		triangle.normal = normal.normalized();
+		for (int i = 0; i < 3; i++)
+		{
+			triangle.edge_normal[i].setZero();
+			const Vector3f& corner = geometry.vertices[triangle.vertex[i]];
+			Vector3f e1 = (geometry.vertices[triangle.vertex[(i + 1) % 3]] - corner).normalized();
+			Vector3f e2 = (geometry.vertices[triangle.vertex[(i + 2) % 3]] - corner).normalized();
+			float angle = acosf(std::min(std::max(e1.dot(e2), -1.0f), 1.0f));
+			geometry.vertex_normals[triangle.vertex[i]] += angle * triangle.normal;
+			Vector3f& edge = edgeNormals.insert(std::make_pair(edgeKey(triangle.vertex[i], triangle.vertex[(i + 1) % 3]), Vector3f::Zero())).first->second;
+			edge += triangle.normal;
+		}
+		geometry.triangles.push_back(triangle);
+	}
+	for (sSdfTriangle& triangle : geometry.triangles)
+	{
+		for (int i = 0; i < 3; i++)
+			triangle.edge_normal[i] = edgeNormals[edgeKey(triangle.vertex[i], triangle.vertex[(i + 1) % 3])];
+	}
+}
+
+/**
+* @brief Closest point of a triangle (Ericson, Real-Time Collision Detection 5.1.5)
+* @param offset: receives p minus the closest point
+* @param normal: receives the pseudo-normal of the feature the closest point lies on
+* @return squared distance
+*/
+static float closestPoint(const sSdfGeometry& geometry, const sSdfTriangle& triangle, const Vector3f& p, Vector3f& offset, Vector3f& normal)
+{
+	const Vector3f& a = geometry.vertices[triangle.vertex[0]];
+	const Vector3f& b = geometry.vertices[triangle.vertex[1]];
+	const Vector3f& c = geometry.vertices[triangle.vertex[2]];
+	Vector3f ab = b - a, ac = c - a, ap = p - a;
+	float d1 = ab.dot(ap), d2 = ac.dot(ap);
+	if ((d1 <= 0.0f) && (d2 <= 0.0f))
+	{
+		normal = geometry.vertex_normals[triangle.vertex[0]];
+		offset = ap;
+		return offset.squaredNorm();
+	}
+	Vector3f bp = p - b;
+	float d3 = ab.dot(bp), d4 = ac.dot(bp);
+	if ((d3 >= 0.0f) && (d4 <= d3))
+	{
+		normal = geometry.vertex_normals[triangle.vertex[1]];
+		offset = bp;
+		return offset.squaredNorm();
+	}
+	float vc = d1 * d4 - d3 * d2;
+	if ((vc <= 0.0f) && (d1 >= 0.0f) && (d3 <= 0.0f))
+	{
+		normal = triangle.edge_normal[0];
+		offset = p - (a + d1 / (d1 - d3) * ab);
+		return offset.squaredNorm();
+	}
+	Vector3f cp = p - c;
+	float d5 = ab.dot(cp), d6 = ac.dot(cp);
+	if ((d6 >= 0.0f) && (d5 <= d6))
+	{
+		normal = geometry.vertex_normals[triangle.vertex[2]];
+		offset = cp;
+		return offset.squaredNorm();
+	}
+	float vb = d5 * d2 - d1 * d6;
+	if ((vb <= 0.0f) && (d2 >= 0.0f) && (d6 <= 0.0f))
+	{
+		normal = triangle.edge_normal[2];
+		offset = p - (a + d2 / (d2 - d6) * ac);
+		return offset.squaredNorm();
+	}
+	float va = d3 * d6 - d5 * d4;
+	if ((va <= 0.0f) && (d4 - d3 >= 0.0f) && (d5 - d6 >= 0.0f))
+	{
+		normal = triangle.edge_normal[1];
+		offset = p - (b + (d4 - d3) / ((d4 - d3) + (d5 - d6)) * (c - b));
+		return offset.squaredNorm();
+	}
+	normal = triangle.normal;
+	float denominator = 1.0f / (va + vb + vc);
+	offset = p - (a + ab * (vb * denominator) + ac * (vc * denominator));
+	return offset.squaredNorm();
+}
+
+// Inside test for points far from the surface: parity of the crossings of a ray (Moeller-Trumbore).
+static bool insideByParity(const sSdfGeometry& geometry, const Vector3f& origin)
+{
+	const Vector3f direction = Vector3f(1.0f, 0.0123f, 0.0071f).normalized();	// Off the axes, so it does not run along edges.
+	int crossings = 0;
+	for (const sSdfTriangle& triangle : geometry.triangles)
+	{
+		const Vector3f& a = geometry.vertices[triangle.vertex[0]];
+		Vector3f e1 = geometry.vertices[triangle.vertex[1]] - a;
+		Vector3f e2 = geometry.vertices[triangle.vertex[2]] - a;
+		Vector3f p = direction.cross(e2);
+		float determinant = e1.dot(p);
+		if (fabsf(determinant) < 1.0e-12f)
+			continue;
+		Vector3f s = origin - a;
+		float u = s.dot(p) / determinant;
+		if ((u < 0.0f) || (u > 1.0f))
+			continue;
+		Vector3f q = s.cross(e1);
+		float v = direction.dot(q) / determinant;
+		if ((v < 0.0f) || (u + v > 1.0f))
+			continue;
+		if (e2.dot(q) / determinant > 0.0f)
+			crossings++;
+	}
+	return (crossings & 1) != 0;
+}
+
+CTissueSdf::CTissueSdf()
+{
+	std::memset(&_header, 0, sizeof(_header));
+}
+
+/**
+* @brief Sample the field of a mesh, see tissueSdf.h
+* @param mesh: closed triangle mesh in the frame of the shape
+* @param settings: resolution and band
+* @param pool: samples the bricks in parallel
+* @return false if the mesh has no triangles
+*/
+bool CTissueSdf::build(const sSdfMesh& mesh, const sSdfSettings& settings, CThreadPool& pool)
+{
+	*this = CTissueSdf();
+	sSdfGeometry geometry;
+	prepareGeometry(mesh, geometry);
+	if (geometry.triangles.empty())
+		return false;
+
+	const float voxel = settings.voxel_size;
+	const float band = std::max(settings.band_voxels, 1) * voxel;
+	Vector3f min = geometry.vertices[0], max = geometry.vertices[0];
+	for (const Vector3f& vertex : geometry.vertices)
+	{
+		min = min.cwiseMin(vertex);
+		max = max.cwiseMax(vertex);
+	}
+	min.array() -= band + voxel;
+	max.array() += band + voxel;
+	const float brickSize = SDF_BRICK * voxel;
+
+	std::memcpy(_header.magic, SDF_MAGIC, sizeof(_header.magic));
+	_header.version = SDF_VERSION;
+	_header.brick_size = SDF_BRICK;
+	_header.mesh_hash = sdfMeshHash(mesh, settings);
+	_header.voxel_size = voxel;
+	_header.band = band;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		_header.origin[axis] = min(axis);
+		_header.bricks[axis] = std::max((int)ceilf((max(axis) - min(axis)) / brickSize), 1);
+	}
+	const int bx = _header.bricks[0], by = _header.bricks[1], bz = _header.bricks[2];
+	const size_t brickCount = (size_t)bx * by * bz;
+
+	// Triangles within band of each brick.
+	std::vector<std::vector<int> > candidates(brickCount);
+	for (size_t t = 0; t < geometry.triangles.size(); t++)
+	{
+		const sSdfTriangle& triangle = geometry.triangles[t];
+		Vector3f low = geometry.vertices[triangle.vertex[0]], high = low;
+		for (int i = 1; i < 3; i++)
+		{
+			low = low.cwiseMin(geometry.vertices[triangle.vertex[i]]);
+			high = high.cwiseMax(geometry.vertices[triangle.vertex[i]]);
+		}
+		int first[3], last[3];
+		for (int axis = 0; axis < 3; axis++)
+		{
+			first[axis] = std::max((int)floorf((low(axis) - band - min(axis)) / brickSize), 0);
+			last[axis] = std::min((int)floorf((high(axis) + band - min(axis)) / brickSize), _header.bricks[axis] - 1);
+		}
+		for (int z = first[2]; z <= last[2]; z++)
+			for (int y = first[1]; y <= last[1]; y++)
+				for (int x = first[0]; x <= last[0]; x++)
+					candidates[((size_t)z * by + y) * bx + x].push_back((int)t);
+	}
+
+	std::vector<int32_t> codes(brickCount, SDF_OUTSIDE);
+	std::vector<std::vector<int16_t> > samples(brickCount);
+	pool.parallelFor(brickCount, [&](size_t index) {
+		int x = (int)(index % bx), y = (int)((index / bx) % by), z = (int)(index / ((size_t)bx * by));
+		Vector3f corner = min + brickSize * Vector3f((float)x, (float)y, (float)z);
+		if (candidates[index].empty())
+		{
+			codes[index] = insideByParity(geometry, corner + Vector3f::Constant(0.5f * brickSize)) ? SDF_INSIDE : SDF_OUTSIDE;
+			return;
+		}
+		std::vector<int16_t>& brick = samples[index];
+		brick.resize(SDF_BRICK_SAMPLES);
+		// Distance and sign of the samples within band. The sign of a sample can only differ from that of
+		// its neighbour if both are within one voxel of the surface, so the others take it over by flood fill.
+		std::vector<float> distances(SDF_BRICK_SAMPLES, band);
+		std::vector<int8_t> signs(SDF_BRICK_SAMPLES, 0);
+		std::vector<int> queue;
+		queue.reserve(SDF_BRICK_SAMPLES);
+		for (int k = 0; k <= SDF_BRICK; k++)
+			for (int j = 0; j <= SDF_BRICK; j++)
+				for (int i = 0; i <= SDF_BRICK; i++)
+				{
+					Vector3f p = corner + voxel * Vector3f((float)i, (float)j, (float)k);
+					float best = band * band;
+					Vector3f offset, normal, bestOffset, bestNormal;
+					bool found = false;
+					for (int t : candidates[index])
+					{
+						float squared = closestPoint(geometry, geometry.triangles[t], p, offset, normal);
+						if (squared < best)
+						{
+							best = squared;
+							bestOffset = offset;
+							bestNormal = normal;
+							found = true;
+						}
+					}
+					if (!found)
+						continue;
+					int sample = (k * (SDF_BRICK + 1) + j) * (SDF_BRICK + 1) + i;
+					distances[sample] = sqrtf(best);
+					signs[sample] = (bestOffset.dot(bestNormal) < 0.0f) ? -1 : 1;
+					queue.push_back(sample);
+				}
+		if (queue.empty())
+		{
+			codes[index] = insideByParity(geometry, corner + Vector3f::Constant(0.5f * brickSize)) ? SDF_INSIDE : SDF_OUTSIDE;
+			brick.clear();
+			return;
+		}
+		const int strides[3] = { 1, SDF_BRICK + 1, (SDF_BRICK + 1) * (SDF_BRICK + 1) };
+		for (size_t q = 0; q < queue.size(); q++)
+		{
+			int sample = queue[q];
+			int coordinates[3] = { sample % (SDF_BRICK + 1), (sample / (SDF_BRICK + 1)) % (SDF_BRICK + 1), sample / strides[2] };
+			for (int axis = 0; axis < 3; axis++)
+			{
+				for (int step = -1; step <= 1; step += 2)
+				{
+					int coordinate = coordinates[axis] + step;
+					int neighbour = sample + step * strides[axis];
+					if ((coordinate < 0) || (coordinate > SDF_BRICK) || (signs[neighbour] != 0))
+						continue;
+					signs[neighbour] = signs[sample];
+					queue.push_back(neighbour);
+				}
+			}
+		}
+		for (int sample = 0; sample < SDF_BRICK_SAMPLES; sample++)
+			brick[sample] = (int16_t)lroundf(signs[sample] * std::min(distances[sample] / band, 1.0f) * SDF_QUANTUM);
+		codes[index] = 0;
+	});
+
+	_index.resize(brickCount);
+	for (size_t i = 0; i < brickCount; i++)
+	{
+		if (codes[i] < 0)
+		{
+			_index[i] = codes[i];
+			continue;
+		}
+		_index[i] = _header.stored_bricks++;
+		_samples.insert(_samples.end(), samples[i].begin(), samples[i].end());
+	}
+	return true;
+}
+
+bool CTissueSdf::load(const std::string& path, uint64_t hash)
+{
+	*this = CTissueSdf();
+	FILE* file = std::fopen(path.c_str(), "rb");
+	if (file == NULL)
+		return false;
+	sSdfHeader header;
+	bool valid = (std::fread(&header, sizeof(header), 1, file) == 1)
+		&& (std::memcmp(header.magic, SDF_MAGIC, sizeof(header.magic)) == 0) && (header.version == SDF_VERSION)
+		&& (header.brick_size == SDF_BRICK) && (header.mesh_hash == hash)
+		&& (header.bricks[0] > 0) && (header.bricks[1] > 0) && (header.bricks[2] > 0) && (header.stored_bricks >= 0);
+	if (valid)
+	{
+		_index.resize((size_t)header.bricks[0] * header.bricks[1] * header.bricks[2]);
+		_samples.resize((size_t)header.stored_bricks * SDF_BRICK_SAMPLES);
+		valid = (std::fread(_index.data(), sizeof(int32_t), _index.size(), file) == _index.size())
+			&& (std::fread(_samples.data(), sizeof(int16_t), _samples.size(), file) == _samples.size())
+			&& (std::fgetc(file) == EOF);
+		for (size_t i = 0; valid && (i < _index.size()); i++)
+			valid = (_index[i] == SDF_OUTSIDE) || (_index[i] == SDF_INSIDE) || ((_index[i] >= 0) && (_index[i] < header.stored_bricks));
+	}
+	std::fclose(file);
+	if (!valid)
+	{
+		*this = CTissueSdf();
+		return false;
+	}
+	_header = header;
+	return true;
+}
+
+bool CTissueSdf::save(const std::string& path) const
+{
+	FILE* file = std::fopen(path.c_str(), "wb");
+	if (file == NULL)
+		return false;
+	bool written = (std::fwrite(&_header, sizeof(_header), 1, file) == 1)
+		&& (std::fwrite(_index.data(), sizeof(int32_t), _index.size(), file) == _index.size())
+		&& (std::fwrite(_samples.data(), sizeof(int16_t), _samples.size(), file) == _samples.size());
+	return (std::fclose(file) == 0) && written;
+}
+
+bool CTissueSdf::isValid() const
+{
+	return !_index.empty();
+}
+
+const sSdfHeader& CTissueSdf::getHeader() const
+{
+	return _header;
+}
+
+size_t CTissueSdf::memoryBytes() const
+{
+	return _index.size() * sizeof(int32_t) + _samples.size() * sizeof(int16_t);
+}
+
+/**
+* @brief Signed distance at a point, one index lookup and a trilinear interpolation, O(1)
+* @param point: frame of the shape
+* @return negative inside, +band outside the grid
+*/
+float CTissueSdf::distance(const Vector3f& point) const
+{
+	if (_index.empty())
+		return 0.0f;
+	float voxels[3];
+	int brick[3];
+	for (int axis = 0; axis < 3; axis++)
+	{
+		voxels[axis] = (point(axis) - _header.origin[axis]) / _header.voxel_size;
+		brick[axis] = (int)floorf(voxels[axis] / SDF_BRICK);
+		if (!(voxels[axis] >= 0.0f) || (brick[axis] >= _header.bricks[axis]))
+			return _header.band;
+	}
+	int32_t index = _index[((size_t)brick[2] * _header.bricks[1] + brick[1]) * _header.bricks[0] + brick[0]];
+	if (index < 0)
+		return (index == SDF_INSIDE) ? -_header.band : _header.band;
+
+	int cell[3];
+	float fraction[3];
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float local = voxels[axis] - brick[axis] * SDF_BRICK;
+		cell[axis] = std::min((int)local, SDF_BRICK - 1);
+		fraction[axis] = local - cell[axis];
+	}
+	const int16_t* samples = &_samples[(size_t)index * SDF_BRICK_SAMPLES];
+	const int row = SDF_BRICK + 1, slice = row * row;
+	const int16_t* s = samples + cell[2] * slice + cell[1] * row + cell[0];
+	float x00 = s[0] + fraction[0] * (s[1] - s[0]);
+	float x10 = s[row] + fraction[0] * (s[row + 1] - s[row]);
+	float x01 = s[slice] + fraction[0] * (s[slice + 1] - s[slice]);
+	float x11 = s[slice + row] + fraction[0] * (s[slice + row + 1] - s[slice + row]);
+	float y0 = x00 + fraction[1] * (x10 - x00);
+	float y1 = x01 + fraction[1] * (x11 - x01);
+	return (y0 + fraction[2] * (y1 - y0)) * (_header.band / SDF_QUANTUM);
+}
+
+float CTissueSdf::_uniformRun(const Vector3f& point, const Vector3f& direction) const
+{
+	float run = 1.0e30f;
+	int brick[3];
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float voxels = (point(axis) - _header.origin[axis]) / _header.voxel_size;
+		brick[axis] = (int)floorf(voxels / SDF_BRICK);
+		if (!(voxels >= 0.0f) || (brick[axis] >= _header.bricks[axis]))
+			return 0.0f;
+		float low = _header.origin[axis] + brick[axis] * SDF_BRICK * _header.voxel_size;
+		float high = low + SDF_BRICK * _header.voxel_size;
+		if (direction(axis) > 0.0f)
+			run = std::min(run, (high - point(axis)) / direction(axis));
+		else if (direction(axis) < 0.0f)
+			run = std::min(run, (low - point(axis)) / direction(axis));
+	}
+	return (_index[((size_t)brick[2] * _header.bricks[1] + brick[1]) * _header.bricks[0] + brick[0]] < 0) ? run : 0.0f;
+}
+
+/**
+* @brief Length of a segment inside the mesh. Sphere tracing: a point at distance d from the surface can
+*        advance by d without crossing it, so far from the surface the steps are long, and a brick without
+*        samples is crossed in one step; crossings are interpolated linearly between two samples half a
+*        voxel apart.
+* @param from: frame of the shape
+* @param to: frame of the shape
+*/
+float CTissueSdf::insideLength(const Vector3f& from, const Vector3f& to) const
+{
+	float length = (to - from).norm();
+	if (_index.empty() || !(length > 0.0f))
+		return 0.0f;
+	const Vector3f direction = (to - from) / length;
+	const float min_step = 0.5f * _header.voxel_size;
+	float inside = 0.0f;
+	float t = 0.0f;
+	float d0 = distance(from);
+	while (t < length)
+	{
+		float step = std::max(fabsf(d0), min_step);
+		if (fabsf(d0) >= _header.band)
+			step = std::max(step, _uniformRun(from + t * direction, direction));
+		step = std::min(step, length - t);
+		float d1 = distance(from + (t + step) * direction);
+		if ((d0 < 0.0f) && (d1 < 0.0f))
+			inside += step;
+		else if ((d0 < 0.0f) || (d1 < 0.0f))
+		{
+			float crossing = d0 / (d0 - d1);
+			inside += ((d0 < 0.0f) ? crossing : 1.0f - crossing) * step;
+		}
+		t += step;
+		d0 = d1;
+	}
+	return inside;
+}
+
+static void hashBytes(uint64_t& hash, const void* data, size_t size)
+{
+	const unsigned char* bytes = (const unsigned char*)data;
+	for (size_t i = 0; i < size; i++)
+	{
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+}
+
+uint64_t sdfMeshHash(const sSdfMesh& mesh, const sSdfSettings& settings)
+{
+	uint64_t hash = 14695981039346656037ULL;
+	int32_t format[3] = { SDF_VERSION, SDF_BRICK, settings.band_voxels };
+	hashBytes(hash, format, sizeof(format));
+	hashBytes(hash, &settings.voxel_size, sizeof(settings.voxel_size));
+	hashBytes(hash, mesh.vertices.data(), mesh.vertices.size() * sizeof(float));
+	hashBytes(hash, mesh.indices.data(), mesh.indices.size() * sizeof(int));
+	return hash;
+}
+
+std::string sdfCachePath(const std::string& directory, uint64_t hash)
+{
+	char name[32];
+	std::snprintf(name, sizeof(name), "%016llx.sdf", (unsigned long long)hash);
+	return directory.empty() ? std::string(name) : directory + "/" + name;
+}
+
+bool cachedTissueSdf(const sSdfMesh& mesh, const sSdfSettings& settings, CThreadPool& pool, CTissueSdf& sdf, bool& built)
+{
+	built = false;
+	uint64_t hash = sdfMeshHash(mesh, settings);
+	if (!settings.cache_directory.empty() && sdf.load(sdfCachePath(settings.cache_directory, hash), hash))
+		return true;
+	if (!sdf.build(mesh, settings, pool))
+		return false;
+	built = true;
+	if (!settings.cache_directory.empty())
+	{
+		// The cache is an optimization, a field that could not be written is still used.
+#ifdef _WIN32
+		_mkdir(settings.cache_directory.c_str());
+#else
+		mkdir(settings.cache_directory.c_str(), 0755);
+#endif
+		sdf.save(sdfCachePath(settings.cache_directory, hash));
+	}
+	return true;
+}
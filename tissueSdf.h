@@ -0,0 +1,96 @@
+// Peter: Signed distance fields of the tissue meshes.
+//
+// The puncture length of the straight needle is the distance from the entry point to the tip, and a
+// puncture counts as left when the tip is back behind the entry plane. That is only right for flat
+// tissues the needle crosses once. With a field of the tissue mesh, the model instead asks how much of
+// the shaft between the entry point and the tip lies inside the tissue, and a puncture is left when
+// nothing is inside any more.
+//
+// A field is a grid of bricks of SDF_BRICK^3 voxels in the frame of the shape. Only bricks within
+// band of the surface store samples: (SDF_BRICK + 1)^3 int16 distances at the voxel corners, the last
+// layer shared with the next brick, so a trilinear lookup never leaves its brick. The other bricks
+// are entirely inside or outside and read as -band or +band. The sign comes from the angle-weighted
+// pseudo-normal at the closest point of the mesh, which needs a closed, consistently oriented mesh.
+//
+// Building takes a while, so the fields are cached on disk, keyed by a hash of the mesh and the
+// settings: the file is a sSdfHeader, the brick index and the samples of the stored bricks.
+
+#pragma once
+
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <Eigen/Core>
+
+class CThreadPool;
+
+const char SDF_MAGIC[8] = { 'T', 'I', 'S', 'S', 'U', 'S', 'D', 'F' };
+const int32_t SDF_VERSION = 1;
+const int SDF_BRICK = 8;							// Voxels per brick edge.
+const int SDF_BRICK_SAMPLES = (SDF_BRICK + 1) * (SDF_BRICK + 1) * (SDF_BRICK + 1);
+const int32_t SDF_OUTSIDE = -1;						// Brick index of a brick without samples outside the mesh.
+const int32_t SDF_INSIDE = -2;						// and inside the mesh.
+
+struct sSdfSettings {
+	float voxel_size = 5.0e-4f;						// Unit: m
+	int band_voxels = 3;							// Distances are exact up to this many voxels from the surface.
+	std::string cache_directory = "sdfCache";		// Built fields are written here, "" to not cache.
+};
+
+// Triangle mesh in the frame of the shape. V-REP's layout: 3 floats per vertex, 3 indices per triangle.
+struct sSdfMesh {
+	std::vector<float> vertices;
+	std::vector<int> indices;
+};
+
+// Plain data at the start of a cached field. Brick (x, y, z) is entry (z * bricks[1] + y) * bricks[0] + x
+// of the index, voxel corner (i, j, k) of a stored brick is sample (k * 9 + j) * 9 + i of it.
+struct sSdfHeader {
+	char magic[8];
+	int32_t version;
+	int32_t brick_size;								// SDF_BRICK of the writer.
+	uint64_t mesh_hash;								// sdfMeshHash() of the mesh and the settings.
+	float voxel_size;								// Unit: m
+	float band;										// Largest distance stored, the samples are in units of band / 32767. Unit: m
+	float origin[3];								// Corner of brick (0, 0, 0) in the frame of the shape. Unit: m
+	int32_t bricks[3];
+	int32_t stored_bricks;
+	int32_t padding;
+};
+
+class CTissueSdf
+{
+public:
+	CTissueSdf();
+
+	// Samples the field of a mesh, in parallel over the bricks.
+	bool build(const sSdfMesh& mesh, const sSdfSettings& settings, CThreadPool& pool);
+	// false if the file is missing, damaged or of another mesh.
+	bool load(const std::string& path, uint64_t hash);
+	bool save(const std::string& path) const;
+	bool isValid() const;
+	const sSdfHeader& getHeader() const;
+	// Bytes of the index and the samples.
+	size_t memoryBytes() const;
+
+	// Signed distance, negative inside, clamped to [-band, band]. point: frame of the shape. Unit: m
+	float distance(const Eigen::Vector3f& point) const;
+	// Length of the segment from -> to that lies inside the mesh, frame of the shape. Unit: m
+	float insideLength(const Eigen::Vector3f& from, const Eigen::Vector3f& to) const;
+
+private:
+	// Length the ray stays in the brick of point if that brick is entirely inside or outside, else 0.
+	float _uniformRun(const Eigen::Vector3f& point, const Eigen::Vector3f& direction) const;
+
+	sSdfHeader _header;
+	std::vector<int32_t> _index;
+	std::vector<int16_t> _samples;
+};
+
+// FNV-1a of the mesh and of the settings that change the field.
+uint64_t sdfMeshHash(const sSdfMesh& mesh, const sSdfSettings& settings);
+std::string sdfCachePath(const std::string& directory, uint64_t hash);
+// Field of a mesh from the cache of settings, built and written to the cache if it is not there.
+// built: receives true if the field had to be built.
+bool cachedTissueSdf(const sSdfMesh& mesh, const sSdfSettings& settings, CThreadPool& pool, CTissueSdf& sdf, bool& built);
@@ -0,0 +1,350 @@
+// Peter: Labeled CT volume of the phantom. See tissueVolume.h.
+
+#include "tissueVolume.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <math.h>
+
+#ifdef _WIN32
+	#define NOMINMAX
+	#include <windows.h>
+#else
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+#endif
+
+using namespace Eigen;
+
+static size_t brickCount(const sVolumeHeader& header)
+{
+	return (size_t)header.bricks[0] * header.bricks[1] * header.bricks[2];
+}
+
+/**
+* @brief Writes a volume file, see tissueVolume.h
+* @param dims: voxels along x, y and z
+* @param spacing: size of a voxel. Unit: m
+* @param origin: corner of voxel (0, 0, 0) in the frame of the phantom. Unit: m
+* @param names: name of each label, label 0 is air
+* @param labels: dense grid, x fastest
+* @return false if the file could not be written or the arguments are out of range
+*/
+bool writeTissueVolume(const std::string& path, const int dims[3], const float spacing[3], const float origin[3],
+	const std::vector<std::string>& names, const uint8_t* labels)
+{
+	if (names.empty() || (names.size() > (size_t)VOLUME_LABELS) || (dims[0] < 1) || (dims[1] < 1) || (dims[2] < 1))
+		return false;
+	sVolumeHeader header;
+	std::memset(&header, 0, sizeof(header));
+	std::memcpy(header.magic, VOLUME_MAGIC, sizeof(header.magic));
+	header.version = VOLUME_VERSION;
+	header.brick_size = VOLUME_BRICK;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		header.dims[axis] = dims[axis];
+		header.bricks[axis] = (dims[axis] + VOLUME_BRICK - 1) / VOLUME_BRICK;
+		header.spacing[axis] = spacing[axis];
+		header.origin[axis] = origin[axis];
+	}
+	header.label_count = (int32_t)names.size();
+
+	// Gather every brick; voxels past the end of the grid are air.
+	std::vector<int32_t> index(brickCount(header));
+	std::vector<uint8_t> bricks;
+	std::vector<uint8_t> brick(VOLUME_BRICK_BYTES);
+	size_t b = 0;
+	for (int bz = 0; bz < header.bricks[2]; bz++)
+	{
+		for (int by = 0; by < header.bricks[1]; by++)
+		{
+			for (int bx = 0; bx < header.bricks[0]; bx++, b++)
+			{
+				bool uniform = true;
+				for (int k = 0; k < VOLUME_BRICK; k++)
+				{
+					for (int j = 0; j < VOLUME_BRICK; j++)
+					{
+						for (int i = 0; i < VOLUME_BRICK; i++)
+						{
+							int x = bx * VOLUME_BRICK + i, y = by * VOLUME_BRICK + j, z = bz * VOLUME_BRICK + k;
+							uint8_t value = ((x < dims[0]) && (y < dims[1]) && (z < dims[2]))
+								? labels[((size_t)z * dims[1] + y) * dims[0] + x] : 0;
+							brick[(k * VOLUME_BRICK + j) * VOLUME_BRICK + i] = value;
+							uniform = uniform && (value == brick[0]);
+						}
+					}
+				}
+				if (uniform)
+					index[b] = -1 - (int32_t)brick[0];
+				else
+				{
+					index[b] = header.stored_bricks++;
+					bricks.insert(bricks.end(), brick.begin(), brick.end());
+				}
+			}
+		}
+	}
+
+	std::vector<char> nameTable(names.size() * VOLUME_NAME_LENGTH, 0);
+	for (size_t i = 0; i < names.size(); i++)
+		std::strncpy(&nameTable[i * VOLUME_NAME_LENGTH], names[i].c_str(), VOLUME_NAME_LENGTH - 1);
+	size_t offset = sizeof(header) + nameTable.size() + index.size() * sizeof(int32_t);
+	header.brick_offset = (offset + VOLUME_BRICK_BYTES - 1) / VOLUME_BRICK_BYTES * VOLUME_BRICK_BYTES;
+	std::vector<char> alignment((size_t)header.brick_offset - offset, 0);
+
+	FILE* file = std::fopen(path.c_str(), "wb");
+	if (file == NULL)
+		return false;
+	bool written = (std::fwrite(&header, sizeof(header), 1, file) == 1)
+		&& (std::fwrite(nameTable.data(), 1, nameTable.size(), file) == nameTable.size())
+		&& (std::fwrite(index.data(), sizeof(int32_t), index.size(), file) == index.size())
+		&& (std::fwrite(alignment.data(), 1, alignment.size(), file) == alignment.size())
+		&& (std::fwrite(bricks.data(), 1, bricks.size(), file) == bricks.size());
+	return (std::fclose(file) == 0) && written;
+}
+
+CTissueVolume::CTissueVolume()
+	: _header(NULL), _names(NULL), _index(NULL), _bricks(NULL), _size(0)
+#ifdef _WIN32
+	, _file(INVALID_HANDLE_VALUE), _mapping(NULL)
+#else
+	, _file(-1)
+#endif
+{
+}
+
+CTissueVolume::~CTissueVolume()
+{
+	close();
+}
+
+/**
+* @brief Maps a volume file read-only. An open volume is closed first.
+* @return false if the file is missing, truncated or not a volume of this version
+*/
+bool CTissueVolume::open(const std::string& path)
+{
+	close();
+	void* view = NULL;
+#ifdef _WIN32
+	_file = CreateFileA(path.c_str(), GENERIC_READ, FILE_SHARE_READ, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+	if (_file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	if (GetFileSizeEx(_file, &size) && (size.QuadPart >= (LONGLONG)sizeof(sVolumeHeader)))
+	{
+		_size = (size_t)size.QuadPart;
+		_mapping = CreateFileMappingA(_file, NULL, PAGE_READONLY, 0, 0, NULL);
+		if (_mapping != NULL)
+			view = MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0);
+	}
+#else
+	_file = ::open(path.c_str(), O_RDONLY);
+	if (_file < 0)
+		return false;
+	struct stat status;
+	if ((fstat(_file, &status) == 0) && (status.st_size >= (off_t)sizeof(sVolumeHeader)))
+	{
+		_size = (size_t)status.st_size;
+		view = mmap(NULL, _size, PROT_READ, MAP_SHARED, _file, 0);
+		if (view == MAP_FAILED)
+			view = NULL;
+	}
+#endif
+	_header = (const sVolumeHeader*)view;
+	bool valid = (_header != NULL) && (std::memcmp(_header->magic, VOLUME_MAGIC, sizeof(_header->magic)) == 0)
+		&& (_header->version == VOLUME_VERSION) && (_header->brick_size == VOLUME_BRICK)
+		&& (_header->label_count >= 1) && (_header->label_count <= VOLUME_LABELS) && (_header->stored_bricks >= 0);
+	for (int axis = 0; valid && (axis < 3); axis++)
+	{
+		valid = (_header->dims[axis] >= 1) && (_header->bricks[axis] == (_header->dims[axis] + VOLUME_BRICK - 1) / VOLUME_BRICK)
+			&& (_header->spacing[axis] > 0.0f);
+	}
+	if (valid)
+	{
+		size_t tables = sizeof(sVolumeHeader) + (size_t)_header->label_count * VOLUME_NAME_LENGTH + brickCount(*_header) * sizeof(int32_t);
+		valid = (_header->brick_offset >= tables) && (_header->brick_offset % VOLUME_BRICK_BYTES == 0)
+			&& (_size == _header->brick_offset + (size_t)_header->stored_bricks * VOLUME_BRICK_BYTES);
+	}
+	if (!valid)
+	{
+		close();
+		return false;
+	}
+	_names = (const char*)view + sizeof(sVolumeHeader);
+	_index = (const int32_t*)(_names + (size_t)_header->label_count * VOLUME_NAME_LENGTH);
+	_bricks = (const uint8_t*)view + _header->brick_offset;
+	return true;
+}
+
+void CTissueVolume::close()
+{
+#ifdef _WIN32
+	if (_header != NULL)
+		UnmapViewOfFile(_header);
+	if (_mapping != NULL)
+		CloseHandle(_mapping);
+	if (_file != INVALID_HANDLE_VALUE)
+		CloseHandle(_file);
+	_mapping = NULL;
+	_file = INVALID_HANDLE_VALUE;
+#else
+	if (_header != NULL)
+		munmap((void*)_header, _size);
+	if (_file >= 0)
+		::close(_file);
+	_file = -1;
+#endif
+	_header = NULL;
+	_names = NULL;
+	_index = NULL;
+	_bricks = NULL;
+	_size = 0;
+}
+
+bool CTissueVolume::isOpen() const
+{
+	return _header != NULL;
+}
+
+const sVolumeHeader& CTissueVolume::getHeader() const
+{
+	return *_header;
+}
+
+std::string CTissueVolume::labelName(int label) const
+{
+	if ((_header == NULL) || (label < 0) || (label >= _header->label_count))
+		return "";
+	const char* name = _names + (size_t)label * VOLUME_NAME_LENGTH;
+	return std::string(name, strnlen(name, VOLUME_NAME_LENGTH));
+}
+
+size_t CTissueVolume::fileBytes() const
+{
+	return _size;
+}
+
+int CTissueVolume::label(const Vector3f& point) const
+{
+	if (_header == NULL)
+		return 0;
+	const sVolumeHeader& header = *_header;
+	int voxel[3];
+	for (int axis = 0; axis < 3; axis++)
+	{
+		float position = (point(axis) - header.origin[axis]) / header.spacing[axis];
+		if (!(position >= 0.0f) || !(position < header.dims[axis]))
+			return 0;
+		voxel[axis] = std::min((int)position, header.dims[axis] - 1);
+	}
+	int32_t entry = _index[((size_t)(voxel[2] / VOLUME_BRICK) * header.bricks[1] + voxel[1] / VOLUME_BRICK) * header.bricks[0] + voxel[0] / VOLUME_BRICK];
+	if (entry < 0)
+		return -1 - entry;
+	return _bricks[(size_t)entry * VOLUME_BRICK_BYTES
+		+ ((voxel[2] % VOLUME_BRICK) * VOLUME_BRICK + voxel[1] % VOLUME_BRICK) * VOLUME_BRICK + voxel[0] % VOLUME_BRICK];
+}
+
+/**
+* @brief Labels along a segment, voxel by voxel, a uniform brick at a time
+* @param from: start of the segment, frame of the phantom
+* @param to: end of the segment
+* @param segments: receives the runs of the tissues, neighbouring voxels of a label merged
+*/
+void CTissueVolume::march(const Vector3f& from, const Vector3f& to, std::vector<sVolumeSegment>& segments) const
+{
+	segments.clear();
+	float length = (to - from).norm();
+	if ((_header == NULL) || !(length > 0.0f))
+		return;
+	const sVolumeHeader& header = *_header;
+	const float infinity = std::numeric_limits<float>::infinity();
+
+	// Voxel coordinates along the segment: start + t * rate, t in metres.
+	float start[3], rate[3];
+	int step[3];
+	float tBegin = 0.0f, tEnd = length;
+	for (int axis = 0; axis < 3; axis++)
+	{
+		start[axis] = (from(axis) - header.origin[axis]) / header.spacing[axis];
+		rate[axis] = (to(axis) - from(axis)) / (length * header.spacing[axis]);
+		step[axis] = (rate[axis] > 0.0f) ? 1 : ((rate[axis] < 0.0f) ? -1 : 0);
+		if (step[axis] == 0)
+		{
+			if (!(start[axis] >= 0.0f) || !(start[axis] < header.dims[axis]))
+				return;
+			continue;
+		}
+		float t0 = -start[axis] / rate[axis];
+		float t1 = (header.dims[axis] - start[axis]) / rate[axis];
+		tBegin = std::max(tBegin, std::min(t0, t1));
+		tEnd = std::min(tEnd, std::max(t0, t1));
+	}
+	if (!(tBegin < tEnd))
+		return;
+
+	// Distance at which the segment leaves cell `cell` of size `size` voxels along an axis.
+	auto leave = [&](int axis, int cell, int size) {
+		if (step[axis] == 0)
+			return infinity;
+		return ((cell + (step[axis] > 0 ? 1 : 0)) * size - start[axis]) / rate[axis];
+	};
+
+	int voxel[3];
+	for (int axis = 0; axis < 3; axis++)
+		voxel[axis] = std::min(std::max((int)floorf(start[axis] + tBegin * rate[axis]), 0), header.dims[axis] - 1);
+	float t = tBegin;
+	while (t < tEnd)
+	{
+		int brick[3] = { voxel[0] / VOLUME_BRICK, voxel[1] / VOLUME_BRICK, voxel[2] / VOLUME_BRICK };
+		int32_t entry = _index[((size_t)brick[2] * header.bricks[1] + brick[1]) * header.bricks[0] + brick[0]];
+		int label, axis = 0;
+		float next;
+		if (entry < 0)
+		{
+			// Uniform brick: leave it in one step, through the face the segment reaches first.
+			label = -1 - entry;
+			float exits[3];
+			for (int i = 0; i < 3; i++)
+				exits[i] = leave(i, brick[i], VOLUME_BRICK);
+			axis = (exits[0] <= exits[1]) ? ((exits[0] <= exits[2]) ? 0 : 2) : ((exits[1] <= exits[2]) ? 1 : 2);
+			next = std::max(exits[axis], t);
+			for (int i = 0; i < 3; i++)
+			{
+				if (i != axis)
+					voxel[i] = std::min(std::max((int)floorf(start[i] + next * rate[i]), brick[i] * VOLUME_BRICK), brick[i] * VOLUME_BRICK + VOLUME_BRICK - 1);
+			}
+			voxel[axis] = (step[axis] > 0) ? (brick[axis] + 1) * VOLUME_BRICK : brick[axis] * VOLUME_BRICK - 1;
+		}
+		else
+		{
+			label = _bricks[(size_t)entry * VOLUME_BRICK_BYTES
+				+ ((voxel[2] % VOLUME_BRICK) * VOLUME_BRICK + voxel[1] % VOLUME_BRICK) * VOLUME_BRICK + voxel[0] % VOLUME_BRICK];
+			float exits[3];
+			for (int i = 0; i < 3; i++)
+				exits[i] = leave(i, voxel[i], 1);
+			axis = (exits[0] <= exits[1]) ? ((exits[0] <= exits[2]) ? 0 : 2) : ((exits[1] <= exits[2]) ? 1 : 2);
+			next = std::max(exits[axis], t);
+			voxel[axis] += step[axis];
+		}
+		next = std::min(next, tEnd);
+		if ((label != 0) && (next > t))
+		{
+			if (!segments.empty() && (segments.back().label == label) && (segments.back().end == t))
+				segments.back().end = next;
+			else
+			{
+				sVolumeSegment segment = { label, t, next };
+				segments.push_back(segment);
+			}
+		}
+		t = next;
+		if ((voxel[axis] < 0) || (voxel[axis] >= header.dims[axis]))
+			break;
+	}
+}
@@ -0,0 +1,95 @@
+// Peter: Labeled CT volume of the phantom.
+//
+// Instead of named V-REP shapes, the tissues can come from a segmented CT scan: a grid of voxels that
+// each hold a label, 0 for air and 1..255 for the tissues, whose names are stored with the volume and
+// map to sTissueParameters like the names of the shapes (see tissueParameters()).
+//
+// The volume is stored in bricks of VOLUME_BRICK^3 voxels, 512 bytes each, so that a short run of the
+// needle through the volume touches a few contiguous blocks instead of one cache line per z slice.
+// Bricks that hold one label only (air, the inside of an organ) are not stored, their index entry
+// holds the label. The file is a sVolumeHeader, the label names, the brick index and the stored bricks,
+// the plugin maps it read-only, so only the pages of the bricks the needles pass stay resident.
+//
+// march() walks the voxels along a segment (Amanatides & Woo) and jumps over uniform bricks in one step.
+// The volume sits in the frame of the phantom object, origin is the corner of voxel (0, 0, 0) in it.
+
+#pragma once
+
+#include <cstddef>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+#include <Eigen/Core>
+
+const char VOLUME_MAGIC[8] = { 'T', 'I', 'S', 'S', 'U', 'V', 'O', 'L' };
+const int32_t VOLUME_VERSION = 1;
+const int VOLUME_BRICK = 8;							// Voxels per brick edge.
+const int VOLUME_BRICK_BYTES = VOLUME_BRICK * VOLUME_BRICK * VOLUME_BRICK;
+const int VOLUME_NAME_LENGTH = 32;					// Bytes per label name, zero padded.
+const int VOLUME_LABELS = 256;
+
+// Plain data at the start of a volume file. Brick (x, y, z) is entry (z * bricks[1] + y) * bricks[0] + x of
+// the index: a stored brick if >= 0, else the label -1 - entry of all its voxels. Voxel (i, j, k) of a stored
+// brick is byte (k * 8 + j) * 8 + i of it. The stored bricks start at brick_offset, aligned to a brick.
+struct sVolumeHeader {
+	char magic[8];
+	int32_t version;
+	int32_t brick_size;								// VOLUME_BRICK of the writer.
+	int32_t dims[3];								// Voxels along x, y and z.
+	int32_t bricks[3];
+	int32_t label_count;							// Names stored after the header, VOLUME_NAME_LENGTH bytes each.
+	int32_t stored_bricks;
+	float spacing[3];								// Size of a voxel. Unit: m
+	float origin[3];								// Corner of voxel (0, 0, 0) in the frame of the phantom. Unit: m
+	uint64_t brick_offset;							// Byte offset of the first stored brick in the file.
+};
+
+// Run of one label along a marched segment.
+struct sVolumeSegment {
+	int label;
+	float begin;									// Distance from the start of the segment. Unit: m
+	float end;
+};
+
+// Read-only view of a volume file, memory-mapped.
+class CTissueVolume
+{
+public:
+	CTissueVolume();
+	virtual ~CTissueVolume();
+
+	bool open(const std::string& path);
+	void close();
+	bool isOpen() const;
+	const sVolumeHeader& getHeader() const;
+	// "" for labels without a name.
+	std::string labelName(int label) const;
+	size_t fileBytes() const;
+
+	// Label of the voxel that contains point, 0 outside the volume. point: frame of the phantom.
+	int label(const Eigen::Vector3f& point) const;
+	// Tissue runs along the segment from -> to, in order, air (label 0) left out. from, to: frame of the phantom.
+	void march(const Eigen::Vector3f& from, const Eigen::Vector3f& to, std::vector<sVolumeSegment>& segments) const;
+
+private:
+	CTissueVolume(const CTissueVolume&);
+	CTissueVolume& operator=(const CTissueVolume&);
+
+	const sVolumeHeader* _header;
+	const char* _names;
+	const int32_t* _index;
+	const uint8_t* _bricks;
+	size_t _size;
+#ifdef _WIN32
+	void* _file;
+	void* _mapping;
+#else
+	int _file;
+#endif
+};
+
+// Writes a dense label grid (x fastest, dims[0] * dims[1] * dims[2] bytes) in the bricked layout.
+// names: one per label, at most VOLUME_LABELS.
+bool writeTissueVolume(const std::string& path, const int dims[3], const float spacing[3], const float origin[3],
+	const std::vector<std::string>& names, const uint8_t* labels);
@@ -22,15 +22,31 @@
 // Vector3f f_ext is the variable that holds the total external force on the needle
 // it is calculated relative to the dummy (magnitude * dummy_direction). The other project did
 // this but it might have to be changed. It can be found in modelExternalForces(model)
+//
+// Every needle in the scene is a CNeedleInstance (needleInstance.h) with its own state (sNeedleState).
+// The model itself lives in needleModel.h and does not call V-REP.
 
 #include <algorithm>
+#include <chrono>
+#include <cstring>
 #include <math.h>
 #include <vector>
 #include <map>
+#include <memory>
 
 #include "v_repExtPluginSkeleton.h"
 #include "luaFunctionData.h"
 #include "v_repLib.h"
+#include "messageRouter.h"
+#include "needleCheckpoint.h"
+#include "needleInstance.h"
+#include "reachabilityMap.h"
+#include "sceneContext.h"
+#include "stepBudget.h"
+#include "stepTracer.h"
+#include "threadPool.h"
+#include "tissueSdf.h"
+#include "tissueVolume.h"
 #include <iostream>
 
 #include <Eigen/Core>
@@ -52,9 +68,6 @@ typedef std::vector<Eigen::Vector3f> Vector3fVector;
 	#include <unistd.h>
 #endif /* __linux || __APPLE__ */
 
-#ifdef __APPLE__
-#define _stricmp strcmp
-#endif
 
 #define CONCAT(x,y,z) x y z
 #define strConCat(x,y,z)	CONCAT(x,y,z)
@@ -64,96 +77,34 @@ typedef std::vector<Eigen::Vector3f> Vector3fVector;
 LIBRARY vrepLib; // the V-REP library that we will dynamically load and bind
 
 
-// Handles
-int dummyHandle;									// This is the handle of the dummy device. That is the virtual 
-													// representation of the position of the haptic device in the scene.
-int dummyToolTipHandle;								// The tool tip dummy that is used to move the robot.
-int phantomHandle;
-int needleHandle;
-int needleTipHandle;
-int extForceGraphHandle;
-int lwrTipHandle;									// A dummy that is always connected to the needle tip.
-int needleForceGraphHandle;
-
-// CoppeliaSim object parameter IDs
-const int RESPONDABLE = 3004;                       // Object parameter id for toggling respondable.
-const int RESPONDABLE_MASK = 3019;                  // Object parameter id for toggling respondable mask.
 const float FRICTION_COEFFICIENT = 0.03;            // Unit: N/mm ? Delete this?
 
-													// Coefficients for bidirectional Karnopp friction model
-const float D_p = 18.45;                            // Positive static friction coefficient. Unit: N/m 
-const float D_n = -18.23;                           // Negative static friction coefficient. Unit: N/m
-const float b_p = 212.13;                           // Positive damping coefficient. Unit: N-s/m
-const float b_n = -293.08;                          // Negative damping coefficient. Unit: N-s/m
-const float C_p = 10.57;                            // Positive dynamic friction coefficient. Unit: N/m
-const float C_n = -11.96;                           // Negative dynamic friction coefficient. Unit: N/m
-const float zero_threshold = 5.0e-6;                // (delta v/2 in paper) Threshold on static and dynamic fricion. Unit: m/s
-
-// Config variables: Use these to configurate the details of the execution.
-float engine_force_scalar = 1.0;					// How much of the v-rep engine force should be counted.
-float model_force_scalar = 1.0;						// How much of the calculated force should be used.
-std::string force_model = "kelvin-voigt";			// Which model should be used to model the forces.
-bool use_only_z_force_on_engine = true;				// When using the engine for both checking punctures and calculating forces, 
-													// Should only z direction be used, or should the full magnitude.
-bool constant_puncture_threshold = false;			// Use the same puncture threshold for all tissues.
-float puncture_threshold = 1.0e-2;					// Set constant puncture threshold (only used if constant_puncture_threshold==true)
-
-// State variables
-bool virtual_fixture = false;						// Is the needle in the tissue/ should the virtual fixture be activated?
-float needleVelocity;
-float full_penetration_length;
-float f_ext_magnitude;								// Magnitude of all external forces on the needle.
-float lwr_tip_engine_force_magnitude = 0;			// Magnitude of external forces on the needle_tip created by the physics engine.
-Vector3f lwr_tip_enging_force = Vector3f(0.0, 0.0, 0.0); // Force vector of external forces on the needle_tip created by the physics engine.
-Vector3f f_ext;										// Total forces on the needle created by the physics engine AND the modeled forces, relative to the dummy.
-Vector3f toolTipPoint;
-Vector3f needleDirection;
-
-
-struct sPuncture {
-	int handle;
-	Vector3f position;
-	Vector3f direction;
-	std::string name;
-	float penetration_length;
-
-	void printPuncture(bool puncture) {
-		if (puncture) {
-			std::cout << "New puncture: " << name << std::endl;
-		}
-		else {
-			std::cout << "Exit puncture: " << name << std::endl;
-		}
-		std::cout << "Position: " << position(0) << ", " << position(1) << ", " << position(2) << std::endl;
-		std::cout << "Direction: " << direction(0) << ", " << direction(1) << ", " << direction(2) << std::endl;
-	}
-};
+sNeedleConfig needleConfig;							// Config variables: Use these to configurate the details of the execution.
+
+CSceneContexts scenes;								// Needles, tissues and caches of every open scene, see sceneContext.h.
+CThreadPool* threadPool = NULL;						// Runs the pure-compute part of the step for all needles.
+std::string reachabilityMapPath = "reachability.map";	// Built offline by bin/lwrReachability, mapped when a scene is bound.
+CReachabilityMap reachabilityMap;
+std::string tissueVolumePath = "phantom.vol";		// Labeled CT volume of the phantom (bin/tissueVolume), mapped when a scene is bound.
+CMessageRouter messageRouter;						// Handlers of the V-REP messages, see v_repMessage.
+std::string tracePath;								// Chrome trace of the simulation steps, written at simulation end. Empty: off.
+CStepBudget stepBudget;								// Sheds optional work when the module-handle passes run long, see stepBudget.h.
 
-std::vector<sPuncture> punctures;
-
-void addPuncture(int handle);
-void checkContacts();
-void checkPunctures();
-void modelExternalForces(std::string force_model);
-void reactivateTissues();
-void setForceGraph();
-void setRespondable(int handle);
-void setUnRespondable(int handle);
-void updateNeedleDirection();
-void updateNeedleTipPos();
-void updateNeedleVelocity();
-int checkSinglePuncture(sPuncture puncture);
-float B(sPuncture puncture);
-float distance3d(Vector3f point1, Vector3f point2);
-float generalForce2NeedleTipZ(Vector3f force);
-float K(std::string tissueName);
-float karnoppModel();
-float kelvinVoigtModel();
-float getVelocityMagnitude(simFloat* velocities);
-float sgn(float x);
-Vector3f changeBasis(const float* objectMatrixReferenceFrame, Vector3f vector);
-Vector3f simContactInfo2EigenForce(const float* contactInfo);
-Vector3f simObjectMatrix2EigenDirection(const float* objectMatrix);
+static void selectCurrentScene()
+{
+	int scene = -1;
+	simGetIntegerParameter(sim_intparam_scene_unique_id, &scene);
+	scenes.select(scene);
+}
+
+// Context of the scene that is shown (and simulated), selected at plugin start, at every instance switch and
+// again after the current scene was closed.
+static sSceneContext& currentScene()
+{
+	if (scenes.current() == NULL)
+		selectCurrentScene();
+	return *scenes.current();
+}
 
 
 // --------------------------------------------------------------------------------------
@@ -227,651 +178,896 @@ void LUA_SETPUNCTURETHRESHOLD_CALLBACK(SLuaCallBack* p)
 	{ // above function reads in the expected arguments. If the arguments are wrong, it returns false and outputs a message to the simulation status bar
 		std::vector<CLuaFunctionDataItem>* inData = D.getInDataPtr();
 
-		puncture_threshold = inData->at(0).intData[0]; // the first argument
+		// A threshold above 0 is used for all tissues, 0 goes back to the puncture force of each tissue.
+		float threshold = inData->at(0).floatData[0]; // the first argument
+		needleConfig.constant_puncture_threshold = (threshold > 0.0f);
+		if (threshold > 0.0f)
+			needleConfig.puncture_threshold = threshold;
 	}
 	D.writeDataToLua(p);
 }
 // --------------------------------------------------------------------------------------
 
-// This is the plugin start routine (called just once, just after the plugin was loaded):
-VREP_DLLEXPORT unsigned char v_repStart(void* reservedPointer,int reservedInt)
-{
-	// Dynamically load and bind V-REP functions:
-	// ******************************************
-	// 1. Figure out this plugin's directory:
-	char curDirAndFile[1024];
-#ifdef _WIN32
-	#ifdef QT_COMPIL
-		_getcwd(curDirAndFile, sizeof(curDirAndFile));
-	#else
-		GetModuleFileName(NULL,curDirAndFile,1023);
-		PathRemoveFileSpec(curDirAndFile);
-	#endif
-#elif defined (__linux) || defined (__APPLE__)
-	getcwd(curDirAndFile, sizeof(curDirAndFile));
-#endif
 
-	std::string currentDirAndPath(curDirAndFile);
-	// 2. Append the V-REP library's name:
-	std::string temp(currentDirAndPath);
-#ifdef _WIN32
-	temp+="\\v_rep.dll";
-#elif defined (__linux)
-	temp+="/libv_rep.so";
-#elif defined (__APPLE__)
-	temp+="/libv_rep.dylib";
-#endif /* __linux || __APPLE__ */
-	// 3. Load the V-REP library:
-	vrepLib=loadVrepLibrary(temp.c_str());
-	if (vrepLib==NULL)
-	{
-		std::cout << "Error, could not find or correctly load the V-REP library. Cannot start 'PluginSkeleton' plugin.\n";
-		return(0); // Means error, V-REP will unload this plugin
-	}
-	if (getVrepProcAddresses(vrepLib)==0)
-	{
-		std::cout << "Error, could not find all required functions in the V-REP library. Cannot start 'PluginSkeleton' plugin.\n";
-		unloadVrepLibrary(vrepLib);
-		return(0); // Means error, V-REP will unload this plugin
-	}
-	// ******************************************
+// --------------------------------------------------------------------------------------
+// simExtSkeleton_setPunctureHysteresis: entry and exit hysteresis of the punctures, see sPunctureHysteresis (punctureCore.h)
+// --------------------------------------------------------------------------------------
+#define LUA_SETPUNCTUREHYSTERESIS_COMMAND "simExtSkeleton_setPunctureHysteresis" // the name of the new Lua command
+
+const int inArgs_SETPUNCTUREHYSTERESIS[] = {
+	4,
+	sim_lua_arg_float,0, // entry margin, relative to the puncture threshold
+	sim_lua_arg_float,0, // exit depth in m
+	sim_lua_arg_int,0, // entry steps
+	sim_lua_arg_int,0, // exit steps
+};
 
-	// Check the version of V-REP:
-	// ******************************************
-	int vrepVer;
-	simGetIntegerParameter(sim_intparam_program_version,&vrepVer);
-	if (vrepVer<30200) // if V-REP version is smaller than 3.02.00
+void LUA_SETPUNCTUREHYSTERESIS_CALLBACK(SLuaCallBack* p)
+{
+	p->outputArgCount = 0;
+	CLuaFunctionData D;
+	if (D.readDataFromLua(p, inArgs_SETPUNCTUREHYSTERESIS, inArgs_SETPUNCTUREHYSTERESIS[0], LUA_SETPUNCTUREHYSTERESIS_COMMAND))
 	{
-		std::cout << "Sorry, your V-REP copy is somewhat old. Cannot start 'PluginSkeleton' plugin.\n";
-		unloadVrepLibrary(vrepLib);
-		return(0); // Means error, V-REP will unload this plugin
+		std::vector<CLuaFunctionDataItem>* inData = D.getInDataPtr();
+		sPunctureHysteresis<float>& hysteresis = needleConfig.hysteresis;
+		hysteresis.entry_margin = std::max(inData->at(0).floatData[0], 0.0f);
+		hysteresis.exit_depth = std::max(inData->at(1).floatData[0], 0.0f);
+		hysteresis.entry_steps = std::max(inData->at(2).intData[0], 1);
+		hysteresis.exit_steps = std::max(inData->at(3).intData[0], 1);
 	}
-	// ******************************************
+	D.writeDataToLua(p);
+}
+// --------------------------------------------------------------------------------------
 
-	std::vector<int> inArgs;
 
-	// Register the new Lua command "simExtSkeleton_getSensorData":
-	CLuaFunctionData::getInputDataForFunctionRegistration(inArgs_GETSENSORDATA,inArgs);
-	simRegisterCustomLuaFunction(LUA_GETSENSORDATA_COMMAND,strConCat("number result,table data,number distance=",LUA_GETSENSORDATA_COMMAND,"(number sensorIndex,table_3 floatParameters,table_2 intParameters)"),&inArgs[0],LUA_GETSENSORDATA_CALLBACK);
-	CLuaFunctionData::getInputDataForFunctionRegistration(inArgs_SETPUNCTURETHRESHOLD, inArgs);
-	simRegisterCustomLuaFunction(LUA_SETPUNCTURETHRESHOLD_COMMAND, strConCat("number threshold"), &inArgs[0], LUA_SETPUNCTURETHRESHOLD_CALLBACK);
+// --------------------------------------------------------------------------------------
+// simExtSkeleton_getPunctureStatistics: puncture events of a needle and the respondable flags written for the scene
+// --------------------------------------------------------------------------------------
+#define LUA_GETPUNCTURESTATISTICS_COMMAND "simExtSkeleton_getPunctureStatistics" // the name of the new Lua command
 
-	return(PLUGIN_VERSION); // initialization went fine, we return the version number of this plugin (can be queried with simGetModuleName)
-}
+const int inArgs_GETPUNCTURESTATISTICS[] = {
+	1,
+	sim_lua_arg_int,0, // needle index, in the order of discovery (0: "Needle", 1: "Needle#0", ...)
+};
 
-// This is the plugin end routine (called just once, when V-REP is ending, i.e. releasing this plugin):
-VREP_DLLEXPORT void v_repEnd()
+void LUA_GETPUNCTURESTATISTICS_CALLBACK(SLuaCallBack* p)
 {
-	// Here you could handle various clean-up tasks
-
-	unloadVrepLibrary(vrepLib); // release the library
+	p->outputArgCount = 0;
+	CLuaFunctionData D;
+	if (D.readDataFromLua(p, inArgs_GETPUNCTURESTATISTICS, inArgs_GETPUNCTURESTATISTICS[0], LUA_GETPUNCTURESTATISTICS_COMMAND))
+	{
+		std::vector<CLuaFunctionDataItem>* inData = D.getInDataPtr();
+		int index = inData->at(0).intData[0];
+		const sSceneContext& scene = currentScene();
+		if ((index >= 0) && (index < (int)scene.needles.size()))
+		{
+			const sPunctureEventCounts& events = scene.needles[index].getState().puncture_events;
+			const sTissueRegistryStatistics& tissues = scene.tissues.getStatistics();
+			D.pushOutData(CLuaFunctionDataItem((int)events.entries));
+			D.pushOutData(CLuaFunctionDataItem((int)events.exits));
+			D.pushOutData(CLuaFunctionDataItem((int)events.entries_avoided));
+			D.pushOutData(CLuaFunctionDataItem((int)events.exits_avoided));
+			D.pushOutData(CLuaFunctionDataItem((int)tissues.writes));
+			D.pushOutData(CLuaFunctionDataItem((int)tissues.writes_avoided));
+		}
+		else
+			simSetLastError(LUA_GETPUNCTURESTATISTICS_COMMAND, "Invalid needle index.");
+	}
+	D.writeDataToLua(p);
 }
+// --------------------------------------------------------------------------------------
 
-// This is the plugin messaging routine (i.e. V-REP calls this function very often, with various messages):
-VREP_DLLEXPORT void* v_repMessage(int message,int* auxiliaryData,void* customData,int* replyData)
-{ // This is called quite often. Just watch out for messages/events you want to handle
-	// Keep following 5 lines at the beginning and unchanged:
-	static bool refreshDlgFlag=true;
-	int errorModeSaved;
-	simGetIntegerParameter(sim_intparam_error_report_mode,&errorModeSaved);
-	simSetIntegerParameter(sim_intparam_error_report_mode,sim_api_errormessage_ignore);
-	void* retVal=NULL;
 
-	// Here we can intercept many messages from V-REP (actually callbacks). Only the most important messages are listed here.
-	// For a complete list of messages that you can intercept/react with, search for "sim_message_eventcallback"-type constants
-	// in the V-REP user manual.
+// --------------------------------------------------------------------------------------
+// simExtSkeleton_setNativeIK: move the LWRs with the plugin's IK solver instead of V-REP's IK groups
+// --------------------------------------------------------------------------------------
+#define LUA_SETNATIVEIK_COMMAND "simExtSkeleton_setNativeIK" // the name of the new Lua command
 
-	if (message==sim_message_eventcallback_refreshdialogs)
-		refreshDlgFlag=true; // V-REP dialogs were refreshed. Maybe a good idea to refresh this plugin's dialog too
+const int inArgs_SETNATIVEIK[] = {
+	1,
+	sim_lua_arg_bool,0, // enabled
+};
 
-	if (message==sim_message_eventcallback_menuitemselected)
-	{ // A custom menu bar entry was selected..
-		// here you could make a plugin's main dialog visible/invisible
+void LUA_SETNATIVEIK_CALLBACK(SLuaCallBack* p)
+{
+	p->outputArgCount = 0;
+	CLuaFunctionData D;
+	if (D.readDataFromLua(p, inArgs_SETNATIVEIK, inArgs_SETNATIVEIK[0], LUA_SETNATIVEIK_COMMAND))
+	{
+		std::vector<CLuaFunctionDataItem>* inData = D.getInDataPtr();
+		needleConfig.native_ik = inData->at(0).boolData[0];
+		for (const CNeedleInstance& needle : currentScene().needles)
+		{
+			if (needleConfig.native_ik && !needle.hasArm())
+				std::cout << "Needle" << needle.getSuffix() << ": no LWR_joint1..7, native IK not available" << std::endl;
+		}
 	}
+	D.writeDataToLua(p);
+}
+// --------------------------------------------------------------------------------------
+
 
-	if (message==sim_message_eventcallback_instancepass)
-	{	// This message is sent each time the scene was rendered (well, shortly after) (very often)
-		// It is important to always correctly react to events in V-REP. This message is the most convenient way to do so:
+// --------------------------------------------------------------------------------------
+// simExtSkeleton_getIkStatistics: iterations, solve time and remaining error of the last native IK solve
+// --------------------------------------------------------------------------------------
+#define LUA_GETIKSTATISTICS_COMMAND "simExtSkeleton_getIkStatistics" // the name of the new Lua command
 
-		int flags=auxiliaryData[0];
-		bool sceneContentChanged=((flags&(1+2+4+8+16+32+64+256))!=0); // object erased, created, model or scene loaded, und/redo called, instance switched, or object scaled since last sim_message_eventcallback_instancepass message 
-		bool instanceSwitched=((flags&64)!=0);
+const int inArgs_GETIKSTATISTICS[] = {
+	1,
+	sim_lua_arg_int,0, // needle index, in the order of discovery (0: "Needle", 1: "Needle#0", ...)
+};
 
-		if (instanceSwitched)
+void LUA_GETIKSTATISTICS_CALLBACK(SLuaCallBack* p)
+{
+	p->outputArgCount = 0;
+	CLuaFunctionData D;
+	if (D.readDataFromLua(p, inArgs_GETIKSTATISTICS, inArgs_GETIKSTATISTICS[0], LUA_GETIKSTATISTICS_COMMAND))
+	{
+		std::vector<CLuaFunctionDataItem>* inData = D.getInDataPtr();
+		int index = inData->at(0).intData[0];
+		const std::vector<CNeedleInstance>& needles = currentScene().needles;
+		if ((index >= 0) && (index < (int)needles.size()))
 		{
-			// React to an instance switch here!!
+			const sIkResult& result = needles[index].getIkResult();
+			D.pushOutData(CLuaFunctionDataItem(result.iterations));
+			D.pushOutData(CLuaFunctionDataItem((float)result.seconds));
+			D.pushOutData(CLuaFunctionDataItem(result.position_error));
+			D.pushOutData(CLuaFunctionDataItem(result.orientation_error));
 		}
+		else
+			simSetLastError(LUA_GETIKSTATISTICS_COMMAND, "Invalid needle index.");
+	}
+	D.writeDataToLua(p);
+}
+// --------------------------------------------------------------------------------------
 
-		if (sceneContentChanged)
-		{ // we actualize plugin objects for changes in the scene
+// --------------------------------------------------------------------------------------
+// simExtSkeleton_getMessageStatistics: how often V-REP sent a message and the time its handler took, see messageRouter.h
+// --------------------------------------------------------------------------------------
+#define LUA_GETMESSAGESTATISTICS_COMMAND "simExtSkeleton_getMessageStatistics" // the name of the new Lua command
 
-			//...
+const int inArgs_GETMESSAGESTATISTICS[] = {
+	1,
+	sim_lua_arg_int,0, // message id, e.g. sim_message_eventcallback_modulehandle
+};
 
-			refreshDlgFlag=true; // always a good idea to trigger a refresh of this plugin's dialog here
-		}
+void LUA_GETMESSAGESTATISTICS_CALLBACK(SLuaCallBack* p)
+{
+	p->outputArgCount = 0;
+	CLuaFunctionData D;
+	if (D.readDataFromLua(p, inArgs_GETMESSAGESTATISTICS, inArgs_GETMESSAGESTATISTICS[0], LUA_GETMESSAGESTATISTICS_COMMAND))
+	{
+		std::vector<CLuaFunctionDataItem>* inData = D.getInDataPtr();
+		const sMessageStatistics& statistics = messageRouter.getStatistics(inData->at(0).intData[0]);
+		D.pushOutData(CLuaFunctionDataItem((int)statistics.calls));
+		D.pushOutData(CLuaFunctionDataItem((int)statistics.handled));
+		D.pushOutData(CLuaFunctionDataItem((float)statistics.seconds));
 	}
+	D.writeDataToLua(p);
+}
+// --------------------------------------------------------------------------------------
+
+// --------------------------------------------------------------------------------------
+// simExtSkeleton_loadReachabilityMap: use another reachability map
+// --------------------------------------------------------------------------------------
+#define LUA_LOADREACHABILITYMAP_COMMAND "simExtSkeleton_loadReachabilityMap" // the name of the new Lua command
 
-	if (message==sim_message_eventcallback_mainscriptabouttobecalled)
-	{ // The main script is about to be run (only called while a simulation is running (and not paused!))
-		
+const int inArgs_LOADREACHABILITYMAP[] = {
+	1,
+	sim_lua_arg_string,0, // path of the map file
+};
+
+void LUA_LOADREACHABILITYMAP_CALLBACK(SLuaCallBack* p)
+{
+	p->outputArgCount = 0;
+	CLuaFunctionData D;
+	if (D.readDataFromLua(p, inArgs_LOADREACHABILITYMAP, inArgs_LOADREACHABILITYMAP[0], LUA_LOADREACHABILITYMAP_COMMAND))
+	{
+		std::vector<CLuaFunctionDataItem>* inData = D.getInDataPtr();
+		reachabilityMapPath = inData->at(0).stringData[0];
+		D.pushOutData(CLuaFunctionDataItem(reachabilityMap.open(reachabilityMapPath)));
 	}
+	D.writeDataToLua(p);
+}
+// --------------------------------------------------------------------------------------
 
-	if (message==sim_message_eventcallback_simulationabouttostart)
-	{ // Simulation is about to start
-	  // Peter
-		
-		dummyHandle = simGetObjectHandle("Dummy_device");
-		dummyToolTipHandle = simGetObjectHandle("Dummy_tool_tip");
-		phantomHandle = simGetObjectHandle("_Phantom");
-		needleHandle = simGetObjectHandle("Needle");
-		needleTipHandle = simGetObjectHandle("Needle_tip");
-		extForceGraphHandle = simGetObjectHandle("Force_Graph");
-		needleForceGraphHandle = simGetObjectHandle("Needle_force_graph");
 
-		lwrTipHandle = simGetObjectHandle("LWR_tip");
-		full_penetration_length = 0.0;
-		
+// Maps the CT volume of a scene and looks up the coefficients of its labels by name.
+static bool loadTissueVolume(sSceneContext& scene, const std::string& path)
+{
+	CTissueVolume& volume = scene.volume;
+	scene.volumeTissues.clear();
+	scene.volumePath.clear();
+	if (!volume.open(path))
+		return false;
+	scene.volumePath = path;
+	const sVolumeHeader& header = volume.getHeader();
+	for (int label = 0; label < header.label_count; label++)
+		scene.volumeTissues.push_back(tissueParameters(volume.labelName(label)));
+	std::cout << "Loaded tissue volume " << path << ": " << header.dims[0] << "x" << header.dims[1] << "x" << header.dims[2]
+		<< " voxels, " << header.label_count << " labels, " << header.stored_bricks << " bricks stored, "
+		<< volume.fileBytes() / 1024 << " KiB mapped" << std::endl;
+	return true;
+}
 
-	}
+// --------------------------------------------------------------------------------------
+// simExtSkeleton_loadTissueVolume: use another CT volume of the phantom, other scenes switch to it when they are bound
+// --------------------------------------------------------------------------------------
+#define LUA_LOADTISSUEVOLUME_COMMAND "simExtSkeleton_loadTissueVolume" // the name of the new Lua command
 
-	if (message==sim_message_eventcallback_simulationended)
-	{ // Simulation just ended
-		reactivateTissues();
+const int inArgs_LOADTISSUEVOLUME[] = {
+	1,
+	sim_lua_arg_string,0, // path of the volume file
+};
 
+void LUA_LOADTISSUEVOLUME_CALLBACK(SLuaCallBack* p)
+{
+	p->outputArgCount = 0;
+	CLuaFunctionData D;
+	if (D.readDataFromLua(p, inArgs_LOADTISSUEVOLUME, inArgs_LOADTISSUEVOLUME[0], LUA_LOADTISSUEVOLUME_COMMAND))
+	{
+		std::vector<CLuaFunctionDataItem>* inData = D.getInDataPtr();
+		tissueVolumePath = inData->at(0).stringData[0];
+		D.pushOutData(CLuaFunctionDataItem(loadTissueVolume(currentScene(), tissueVolumePath)));
 	}
+	D.writeDataToLua(p);
+}
+// --------------------------------------------------------------------------------------
 
-	if (message==sim_message_eventcallback_moduleopen)
-	{ // A script called simOpenModule (by default the main script). Is only called during simulation.
-		if ( (customData==NULL)||(_stricmp("PluginSkeleton",(char*)customData)==0) ) // is the command also meant for this plugin?
-		{
-			// we arrive here only at the beginning of a simulation
-		}
-	}
 
-	if (message==sim_message_eventcallback_modulehandle)
-	{ // A script called simHandleModule (by default the main script). Is only called during simulation.
-		if ( (customData==NULL)||(_stricmp("PluginSkeleton",(char*)customData)==0) ) // is the command also meant for this plugin?
-		{
-			// we arrive here only while a simulation is running
-			
-			if (punctures.size() == 0)
-			{
-				full_penetration_length = 0.0;
-				virtual_fixture = false;
-			}
-			else
-				virtual_fixture = true;
-			
-			updateNeedleTipPos();
-			updateNeedleVelocity();
-			updateNeedleDirection();
-			
-			checkPunctures();
-			
-			checkContacts();
-			
-			modelExternalForces(force_model);
-			
-			setForceGraph();
-			
-		}
+// Checkpoint of all needles of a scene, see needleCheckpoint.h: a header and one entry per needle.
+static std::string saveCheckpoint(const sSceneContext& scene)
+{
+	std::string blob;
+	CCheckpointWriter writer(blob);
+	writer.write(CHECKPOINT_MAGIC, sizeof(CHECKPOINT_MAGIC));
+	writer.value(CHECKPOINT_VERSION);
+	writer.value((int32_t)scene.needles.size());
+	for (const CNeedleInstance& needle : scene.needles)
+		needle.saveCheckpoint(writer);
+	return blob;
+}
+
+/**
+* @brief Continue the simulation of a scene from a checkpoint. The whole blob is read before anything is changed,
+*        needles are matched by their suffix, needles that are not in the checkpoint keep their state.
+*        The respondable flags of the tissues are then set in one pass.
+* @return false if the blob is not a checkpoint of this version or the scene is not simulated
+*/
+static bool restoreCheckpoint(sSceneContext& scene, const std::string& blob)
+{
+	if (!scene.running)
+		return false;
+	CCheckpointReader reader(blob);
+	char magic[sizeof(CHECKPOINT_MAGIC)];
+	int32_t version = 0, count = 0;
+	if (!reader.read(magic, sizeof(magic)) || (std::memcmp(magic, CHECKPOINT_MAGIC, sizeof(magic)) != 0) ||
+		!reader.value(version) || (version != CHECKPOINT_VERSION) || !reader.value(count) || (count < 0))
+		return false;
+	std::vector<sNeedleCheckpoint> checkpoints;
+	for (int32_t i = 0; i < count; i++)
+	{
+		checkpoints.push_back(sNeedleCheckpoint());
+		if (!CNeedleInstance::readCheckpoint(reader, checkpoints.back()))
+			return false;
 	}
 
-	if (message==sim_message_eventcallback_moduleclose)
-	{ // A script called simCloseModule (by default the main script). Is only called during simulation.
-		if ( (customData==NULL)||(_stricmp("PluginSkeleton",(char*)customData)==0) ) // is the command also meant for this plugin?
+	std::map<int, int> punctureCount;
+	for (CNeedleInstance& needle : scene.needles)
+	{
+		const sNeedleCheckpoint* checkpoint = NULL;
+		for (const sNeedleCheckpoint& candidate : checkpoints)
 		{
-			// we arrive here only at the end of a simulation
+			if (candidate.suffix == needle.getSuffix())
+				checkpoint = &candidate;
 		}
+		if (checkpoint != NULL)
+			needle.restoreCheckpoint(*checkpoint);
+		for (const sPuncture& puncture : needle.getState().punctures)
+			punctureCount[puncture.handle]++;
 	}
+	scene.tissues.assign(punctureCount);
+	return true;
+}
 
-	if (message==sim_message_eventcallback_instanceswitch)
-	{ // We switched to a different scene. Such a switch can only happen while simulation is not running
-
-	}
+// --------------------------------------------------------------------------------------
+// simExtSkeleton_saveCheckpoint: state of all needles of the scene as a binary string, see needleCheckpoint.h
+// --------------------------------------------------------------------------------------
+#define LUA_SAVECHECKPOINT_COMMAND "simExtSkeleton_saveCheckpoint" // the name of the new Lua command
 
-	if (message==sim_message_eventcallback_broadcast)
-	{ // Here we have a plugin that is broadcasting data (the broadcaster will also receive this data!)
+const int inArgs_SAVECHECKPOINT[] = {
+	0,
+};
 
+void LUA_SAVECHECKPOINT_CALLBACK(SLuaCallBack* p)
+{
+	p->outputArgCount = 0;
+	CLuaFunctionData D;
+	if (D.readDataFromLua(p, inArgs_SAVECHECKPOINT, inArgs_SAVECHECKPOINT[0], LUA_SAVECHECKPOINT_COMMAND))
+	{
+		std::string blob = saveCheckpoint(currentScene());
+		D.pushOutData(CLuaFunctionDataItem(blob.data(), (int)blob.size()));
 	}
+	D.writeDataToLua(p);
+}
+// --------------------------------------------------------------------------------------
 
-	if (message==sim_message_eventcallback_scenesave)
-	{ // The scene is about to be saved. If required do some processing here (e.g. add custom scene data to be serialized with the scene)
-
-	}
+// --------------------------------------------------------------------------------------
+// simExtSkeleton_restoreCheckpoint: continue the running simulation from a checkpoint
+// --------------------------------------------------------------------------------------
+#define LUA_RESTORECHECKPOINT_COMMAND "simExtSkeleton_restoreCheckpoint" // the name of the new Lua command
 
-	// You can add many more messages to handle here
+const int inArgs_RESTORECHECKPOINT[] = {
+	1,
+	sim_lua_arg_charbuff,0, // checkpoint from simExtSkeleton_saveCheckpoint
+};
 
-	if ((message==sim_message_eventcallback_guipass)&&refreshDlgFlag)
-	{ // handle refresh of the plugin's dialogs
-		// ...
-		refreshDlgFlag=false;
+void LUA_RESTORECHECKPOINT_CALLBACK(SLuaCallBack* p)
+{
+	p->outputArgCount = 0;
+	CLuaFunctionData D;
+	if (D.readDataFromLua(p, inArgs_RESTORECHECKPOINT, inArgs_RESTORECHECKPOINT[0], LUA_RESTORECHECKPOINT_COMMAND))
+	{
+		std::vector<CLuaFunctionDataItem>* inData = D.getInDataPtr();
+		D.pushOutData(CLuaFunctionDataItem(restoreCheckpoint(currentScene(), inData->at(0).stringData[0])));
 	}
-
-	// Keep following unchanged:
-	simSetIntegerParameter(sim_intparam_error_report_mode,errorModeSaved); // restore previous settings
-	return(retVal);
+	D.writeDataToLua(p);
 }
+// --------------------------------------------------------------------------------------
 
 
+// --------------------------------------------------------------------------------------
+// simExtSkeleton_setTraceFile: trace the steps of the simulations into a Chrome trace-event file, "" to stop
+// --------------------------------------------------------------------------------------
+#define LUA_SETTRACEFILE_COMMAND "simExtSkeleton_setTraceFile" // the name of the new Lua command
 
+const int inArgs_SETTRACEFILE[] = {
+	1,
+	sim_lua_arg_string,0, // path of the JSON file, written when the simulation ends
+};
 
-// ------------------------------------------------------------------------- //
-// ------------------------------------------------------------------------- //
-// ------------------------- Peter Cook Bulukin -----------------------------//
-// ------------------------------------------------------------------------- //
-// ------------------------------------------------------------------------- //
+// Writes the trace of the session that just stopped.
+static void writeTrace()
+{
+	traceStop();
+	if (traceWrite(tracePath))
+		std::cout << "Wrote " << traceEventCount() << " trace events to " << tracePath << " (" << traceDroppedCount() << " dropped)" << std::endl;
+	else
+		std::cout << "Could not write the trace " << tracePath << std::endl;
+}
 
-/**
-* @brief Retrieve puncture related to handle.
-* @param handle: handle of object to retrieve.
-* @return the puncture of the handle. Returns empty puncture if not found.
-*/
-sPuncture getPunctureFromHandle(int handle)
+void LUA_SETTRACEFILE_CALLBACK(SLuaCallBack* p)
 {
-	for (sPuncture puncture : punctures)
+	p->outputArgCount = 0;
+	CLuaFunctionData D;
+	if (D.readDataFromLua(p, inArgs_SETTRACEFILE, inArgs_SETTRACEFILE[0], LUA_SETTRACEFILE_COMMAND))
 	{
-		if (puncture.handle == handle)
-		{
-			return puncture;
-		}
+		std::vector<CLuaFunctionDataItem>* inData = D.getInDataPtr();
+		// A running session is written to the old path, a new one starts with the next simulation or at once.
+		if (traceStarted())
+			writeTrace();
+		tracePath = inData->at(0).stringData[0];
+		if (!tracePath.empty() && currentScene().running)
+			traceStart();
+		D.pushOutData(CLuaFunctionDataItem(!tracePath.empty()));
 	}
-	sPuncture puncture;
-	return puncture;
+	D.writeDataToLua(p);
 }
+// --------------------------------------------------------------------------------------
 
-/**
-* @brief Get puncture from tissue name
-* @param name: name of tissue (as set in v-rep)
-* @return puncture related to name. Empty puncture if not found.
-*/
-sPuncture getPunctureFromName(std::string name)
+
+// --------------------------------------------------------------------------------------
+// simExtSkeleton_setStepBudget: time budget of the module-handle pass, optional work is shed above it (0: off)
+// --------------------------------------------------------------------------------------
+#define LUA_SETSTEPBUDGET_COMMAND "simExtSkeleton_setStepBudget" // the name of the new Lua command
+
+const int inArgs_SETSTEPBUDGET[] = {
+	1,
+	sim_lua_arg_float,0, // budget in seconds
+};
+
+void LUA_SETSTEPBUDGET_CALLBACK(SLuaCallBack* p)
 {
-	for (sPuncture puncture : punctures)
+	p->outputArgCount = 0;
+	CLuaFunctionData D;
+	if (D.readDataFromLua(p, inArgs_SETSTEPBUDGET, inArgs_SETSTEPBUDGET[0], LUA_SETSTEPBUDGET_COMMAND))
 	{
-		if (puncture.name == name)
-		{
-			return puncture;
-		}
+		std::vector<CLuaFunctionDataItem>* inData = D.getInDataPtr();
+		sStepBudgetSettings settings = stepBudget.getSettings();
+		settings.budget = std::max(inData->at(0).floatData[0], 0.0f);
+		stepBudget.configure(settings);
 	}
-	sPuncture puncture;
-	return puncture;
+	D.writeDataToLua(p);
 }
+// --------------------------------------------------------------------------------------
 
-/**
-* @brief Calculate length of a puncture
-* @param puncture: puncture
-* @return penetration distance of puncture. Value bellow zero means distance is "outside" of the tissue.
-*/
-float punctureLength(sPuncture puncture)
+// --------------------------------------------------------------------------------------
+// simExtSkeleton_getStepBudget: what the budget governor shed and why
+// --------------------------------------------------------------------------------------
+#define LUA_GETSTEPBUDGET_COMMAND "simExtSkeleton_getStepBudget" // the name of the new Lua command
+
+const int inArgs_GETSTEPBUDGET[] = {
+	0,
+};
+
+void LUA_GETSTEPBUDGET_CALLBACK(SLuaCallBack* p)
 {
-	return distance3d(puncture.position, toolTipPoint) * checkSinglePuncture(puncture);
+	p->outputArgCount = 0;
+	CLuaFunctionData D;
+	if (D.readDataFromLua(p, inArgs_GETSTEPBUDGET, inArgs_GETSTEPBUDGET[0], LUA_GETSTEPBUDGET_COMMAND))
+	{
+		const sStepBudgetStatistics& statistics = stepBudget.getStatistics();
+		D.pushOutData(CLuaFunctionDataItem((int)stepBudget.getLevel()));
+		D.pushOutData(CLuaFunctionDataItem(std::string(CStepBudget::levelName(stepBudget.getLevel()))));
+		D.pushOutData(CLuaFunctionDataItem((float)statistics.last_seconds));
+		D.pushOutData(CLuaFunctionDataItem((float)statistics.average_seconds));
+		D.pushOutData(CLuaFunctionDataItem((int)statistics.overruns));
+		D.pushOutData(CLuaFunctionDataItem((int)statistics.sheds));
+		D.pushOutData(CLuaFunctionDataItem((int)statistics.restores));
+	}
+	D.writeDataToLua(p);
 }
+// --------------------------------------------------------------------------------------
 
-/**
-* @brief Check if the needle is still in the puncture. This is where full_penetration_length is incremented.
-*/
-void checkPunctures()
+
+// --------------------------------------------------------------------------------------
+// simExtSkeleton_getReachability: can the LWR put the needle tip onto position, pointing along direction, and how well
+// --------------------------------------------------------------------------------------
+#define LUA_GETREACHABILITY_COMMAND "simExtSkeleton_getReachability" // the name of the new Lua command
+
+const int inArgs_GETREACHABILITY[] = {
+	2,
+	sim_lua_arg_float|sim_lua_arg_table,3, // entry position in the world
+	sim_lua_arg_float|sim_lua_arg_table,3, // insertion direction in the world
+};
+
+void LUA_GETREACHABILITY_CALLBACK(SLuaCallBack* p)
 {
-	// Iterate through punctures backwards, because if a puncture still is active, all punctures before will also still be active.
-	for (auto it = punctures.rbegin(); it != punctures.rend(); ++it)
+	p->outputArgCount = 0;
+	CLuaFunctionData D;
+	if (D.readDataFromLua(p, inArgs_GETREACHABILITY, inArgs_GETREACHABILITY[0], LUA_GETREACHABILITY_COMMAND))
 	{
-		float puncture_length = punctureLength(*it);
-		// If puncture length is above zero, all punctures before it in the vector will be unchanged.
-		if (checkSinglePuncture(*it) > 0)
+		std::vector<CLuaFunctionDataItem>* inData = D.getInDataPtr();
+		if (reachabilityMap.isOpen())
 		{
-			full_penetration_length -= it->penetration_length;
-			full_penetration_length += puncture_length;
-			// This penetration length might have been updated, so update.
-			it->penetration_length = puncture_length;
-			// Set punctures to be from the first puncture up until the current.
-			punctures = std::vector<sPuncture>(it, punctures.rend());
-			std::reverse(punctures.begin(), punctures.end());
-			return;
-		}
-		else {
-			// The needle isn't puncturing this tissue anymore. Set tissue respondable and print.
-			setRespondable(it->handle);
-			full_penetration_length -= it->penetration_length;
-			it->printPuncture(false);
+			std::vector<float>& position = inData->at(0).floatData;
+			std::vector<float>& direction = inData->at(1).floatData;
+			sReachability reachability = reachabilityMap.query(Vector3f(position[0], position[1], position[2]),
+				Vector3f(direction[0], direction[1], direction[2]));
+			D.pushOutData(CLuaFunctionDataItem(reachability.reachable));
+			D.pushOutData(CLuaFunctionDataItem(reachability.manipulability));
+			D.pushOutData(CLuaFunctionDataItem(reachability.inside));
 		}
-
+		else
+			simSetLastError(LUA_GETREACHABILITY_COMMAND, "No reachability map loaded.");
 	}
-	// No punctures had length > 0
-	punctures.clear();
+	D.writeDataToLua(p);
 }
+// --------------------------------------------------------------------------------------
 
+// --------------------------------------------------------------------------------------
+// simExtSkeleton_setSharedMemory: publish the needles to the haptic driver through shared memory
+// --------------------------------------------------------------------------------------
+#define LUA_SETSHAREDMEMORY_COMMAND "simExtSkeleton_setSharedMemory" // the name of the new Lua command
 
+const int inArgs_SETSHAREDMEMORY[] = {
+	1,
+	sim_lua_arg_bool,0, // enabled
+};
 
-/**
-* @brief Set object respondable
-* @param handle: handle
-*/
-void setRespondable(int handle)
+// Creates or removes the segments of all needles of the current scene, see hapticChannel.h.
+static void updateHapticChannels()
 {
-	simSetObjectIntParameter(handle, RESPONDABLE, 1);
+	for (CNeedleInstance& needle : currentScene().needles)
+	{
+		if (!needleConfig.shared_memory)
+			needle.closeHapticChannel();
+		else if (!needle.openHapticChannel())
+			std::cout << "Needle" << needle.getSuffix() << ": could not create " << CHapticChannel::segmentName(needle.getSuffix(), false) << std::endl;
+	}
 }
 
-/**
-* @brief Set object unrespondable
-* @param handle: handle
-*/
-void setUnRespondable(int handle)
+void LUA_SETSHAREDMEMORY_CALLBACK(SLuaCallBack* p)
 {
-	simSetObjectIntParameter(handle, RESPONDABLE, 0);
+	p->outputArgCount = 0;
+	CLuaFunctionData D;
+	if (D.readDataFromLua(p, inArgs_SETSHAREDMEMORY, inArgs_SETSHAREDMEMORY[0], LUA_SETSHAREDMEMORY_COMMAND))
+	{
+		std::vector<CLuaFunctionDataItem>* inData = D.getInDataPtr();
+		needleConfig.shared_memory = inData->at(0).boolData[0];
+		updateHapticChannels();
+	}
+	D.writeDataToLua(p);
 }
+// --------------------------------------------------------------------------------------
 
-/**
-* @brief Check if a puncture is still active.
-* @param puncture: puncture
-* @return 1 if still active, -1 if not.
-*/
-int checkSinglePuncture(sPuncture puncture) {
-	Vector3f current_translation = puncture.position - toolTipPoint;
-	// If the dot product of the two vectors are positive (and not to negative because of edge case when distance is around 0), we are still in the tissue.
-	if (current_translation.dot(puncture.direction) >= -1)
-		return 1;
-	return -1;
+// Builds or loads from the cache (see tissueSdf.h) the fields of all shapes of the phantom. They are kept
+// until the content of the scene changes.
+static void loadTissueFields(sSceneContext& scene)
+{
+	if (scene.fieldsValid && needleConfig.use_tissue_sdf)
+		return;
+	scene.tissueFields.clear();
+	scene.fieldsValid = needleConfig.use_tissue_sdf;
+	if (!needleConfig.use_tissue_sdf || (scene.phantomHandle == -1))
+		return;
+	for (int i = 0; ; i++)
+	{
+		int handle = simGetObjects(i, sim_object_shape_type);
+		if (handle == -1)
+			break;
+		if (simGetObjectParent(handle) != scene.phantomHandle)
+			continue;
+		simFloat* vertices = NULL;
+		simInt* indices = NULL;
+		simInt vertexSize = 0, indexSize = 0;
+		if (simGetShapeMesh(handle, &vertices, &vertexSize, &indices, &indexSize, NULL) == -1)
+			continue;
+		sSdfMesh mesh;
+		mesh.vertices.assign(vertices, vertices + vertexSize);
+		mesh.indices.assign(indices, indices + indexSize);
+		simReleaseBuffer((simChar*)vertices);
+		simReleaseBuffer((simChar*)indices);
+
+		std::shared_ptr<CTissueSdf> field(new CTissueSdf());
+		bool built;
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		if (!cachedTissueSdf(mesh, needleConfig.sdf, *threadPool, *field, built))
+			continue;
+		scene.tissueFields[handle] = field;
+		simChar* name = simGetObjectName(handle);
+		std::cout << "Tissue " << (name != NULL ? name : "") << ": signed distance field " << (built ? "built" : "loaded") << " in "
+			<< std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count() << " s, "
+			<< field->getHeader().stored_bricks << " bricks, " << field->memoryBytes() / 1024 << " KiB" << std::endl;
+		if (name != NULL)
+			simReleaseBuffer(name);
+	}
 }
 
-/**
-* @brief Update needle velocity
-*/
-void updateNeedleVelocity()														// To add Low-pass filter, I think a good place to add it would be here.
+// --------------------------------------------------------------------------------------
+// Message handlers, routed in v_repStart. Here we can intercept many messages from V-REP (actually callbacks).
+// For a complete list of messages that you can intercept/react with, search for "sim_message_eventcallback"-type
+// constants in the V-REP user manual. Messages without a handler cost a table lookup and a counter.
+// --------------------------------------------------------------------------------------
+static bool refreshDlgFlag = true;
+
+static void silenceErrorReports(int& saved)
 {
-	simFloat needleVelocities[3];
-	if (simGetObjectVelocity(lwrTipHandle, needleVelocities, NULL) == -1)
-		std::cerr << "Needle tip velocity retrieval failed" << std::endl;
-	needleVelocity = getVelocityMagnitude(needleVelocities);
+	simGetIntegerParameter(sim_intparam_error_report_mode, &saved);
+	simSetIntegerParameter(sim_intparam_error_report_mode, sim_api_errormessage_ignore);
 }
 
-/**
-* @brief Update needle direction
-*/
-void updateNeedleDirection()
+static void restoreErrorReports(int& saved)
 {
-	simFloat objectMatrix[12];
-	simGetObjectMatrix(lwrTipHandle, -1, objectMatrix);
-	needleDirection = simObjectMatrix2EigenDirection(objectMatrix);
-
+	simSetIntegerParameter(sim_intparam_error_report_mode, saved);
 }
 
-/**
-* @brief Update needle position
-*/
-void updateNeedleTipPos()
-{
-	float needleTipPos[3];
-	simGetObjectPosition(lwrTipHandle, -1, needleTipPos);
-	toolTipPoint = Vector3f(needleTipPos[0], needleTipPos[1], needleTipPos[2]);
+static void* onRefreshDialogs(int* auxiliaryData, void* customData, int* replyData)
+{ // V-REP dialogs were refreshed. Maybe a good idea to refresh this plugin's dialog too
+	refreshDlgFlag = true;
+	return NULL;
 }
 
 /**
-* @brief Add new puncture to punctures
-* @param handle: handle of tissue that was punctured
+* @brief Load what the simulation of a scene needs besides its objects: the fields of the phantom's shapes,
+*        its CT volume and the reachability map. Done when the scene is bound and when a simulation ends,
+*        so that simulation start loads nothing. The volume stays mapped across runs.
 */
-void addPuncture(int handle)
+static void loadSceneData(sSceneContext& scene)
 {
-	float needleMatrix[12];
-	simGetObjectMatrix(needleHandle, -1, needleMatrix);
-	sPuncture puncture;
-	puncture.position = toolTipPoint;
-	puncture.direction = Vector3f(needleMatrix[2], needleMatrix[6], needleMatrix[10]);
-	puncture.handle = handle;
-	puncture.name = simGetObjectName(handle);
-	puncture.penetration_length = punctureLength(puncture);
-	full_penetration_length += puncture.penetration_length;
-	setUnRespondable(handle);
-	punctures.push_back(puncture);
-	puncture.printPuncture(true);
+	loadTissueFields(scene);
+	if (!scene.volume.isOpen() || (scene.volumePath != tissueVolumePath))
+		loadTissueVolume(scene, tissueVolumePath);
+	if (!reachabilityMap.isOpen() && reachabilityMap.open(reachabilityMapPath))
+		std::cout << "Loaded reachability map " << reachabilityMapPath << std::endl;
 }
 
 /**
-* @brief Check which contacts will result in a puncture
+* @brief Bind the phantom and the needles of a scene to its objects and report what is missing, see
+*        CNeedleInstance::bind(). Runs when the scene is loaded or its content changes. While the scene is
+*        simulated, the needles are only bound again and keep their state: a needle that lost a required
+*        object is dropped, new needles are found at the next simulation start.
 */
-void checkContacts()
+static void bindScene(sSceneContext& scene)
 {
-
-	lwr_tip_engine_force_magnitude = 0.0;
-	lwr_tip_enging_force.setZero();
-	for (int a = 0; a<20; a++)
+	int saved;
+	silenceErrorReports(saved); // missing objects are reported below
+	std::vector<std::string> problems;
+	scene.phantomHandle = simGetObjectHandle("_Phantom");
+	if (!scene.running)
+		scene.needles = CNeedleInstance::discover(scene.phantomHandle, problems);
+	else
 	{
-		simInt contactHandles[2];
-		simFloat contactInfo[6];
-		simGetContactInfo(sim_handle_all, needleHandle , a, contactHandles, contactInfo);
-		if (contactHandles[1] < 1000)
+		std::vector<CNeedleInstance> needles;
+		for (CNeedleInstance& needle : scene.needles)
 		{
-			Vector3f force = simContactInfo2EigenForce(contactInfo);
-			float force_magnitude;
-			if (use_only_z_force_on_engine)
-				force_magnitude = generalForce2NeedleTipZ(force);
+			if (needle.bind(needle.getSuffix(), scene.phantomHandle, problems))
+				needles.push_back(needle);
 			else
-				force_magnitude = force.norm();
-
-			int respondableValue;
-			simGetObjectIntParameter(contactHandles[1], RESPONDABLE, &respondableValue);
-			if (respondableValue != 0 && simGetObjectParent(contactHandles[1]) == phantomHandle)
 			{
-				lwr_tip_engine_force_magnitude += force_magnitude;
-				lwr_tip_enging_force += simContactInfo2EigenForce(contactInfo);
-			}
-
-				
-			// Here we are supposed to use simGetObjectName to use K(), but there is something weird with the sim function that makes v-rep crash.
-			if (force_magnitude > constant_puncture_threshold && respondableValue != 0 && simGetObjectParent(contactHandles[1]) == phantomHandle) {
-				addPuncture(contactHandles[1]);
-				std::cout << "Force magnitude: " << force_magnitude << std::endl;
+				needle.reactivateTissues(scene.tissues);
+				needle.closeHapticChannel();
 			}
-
-
 		}
+		scene.needles.swap(needles);
+	}
+	scene.bound = !scene.running;
+	// A running scene catches up when its simulation ends.
+	if (!scene.running)
+		loadSceneData(scene);
+	// A scene without any needle object, e.g. a new one, needs no phantom.
+	if ((scene.phantomHandle == -1) && (!scene.needles.empty() || !problems.empty()))
+		problems.insert(problems.begin(), "_Phantom is missing: no tissue is punctured");
+	restoreErrorReports(saved);
+
+	std::vector<std::string> report(1, std::to_string(scene.needles.size()) + " needle(s) bound");
+	report.insert(report.end(), problems.begin(), problems.end());
+	if (report == scene.bindingReport)
+		return;
+	scene.bindingReport = report;
+	std::cout << "Scene " << scene.scene << ": " << report[0] << std::endl;
+	for (const std::string& problem : problems)
+	{
+		std::cout << "  " << problem << std::endl;
+		simAddStatusbarMessage(("Needle plugin: " + problem).c_str());
 	}
 }
 
-/**
-* @brief Sign function
-*/
-float sgn(float x) {
-	if (x > 0) return 1.0;
-	if (x < 0) return -1.0;
-	return 0.0;
-}
-
-/**
-* @brief Model external forces that act upon the needle. Updates f_ext_magnitude and f_ext
-* @param model: string describing the model that should be used for modeling the forces
-*/
-void modelExternalForces(std::string model) {
-
-	if (model == "kelvin-voigt") {
-		f_ext_magnitude = kelvinVoigtModel();
+static void* onInstancePass(int* auxiliaryData, void* customData, int* replyData)
+{ // This message is sent each time the scene was rendered (well, shortly after) (very often)
+	int flags = auxiliaryData[0];
+	bool sceneContentChanged = ((flags&(1+2+4+8+16+32+64+256)) != 0); // object erased, created, model or scene loaded, und/redo called, instance switched, or object scaled since last sim_message_eventcallback_instancepass message
+	bool instanceSwitched = ((flags&64) != 0);
+	if (instanceSwitched)
+	{ // the other scene keeps its context
+		selectCurrentScene();
+		if (!currentScene().bound)
+			bindScene(currentScene());
 	}
-	else if (model == "karnopp")
-	{
-		f_ext_magnitude = karnoppModel() * 0.1;
+	if ((flags&(1+2+4+8+16+32+256)) != 0)
+	{ // the scene itself changed: its objects are bound again, its caches are rebuilt when they are needed next
+		currentScene().fieldsValid = false;
+		currentScene().tissues.clearNames();
+		bindScene(currentScene());
 	}
-	else
-	{
-		std::cout << "No valid friction model was chosen, automatically set Kelvin-Voigt" << std::endl;
-		f_ext_magnitude = kelvinVoigtModel();
-	}
-	f_ext_magnitude *= model_force_scalar;
-	// Obtain the forces in the z direction in the reference frame of the lwr needle tip.
-	// Add the z force to the magnitude of the forces
-	if (use_only_z_force_on_engine)
-		f_ext_magnitude += generalForce2NeedleTipZ(lwr_tip_enging_force) * engine_force_scalar;
-	else
-		f_ext_magnitude += lwr_tip_enging_force.norm() * engine_force_scalar;
-	// Get direction of the dummy so that the forces get distributed on all the axis. (They did this in the other project, but is this correct?)
-	// Shouldn't we rather map all the calculated forces onto the z direction of the needle? The other directions should be handled by the virtual fixture.
-	float dummy_object_matrix[12];
-	simGetObjectMatrix(dummyHandle, -1, dummy_object_matrix);
-	Vector3f dummy_dir = simObjectMatrix2EigenDirection(dummy_object_matrix);
-	f_ext = f_ext_magnitude * dummy_dir; // Should we normalize dir?				Peter: Multiplying with dummy dir creates equal force in all directions of the dummy. Is this right?
+	if (sceneContentChanged)
+		refreshDlgFlag = true; // always a good idea to trigger a refresh of this plugin's dialog here
+	return NULL;
 }
 
-/**
-* @brief Distance between two points
-* @param point1: point 1
-* @param point2: point 2
-* @return distance between the points
-*/
-float distance3d(Vector3f point1, Vector3f point2) {
-	return (point1 - point2).norm();
+static void* onSceneClosed(int* auxiliaryData, void* customData, int* replyData)
+{ // The scene is about to be closed: its needles, haptic channels, fields and volume go with its context
+	// It is still the current scene here, the one V-REP switches to is selected by the next instance pass.
+	int scene = -1;
+	simGetIntegerParameter(sim_intparam_scene_unique_id, &scene);
+	scenes.erase(scene);
+	return NULL;
 }
 
-/**
-* @brief Get the magnitude of a sim velocity vector.
-* @param velocity: A pointer to an array of 3 values representing the velocity.
-* @return the velocity magnitude
-*/
-float getVelocityMagnitude(simFloat* velocity) {
-	return std::sqrt(std::pow(velocity[0], 2)
-		+ std::pow(velocity[1], 2)
-		+ std::pow(velocity[2], 2));
+static void* onSimulationAboutToStart(int* auxiliaryData, void* customData, int* replyData)
+{ // Simulation is about to start. The objects were bound and the fields, volume and map loaded when the scene was loaded or changed.
+	sSceneContext& scene = currentScene();
+	if (!scene.bound)
+		bindScene(scene);
+	scene.running = true;
+	for (CNeedleInstance& needle : scene.needles)
+		needle.start();
+	updateHapticChannels();
+	stepBudget.reset();
+	if (!tracePath.empty())
+		traceStart();
+	return NULL;
 }
 
-
-void setForceGraph()
-{
-	simSetGraphUserData(extForceGraphHandle, "measured_F", f_ext_magnitude);
-	float objectMatrixRefFrame[12];
-	simGetObjectMatrix(lwrTipHandle, -1, objectMatrixRefFrame);
-	Vector3f extf = changeBasis(objectMatrixRefFrame, lwr_tip_enging_force);
-	simSetGraphUserData(needleForceGraphHandle, "x", extf(0));
-	simSetGraphUserData(needleForceGraphHandle, "y", extf(1));
-	simSetGraphUserData(needleForceGraphHandle, "z", extf(2));
-	for (sPuncture puncture : punctures)
+static void* onSimulationEnded(int* auxiliaryData, void* customData, int* replyData)
+{ // Simulation just ended
+	sSceneContext& scene = currentScene();
+	scene.running = false;
+	for (CNeedleInstance& needle : scene.needles)
 	{
-		if (puncture.name == "Fat") {
-			simSetGraphUserData(extForceGraphHandle, "fat_penetration", puncture.penetration_length);
-		}
-		else if (puncture.name == "muscle")
-		{
-			simSetGraphUserData(extForceGraphHandle, "muscle_penetration", puncture.penetration_length);
-		}
-		else if (puncture.name == "lung")
-		{
-			simSetGraphUserData(extForceGraphHandle, "lung_penetration", puncture.penetration_length);
-		}
-		else if (puncture.name == "bronchus")
-		{
-			simSetGraphUserData(extForceGraphHandle, "bronchus_penetration", puncture.penetration_length);
-		}
-
+		needle.reactivateTissues(scene.tissues);
+		needle.closeHapticChannel();
 	}
-	simSetGraphUserData(extForceGraphHandle, "full_penetration", full_penetration_length);
+	// The content may have changed during the run, the fields are then rebuilt now instead of at the next start.
+	loadSceneData(scene);
+	if (traceStarted())
+		writeTrace();
+	return NULL;
 }
 
-
-float karnoppModel()
+// One step of all needles of a scene. What the budget governor shed is left out, see stepBudget.h.
+static void stepScene(sSceneContext& scene)
 {
-	if (needleVelocity <= -zero_threshold) {
-		return full_penetration_length*(C_n*sgn(needleVelocity) + b_n*needleVelocity);
-	}
-	else if (-zero_threshold < needleVelocity && needleVelocity <= 0) {
-		return full_penetration_length * D_n;
-	}
-	else if (0 < needleVelocity && needleVelocity < zero_threshold) {
-		return full_penetration_length * D_p;
-	}
-	else if (needleVelocity >= zero_threshold) {
-		return full_penetration_length * (C_p*sgn(needleVelocity) + b_p*needleVelocity);
-	}
-	return -1;
-}
-
-float B(sPuncture puncture)
-{
-	if (puncture.name == "Fat")
+	// V-REP may only be called from this thread: read the scene for all needles first,
+	CTraceSpan stepSpan("moduleHandle");
+	std::vector<CNeedleInstance>& needles = scene.needles;
+	sVolumeInput volume;
+	if (scene.volume.isOpen() && (scene.phantomHandle != -1))
 	{
-		return 3.0f * 100.0f;
+		float objectMatrix[12];
+		simGetObjectMatrix(scene.phantomHandle, -1, objectMatrix);
+		volume.volume = &scene.volume;
+		volume.tissues = &scene.volumeTissues;
+		for (int i = 0; i < 3; i++)
+		{
+			for (int j = 0; j < 3; j++)
+				volume.rotation(i, j) = objectMatrix[4 * i + j];
+			volume.position(i) = objectMatrix[4 * i + 3];
+		}
 	}
-	else if (puncture.name == "muscle")
 	{
-		return 3.0f * 100.0f;
+		CTraceSpan span("readSimState");
+		for (CNeedleInstance& needle : needles)
+			needle.readSimState(scene.tissues, scene.tissueFields, volume);
 	}
-	else if (puncture.name == "lung")
+
+	// then run the force model and puncture bookkeeping of all needles in parallel,
 	{
-		return 3.0f * 100.0f;
+		CTraceSpan span("compute");
+		sNeedleConfig config = needleConfig;
+		stepBudget.degrade(config);
+		threadPool->parallelFor(needles.size(), [&needles, &config](size_t i) {
+			CTraceSpan needleSpan("needle", "index", (int)i);
+			needles[i].compute(config);
+		});
 	}
-	else if (puncture.name == "bone")
+
+	// and write the results back.
+	CTraceSpan span("applySimState");
+	bool graphs = stepBudget.graphsDue();
+	for (CNeedleInstance& needle : needles)
 	{
-		return 30.0f * 100.05;
+		needle.applySimState(scene.tissues);
+		if (graphs)
+			needle.setForceGraph();
 	}
-	else
+	scene.tissues.flush();
+}
+
+static void* onModuleHandle(int* auxiliaryData, void* customData, int* replyData)
+{ // A script called simHandleModule (by default the main script). Is only called during simulation.
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	stepBudget.beginPass();
+	if (traceStarted())
+		tracePause(!stepBudget.traceDue());
+	stepScene(currentScene());
+	// The filters only shape the force of the haptic device, they are kept while it is attached.
+	stepBudget.endPass(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(),
+		needleConfig.shared_memory ? BUDGET_SUBSTEPS : BUDGET_FILTERS);
+	return NULL;
+}
+
+static void* onGuiPass(int* auxiliaryData, void* customData, int* replyData)
+{ // handle refresh of the plugin's dialogs
+	if (refreshDlgFlag)
 	{
-		return 3.0f * 100.0f;
+		// ...
+		refreshDlgFlag = false;
 	}
+	return NULL;
 }
 
-float K(std::string name)
+// This is the plugin start routine (called just once, just after the plugin was loaded):
+VREP_DLLEXPORT unsigned char v_repStart(void* reservedPointer,int reservedInt)
 {
-	if (name == "Fat")
-	{
-		return 1.0e-2;
-	}
-	
-	else if (name == "muscle")
-	{
-		return 1.0e-2;
-	}
-	else if (name == "lung")
-	{
-		return 1.0e-2;
-	}
-	else if (name == "bone")
+	// Dynamically load and bind V-REP functions:
+	// ******************************************
+	// 1. Figure out this plugin's directory:
+	char curDirAndFile[1024];
+#ifdef _WIN32
+	#ifdef QT_COMPIL
+		_getcwd(curDirAndFile, sizeof(curDirAndFile));
+	#else
+		GetModuleFileName(NULL,curDirAndFile,1023);
+		PathRemoveFileSpec(curDirAndFile);
+	#endif
+#elif defined (__linux) || defined (__APPLE__)
+	getcwd(curDirAndFile, sizeof(curDirAndFile));
+#endif
+
+	std::string currentDirAndPath(curDirAndFile);
+	// 2. Append the V-REP library's name:
+	std::string temp(currentDirAndPath);
+#ifdef _WIN32
+	temp+="\\v_rep.dll";
+#elif defined (__linux)
+	temp+="/libv_rep.so";
+#elif defined (__APPLE__)
+	temp+="/libv_rep.dylib";
+#endif /* __linux || __APPLE__ */
+	// 3. Load the V-REP library:
+	vrepLib=loadVrepLibrary(temp.c_str());
+	if (vrepLib==NULL)
 	{
-		return 1.0;
+		std::cout << "Error, could not find or correctly load the V-REP library. Cannot start 'PluginSkeleton' plugin.\n";
+		return(0); // Means error, V-REP will unload this plugin
 	}
-	else
+	if (getVrepProcAddresses(vrepLib)==0)
 	{
-		return 1.0e-2;
+		std::cout << "Error, could not find all required functions in the V-REP library. Cannot start 'PluginSkeleton' plugin.\n";
+		unloadVrepLibrary(vrepLib);
+		return(0); // Means error, V-REP will unload this plugin
 	}
-}
+	// ******************************************
 
-float kelvinVoigtModel() {
-	float f_magnitude = 0.0;
-	for (auto puncture_it = punctures.begin(); puncture_it != punctures.end(); puncture_it++)
+	// Check the version of V-REP:
+	// ******************************************
+	int vrepVer;
+	simGetIntegerParameter(sim_intparam_program_version,&vrepVer);
+	if (vrepVer<30200) // if V-REP version is smaller than 3.02.00
 	{
-		f_magnitude += (B(*puncture_it) * puncture_it->penetration_length);
+		std::cout << "Sorry, your V-REP copy is somewhat old. Cannot start 'PluginSkeleton' plugin.\n";
+		unloadVrepLibrary(vrepLib);
+		return(0); // Means error, V-REP will unload this plugin
 	}
-	f_magnitude *= needleVelocity;
-	return f_magnitude;
-}
+	// ******************************************
 
-Vector3f simObjectMatrix2EigenDirection(const float* objectMatrix)
-{
-	return Vector3f(objectMatrix[2], objectMatrix[6], objectMatrix[10]);
-}
+	std::vector<int> inArgs;
 
+	// Register the new Lua command "simExtSkeleton_getSensorData":
+	CLuaFunctionData::getInputDataForFunctionRegistration(inArgs_GETSENSORDATA,inArgs);
+	simRegisterCustomLuaFunction(LUA_GETSENSORDATA_COMMAND,strConCat("number result,table data,number distance=",LUA_GETSENSORDATA_COMMAND,"(number sensorIndex,table_3 floatParameters,table_2 intParameters)"),&inArgs[0],LUA_GETSENSORDATA_CALLBACK);
+	CLuaFunctionData::getInputDataForFunctionRegistration(inArgs_SETPUNCTURETHRESHOLD, inArgs);
+	simRegisterCustomLuaFunction(LUA_SETPUNCTURETHRESHOLD_COMMAND, strConCat("",LUA_SETPUNCTURETHRESHOLD_COMMAND,"(number threshold)"), &inArgs[0], LUA_SETPUNCTURETHRESHOLD_CALLBACK);
+	CLuaFunctionData::getInputDataForFunctionRegistration(inArgs_SETPUNCTUREHYSTERESIS, inArgs);
+	simRegisterCustomLuaFunction(LUA_SETPUNCTUREHYSTERESIS_COMMAND, strConCat("",LUA_SETPUNCTUREHYSTERESIS_COMMAND,"(number entryMargin,number exitDepth,number entrySteps,number exitSteps)"), &inArgs[0], LUA_SETPUNCTUREHYSTERESIS_CALLBACK);
+	CLuaFunctionData::getInputDataForFunctionRegistration(inArgs_GETPUNCTURESTATISTICS, inArgs);
+	simRegisterCustomLuaFunction(LUA_GETPUNCTURESTATISTICS_COMMAND, strConCat("number entries,number exits,number entriesAvoided,number exitsAvoided,number respondableWrites,number writesAvoided=",LUA_GETPUNCTURESTATISTICS_COMMAND,"(number needleIndex)"), &inArgs[0], LUA_GETPUNCTURESTATISTICS_CALLBACK);
+	CLuaFunctionData::getInputDataForFunctionRegistration(inArgs_SETNATIVEIK, inArgs);
+	simRegisterCustomLuaFunction(LUA_SETNATIVEIK_COMMAND, strConCat("",LUA_SETNATIVEIK_COMMAND,"(boolean enabled)"), &inArgs[0], LUA_SETNATIVEIK_CALLBACK);
+	CLuaFunctionData::getInputDataForFunctionRegistration(inArgs_GETIKSTATISTICS, inArgs);
+	simRegisterCustomLuaFunction(LUA_GETIKSTATISTICS_COMMAND, strConCat("number iterations,number solveTime,number positionError,number orientationError=",LUA_GETIKSTATISTICS_COMMAND,"(number needleIndex)"), &inArgs[0], LUA_GETIKSTATISTICS_CALLBACK);
+	CLuaFunctionData::getInputDataForFunctionRegistration(inArgs_GETMESSAGESTATISTICS, inArgs);
+	simRegisterCustomLuaFunction(LUA_GETMESSAGESTATISTICS_COMMAND, strConCat("number calls,number handled,number seconds=",LUA_GETMESSAGESTATISTICS_COMMAND,"(number message)"), &inArgs[0], LUA_GETMESSAGESTATISTICS_CALLBACK);
+	CLuaFunctionData::getInputDataForFunctionRegistration(inArgs_SETSHAREDMEMORY, inArgs);
+	simRegisterCustomLuaFunction(LUA_SETSHAREDMEMORY_COMMAND, strConCat("",LUA_SETSHAREDMEMORY_COMMAND,"(boolean enabled)"), &inArgs[0], LUA_SETSHAREDMEMORY_CALLBACK);
+	CLuaFunctionData::getInputDataForFunctionRegistration(inArgs_LOADREACHABILITYMAP, inArgs);
+	simRegisterCustomLuaFunction(LUA_LOADREACHABILITYMAP_COMMAND, strConCat("boolean loaded=",LUA_LOADREACHABILITYMAP_COMMAND,"(string path)"), &inArgs[0], LUA_LOADREACHABILITYMAP_CALLBACK);
+	CLuaFunctionData::getInputDataForFunctionRegistration(inArgs_LOADTISSUEVOLUME, inArgs);
+	simRegisterCustomLuaFunction(LUA_LOADTISSUEVOLUME_COMMAND, strConCat("boolean loaded=",LUA_LOADTISSUEVOLUME_COMMAND,"(string path)"), &inArgs[0], LUA_LOADTISSUEVOLUME_CALLBACK);
+	CLuaFunctionData::getInputDataForFunctionRegistration(inArgs_SAVECHECKPOINT, inArgs);
+	simRegisterCustomLuaFunction(LUA_SAVECHECKPOINT_COMMAND, strConCat("string checkpoint=",LUA_SAVECHECKPOINT_COMMAND,"()"), &inArgs[0], LUA_SAVECHECKPOINT_CALLBACK);
+	CLuaFunctionData::getInputDataForFunctionRegistration(inArgs_RESTORECHECKPOINT, inArgs);
+	simRegisterCustomLuaFunction(LUA_RESTORECHECKPOINT_COMMAND, strConCat("boolean restored=",LUA_RESTORECHECKPOINT_COMMAND,"(string checkpoint)"), &inArgs[0], LUA_RESTORECHECKPOINT_CALLBACK);
+	CLuaFunctionData::getInputDataForFunctionRegistration(inArgs_SETTRACEFILE, inArgs);
+	simRegisterCustomLuaFunction(LUA_SETTRACEFILE_COMMAND, strConCat("boolean tracing=",LUA_SETTRACEFILE_COMMAND,"(string path)"), &inArgs[0], LUA_SETTRACEFILE_CALLBACK);
+	CLuaFunctionData::getInputDataForFunctionRegistration(inArgs_SETSTEPBUDGET, inArgs);
+	simRegisterCustomLuaFunction(LUA_SETSTEPBUDGET_COMMAND, strConCat("",LUA_SETSTEPBUDGET_COMMAND,"(number budget)"), &inArgs[0], LUA_SETSTEPBUDGET_CALLBACK);
+	CLuaFunctionData::getInputDataForFunctionRegistration(inArgs_GETSTEPBUDGET, inArgs);
+	simRegisterCustomLuaFunction(LUA_GETSTEPBUDGET_COMMAND, strConCat("number level,string shed,number lastPass,number averagePass,number overruns,number sheds,number restores=",LUA_GETSTEPBUDGET_COMMAND,"()"), &inArgs[0], LUA_GETSTEPBUDGET_CALLBACK);
+	CLuaFunctionData::getInputDataForFunctionRegistration(inArgs_GETREACHABILITY, inArgs);
+	simRegisterCustomLuaFunction(LUA_GETREACHABILITY_COMMAND, strConCat("boolean reachable,number manipulability,boolean inMap=",LUA_GETREACHABILITY_COMMAND,"(table_3 position,table_3 direction)"), &inArgs[0], LUA_GETREACHABILITY_CALLBACK);
+
+	threadPool = new CThreadPool(CThreadPool::defaultWorkerCount());
+	selectCurrentScene();
+	bindScene(currentScene());
+
+	// Messages this plugin reacts to; the API handlers run with the error report mode silenced.
+	messageRouter.setModuleName("PluginSkeleton");
+	messageRouter.setApiGuard(silenceErrorReports, restoreErrorReports);
+	messageRouter.route(sim_message_eventcallback_refreshdialogs, onRefreshDialogs, 0);
+	messageRouter.route(sim_message_eventcallback_instancepass, onInstancePass, 0);
+	messageRouter.route(sim_message_eventcallback_sceneclosed, onSceneClosed, 0);
+	messageRouter.route(sim_message_eventcallback_simulationabouttostart, onSimulationAboutToStart, MESSAGE_API);
+	messageRouter.route(sim_message_eventcallback_simulationended, onSimulationEnded, MESSAGE_API);
+	messageRouter.route(sim_message_eventcallback_modulehandle, onModuleHandle, MESSAGE_API | MESSAGE_MODULE);
+	messageRouter.route(sim_message_eventcallback_guipass, onGuiPass, 0);
 
-void reactivateTissues()
-{
-	std::cout << punctures.size() << std::endl;
-	for (sPuncture puncture : punctures) {
-		simSetObjectIntParameter(puncture.handle, RESPONDABLE, 1);
-		std::cout << "Reactivated respondable for object " << simGetObjectName(puncture.handle) << std::endl;
-	}
-	punctures.clear();
+	return(PLUGIN_VERSION); // initialization went fine, we return the version number of this plugin (can be queried with simGetModuleName)
 }
 
-Vector3f simContactInfo2EigenForce(const float* contactInfo)
+// This is the plugin end routine (called just once, when V-REP is ending, i.e. releasing this plugin):
+VREP_DLLEXPORT void v_repEnd()
 {
-	return Vector3f(contactInfo[3], contactInfo[4], contactInfo[5]);
-}
+	// Here you could handle various clean-up tasks
+	delete threadPool;
+	threadPool = NULL;
 
-Vector3f changeBasis(const float* objectMatrixReferenceFrame, Vector3f vector)
-{
-	float quat[4];
-	simGetQuaternionFromMatrix(objectMatrixReferenceFrame, quat);
-	return Quaternionf(quat[0], quat[1], quat[2], quat[3]) * vector;
+	unloadVrepLibrary(vrepLib); // release the library
 }
 
-float generalForce2NeedleTipZ(Vector3f force)
-{
-	float lwr_tip_object_matrix[12];
-	simGetObjectMatrix(lwrTipHandle, -1, lwr_tip_object_matrix);
-	Vector3f lwr_tip_engine_force_tmp = changeBasis(lwr_tip_object_matrix, lwr_tip_enging_force);
-	return lwr_tip_engine_force_tmp.z();
-}
\ No newline at end of file
+// This is the plugin messaging routine (i.e. V-REP calls this function very often, with various messages):
+VREP_DLLEXPORT void* v_repMessage(int message,int* auxiliaryData,void* customData,int* replyData)
+{ // This is called quite often. Messages without a handler return at once, see messageRouter.h and v_repStart.
+	return messageRouter.dispatch(message, auxiliaryData, customData, replyData);
+}
@@ -23,7 +23,9 @@ TEMPLATE = lib
 DEFINES -= UNICODE
 DEFINES += QT_COMPIL
 CONFIG += shared
+CONFIG += c++11
 INCLUDEPATH += "../include"
+INCLUDEPATH += "packages/Eigen.3.3.3/build/native/include"
 
 *-msvc* {
 	QMAKE_CXXFLAGS += -O2
@@ -59,6 +61,7 @@ macx {
 
 unix:!macx {
     DEFINES += LIN_VREP
+    LIBS += -lrt
 }
 
 unix:!symbian {
@@ -72,12 +75,58 @@ unix:!symbian {
 
 HEADERS += \
     v_repExtPluginSkeleton.h \
+    punctureCore.h \
+    stepBudget.h \
+    stepTracer.h \
+    shaftKernel.h \
+    needleCheckpoint.h \
+    sceneContext.h \
+    messageRouter.h \
+    tissueVolume.h \
+    tissueSdf.h \
+    forceExtrapolation.h \
+    hapticChannel.h \
+    passivityControl.h \
+    virtualFixture.h \
+    reachabilityMap.h \
+    lwrKinematics.h \
+    beamModel.h \
+    bevelModel.h \
+    shaftModel.h \
+    lugreModel.h \
+    pronyModel.h \
+    needleInstance.h \
+    needleModel.h \
+    threadPool.h \
     ../include/luaFunctionData.h \
     ../include/luaFunctionDataItem.h \
     ../include/v_repLib.h 
 
 SOURCES += \
     v_repExtPluginSkeleton.cpp \
+    punctureCore.cpp \
+    stepBudget.cpp \
+    stepTracer.cpp \
+    shaftKernel.cpp \
+    needleCheckpoint.cpp \
+    sceneContext.cpp \
+    messageRouter.cpp \
+    tissueVolume.cpp \
+    tissueSdf.cpp \
+    forceExtrapolation.cpp \
+    hapticChannel.cpp \
+    passivityControl.cpp \
+    virtualFixture.cpp \
+    reachabilityMap.cpp \
+    lwrKinematics.cpp \
+    beamModel.cpp \
+    bevelModel.cpp \
+    shaftModel.cpp \
+    lugreModel.cpp \
+    pronyModel.cpp \
+    needleInstance.cpp \
+    needleModel.cpp \
+    threadPool.cpp \
     ../common/luaFunctionData.cpp \
     ../common/luaFunctionDataItem.cpp \
     ../common/v_repLib.cpp
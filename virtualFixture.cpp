@@ -0,0 +1,41 @@
+// Peter: Remote-centre-of-motion virtual fixture. See virtualFixture.h.
+
+#include "virtualFixture.h"
+
+using namespace Eigen;
+
+void sVirtualFixture::engage(const Vector3f& entry, const Vector3f& insertionDirection)
+{
+	active = true;
+	centre = entry;
+	axis = insertionDirection.normalized();
+}
+
+void sVirtualFixture::release()
+{
+	*this = sVirtualFixture();
+}
+
+/**
+* @brief Constraint of the commanded motion to the insertion line, see virtualFixture.h
+* @param fixture: centre and axis, receives the projection and the constraint force
+* @param parameters: stiffness, damping and saturation
+* @param commanded: tip position commanded by the device, world frame
+* @param velocity: velocity of the tip, world frame
+*/
+void evaluateFixture(sVirtualFixture& fixture, const sFixtureParameters& parameters, const Vector3f& commanded, const Vector3f& velocity)
+{
+	if (!fixture.active)
+		return;
+	Vector3f offset = commanded - fixture.centre;
+	fixture.depth = fixture.axis.dot(offset);
+	fixture.projected = fixture.centre + fixture.depth * fixture.axis;
+	Vector3f lateral = offset - fixture.depth * fixture.axis;
+	Vector3f lateral_velocity = velocity - fixture.axis.dot(velocity) * fixture.axis;
+	fixture.lateral_error = lateral.norm();
+
+	fixture.force = -parameters.stiffness * lateral - parameters.damping * lateral_velocity;
+	float magnitude = fixture.force.norm();
+	if (magnitude > parameters.max_force)
+		fixture.force *= parameters.max_force / magnitude;
+}
@@ -0,0 +1,35 @@
+// Peter: Remote-centre-of-motion virtual fixture for the haptic device.
+//
+// Once the needle has punctured the first tissue, the entry point of that puncture is the remote
+// centre of motion c and the needle may only slide along the line a it entered along. Every step the
+// commanded tip position p (Dummy_tool_tip, moved by the device) is
+//   - projected onto the line:            p* = c + a a^T (p - c)
+//   - pulled back by a spring-damper:     F = -K (I - a a^T)(p - c) - B (I - a a^T) v
+// and F is saturated at max_force, so a stiff fixture cannot drive the device into its limits.
+// Closed form on fixed-size vectors, no allocation: cheap enough for the 1 kHz haptic loop.
+
+#pragma once
+
+#include <Eigen/Core>
+
+struct sFixtureParameters {
+	float stiffness = 2000.0f;						// Lateral stiffness. Unit: N/m
+	float damping = 10.0f;							// Lateral damping. Unit: N-s/m
+	float max_force = 3.0f;							// Saturation of the constraint force (peak force of a Phantom Omni). Unit: N
+};
+
+struct sVirtualFixture {
+	bool active = false;
+	Eigen::Vector3f centre = Eigen::Vector3f::Zero();	// Entry point of the first puncture.
+	Eigen::Vector3f axis = -Eigen::Vector3f::UnitZ();	// Insertion direction, unit length.
+	Eigen::Vector3f force = Eigen::Vector3f::Zero();	// Constraint force for the device, world frame. Unit: N
+	Eigen::Vector3f projected = Eigen::Vector3f::Zero();	// Commanded tip position projected onto the line.
+	float lateral_error = 0.0f;						// Distance of the commanded tip from the line. Unit: m
+	float depth = 0.0f;								// Position of the commanded tip along the line, from the centre. Unit: m
+
+	void engage(const Eigen::Vector3f& entry, const Eigen::Vector3f& insertionDirection);
+	void release();
+};
+
+// Updates projected, force and the errors for the commanded tip position and its velocity. Does nothing while inactive.
+void evaluateFixture(sVirtualFixture& fixture, const sFixtureParameters& parameters, const Eigen::Vector3f& commanded, const Eigen::Vector3f& velocity);
@@ -0,0 +1,125 @@
+// Peter: Converter of a segmented CT scan into the bricked volume the plugin maps (tissueVolume.h). Does not need V-REP.
+//
+// Build with "make volume" and run e.g.
+//   bin/tissueVolume --raw labels.raw --dims 512 512 512 --spacing 0.0005 0.0005 0.0005 --labels air,Fat,muscle,bone,lung
+// and copy the volume next to V-REP, the plugin loads phantom.vol at simulation start.
+//
+// Options:
+//   --raw PATH          labels, one byte per voxel, x fastest, as written by most segmentation tools
+//   --dims X Y Z        voxels along each axis
+//   --spacing X Y Z     size of a voxel (default 0.0005 0.0005 0.0005). Unit: m
+//   --origin X Y Z      corner of voxel (0, 0, 0) in the frame of the phantom object (default 0 0 0). Unit: m
+//   --labels A,B,...    tissue names of the labels 0, 1, ..., as used by tissueParameters() (default air)
+//   --out PATH          volume file (default phantom.vol)
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <vector>
+
+#include "tissueVolume.h"
+
+int main(int argc, char* argv[])
+{
+	std::string rawPath, path = "phantom.vol";
+	int dims[3] = { 0, 0, 0 };
+	float spacing[3] = { 5.0e-4f, 5.0e-4f, 5.0e-4f };
+	float origin[3] = { 0.0f, 0.0f, 0.0f };
+	std::vector<std::string> names(1, "air");
+
+	for (int i = 1; i < argc; i++)
+	{
+		std::string option(argv[i]);
+		int count = ((option == "--dims") || (option == "--spacing") || (option == "--origin")) ? 3 : 1;
+		if (i + count >= argc)
+		{
+			std::fprintf(stderr, "Missing value for %s\n", option.c_str());
+			return 1;
+		}
+		const char* value = argv[i + 1];
+		float values[3] = { 0.0f, 0.0f, 0.0f };
+		for (int k = 0; k < count; k++)
+			values[k] = (float)std::atof(argv[++i]);
+
+		if (option == "--raw")
+			rawPath = value;
+		else if (option == "--out")
+			path = value;
+		else if (option == "--dims")
+		{
+			for (int axis = 0; axis < 3; axis++)
+				dims[axis] = (int)values[axis];
+		}
+		else if ((option == "--spacing") || (option == "--origin"))
+		{
+			for (int axis = 0; axis < 3; axis++)
+				((option == "--spacing") ? spacing : origin)[axis] = values[axis];
+		}
+		else if (option == "--labels")
+		{
+			names.clear();
+			std::string list(value);
+			for (size_t begin = 0; begin <= list.size(); )
+			{
+				size_t end = list.find(',', begin);
+				if (end == std::string::npos)
+					end = list.size();
+				names.push_back(list.substr(begin, end - begin));
+				begin = end + 1;
+			}
+		}
+		else
+		{
+			std::fprintf(stderr, "Unknown option %s\n", option.c_str());
+			return 1;
+		}
+	}
+	if (rawPath.empty() || (dims[0] < 1) || (dims[1] < 1) || (dims[2] < 1))
+	{
+		std::fprintf(stderr, "Usage: %s --raw PATH --dims X Y Z [--spacing X Y Z] [--origin X Y Z] [--labels A,B,...] [--out PATH]\n", argv[0]);
+		return 1;
+	}
+
+	std::vector<uint8_t> labels((size_t)dims[0] * dims[1] * dims[2]);
+	FILE* file = std::fopen(rawPath.c_str(), "rb");
+	if (file == NULL)
+	{
+		std::fprintf(stderr, "Could not open %s\n", rawPath.c_str());
+		return 1;
+	}
+	size_t read = std::fread(labels.data(), 1, labels.size(), file);
+	std::fclose(file);
+	if (read != labels.size())
+	{
+		std::fprintf(stderr, "%s has %zu voxels, expected %zu\n", rawPath.c_str(), read, labels.size());
+		return 1;
+	}
+	for (uint8_t label : labels)
+	{
+		if (label >= names.size())
+		{
+			std::fprintf(stderr, "Label %d has no name, pass it with --labels\n", (int)label);
+			return 1;
+		}
+	}
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	if (!writeTissueVolume(path, dims, spacing, origin, names, labels.data()))
+	{
+		std::fprintf(stderr, "Could not write %s\n", path.c_str());
+		return 1;
+	}
+	CTissueVolume volume;
+	if (!volume.open(path))
+	{
+		std::fprintf(stderr, "Could not read back %s\n", path.c_str());
+		return 1;
+	}
+	const sVolumeHeader& header = volume.getHeader();
+	std::printf("Wrote %s in %.2f s: %d of %d bricks stored, %.1f MiB (raw %.1f MiB)\n", path.c_str(),
+		std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count(),
+		header.stored_bricks, header.bricks[0] * header.bricks[1] * header.bricks[2],
+		volume.fileBytes() / 1048576.0, labels.size() / 1048576.0);
+	return 0;
+}